@@ -6,16 +6,45 @@ net_fs_list="
 	afs ceph cifs coda davfs fuse fuse.glusterfs fuse.sshfs gfs glusterfs lustre
 	ncpfs nfs nfs4 ocfs2 shfs smbfs
 "
+
+# Escape a word for mountinfo --batch as fstab would, which only mount
+# points with a space, tab or backslash in them need
+_mountinfo_escape()
+{
+	local s="$1" c= out=
+
+	case "$s" in
+		*[\ \	\\]*) ;;
+		*) printf '%s' "$s"; return ;;
+	esac
+	while [ -n "$s" ]; do
+		c="${s%"${s#?}"}"
+		s="${s#?}"
+		case "$c" in
+			" ") out="$out\\040" ;;
+			"	") out="$out\\011" ;;
+			\\) out="$out\\134" ;;
+			*) out="$out$c" ;;
+		esac
+	done
+	printf '%s' "$out"
+}
+
 is_net_fs()
 {
 	[ -z "$1" ] && return 1
 
+	# Ask everything at once, rather than running mountinfo for each
+	local p="$(_mountinfo_escape "$1")"
+	set -- $(printf '%s\n' "--quiet --netdev $p" "--quiet --nonetdev $p" \
+		"--fstype $p" | mountinfo --batch)
+
 	# Check OS specific flags to see if we're local or net mounted
-	mountinfo --quiet --netdev "$1"  && return 0
-	mountinfo --quiet --nonetdev "$1" && return 1
+	[ "$1" = 0 ] && return 0
+	[ "$2" = 0 ] && return 1
 
 	# Fall back on fs types
-	local t=$(mountinfo --fstype "$1")
+	local t="$4"
 	for x in $net_fs_list $extra_net_fs_list; do
 		[ "$x" = "$t" ] && return 0
 	done
@@ -9,6 +9,7 @@
 #    except according to the terms contained in the LICENSE file.
 # Released under the 2-clause BSD license.
 
+command -v runit_start >/dev/null ||
 runit_start()
 {
 	local service_path service_link
@@ -36,6 +37,7 @@ runit_start()
 	eend $retval "Failed to start ${name:-$RC_SVCNAME}"
 }
 
+command -v runit_stop >/dev/null ||
 runit_stop()
 {
 	local service_path service_link
@@ -51,6 +53,7 @@ runit_stop()
 	eend $? "Failed to stop ${name:-$RC_SVCNAME}"
 }
 
+command -v runit_status >/dev/null ||
 runit_status()
 {
 	local service_path service_link
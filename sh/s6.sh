@@ -22,9 +22,8 @@
 # timeout_down: wait for the service to stop
 # timeout_kill: if not stopped after that amount, send a SIGKILL
 
-extra_commands="restart reload ${extra_commands}"
-
 # Call this on every entry point, for readability
+command -v _s6_set_variables >/dev/null ||
 _s6_set_variables() {
 	name="${name:-${RC_SVCNAME}}"
 	_execlineb="$(command -v execlineb)"
@@ -33,14 +32,17 @@ _s6_set_variables() {
 	_service="$_scandir/$name"
 }
 
+command -v _s6_available >/dev/null ||
 _s6_available() {
 	s6-svscanctl -- "$_scandir" 2>/dev/null
 }
 
+command -v _execline_available >/dev/null ||
 _execline_available() {
 	test -n "$_execlineb" && "$_execlineb" -Pc 'exit 0' 2>/dev/null
 }
 
+command -v _s6_sanity_checks >/dev/null ||
 _s6_sanity_checks() {
 	if ! _s6_available ; then
 		eerror "No supervision tree running on $_scandir"
@@ -75,14 +77,17 @@ _s6_sanity_checks() {
 	return 0
 }
 
+command -v _s6_force_stop >/dev/null ||
 _s6_force_stop() {
 	s6-svunlink -- "$_scandir" "$name"
 }
 
+command -v _s6_have_legacy_servicedir >/dev/null ||
 _s6_have_legacy_servicedir() {
 	test -z "$command" && test -x "/var/svc.d/$name/run"
 }
 
+command -v _s6_make_envdir >/dev/null ||
 _s6_make_envdir() {
 	local envs="`env | grep -v \
 		-e ^EERROR_QUIET= \
@@ -107,6 +112,7 @@ _s6_make_envdir() {
 	return 0
 }
 
+command -v _s6_servicedir_creation_needed >/dev/null ||
 _s6_servicedir_creation_needed() {
 	local dir="$_servicedirs/$name" conffile="{$RC_SERVICE%/*}/../conf.d/${RC_SERVICE##*/}"
 	if ! test -e "$dir" ; then
@@ -124,6 +130,7 @@ _s6_servicedir_creation_needed() {
 	return 1
 }
 
+command -v _s6_servicedir_create >/dev/null ||
 _s6_servicedir_create() {
 	local logger="${output_logger}${error_logger}" dir="$_servicedirs/$name"
 
@@ -194,6 +201,7 @@ _s6_servicedir_create() {
 	chmod 0755 "$dir"
 }
 
+command -v s6_start >/dev/null ||
 s6_start()
 {
 	local servicepath r waitcommand waitname
@@ -235,6 +243,7 @@ s6_start()
 	eend 0
 }
 
+command -v s6_stop >/dev/null ||
 s6_stop() {
 	_s6_set_variables
 	ebegin "Stopping $name"
@@ -242,6 +251,7 @@ s6_stop() {
 	eend $? "Failed to stop $name"
 }
 
+command -v s6_status >/dev/null ||
 s6_status() {
 	_s6_set_variables
 	if s6-svok "$_service" 2>/dev/null ; then
@@ -251,6 +261,7 @@ s6_status() {
 	fi
 }
 
+command -v s6_reload >/dev/null ||
 s6_reload() {
 	_s6_set_variables
 	ebegin "Reloading $name"
@@ -10,6 +10,7 @@
 # This file may not be copied, modified, propagated, or distributed
 #    except according to the terms contained in the LICENSE file.
 
+command -v ssd_start >/dev/null ||
 ssd_start()
 {
 	if [ -z "$command" ]; then
@@ -80,6 +81,7 @@ ssd_start()
 	return 1
 }
 
+command -v ssd_stop >/dev/null ||
 ssd_stop()
 {
 	local _progress=
@@ -106,6 +108,7 @@ ssd_stop()
 	eend $? "Failed to stop ${name:-$RC_SVCNAME}"
 }
 
+command -v ssd_status >/dev/null ||
 ssd_status()
 {
 	_status
@@ -10,8 +10,7 @@
 # This file may not be copied, modified, propagated, or distributed
 #    except according to the terms contained in the LICENSE file.
 
-extra_commands="healthcheck unhealthy ${extra_commands}"
-
+command -v supervise_start >/dev/null ||
 supervise_start()
 {
 	if [ -z "$command" ]; then
@@ -33,11 +32,14 @@ supervise_start()
 		notify="$ready"
 	fi
 
+	local mux=
+	[ "$supervisor" = supervise-daemon-mux ] && mux=--mux
+
 	ebegin "Starting ${name:-$RC_SVCNAME}"
 	# The eval call is necessary for cases like:
 	# command_args="this \"is a\" test"
 	# to work properly.
-	eval supervise-daemon "${RC_SVCNAME}" --start \
+	eval supervise-daemon "${RC_SVCNAME}" --start $mux \
 		${retry:+--retry} $retry \
 		${directory:+--chdir} $directory  \
 		${chroot:+--chroot} $chroot \
@@ -52,6 +54,7 @@ supervise_start()
 		${respawn_period:+--respawn-period} $respawn_period \
 		${healthcheck_delay:+--healthcheck-delay} $healthcheck_delay \
 		${healthcheck_timer:+--healthcheck-timer} $healthcheck_timer \
+		${healthcheck_probe:+--healthcheck-probe \"$healthcheck_probe\"} \
 		${capabilities+--capabilities} "$capabilities" \
 		${secbits:+--secbits} "$secbits" \
 		${no_new_privs:+--no-new-privs} \
@@ -70,6 +73,7 @@ supervise_start()
 	eend $rc "failed to start ${name:-$RC_SVCNAME}"
 }
 
+command -v supervise_stop >/dev/null ||
 supervise_stop()
 {
 	local startchroot="$(service_get_value "chroot")"
@@ -83,6 +87,7 @@ supervise_stop()
 	eend $? "Failed to stop ${name:-$RC_SVCNAME}"
 }
 
+command -v _check_supervised >/dev/null ||
 _check_supervised()
 {
 	local child_pid start_time
@@ -94,6 +99,7 @@ _check_supervised()
 	return 0
 }
 
+command -v supervise_status >/dev/null ||
 supervise_status()
 {
 	if service_stopping; then
@@ -121,13 +127,3 @@ supervise_status()
 		return 3
 	fi
 }
-
-healthcheck()
-{
-	return 0
-}
-
-unhealthy()
-{
-	return 0
-}
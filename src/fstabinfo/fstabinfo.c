@@ -25,44 +25,12 @@
 #include <stdbool.h>
 #include <spawn.h>
 
-/* Yay for linux and its non liking of POSIX functions.
-   Okay, we could use getfsent but the man page says use getmntent instead
-   AND we don't have getfsent on uclibc or dietlibc for some odd reason. */
-#ifdef __linux__
-#  define HAVE_GETMNTENT
-#  include <mntent.h>
-
-#  define ENT mntent
-#  define START_ENT fp = setmntent ("/etc/fstab", "r");
-#  define GET_ENT getmntent (fp)
-#  define GET_ENT_FILE(_name) getmntfile (_name)
-#  define END_ENT endmntent (fp)
-#  define ENT_BLOCKDEVICE(_ent) (_ent)->mnt_fsname
-#  define ENT_FILE(_ent) (_ent)->mnt_dir
-#  define ENT_TYPE(_ent) (_ent)->mnt_type
-#  define ENT_OPTS(_ent) (_ent)->mnt_opts
-#  define ENT_PASS(_ent) (_ent)->mnt_passno
-#else
-#  define HAVE_GETFSENT
-#  include <fstab.h>
-
-#  define ENT fstab
-#  define START_ENT
-#  define GET_ENT getfsent ()
-#  define GET_ENT_FILE(_name) getfsfile (_name)
-#  define END_ENT endfsent ()
-#  define ENT_BLOCKDEVICE(_ent) (_ent)->fs_spec
-#  define ENT_TYPE(_ent) (_ent)->fs_vfstype
-#  define ENT_FILE(_ent) (_ent)->fs_file
-#  define ENT_OPTS(_ent) (_ent)->fs_mntops
-#  define ENT_PASS(_ent) (_ent)->fs_passno
-#endif
-
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
 #include "_usage.h"
 #include "helpers.h"
+#include "fstab_cache.h"
 
 extern char **environ;
 
@@ -91,27 +59,10 @@ const char * const longopts_help[] = {
 };
 const char *usagestring = NULL;
 
-#ifdef HAVE_GETMNTENT
-static struct mntent *
-getmntfile(const char *file)
-{
-	struct mntent *ent;
-	FILE *fp;
-
-	START_ENT;
-	while ((ent = getmntent(fp)))
-		if (strcmp(file, ent->mnt_dir) == 0)
-			break;
-	END_ENT;
-
-	return ent;
-}
-#endif
-
 extern const char *applet;
 
 static int
-do_mount(struct ENT *ent, bool remount)
+do_mount(const struct fstab_entry *ent, bool remount)
 {
 	char *argv[10];
 	pid_t pid;
@@ -119,24 +70,24 @@ do_mount(struct ENT *ent, bool remount)
 
 	argv[0] = UNCONST("mount");
 	argv[1] = UNCONST("-o");
-	argv[2] = ENT_OPTS(ent);
+	argv[2] = ent->mntopts;
 	argv[3] = UNCONST("-t");
-	argv[4] = ENT_TYPE(ent);
+	argv[4] = ent->vfstype;
 	if (!remount) {
-		argv[5] = ENT_BLOCKDEVICE(ent);
-		argv[6] = ENT_FILE(ent);
+		argv[5] = ent->spec;
+		argv[6] = ent->file;
 		argv[7] = NULL;
 	} else {
 #ifdef __linux__
 		argv[5] = UNCONST("-o");
 		argv[6] = UNCONST("remount");
-		argv[7] = ENT_BLOCKDEVICE(ent);
-		argv[8] = ENT_FILE(ent);
+		argv[7] = ent->spec;
+		argv[8] = ent->file;
 		argv[9] = NULL;
 #else
 		argv[5] = UNCONST("-u");
-		argv[6] = ENT_BLOCKDEVICE(ent);
-		argv[7] = ENT_FILE(ent);
+		argv[6] = ent->spec;
+		argv[7] = ent->file;
 		argv[8] = NULL;
 #endif
 	}
@@ -160,7 +111,8 @@ do_mount(struct ENT *ent, bool remount)
 
 int main(int argc, char **argv)
 {
-	struct ENT *ent;
+	struct fstab_cache *fstab;
+	const struct fstab_entry *ent;
 	int result = EXIT_SUCCESS;
 	char *token;
 	int i, p;
@@ -170,13 +122,11 @@ int main(int argc, char **argv)
 	RC_STRING *file, *file_np;
 	bool filtered = false;
 
-#ifdef HAVE_GETMNTENT
-	FILE *fp;
-#endif
-
 	/* fail if there is no /etc/fstab */
 	if (access("/etc/fstab", F_OK) != 0)
 		eerrorx("/etc/fstab does not exist");
+	if (!(fstab = fstab_cache_load()))
+		eerrorx("/etc/fstab: %s", strerror(errno));
 	/* Ensure that we are only quiet when explicitly told to be */
 	unsetenv("EINFO_QUIET");
 
@@ -212,18 +162,16 @@ int main(int argc, char **argv)
 
 				filtered = true;
 				opt = optarg[0];
-				START_ENT;
-				while ((ent = GET_ENT)) {
-					if (strcmp(ENT_FILE(ent), "none") == 0)
+				TAILQ_FOREACH(ent, &fstab->entries, entries) {
+					if (strcmp(ent->file, "none") == 0)
 						continue;
-					p = ENT_PASS(ent);
+					p = ent->passno;
 					if ((opt == '=' && i == p) ||
 					    (opt == '<' && i > p && p != 0) ||
 					    (opt == '>' && i < p && p != 0))
 						rc_stringlist_add(files,
-						    ENT_FILE(ent));
+						    ent->file);
 				}
-				END_ENT;
 				break;
 
 			default:
@@ -235,14 +183,11 @@ int main(int argc, char **argv)
 
 		case 't':
 			filtered = true;
-			while ((token = strsep(&optarg, ","))) {
-				START_ENT;
-				while ((ent = GET_ENT))
-					if (strcmp(token, ENT_TYPE(ent)) == 0)
+			while ((token = strsep(&optarg, ",")))
+				TAILQ_FOREACH(ent, &fstab->entries, entries)
+					if (strcmp(token, ent->vfstype) == 0)
 						rc_stringlist_add(files,
-						    ENT_FILE(ent));
-				END_ENT;
-			}
+						    ent->file);
 			break;
 
 		case_RC_COMMON_GETOPT
@@ -264,10 +209,8 @@ int main(int argc, char **argv)
 				rc_stringlist_add(files, argv[optind++]);
 		}
 	} else if (!filtered) {
-		START_ENT;
-		while ((ent = GET_ENT))
-			rc_stringlist_add(files, ENT_FILE(ent));
-		END_ENT;
+		TAILQ_FOREACH(ent, &fstab->entries, entries)
+			rc_stringlist_add(files, ent->file);
 
 		if (!TAILQ_FIRST(files))
 			eerrorx("%s: empty fstab", argv[0]);
@@ -275,13 +218,13 @@ int main(int argc, char **argv)
 
 	if (!TAILQ_FIRST(files)) {
 		rc_stringlist_free(files);
+		fstab_cache_free(fstab);
 		return (EXIT_FAILURE);
 	}
 
 	/* Ensure we always display something */
-	START_ENT;
 	TAILQ_FOREACH(file, files, entries) {
-		if (!(ent = GET_ENT_FILE(file->value))) {
+		if (!(ent = fstab_cache_find(fstab, file->value))) {
 			result = EXIT_FAILURE;
 			continue;
 		}
@@ -303,19 +246,19 @@ int main(int argc, char **argv)
 
 		switch (output) {
 		case OUTPUT_BLOCKDEV:
-			printf("%s\n", ENT_BLOCKDEVICE(ent));
+			printf("%s\n", ent->spec);
 			break;
 
 		case OUTPUT_MOUNTARGS:
 			printf("-o %s -t %s %s %s\n",
-			    ENT_OPTS(ent),
-			    ENT_TYPE(ent),
-			    ENT_BLOCKDEVICE(ent),
+			    ent->mntopts,
+			    ent->vfstype,
+			    ent->spec,
 			    file->value);
 			break;
 
 		case OUTPUT_OPTIONS:
-			printf("%s\n", ENT_OPTS(ent));
+			printf("%s\n", ent->mntopts);
 			break;
 
 		case OUTPUT_FILE:
@@ -323,13 +266,13 @@ int main(int argc, char **argv)
 			break;
 
 		case OUTPUT_PASSNO:
-			printf("%d\n", ENT_PASS(ent));
+			printf("%d\n", ent->passno);
 			break;
 		}
 	}
-	END_ENT;
 
 	rc_stringlist_free(files);
+	fstab_cache_free(fstab);
 	exit(result);
 	/* NOTREACHED */
 }
@@ -18,8 +18,10 @@
 
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -79,63 +81,213 @@ static int mount_proc(void)
 	return 0;
 }
 
-static bool is_user_process(pid_t pid)
+/* set in the flags field of /proc/<pid>/stat for kernel threads */
+#define PF_KTHREAD 0x00200000
+
+/*
+ * The pids we must not signal, in an open addressed table where 0 is an
+ * empty slot, so each process costs one probe rather than a list walk.
+ */
+struct pid_set {
+	pid_t *slots;
+	size_t count;
+	size_t mask;
+};
+
+/*
+ * Every process is read the once, while the system is stopped, and chained
+ * into buckets by pid so its parent can be found. Whether it descends from
+ * a kernel thread is worked out the first time it is asked and remembered,
+ * so a parent shared by many processes is only looked at once.
+ */
+enum proc_kind {
+	PROC_UNKNOWN,
+	PROC_CHECKING,
+	PROC_USER,
+	PROC_KERNEL,
+};
+
+struct proc {
+	pid_t pid;
+	pid_t ppid;
+	pid_t sid;
+	unsigned int flags;
+	enum proc_kind kind;
+	uint32_t next;	/* proc + 1 in the same bucket */
+};
+
+struct proc_table {
+	struct proc *procs;
+	size_t count;
+	size_t alloc;
+	uint32_t *buckets;	/* proc + 1, 0 is empty */
+	size_t mask;
+};
+
+static uint32_t
+pid_hash(pid_t pid)
 {
-	char *buf = NULL;
-	FILE *fp;
-	char *path = NULL;
-	pid_t temp_pid;
-	size_t size;
-	bool user_process = true;
-
-	while (pid >0 && user_process) {
-		if (pid == 2) {
-			user_process = false;
+	return (uint32_t)pid * 2654435761u;
+}
+
+static void pid_set_add(struct pid_set *set, pid_t pid)
+{
+	pid_t *old = set->slots;
+	size_t size = set->mask + 1, i;
+
+	if (!old || (set->count + 1) * 2 > size) {
+		size = old ? size * 2 : 16;
+		set->slots = xmalloc(size * sizeof(*set->slots));
+		memset(set->slots, 0, size * sizeof(*set->slots));
+		set->mask = size - 1;
+		set->count = 0;
+		if (old) {
+			for (i = 0; i < size / 2; i++)
+				if (old[i])
+					pid_set_add(set, old[i]);
+			free(old);
+		}
+	}
+	for (i = pid_hash(pid) & set->mask; set->slots[i]; i = (i + 1) & set->mask)
+		if (set->slots[i] == pid)
+			return;
+	set->slots[i] = pid;
+	set->count++;
+}
+
+static bool pid_set_has(const struct pid_set *set, pid_t pid)
+{
+	size_t i;
+
+	if (!set->slots)
+		return false;
+	for (i = pid_hash(pid) & set->mask; set->slots[i]; i = (i + 1) & set->mask)
+		if (set->slots[i] == pid)
+			return true;
+	return false;
+}
+
+/*
+ * Read what we need from /proc/<pid>/stat, which is relative to our cwd.
+ * The command name may hold spaces and brackets, so the fields after it
+ * are found from its last closing bracket.
+ */
+static bool read_stat(struct proc *p)
+{
+	char path[32], buf[512];
+	char *s;
+	ssize_t len;
+	int fd;
+
+	snprintf(path, sizeof(path), "%d/stat", p->pid);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len <= 0)
+		return false;
+	buf[len] = '\0';
+	if (!(s = strrchr(buf, ')')))
+		return false;
+	return sscanf(s + 1, " %*c %d %*d %d %*d %*d %u",
+	    &p->ppid, &p->sid, &p->flags) == 3;
+}
+
+static void proc_table_read(struct proc_table *table, DIR *dir)
+{
+	struct dirent *d;
+	struct proc *p;
+	uint32_t *slot;
+	size_t size = 64, i;
+	pid_t pid;
+
+	while ((d = readdir(dir)) != NULL) {
+		/* Is this a process? */
+		pid = (pid_t) atoi(d->d_name);
+		if (pid <= 0)
 			continue;
+		if (table->count == table->alloc) {
+			table->alloc = table->alloc ? table->alloc * 2 : 256;
+			table->procs = xrealloc(table->procs,
+			    table->alloc * sizeof(*table->procs));
 		}
-		xasprintf(&path, "/proc/%d/status", pid);
-		fp = fopen(path, "r");
-		free(path);
+		p = &table->procs[table->count];
+		memset(p, 0, sizeof(*p));
+		p->pid = pid;
+		/* it has gone away, so there is nothing to signal */
+		if (read_stat(p))
+			table->count++;
+	}
+
+	while (size < table->count * 2)
+		size *= 2;
+	table->mask = size - 1;
+	table->buckets = xmalloc(size * sizeof(*table->buckets));
+	memset(table->buckets, 0, size * sizeof(*table->buckets));
+	for (i = 0; i < table->count; i++) {
+		slot = &table->buckets[pid_hash(table->procs[i].pid) & table->mask];
+		table->procs[i].next = *slot;
+		*slot = i + 1;
+	}
+}
+
+static struct proc *proc_find(const struct proc_table *table, pid_t pid)
+{
+	uint32_t i = table->buckets[pid_hash(pid) & table->mask];
+
+	for (; i; i = table->procs[i - 1].next)
+		if (table->procs[i - 1].pid == pid)
+			return &table->procs[i - 1];
+	return NULL;
+}
+
+static void proc_table_free(struct proc_table *table)
+{
+	free(table->procs);
+	free(table->buckets);
+}
+
+static bool is_user_process(const struct proc_table *table, struct proc *p)
+{
+	struct proc *parent;
+	enum proc_kind kind;
+
+	if (p->kind == PROC_USER || p->kind == PROC_KERNEL)
+		return p->kind == PROC_USER;
+	if (p->kind == PROC_CHECKING) {
+		/* a loop means the pids were reused under us */
+		syslog(LOG_ERR, "Parent of process %d loops", p->pid);
+		return false;
+	}
+
+	if (p->pid == 2 || p->flags & PF_KTHREAD)
+		kind = PROC_KERNEL;
+	else if (p->ppid <= 0)
+		kind = PROC_USER;
+	else if (!(parent = proc_find(table, p->ppid)))
 		/*
-		 * if we could not open the file, the process disappeared, which
-		 * leaves us no way to determine for sure whether it was a user
-		 * process or kernel thread, so we say it is a kernel thread to
-		 * avoid accidentally killing it.
+		 * the parent disappeared, which leaves us no way to determine
+		 * for sure whether this was a user process or kernel thread,
+		 * so we say it is a kernel thread to avoid accidentally
+		 * killing it.
 		 */
-		if (!fp) {
-			user_process = false;
-			continue;
-		}
-		temp_pid = -1;
-		while (!feof(fp)) {
-			buf = NULL;
-			if (xgetline(&buf, &size, fp) != -1) {
-				sscanf(buf, "PPid: %d", &temp_pid);
-				free(buf);
-			} else {
-				free(buf);
-				break;
-			}
-		}
-		fclose(fp);
-		if (temp_pid == -1) {
-			syslog(LOG_ERR, "Unable to read pid from /proc/%d/status", pid);
-			user_process = false;
-			continue;
-		}
-		pid = temp_pid;
+		kind = PROC_KERNEL;
+	else {
+		p->kind = PROC_CHECKING;
+		kind = is_user_process(table, parent) ? PROC_USER : PROC_KERNEL;
 	}
-	return user_process;
+	p->kind = kind;
+	return kind == PROC_USER;
 }
 
-static int signal_processes(int sig, RC_STRINGLIST *omits, bool dryrun)
+static int signal_processes(int sig, const struct pid_set *omits, bool dryrun)
 {
 	sigset_t signals;
 	sigset_t oldsigs;
 	DIR *dir;
-	struct dirent	*d;
-	char *buf = NULL;
-	pid_t pid;
+	struct proc_table table;
+	struct proc *p;
+	pid_t sid = getsid(0);
 	int sendcount = 0;
 
 	kill(-1, SIGSTOP);
@@ -160,37 +312,31 @@ static int signal_processes(int sig, RC_STRINGLIST *omits, bool dryrun)
 		kill(-1, SIGCONT);
 		return -1;
 	}
+	memset(&table, 0, sizeof(table));
+	proc_table_read(&table, dir);
+	closedir(dir);
 
-	/* Walk through the directory. */
-	while ((d = readdir(dir)) != NULL) {
-		/* Is this a process? */
-		pid = (pid_t) atoi(d->d_name);
-		if (pid == 0)
-			continue;
+	for (size_t i = 0; i < table.count; i++) {
+		p = &table.procs[i];
 
 		/* Is this a process we have been requested to omit? */
-		if (buf) {
-			free(buf);
-			buf = NULL;
-		}
-		xasprintf(&buf, "%d", pid);
-		if (rc_stringlist_find(omits, buf))
+		if (pid_set_has(omits, p->pid))
 			continue;
 
 		/* Is this process in our session? */
-		if (getsid(getpid()) == getsid(pid))
+		if (p->sid == sid)
 			continue;
 
 		/* Is this a kernel thread? */
-		if (!is_user_process(pid))
+		if (!is_user_process(&table, p))
 			continue;
 
 		if (dryrun)
-			einfo("Would send signal %d to process %d", sig, pid);
-		else if (kill(pid, sig) == 0)
+			einfo("Would send signal %d to process %d", sig, p->pid);
+		else if (kill(p->pid, sig) == 0)
 			sendcount++;
 	}
-	closedir(dir);
+	proc_table_free(&table);
 	sigprocmask(SIG_SETMASK, &oldsigs, NULL);
 	kill(-1, SIGCONT);
 	return sendcount;
@@ -201,8 +347,9 @@ int main(int argc, char **argv)
 	char *arg = NULL;
 	int opt;
 	bool dryrun = false;
-	RC_STRINGLIST *omits = rc_stringlist_new();
+	struct pid_set omits = { NULL, 0, 0 };
 	int sig = SIGKILL;
+	pid_t pid;
 	char *here;
 	char *token;
 
@@ -210,7 +357,7 @@ int main(int argc, char **argv)
 	unsetenv("EINFO_QUIET");
 
 	applet = basename_c(argv[0]);
-	rc_stringlist_addu(omits, "1");
+	pid_set_add(&omits, 1);
 	while ((opt = getopt_long(argc, argv, getoptstring,
 		    longopts, (int *) 0)) != -1)
 	{
@@ -221,8 +368,8 @@ int main(int argc, char **argv)
 			case 'o':
 				here = optarg;
 				while ((token = strsep(&here, ",;:"))) {
-					if ((pid_t) atoi(token) > 0)
-						rc_stringlist_addu(omits, token);
+					if ((pid = (pid_t) atoi(token)) > 0)
+						pid_set_add(&omits, pid);
 					else {
 						eerror("Invalid omit pid value %s", token);
 						usage(EXIT_FAILURE);
@@ -237,7 +384,7 @@ int main(int argc, char **argv)
 	arg = argv[optind];
 	sig = atoi(arg);
 	if (sig <= 0 || sig > 31) {
-		rc_stringlist_free(omits);
+		free(omits.slots);
 		eerror("Invalid signal %s", arg);
 		usage(EXIT_FAILURE);
 	}
@@ -245,10 +392,10 @@ int main(int argc, char **argv)
 
 	openlog(applet, LOG_CONS|LOG_PID, LOG_DAEMON);
 	if (mount_proc() != 0) {
-		rc_stringlist_free(omits);
+		free(omits.slots);
 		eerrorx("Unable to mount /proc file system");
 	}
-	signal_processes(sig, omits, dryrun);
-	rc_stringlist_free(omits);
+	signal_processes(sig, &omits, dryrun);
+	free(omits.slots);
 	return 0;
 }
@@ -31,57 +31,102 @@
 #include "librc.h"
 #include "helpers.h"
 
-#if defined(__linux__) || (defined (__FreeBSD_kernel__) && defined(__GLIBC__)) \
-	|| defined(__GNU__)
-static bool
-pid_is_exec(pid_t pid, const char *exec)
+/*
+ * A process table is one pass over the process list which keeps everything
+ * rc_find_pids matches on, so callers checking many daemons at once only
+ * have to walk the kernel's process list the one time.
+ * Each process is chained into hash buckets by its pid, its name and its
+ * first argument so a search only looks at the processes that could match.
+ */
+enum proc_key {
+	PROC_BY_PID,
+	PROC_BY_COMM,
+	PROC_BY_ARG0,
+	PROC_KEYS
+};
+
+struct proc_entry {
+	pid_t pid;
+	uid_t uid;
+	bool other_ns;	/* in a different pid namespace to us */
+	char *comm;
+	char *cmdline;	/* NUL separated arguments */
+	size_t cmdlen;
+	uint32_t next[PROC_KEYS];	/* entry + 1 in the same bucket */
+};
+
+struct rc_proctable {
+	struct proc_entry *procs;
+	size_t count;
+	size_t alloc;
+	uint32_t *buckets[PROC_KEYS];	/* entry + 1, 0 is empty */
+	size_t mask;
+};
+
+static uint32_t
+pid_hash(pid_t pid)
 {
-	char *buffer = NULL;
-	FILE *fp;
-	int c;
-	bool retval = false;
+	return (uint32_t)pid * 2654435761u;
+}
 
-	exec = basename_c(exec);
-	xasprintf(&buffer, "/proc/%d/stat", pid);
-	if ((fp = fopen(buffer, "r"))) {
-		while ((c = getc(fp)) != EOF && c != '(')
-			;
-		if (c == '(') {
-			while ((c = getc(fp)) != EOF && c == *exec)
-				exec++;
-			if (c == ')' && *exec == '\0')
-				retval = true;
+static uint32_t
+proc_entry_hash(const struct proc_entry *e, enum proc_key key)
+{
+	switch (key) {
+	case PROC_BY_PID:
+		return pid_hash(e->pid);
+	case PROC_BY_COMM:
+		return e->comm ? string_hash(e->comm) : 0;
+	default:
+		return e->cmdline ? string_hash(e->cmdline) : 0;
+	}
+}
+
+static void
+proctable_index(RC_PROCTABLE *table)
+{
+	size_t size = 64;
+	uint32_t *slot;
+	size_t i;
+	int key;
+
+	while (size < table->count * 2)
+		size *= 2;
+	table->mask = size - 1;
+	for (key = 0; key < PROC_KEYS; key++) {
+		table->buckets[key] = xmalloc(size * sizeof(uint32_t));
+		memset(table->buckets[key], 0, size * sizeof(uint32_t));
+		for (i = 0; i < table->count; i++) {
+			slot = &table->buckets[key][proc_entry_hash(&table->procs[i],
+			    key) & table->mask];
+			table->procs[i].next[key] = *slot;
+			*slot = i + 1;
 		}
-		fclose(fp);
 	}
-	free(buffer);
-	return retval;
 }
 
-static bool
-pid_is_argv(pid_t pid, const char *const *argv)
+static struct proc_entry *
+proctable_add(RC_PROCTABLE *table)
 {
-	char *cmdline = NULL;
-	int fd;
-	char buffer[PATH_MAX];
-	char *p;
-	ssize_t bytes;
+	struct proc_entry *e;
 
-	xasprintf(&cmdline, "/proc/%u/cmdline", pid);
-	if ((fd = open(cmdline, O_RDONLY)) < 0) {
-		free(cmdline);
-		return false;
+	if (table->count == table->alloc) {
+		table->alloc = table->alloc ? table->alloc * 2 : 256;
+		table->procs = xrealloc(table->procs,
+		    table->alloc * sizeof(*table->procs));
 	}
-	bytes = read(fd, buffer, sizeof(buffer) - 1);
-	close(fd);
-	free(cmdline);
-	if (bytes == -1)
-		return false;
+	e = &table->procs[table->count++];
+	memset(e, 0, sizeof(*e));
+	return e;
+}
+
+static bool
+cmdline_has_argv(const char *cmdline, size_t len, const char *const *argv)
+{
+	const char *p = cmdline;
 
-	buffer[bytes] = '\0';
-	p = buffer;
 	while (*argv) {
-		if ((unsigned)(p - buffer) >= sizeof(buffer))
+		if ((size_t)(p - cmdline) >= len)
 			return false;
 		if (strcmp(*argv, p) != 0)
 			return false;
@@ -91,29 +136,23 @@ pid_is_argv(pid_t pid, const char *const *argv)
 	return true;
 }
 
-RC_PIDLIST *
-rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+#if defined(__linux__) || (defined (__FreeBSD_kernel__) && defined(__GLIBC__)) \
+	|| defined(__GNU__)
+struct proc_filter {
+	pid_t openrc_pid;
+	bool openvz_host;
+	char ns[30];
+};
+
+static void
+proc_filter_init(struct proc_filter *filter)
 {
-	DIR *procdir;
-	struct dirent *entry;
 	FILE *fp;
-	int rc;
-	bool container_pid = false;
-	bool openvz_host = false;
 	char *line = NULL;
-	char my_ns[30] = {0};
-	char proc_ns[30] = {0};
 	size_t len = 0;
-	pid_t p;
-	char *buffer = NULL;
-	struct stat sb;
-	pid_t openrc_pid = 0;
 	char *pp;
-	RC_PIDLIST *pids = NULL;
-	RC_PID *pi;
 
-	if ((procdir = opendir("/proc")) == NULL)
-		return NULL;
+	memset(filter, 0, sizeof(*filter));
 
 	/*
 	  We never match RC_OPENRC_PID if present so we avoid the below
@@ -127,8 +166,8 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 	*/
 
 	if ((pp = getenv("RC_OPENRC_PID"))) {
-		if (sscanf(pp, "%d", &openrc_pid) != 1)
-			openrc_pid = 0;
+		if (sscanf(pp, "%d", &filter->openrc_pid) != 1)
+			filter->openrc_pid = 0;
 	}
 
 	/*
@@ -140,58 +179,167 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 	if ((fp = fopen("/proc/self/status", "r"))) {
 		while (xgetline(&line, &len, fp) != -1) {
 			if (strncmp(line, "envID:\t0", 8) == 0) {
-				openvz_host = true;
+				filter->openvz_host = true;
 				break;
 			}
 		}
 		fclose(fp);
 	}
+	free(line);
+
+	if (readlink("/proc/self/ns/pid", filter->ns, sizeof(filter->ns) - 1) <= 0)
+		filter->ns[0] = '\0';
+}
+
+/* Reads at most size - 1 bytes of a file under a /proc/<pid> directory */
+static ssize_t
+proc_read(int fd, const char *file, char *buffer, size_t size)
+{
+	ssize_t bytes;
+	int ffd;
+
+	if ((ffd = openat(fd, file, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	bytes = read(ffd, buffer, size - 1);
+	close(ffd);
+	if (bytes >= 0)
+		buffer[bytes] = '\0';
+	return bytes;
+}
+
+static bool
+proc_other_ns(int fd, const struct proc_filter *filter)
+{
+	char ns[30] = { 0 };
+
+	if (!*filter->ns || readlinkat(fd, "ns/pid", ns, sizeof(ns) - 1) <= 0)
+		return false;
+	return strcmp(filter->ns, ns) != 0;
+}
+
+/* The process name is the field in brackets after the pid in stat */
+static char *
+proc_comm(int fd, char *buffer, size_t size)
+{
+	char *start, *end;
+
+	if (proc_read(fd, "stat", buffer, size) <= 0 ||
+	    !(start = strchr(buffer, '(')) || !(end = strrchr(start, ')')))
+		return NULL;
+	*end = '\0';
+	return start + 1;
+}
+
+static bool
+proc_in_container(int fd)
+{
+	char buffer[4096];
+	char *p;
+
+	if (proc_read(fd, "status", buffer, sizeof(buffer)) <= 0)
+		return true;
+	if (!(p = strstr(buffer, "\nenvID:")))
+		return false;
+	return strncmp(p + 1, "envID:\t0", 8) != 0;
+}
+
+/* Start time of pid in clock ticks after boot, or 0 if it is not running */
+static uint64_t
+pid_start_time(pid_t pid)
+{
+	char buffer[PATH_MAX];
+	unsigned long long start;
+	char *p;
+	int fd;
+	int i;
+
+	snprintf(buffer, sizeof(buffer), "/proc/%d", pid);
+	if ((fd = open(buffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return 0;
+	i = proc_read(fd, "stat", buffer, sizeof(buffer)) > 0;
+	close(fd);
+	if (!i || !(p = strrchr(buffer, ')')))
+		return 0;
+	/* starttime is the 22nd field, the 20th after the process name */
+	for (i = 0; i < 20 && p; i++)
+		p = strchr(p + 1, ' ');
+	if (!p || sscanf(p, " %llu", &start) != 1)
+		return 0;
+	return start;
+}
+
+static bool
+pid_matches(int procfd, pid_t p, const struct proc_filter *filter,
+    const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+{
+	char buffer[PATH_MAX];
+	char name[32];
+	struct stat sb;
+	ssize_t bytes;
+	bool retval = false;
+	char *comm;
+	int fd;
+
+	if (filter->openrc_pid != 0 && filter->openrc_pid == p)
+		return false;
+	snprintf(name, sizeof(name), "%d", p);
+	if ((fd = openat(procfd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return false;
+
+	if (pid == 0 && proc_other_ns(fd, filter))
+		goto out;
+	if (uid && (fstat(fd, &sb) != 0 || sb.st_uid != uid))
+		goto out;
+	if (exec && (!(comm = proc_comm(fd, buffer, sizeof(buffer))) ||
+		    strcmp(comm, basename_c(exec)) != 0))
+		goto out;
+	if (argv) {
+		if ((bytes = proc_read(fd, "cmdline", buffer, sizeof(buffer))) < 0 ||
+		    !cmdline_has_argv(buffer, bytes + 1, argv))
+			goto out;
+	}
+	/* If this is an OpenVZ host, filter out container processes */
+	if (filter->openvz_host && proc_in_container(fd))
+		goto out;
+	retval = true;
+
+out:
+	close(fd);
+	return retval;
+}
+
+RC_PIDLIST *
+rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
+{
+	struct proc_filter filter;
+	DIR *procdir;
+	struct dirent *entry;
+	pid_t p;
+	RC_PIDLIST *pids = NULL;
+	RC_PID *pi;
+
+	if ((procdir = opendir("/proc")) == NULL)
+		return NULL;
 
-	if ((rc = readlink("/proc/self/ns/pid", my_ns, sizeof(my_ns)-1)) <= 0)
-		my_ns[0] = '\0';
+	proc_filter_init(&filter);
+
+	/* A given pid can only ever match itself, so just look at that */
+	if (pid != 0) {
+		if (pid_matches(dirfd(procdir), pid, &filter, exec, argv, uid, pid)) {
+			pids = xmalloc(sizeof(*pids));
+			LIST_INIT(pids);
+			pi = xmalloc(sizeof(*pi));
+			pi->pid = pid;
+			LIST_INSERT_HEAD(pids, pi, entries);
+		}
+		closedir(procdir);
+		return pids;
+	}
 
 	while ((entry = readdir(procdir)) != NULL) {
 		if (sscanf(entry->d_name, "%d", &p) != 1)
 			continue;
-		if (openrc_pid != 0 && openrc_pid == p)
-			continue;
-		if (pid != 0 && pid != p)
-			continue;
-		xasprintf(&buffer, "/proc/%d/ns/pid", p);
-		if ((rc = readlink(buffer, proc_ns, sizeof(proc_ns)-1)) <= 0)
-			proc_ns[0] = '\0';
-		free(buffer);
-		if (pid == 0 && strlen(my_ns) && strlen (proc_ns) && strcmp(my_ns, proc_ns))
-			continue;
-		if (uid) {
-			xasprintf(&buffer, "/proc/%d", p);
-			if (stat(buffer, &sb) != 0 || sb.st_uid != uid) {
-				free(buffer);
-				continue;
-			}
-			free(buffer);
-		}
-		if (exec && !pid_is_exec(p, exec))
-			continue;
-		if (argv &&
-		    !pid_is_argv(p, (const char *const *)argv))
-			continue;
-		/* If this is an OpenVZ host, filter out container processes */
-		if (openvz_host) {
-			xasprintf(&buffer, "/proc/%d/status", p);
-			fp = fopen(buffer, "r");
-			free(buffer);
-			if (!fp)
-				continue;
-			while (xgetline(&line, &len, fp) != -1) {
-				if (strncmp(line, "envID:", 6) == 0) {
-					container_pid = !(strncmp(line, "envID:\t0", 8) == 0);
-					break;
-				}
-			}
-			fclose(fp);
-		}
-		if (container_pid)
+		if (!pid_matches(dirfd(procdir), p, &filter, exec, argv, uid, pid))
 			continue;
 		if (!pids) {
 			pids = xmalloc(sizeof(*pids));
@@ -201,12 +349,64 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 		pi->pid = p;
 		LIST_INSERT_HEAD(pids, pi, entries);
 	}
-	if (line != NULL)
-		free(line);
 	closedir(procdir);
 	return pids;
 }
 
+RC_PROCTABLE *
+rc_proctable_new(void)
+{
+	struct proc_filter filter;
+	RC_PROCTABLE *table;
+	struct proc_entry *e;
+	DIR *procdir;
+	struct dirent *entry;
+	char buffer[PATH_MAX];
+	struct stat sb;
+	ssize_t bytes;
+	char *comm;
+	pid_t p;
+	int fd;
+
+	if ((procdir = opendir("/proc")) == NULL)
+		return NULL;
+
+	proc_filter_init(&filter);
+	table = xmalloc(sizeof(*table));
+	memset(table, 0, sizeof(*table));
+
+	while ((entry = readdir(procdir)) != NULL) {
+		if (sscanf(entry->d_name, "%d", &p) != 1)
+			continue;
+		if (filter.openrc_pid != 0 && filter.openrc_pid == p)
+			continue;
+		if ((fd = openat(dirfd(procdir), entry->d_name,
+			    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+			continue;
+		if (fstat(fd, &sb) != 0 ||
+		    (filter.openvz_host && proc_in_container(fd))) {
+			close(fd);
+			continue;
+		}
+
+		e = proctable_add(table);
+		e->pid = p;
+		e->uid = sb.st_uid;
+		e->other_ns = proc_other_ns(fd, &filter);
+		if ((comm = proc_comm(fd, buffer, sizeof(buffer))))
+			e->comm = xstrdup(comm);
+		if ((bytes = proc_read(fd, "cmdline", buffer, sizeof(buffer))) >= 0) {
+			e->cmdlen = bytes + 1;
+			e->cmdline = xmalloc(e->cmdlen);
+			memcpy(e->cmdline, buffer, e->cmdlen);
+		}
+		close(fd);
+	}
+	closedir(procdir);
+	proctable_index(table);
+	return table;
+}
+
 #elif BSD
 
 # if defined(__NetBSD__) || defined(__OpenBSD__)
@@ -260,10 +460,17 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 		return NULL;
 	}
 
+	/* A given pid can only ever match itself, so just ask for that */
 #ifdef _KVM_GETPROC2
-	kp = kvm_getproc2(kd, KERN_PROC_ALL, 0, sizeof(*kp), &processes);
+	if (pid != 0)
+		kp = kvm_getproc2(kd, KERN_PROC_PID, pid, sizeof(*kp), &processes);
+	else
+		kp = kvm_getproc2(kd, KERN_PROC_ALL, 0, sizeof(*kp), &processes);
 #else
-	kp = kvm_getprocs(kd, KERN_PROC_PROC, 0, &processes);
+	if (pid != 0)
+		kp = kvm_getprocs(kd, KERN_PROC_PID, pid, &processes);
+	else
+		kp = kvm_getprocs(kd, KERN_PROC_PROC, 0, &processes);
 #endif
 	if ((kp == NULL && processes > 0) || (kp != NULL && processes < 0)) {
 		fprintf(stderr, "kvm_getprocs: %s\n", kvm_geterr(kd));
@@ -311,68 +518,497 @@ rc_find_pids(const char *exec, const char *const *argv, uid_t uid, pid_t pid)
 	return pids;
 }
 
+RC_PROCTABLE *
+rc_proctable_new(void)
+{
+	kvm_t *kd;
+	char errbuf[_POSIX2_LINE_MAX];
+	struct _KINFO_PROC *kp;
+	struct proc_entry *e;
+	RC_PROCTABLE *table;
+	char **pargv;
+	size_t len;
+	int processes = 0;
+	int i;
+
+	if ((kd = kvm_openfiles(_KVM_PATH, _KVM_PATH,
+		    NULL, _KVM_FLAGS, errbuf)) == NULL)
+	{
+		fprintf(stderr, "kvm_open: %s\n", errbuf);
+		return NULL;
+	}
+
+#ifdef _KVM_GETPROC2
+	kp = kvm_getproc2(kd, KERN_PROC_ALL, 0, sizeof(*kp), &processes);
+#else
+	kp = kvm_getprocs(kd, KERN_PROC_PROC, 0, &processes);
+#endif
+	if ((kp == NULL && processes > 0) || (kp != NULL && processes < 0)) {
+		fprintf(stderr, "kvm_getprocs: %s\n", kvm_geterr(kd));
+		kvm_close(kd);
+		return NULL;
+	}
+
+	table = xmalloc(sizeof(*table));
+	memset(table, 0, sizeof(*table));
+	for (i = 0; i < processes; i++) {
+		e = proctable_add(table);
+		e->pid = _GET_KINFO_PID(kp[i]);
+		e->uid = _GET_KINFO_UID(kp[i]);
+		if (_GET_KINFO_COMM(kp[i]))
+			e->comm = xstrdup(_GET_KINFO_COMM(kp[i]));
+		if (!(pargv = _KVM_GETARGV(kd, &kp[i], 0)))
+			continue;
+		for (; *pargv; pargv++) {
+			len = strlen(*pargv) + 1;
+			e->cmdline = xrealloc(e->cmdline, e->cmdlen + len);
+			memcpy(e->cmdline + e->cmdlen, *pargv, len);
+			e->cmdlen += len;
+		}
+	}
+	kvm_close(kd);
+	proctable_index(table);
+
+	return table;
+}
+
+/* We have no cheap way to ask for a start time here, so never know it */
+static uint64_t
+pid_start_time(pid_t pid RC_UNUSED)
+{
+	return 0;
+}
+
 #else
 #  error "Platform not supported!"
 #endif
 
 static bool
-_match_daemon(const char *svcname, const char *instance, RC_STRINGLIST *match)
+proc_entry_match(const struct proc_entry *e, const char *exec,
+    const char *const *argv, uid_t uid, pid_t pid)
+{
+	if (pid != 0 && pid != e->pid)
+		return false;
+	if (pid == 0 && e->other_ns)
+		return false;
+	if (uid && uid != e->uid)
+		return false;
+	if (exec && (!e->comm || strcmp(e->comm, basename_c(exec)) != 0))
+		return false;
+	if (argv && *argv &&
+	    (!e->cmdline || !cmdline_has_argv(e->cmdline, e->cmdlen, argv)))
+		return false;
+	return true;
+}
+
+static void
+pidlist_add(RC_PIDLIST **pids, pid_t pid)
 {
+	RC_PID *pi;
+
+	if (!*pids) {
+		*pids = xmalloc(sizeof(**pids));
+		LIST_INIT(*pids);
+	}
+	pi = xmalloc(sizeof(*pi));
+	pi->pid = pid;
+	LIST_INSERT_HEAD(*pids, pi, entries);
+}
+
+RC_PIDLIST *
+rc_proctable_find_pids(const RC_PROCTABLE *table, const char *exec,
+    const char *const *argv, uid_t uid, pid_t pid)
+{
+	RC_PIDLIST *pids = NULL;
+	const struct proc_entry *e;
+	enum proc_key key;
+	uint32_t hash;
+	uint32_t i;
+
+	if (pid != 0) {
+		key = PROC_BY_PID;
+		hash = pid_hash(pid);
+	} else if (exec) {
+		key = PROC_BY_COMM;
+		hash = string_hash(basename_c(exec));
+	} else if (argv && *argv) {
+		key = PROC_BY_ARG0;
+		hash = string_hash(*argv);
+	} else {
+		for (i = 0; i < table->count; i++)
+			if (proc_entry_match(&table->procs[i], exec, argv, uid, pid))
+				pidlist_add(&pids, table->procs[i].pid);
+		return pids;
+	}
+
+	for (i = table->buckets[key][hash & table->mask]; i; i = e->next[key]) {
+		e = &table->procs[i - 1];
+		if (proc_entry_match(e, exec, argv, uid, pid))
+			pidlist_add(&pids, e->pid);
+	}
+	return pids;
+}
+
+void
+rc_proctable_free(RC_PROCTABLE *table)
+{
+	size_t i;
+
+	if (!table)
+		return;
+	for (i = 0; i < table->count; i++) {
+		free(table->procs[i].comm);
+		free(table->procs[i].cmdline);
+	}
+	for (i = 0; i < PROC_KEYS; i++)
+		free(table->buckets[i]);
+	free(table->procs);
+	free(table);
+}
+
+/*
+ * The daemons a service started are kept in daemons/<service>/.index, one
+ * binary record per daemon, so a match or crash check is a single read.
+ * A record is the pid and start time of the daemon when they were known,
+ * then exec, pidfile and each argument as length prefixed strings.
+ * The numbered key=value files beside it are a text export of the same
+ * records, which we also read if a service has no index yet.
+ */
+#define DAEMON_INDEX	".index"
+#define DAEMON_MAGIC	0x52434431	/* RCD1 */
+
+struct daemon_buf {
+	char *data;
+	size_t len;
+	size_t alloc;
+};
+
+struct daemon_record {
+	pid_t pid;		/* 0 if not known */
+	uint64_t start;		/* start time of pid, 0 if not known */
+	const char *exec;
+	const char *pidfile;
+	const char **argv;	/* NULL terminated */
+	size_t argc;
+};
+
+struct daemon_records {
+	struct daemon_buf buf;	/* the strings point into this */
+	struct daemon_record *records;
+	size_t count;
+};
+
+static void
+buf_add(struct daemon_buf *buf, const void *data, size_t len)
+{
+	if (buf->len + len > buf->alloc) {
+		while (buf->len + len > buf->alloc)
+			buf->alloc = buf->alloc ? buf->alloc * 2 : 256;
+		buf->data = xrealloc(buf->data, buf->alloc);
+	}
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+static void
+buf_add_u32(struct daemon_buf *buf, uint32_t value)
+{
+	buf_add(buf, &value, sizeof(value));
+}
+
+/* Strings are stored with their NUL so they can be used in place,
+ * a length of 0 is a string that was not set */
+static void
+buf_add_str(struct daemon_buf *buf, const char *str)
+{
+	uint32_t len = str ? strlen(str) + 1 : 0;
+
+	buf_add_u32(buf, len);
+	if (str)
+		buf_add(buf, str, len);
+}
+
+static void
+buf_add_record(struct daemon_buf *buf, pid_t pid, uint64_t start,
+    const char *exec, const char *pidfile, const char *const *argv)
+{
+	uint32_t argc = 0;
+
+	while (argv && argv[argc])
+		argc++;
+	buf_add_u32(buf, (uint32_t)pid);
+	buf_add(buf, &start, sizeof(start));
+	buf_add_str(buf, exec);
+	buf_add_str(buf, pidfile);
+	buf_add_u32(buf, argc);
+	while (argv && *argv)
+		buf_add_str(buf, *argv++);
+}
+
+static bool
+get_u32(const char **p, const char *end, uint32_t *value)
+{
+	if ((size_t)(end - *p) < sizeof(*value))
+		return false;
+	memcpy(value, *p, sizeof(*value));
+	*p += sizeof(*value);
+	return true;
+}
+
+static bool
+get_str(const char **p, const char *end, const char **str)
+{
+	uint32_t len;
+
+	if (!get_u32(p, end, &len) || (size_t)(end - *p) < len ||
+	    (len && (*p)[len - 1] != '\0'))
+		return false;
+	*str = len ? *p : NULL;
+	*p += len;
+	return true;
+}
+
+static void
+daemons_free(struct daemon_records *recs)
+{
+	size_t i;
+
+	for (i = 0; i < recs->count; i++)
+		free(recs->records[i].argv);
+	free(recs->records);
+	free(recs->buf.data);
+	memset(recs, 0, sizeof(*recs));
+}
+
+static bool
+daemons_decode(struct daemon_records *recs)
+{
+	const char *p = recs->buf.data;
+	const char *end = p + recs->buf.len;
+	struct daemon_record *rec;
+	uint32_t magic, count, value, i;
+
+	if (!get_u32(&p, end, &magic) || magic != DAEMON_MAGIC ||
+	    !get_u32(&p, end, &count) || count > recs->buf.len)
+		return false;
+	recs->records = xmalloc(sizeof(*recs->records) * (count + 1));
+	for (recs->count = 0; recs->count < count; recs->count++) {
+		rec = &recs->records[recs->count];
+		rec->argv = NULL;
+		if (!get_u32(&p, end, &value) ||
+		    (size_t)(end - p) < sizeof(rec->start))
+			return false;
+		rec->pid = (pid_t)value;
+		memcpy(&rec->start, p, sizeof(rec->start));
+		p += sizeof(rec->start);
+		if (!get_str(&p, end, &rec->exec) ||
+		    !get_str(&p, end, &rec->pidfile) ||
+		    !get_u32(&p, end, &value) || value > recs->buf.len)
+			return false;
+		rec->argc = value;
+		rec->argv = xmalloc(sizeof(*rec->argv) * (rec->argc + 1));
+		for (i = 0; i < rec->argc; i++) {
+			if (!get_str(&p, end, &rec->argv[i]) || !rec->argv[i]) {
+				free(rec->argv);
+				return false;
+			}
+		}
+		rec->argv[i] = NULL;
+	}
+	return true;
+}
+
+/* Build records from the key=value files of a service without an index */
+static void
+daemons_import(int dfd, struct daemon_buf *buf)
+{
+	RC_STRINGLIST *files = rc_stringlist_new();
+	RC_STRINGLIST *args;
+	RC_STRING *f, *s;
+	const char **argv;
+	struct dirent *d;
 	char *line = NULL;
+	char *exec, *pidfile;
+	char *p, *token;
 	size_t len = 0;
+	uint32_t count = 0;
+	size_t i;
 	FILE *fp;
-	RC_STRING *m;
-	char *daemon;
+	DIR *dp;
 
-	xasprintf(&daemon, "%s/%s", svcname, instance);
-	fp = do_fopenat(rc_dirfd(RC_DIR_DAEMONS), daemon, O_RDONLY);
-	free(daemon);
+	if ((dp = do_dopendir(dfd))) {
+		while ((d = readdir(dp)))
+			if (d->d_name[0] != '.')
+				rc_stringlist_add(files, d->d_name);
+		closedir(dp);
+	}
+	rc_stringlist_sort(&files);
 
-	if (!fp)
-		return false;
+	buf_add_u32(buf, DAEMON_MAGIC);
+	buf_add_u32(buf, 0);
+	TAILQ_FOREACH(f, files, entries) {
+		if (!(fp = do_fopenat(dfd, f->value, O_RDONLY)))
+			continue;
+		exec = pidfile = NULL;
+		args = rc_stringlist_new();
+		while (xgetline(&line, &len, fp) != -1) {
+			p = line;
+			if ((token = strsep(&p, "=")) == NULL || !p || !*p)
+				continue;
+			if (strcmp(token, "exec") == 0) {
+				free(exec);
+				exec = xstrdup(p);
+			} else if (strncmp(token, "argv_", 5) == 0)
+				rc_stringlist_add(args, p);
+			else if (strcmp(token, "pidfile") == 0) {
+				free(pidfile);
+				pidfile = xstrdup(p);
+			}
+		}
+		fclose(fp);
 
-	while (xgetline(&line, &len, fp) != -1) {
-		TAILQ_FOREACH(m, match, entries)
-		    if (strcmp(line, m->value) == 0) {
-			    TAILQ_REMOVE(match, m, entries);
-			    break;
-		    }
-		if (!TAILQ_FIRST(match))
-			break;
+		i = 0;
+		TAILQ_FOREACH(s, args, entries)
+			i++;
+		argv = xmalloc(sizeof(*argv) * (i + 1));
+		i = 0;
+		TAILQ_FOREACH(s, args, entries)
+			argv[i++] = s->value;
+		argv[i] = NULL;
+		buf_add_record(buf, 0, 0, exec, pidfile, argv);
+		count++;
+		free(argv);
+		rc_stringlist_free(args);
+		free(exec);
+		free(pidfile);
 	}
-	fclose(fp);
+	memcpy(buf->data + sizeof(uint32_t), &count, sizeof(count));
 	free(line);
-	if (TAILQ_FIRST(match))
-		return false;
-	return true;
+	rc_stringlist_free(files);
 }
 
-static RC_STRINGLIST *
-_match_list(const char *exec, const char *const *argv, const char *pidfile)
+static void
+daemons_load(const char *service, struct daemon_records *recs)
 {
-	RC_STRINGLIST *match = rc_stringlist_new();
-	int i = 0;
-	char *m;
+	struct stat st;
+	ssize_t bytes;
+	int dfd, fd;
+
+	memset(recs, 0, sizeof(*recs));
+	if ((dfd = openat(rc_dirfd(RC_DIR_DAEMONS), service,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return;
+
+	if ((fd = openat(dfd, DAEMON_INDEX, O_RDONLY | O_CLOEXEC)) != -1) {
+		if (fstat(fd, &st) == 0 && st.st_size > 0) {
+			recs->buf.alloc = st.st_size;
+			recs->buf.data = xmalloc(recs->buf.alloc);
+			if ((bytes = read(fd, recs->buf.data, recs->buf.alloc)) > 0)
+				recs->buf.len = bytes;
+		}
+		close(fd);
+	} else
+		daemons_import(dfd, &recs->buf);
+	close(dfd);
+
+	if (!daemons_decode(recs))
+		daemons_free(recs);
+}
 
-	if (exec) {
-		xasprintf(&m, "exec=%s", exec);
-		rc_stringlist_add(match, m);
-		free(m);
+static void
+daemons_export(int dfd, const struct daemon_records *recs)
+{
+	const struct daemon_record *rec;
+	char name[32];
+	struct dirent *d;
+	size_t i, j;
+	FILE *fp;
+	DIR *dp;
+
+	if ((dp = do_dopendir(dfd))) {
+		while ((d = readdir(dp)))
+			if (d->d_name[0] != '.')
+				unlinkat(dfd, d->d_name, 0);
+		closedir(dp);
 	}
 
-	while (argv && argv[i]) {
-		xasprintf(&m, "argv_0=%s", argv[i++]);
-		rc_stringlist_add(match, m);
-		free(m);
+	for (i = 0; i < recs->count; i++) {
+		rec = &recs->records[i];
+		snprintf(name, sizeof(name), "%03zu", i + 1);
+		if (!(fp = do_fopenat(dfd, name, O_WRONLY | O_CREAT | O_TRUNC)))
+			continue;
+		fprintf(fp, "exec=%s", rec->exec ? rec->exec : "");
+		for (j = 0; j < rec->argc; j++)
+			fprintf(fp, "\nargv_%zu=%s", j, rec->argv[j]);
+		fprintf(fp, "\npidfile=%s\n", rec->pidfile ? rec->pidfile : "");
+		fclose(fp);
 	}
+}
+
+/* Replace the index with recs in one rename, then export it */
+static bool
+daemons_save(const char *service, struct daemon_records *recs)
+{
+	bool retval = false;
+	int dfd, fd;
+	ssize_t bytes;
 
-	if (pidfile) {
-		xasprintf(&m, "pidfile=%s", pidfile);
-		rc_stringlist_add(match, m);
-		free(m);
+	if (mkdirat(rc_dirfd(RC_DIR_DAEMONS), service, 0755) != 0 &&
+	    errno != EEXIST)
+		return false;
+	if ((dfd = openat(rc_dirfd(RC_DIR_DAEMONS), service,
+		    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		return false;
+
+	if ((fd = openat(dfd, DAEMON_INDEX ".tmp",
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) != -1) {
+		bytes = write(fd, recs->buf.data, recs->buf.len);
+		close(fd);
+		if (bytes == (ssize_t)recs->buf.len &&
+		    renameat(dfd, DAEMON_INDEX ".tmp", dfd, DAEMON_INDEX) == 0)
+			retval = true;
+		else
+			unlinkat(dfd, DAEMON_INDEX ".tmp", 0);
 	}
+	if (retval && daemons_decode(recs))
+		daemons_export(dfd, recs);
+	close(dfd);
+	return retval;
+}
 
-	return match;
+static bool
+daemon_matches(const struct daemon_record *rec, const char *exec,
+    const char *const *argv, const char *pidfile)
+{
+	size_t i;
+
+	if (exec && (!rec->exec || strcmp(exec, rec->exec) != 0))
+		return false;
+	for (i = 0; argv && argv[i]; i++)
+		if (i >= rec->argc || strcmp(argv[i], rec->argv[i]) != 0)
+			return false;
+	if (pidfile && (!rec->pidfile || strcmp(pidfile, rec->pidfile) != 0))
+		return false;
+	return true;
+}
+
+/* The pid in the pidfile, seen from inside the chroot if there is one */
+static pid_t
+daemon_pidfile_pid(const char *ch_root, const char *pidfile)
+{
+	char *path = NULL;
+	pid_t pid = 0;
+	FILE *fp;
+
+	if (ch_root)
+		xasprintf(&path, "%s%s", ch_root, pidfile);
+	if ((fp = fopen(path ? path : pidfile, "r"))) {
+		if (fscanf(fp, "%d", &pid) != 1)
+			pid = 0;
+		fclose(fp);
+	}
+	free(path);
+	return pid;
 }
 
 bool
@@ -380,262 +1016,181 @@ rc_service_daemon_set(const char *service, const char *exec,
     const char *const *argv,
     const char *pidfile, bool started)
 {
-	char *file = NULL;
-	int nfiles = 0;
-	char oldfile[PATH_MAX] = { '\0' };
-	bool retval = false;
-	DIR *dp;
-	struct dirent *d;
-	RC_STRINGLIST *match, *renamelist;
-	int i = 0;
-	FILE *fp;
 	const char *base = basename_c(service);
+	struct daemon_records recs, next;
+	const struct daemon_record *rec;
+	bool erased = false;
+	uint32_t count = 0;
+	char *ch_root;
+	pid_t pid = 0;
+	size_t i;
 
 	if (!exec && !pidfile) {
 		errno = EINVAL;
 		return false;
 	}
 
-	/* Regardless, erase any existing daemon info */
-	if ((dp = do_opendirat(rc_dirfd(RC_DIR_DAEMONS), base))) {
-		match = _match_list(exec, argv, pidfile);
-		renamelist = rc_stringlist_new();
-		while ((d = readdir(dp))) {
-			if (d->d_name[0] == '.')
-				continue;
-
-			xasprintf(&file, "%s/daemons/%s/%s", rc_svcdir(), base, d->d_name);
-			if (rc_stringlist_find(renamelist, file)) {
-				free(file);
-				continue;
-			}
-
-			nfiles++;
+	memset(&next, 0, sizeof(next));
+	buf_add_u32(&next.buf, DAEMON_MAGIC);
+	buf_add_u32(&next.buf, 0);
 
-			if (!*oldfile) {
-				if (_match_daemon(base, d->d_name, match)) {
-					unlink(file);
-					strlcpy(oldfile, file, sizeof(oldfile));
-					nfiles--;
-				}
-			} else {
-				rename(file, oldfile);
-				strlcpy(oldfile, file, sizeof(oldfile));
-				/* Add renamed file to renamelist, as this new file name could
-				 * be read again from readdir() */
-				rc_stringlist_add(renamelist, oldfile);
-			}
-			free(file);
+	/* Regardless, erase any existing daemon info */
+	daemons_load(base, &recs);
+	for (i = 0; i < recs.count; i++) {
+		rec = &recs.records[i];
+		if (!erased && daemon_matches(rec, exec, argv, pidfile)) {
+			erased = true;
+			continue;
 		}
-		closedir(dp);
-		rc_stringlist_free(match);
-		rc_stringlist_free(renamelist);
+		buf_add_record(&next.buf, rec->pid, rec->start, rec->exec,
+		    rec->pidfile, rec->argv);
+		count++;
 	}
+	daemons_free(&recs);
 
-	/* Now store our daemon info */
-	if (!started)
-		return true;
-
-	if (mkdirat(rc_dirfd(RC_DIR_DAEMONS), base, 0755) == 0 || errno == EEXIST) {
-		xasprintf(&file, "%s/daemons/%s/%03d", rc_svcdir(), base, nfiles + 1);
-		if ((fp = fopen(file, "w"))) {
-			fprintf(fp, "exec=");
-			if (exec)
-				fprintf(fp, "%s", exec);
-			while (argv && argv[i]) {
-				fprintf(fp, "\nargv_%d=%s", i, argv[i]);
-				i++;
-			}
-			fprintf(fp, "\npidfile=");
-			if (pidfile)
-				fprintf(fp, "%s", pidfile);
-			fprintf(fp, "\n");
-			fclose(fp);
-			retval = true;
+	/* Now store our daemon info, with the pid and when it started if
+	 * we can tell so that a recycled pid is not taken for our daemon */
+	if (started) {
+		if (pidfile) {
+			ch_root = rc_service_value_get(base, "chroot");
+			pid = daemon_pidfile_pid(ch_root, pidfile);
+			free(ch_root);
 		}
-		free(file);
+		buf_add_record(&next.buf, pid, pid ? pid_start_time(pid) : 0,
+		    exec, pidfile, argv);
+		count++;
 	}
 
-	return retval;
+	memcpy(next.buf.data + sizeof(uint32_t), &count, sizeof(count));
+	if (started || erased) {
+		if (!daemons_save(base, &next) && started) {
+			daemons_free(&next);
+			return false;
+		}
+	}
+	daemons_free(&next);
+	return true;
 }
 
 bool
 rc_service_started_daemon(const char *service,
     const char *exec, const char *const *argv, int indx)
 {
-	const char *base = basename_c(service);
-	char *file = NULL;
-	RC_STRINGLIST *match;
+	struct daemon_records recs;
 	bool retval = false;
-	DIR *dp;
-	struct dirent *d;
+	size_t i;
 
 	if (!service || !exec)
 		return false;
 
-	match = _match_list(exec, argv, NULL);
-
+	daemons_load(basename_c(service), &recs);
 	if (indx > 0) {
-		xasprintf(&file, "%03d", indx);
-		retval = _match_daemon(base, file, match);
-		free(file);
-	} else if ((dp = do_opendirat(rc_dirfd(RC_DIR_DAEMONS), base))) {
-		while ((d = readdir(dp))) {
-			if (d->d_name[0] == '.')
-				continue;
-			if ((retval = _match_daemon(base, d->d_name, match)))
-				break;
-		}
-		closedir(dp);
+		if ((size_t)indx <= recs.count)
+			retval = daemon_matches(&recs.records[indx - 1],
+			    exec, argv, NULL);
+	} else {
+		for (i = 0; i < recs.count && !retval; i++)
+			retval = daemon_matches(&recs.records[i], exec, argv, NULL);
 	}
-
-	rc_stringlist_free(match);
+	daemons_free(&recs);
 	return retval;
 }
 
+/*
+ * When table is given, any daemon which has to be found by name is looked up
+ * in it, creating it on first use, instead of walking the process list.
+ */
 bool
-rc_service_daemons_crashed(const char *service)
+rc_service_daemons_crashed_in(const char *service, RC_PROCTABLE **table)
 {
-	DIR *dp;
-	struct dirent *d;
-	FILE *fp;
-	char *line = NULL;
-	size_t len = 0;
-	char **argv = NULL;
-	char *exec = NULL;
-	char *name = NULL;
-	char *pidfile = NULL;
-	pid_t pid = 0;
-	RC_PIDLIST *pids;
-	RC_PID *p1;
-	RC_PID *p2;
-	char *p;
-	char *token;
+	const char *base = basename_c(service);
+	struct daemon_records recs;
+	const struct daemon_record *rec;
+	const char *exec_argv[2] = { NULL, NULL };
+	const char *const *argv;
+	char *ch_root = NULL;
 	bool retval = false;
-	RC_STRINGLIST *list = NULL;
-	RC_STRING *s;
+	RC_PIDLIST *pids;
+	RC_PID *p1, *p2;
+	pid_t pid;
 	size_t i;
-	char *ch_root;
-	char *spidfile;
 
-	if (!(dp = do_opendirat(rc_dirfd(RC_DIR_DAEMONS), basename_c(service))))
-		return false;
-
-	while ((d = readdir(dp))) {
-		if (d->d_name[0] == '.')
-			continue;
-
-		if (!(fp = do_fopenat(dirfd(dp), d->d_name, O_RDONLY)))
-			break;
+	daemons_load(base, &recs);
+	if (recs.count)
+		ch_root = rc_service_value_get(base, "chroot");
 
-		while (xgetline(&line, &len, fp) != -1) {
-			p = line;
-			if ((token = strsep(&p, "=")) == NULL || !p)
-				continue;
-
-			if (!*p)
+	for (i = 0; i < recs.count && !retval; i++) {
+		rec = &recs.records[i];
+		if (rec->pidfile) {
+			errno = 0;
+			if (!(pid = daemon_pidfile_pid(ch_root, rec->pidfile))) {
+				retval = true;
 				continue;
-
-			if (strcmp(token, "exec") == 0) {
-				if (exec)
-					free(exec);
-				exec = xstrdup(p);
-			} else if (strncmp(token, "argv_", 5) == 0) {
-				if (!list)
-					list = rc_stringlist_new();
-				rc_stringlist_add(list, p);
-			} else if (strcmp(token, "name") == 0) {
-				if (name)
-					free(name);
-				name = xstrdup(p);
-			} else if (strcmp(token, "pidfile") == 0) {
-				pidfile = xstrdup(p);
-				break;
 			}
-		}
-		fclose(fp);
-
-		ch_root = rc_service_value_get(basename_c(service), "chroot");
-		spidfile = pidfile;
-		if (ch_root && pidfile) {
-			xasprintf(&spidfile, "%s%s", ch_root, pidfile);
-			free(pidfile);
-			pidfile = spidfile;
+			/* Same pid but started at another time is not ours */
+			if (rec->pid == pid && rec->start &&
+			    pid_start_time(pid) != rec->start)
+				retval = true;
+			else if (kill(pid, 0) == -1 && errno == ESRCH)
+				retval = true;
+			continue;
 		}
 
-		pid = 0;
-		if (pidfile) {
-			retval = true;
-			if ((fp = fopen(pidfile, "r"))) {
-				if (fscanf(fp, "%d", &pid) == 1)
-					retval = false;
-				fclose(fp);
-			}
-			free(pidfile);
-			pidfile = NULL;
-
-			/* We have the pid, so no need to match
-			   on exec or name */
-			free(exec);
-			exec = NULL;
-			free(name);
-			name = NULL;
-		} else {
-			if (exec) {
-				if (!list)
-					list = rc_stringlist_new();
-				if (!TAILQ_FIRST(list))
-					rc_stringlist_add(list, exec);
+		/* We match on the arguments, or just exec without them */
+		if (rec->argc)
+			argv = rec->argv;
+		else if (rec->exec) {
+			exec_argv[0] = rec->exec;
+			argv = exec_argv;
+		} else
+			continue;
 
-				free(exec);
-				exec = NULL;
-			}
+		if (table && !*table)
+			*table = rc_proctable_new();
+		if (table && *table)
+			pids = rc_proctable_find_pids(*table, NULL, argv, 0, 0);
+		else
+			pids = rc_find_pids(NULL, argv, 0, 0);
 
-			if (list) {
-				/* We need to flatten our linked list
-				   into an array */
-				i = 0;
-				TAILQ_FOREACH(s, list, entries)
-				    i++;
-				argv = xmalloc(sizeof(char *) * (i + 1));
-				i = 0;
-				TAILQ_FOREACH(s, list, entries)
-				    argv[i++] = s->value;
-				argv[i] = NULL;
-			}
+		/* errno is only meaningful for the pidfile */
+		if (!pids) {
+			errno = 0;
+			retval = true;
+			continue;
 		}
-
-		if (!retval) {
-			if (pid != 0) {
-				if (kill(pid, 0) == -1 && errno == ESRCH)
-					retval = true;
-			} else if ((pids = rc_find_pids(exec,
-				    (const char *const *)argv,
-				    0, pid)))
-			{
-				p1 = LIST_FIRST(pids);
-				while (p1) {
-					p2 = LIST_NEXT(p1, entries);
-					free(p1);
-					p1 = p2;
-				}
-				free(pids);
-			} else
-				retval = true;
+		p1 = LIST_FIRST(pids);
+		while (p1) {
+			p2 = LIST_NEXT(p1, entries);
+			free(p1);
+			p1 = p2;
 		}
-		rc_stringlist_free(list);
-		list = NULL;
-		free(argv);
-		argv = NULL;
-		free(exec);
-		exec = NULL;
-		free(name);
-		name = NULL;
-		if (retval)
-			break;
+		free(pids);
 	}
-	closedir(dp);
-	free(line);
+	free(ch_root);
+	daemons_free(&recs);
 
 	return retval;
 }
+
+bool
+rc_service_daemons_crashed(const char *service)
+{
+	return rc_service_daemons_crashed_in(service, NULL);
+}
+
+RC_STRINGLIST *
+rc_services_daemons_crashed(const RC_STRINGLIST *services)
+{
+	RC_STRINGLIST *crashed = rc_stringlist_new();
+	RC_PROCTABLE *table = NULL;
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, services, entries) {
+		errno = 0;
+		if (rc_service_daemons_crashed_in(s->value, &table) &&
+		    errno != EACCES)
+			rc_stringlist_add(crashed, s->value);
+	}
+	rc_proctable_free(table);
+	return crashed;
+}
@@ -15,12 +15,17 @@
  *    except according to the terms contained in the LICENSE file.
  */
 
+#include <sys/mman.h>
 #include <sys/utsname.h>
+#include <sys/wait.h>
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -34,6 +39,7 @@
 #include "misc.h"
 
 #define GENDEP          RC_LIBEXECDIR "/sh/gendepends.sh"
+#define GENDEP_JOBS_MAX 32
 
 static const char *bootlevel = NULL;
 
@@ -61,66 +67,249 @@ get_shell_value(char *string)
 	return NULL;
 }
 
-void
-rc_deptree_free(RC_DEPTREE *deptree)
+/*
+ * The deptree is compiled into a host endian image which is written next to
+ * the shell parseable deptree file and mapped read-only by rc_deptree_load.
+ *
+ *   header
+ *   uint32_t types[ntypes]                  dependency type names
+ *   uint32_t services[nservices]            service names
+ *   uint32_t index[nslots]                  service hash index
+ *   uint32_t rows[nservices * ntypes + 1]   first edge of service/type
+ *   uint32_t edges[nedges]                  dependency names
+ *   char strtab[strtab_size]                interned NUL terminated strings
+ *
+ * Names are stored as offsets into the string table. The first
+ * RC_DEPTYPE_MAX types are always those of enum rc_deptype_id, followed by
+ * any other type found. The index is an open addressing table of service
+ * numbers + 1, keyed on the name, where 0 is an empty slot.
+ * Each update writes a fresh file and renames it into place, so a process
+ * which still has the previous generation mapped keeps a consistent view
+ * of it.
+ */
+#define DEPTREE_IMAGE		"deptree.bin"
+#define DEPTREE_IMAGE_TMP	"deptree.bin.tmp"
+#define DEPTREE_MAGIC		0x52434454 /* RCDT */
+#define DEPTREE_VERSION		2
+
+struct deptree_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t checksum;
+	uint32_t generation;
+	uint32_t ntypes;
+	uint32_t nservices;
+	uint32_t nslots;
+	uint32_t nedges;
+	uint32_t strtab_size;
+};
+
+struct rc_deptree {
+	void *image;
+	size_t size;
+	bool mapped;
+	uint32_t ntypes;
+	uint32_t nservices;
+	uint32_t nslots;
+	const uint32_t *types;
+	const uint32_t *services;
+	const uint32_t *index;
+	const uint32_t *rows;
+	const uint32_t *edges;
+	const char *strtab;
+};
+
+/* Dependencies of one type for one service, pointing into the image */
+typedef struct rc_depview {
+	const RC_DEPTREE *deptree;
+	const uint32_t *edges;
+	size_t count;
+} RC_DEPVIEW;
+
+#define NO_SERVICE UINT32_MAX
+#define NO_DEPTYPE UINT32_MAX
+
+static const char *const deptype_names[RC_DEPTYPE_MAX] = {
+	[RC_DEPTYPE_INEED] = "ineed",
+	[RC_DEPTYPE_NEEDSME] = "needsme",
+	[RC_DEPTYPE_IUSE] = "iuse",
+	[RC_DEPTYPE_USESME] = "usesme",
+	[RC_DEPTYPE_IWANT] = "iwant",
+	[RC_DEPTYPE_WANTSME] = "wantsme",
+	[RC_DEPTYPE_IAFTER] = "iafter",
+	[RC_DEPTYPE_IBEFORE] = "ibefore",
+	[RC_DEPTYPE_IPROVIDE] = "iprovide",
+	[RC_DEPTYPE_PROVIDEDBY] = "providedby",
+	[RC_DEPTYPE_KEYWORD] = "keyword",
+	[RC_DEPTYPE_BROKEN] = "broken",
+	[RC_DEPTYPE_REEXPORT] = "reexport",
+};
+
+static enum rc_deptype_id
+deptype_id(const char *type)
+{
+	int i;
+
+	for (i = 0; i < RC_DEPTYPE_MAX; i++)
+		if (strcmp(deptype_names[i], type) == 0)
+			break;
+	return i;
+}
+
+static uint32_t
+fnv1a(const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t
+hash_name(const char *name)
+{
+	return fnv1a(name, strlen(name));
+}
+
+/* Marks a removed service in the depinfos index */
+static RC_DEPINFO removed_depinfo;
+
+static void
+depinfos_free(RC_DEPINFOS *depinfos)
 {
 	RC_DEPINFO *di;
 	RC_DEPINFO *di_save;
 	RC_DEPTYPE *dt;
 	RC_DEPTYPE *dt_save;
 
-	if (!deptree)
+	if (!depinfos)
 		return;
 
-	TAILQ_FOREACH_SAFE(di, deptree, entries, di_save) {
+	TAILQ_FOREACH_SAFE(di, &depinfos->list, entries, di_save) {
 		TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_save) {
 			TAILQ_REMOVE(&di->depends, dt, entries);
 			rc_stringlist_free(dt->services);
 			free(dt->type);
 			free(dt);
 		}
-		TAILQ_REMOVE(deptree, di, entries);
+		TAILQ_REMOVE(&depinfos->list, di, entries);
 		free(di->service);
 		free(di);
 	}
 
-	/* Use free() here since rc_deptree_free should not call itself */
+	free(depinfos->index);
+	free(depinfos);
+}
+
+void
+rc_deptree_free(RC_DEPTREE *deptree)
+{
+	if (!deptree)
+		return;
+
+	if (deptree->mapped)
+		munmap(deptree->image, deptree->size);
+	else
+		free(deptree->image);
 	free(deptree);
 }
 
-static RC_DEPINFO *
-get_depinfo(const RC_DEPTREE *deptree, const char *service)
+/* Return the index slot holding service, or the empty slot it belongs in */
+static size_t
+depinfos_slot(const RC_DEPINFOS *depinfos, const char *service)
 {
+	size_t mask = depinfos->index_size - 1;
+	size_t i = hash_name(service) & mask;
 	RC_DEPINFO *di;
-	if (deptree) {
-		TAILQ_FOREACH(di, deptree, entries)
-			if (strcmp(di->service, service) == 0)
-				return di;
+
+	while ((di = depinfos->index[i])) {
+		if (di != &removed_depinfo && strcmp(di->service, service) == 0)
+			break;
+		i = (i + 1) & mask;
 	}
-	return NULL;
+	return i;
+}
+
+static void
+depinfos_index(RC_DEPINFOS *depinfos, RC_DEPINFO *depinfo)
+{
+	RC_DEPINFO **index = depinfos->index;
+	size_t size = depinfos->index_size;
+	size_t i;
+
+	if ((depinfos->index_used + 1) * 2 > depinfos->index_size) {
+		depinfos->index_size = size ? size * 2 : 256;
+		depinfos->index = xmalloc(depinfos->index_size * sizeof(*index));
+		memset(depinfos->index, 0, depinfos->index_size * sizeof(*index));
+		depinfos->index_used = 0;
+		for (i = 0; i < size; i++) {
+			if (!index[i] || index[i] == &removed_depinfo)
+				continue;
+			depinfos->index[depinfos_slot(depinfos, index[i]->service)] = index[i];
+			depinfos->index_used++;
+		}
+		free(index);
+	}
+
+	/* The first service of a name wins, as in a linear search */
+	i = depinfos_slot(depinfos, depinfo->service);
+	if (!depinfos->index[i]) {
+		depinfos->index[i] = depinfo;
+		depinfos->index_used++;
+	}
+}
+
+static RC_DEPINFO *
+get_depinfo(const RC_DEPINFOS *depinfos, const char *service)
+{
+	if (!depinfos || !depinfos->index_size)
+		return NULL;
+	return depinfos->index[depinfos_slot(depinfos, service)];
 }
 
 static RC_DEPINFO *
-make_depinfo(RC_DEPTREE *deptree, const char *service)
+make_depinfo(RC_DEPINFOS *depinfos, const char *service)
 {
 	RC_DEPINFO *depinfo = xmalloc(sizeof(*depinfo));
 	TAILQ_INIT(&depinfo->depends);
+	memset(depinfo->types, 0, sizeof(depinfo->types));
 	depinfo->service = xstrdup(service);
-	TAILQ_INSERT_TAIL(deptree, depinfo, entries);
+	TAILQ_INSERT_TAIL(&depinfos->list, depinfo, entries);
+	depinfos_index(depinfos, depinfo);
 
 	return depinfo;
 }
 
+/* Take depinfo out of the list, it is not freed */
+static void
+remove_depinfo(RC_DEPINFOS *depinfos, RC_DEPINFO *depinfo)
+{
+	size_t i = depinfos_slot(depinfos, depinfo->service);
+
+	TAILQ_REMOVE(&depinfos->list, depinfo, entries);
+	if (depinfos->index[i] == depinfo)
+		depinfos->index[i] = &removed_depinfo;
+}
+
 static RC_DEPTYPE *
 get_deptype(const RC_DEPINFO *depinfo, const char *type)
 {
 	RC_DEPTYPE *dt;
+	enum rc_deptype_id id;
 
-	if (depinfo) {
-		TAILQ_FOREACH(dt, &depinfo->depends, entries)
-			if (strcmp(dt->type, type) == 0)
-				return dt;
-	}
+	if (!depinfo)
+		return NULL;
+
+	if ((id = deptype_id(type)) != RC_DEPTYPE_MAX)
+		return depinfo->types[id];
+
+	TAILQ_FOREACH(dt, &depinfo->depends, entries)
+		if (strcmp(dt->type, type) == 0)
+			return dt;
 	return NULL;
 }
 
@@ -129,26 +318,342 @@ make_deptype(RC_DEPINFO *depinfo, const char *type)
 {
 	RC_DEPTYPE *deptype = xmalloc(sizeof(*deptype));
 	deptype->type = xstrdup(type);
+	deptype->id = deptype_id(type);
 	deptype->services = rc_stringlist_new();
 	TAILQ_INSERT_TAIL(&depinfo->depends, deptype, entries);
+	if (deptype->id != RC_DEPTYPE_MAX && !depinfo->types[deptype->id])
+		depinfo->types[deptype->id] = deptype;
 
 	return deptype;
 }
 
+static void
+free_deptype(RC_DEPINFO *depinfo, RC_DEPTYPE *deptype)
+{
+	RC_DEPTYPE *dt;
+
+	TAILQ_REMOVE(&depinfo->depends, deptype, entries);
+	if (deptype->id != RC_DEPTYPE_MAX &&
+	    depinfo->types[deptype->id] == deptype)
+	{
+		depinfo->types[deptype->id] = NULL;
+		TAILQ_FOREACH(dt, &depinfo->depends, entries)
+			if (dt->id == deptype->id) {
+				depinfo->types[dt->id] = dt;
+				break;
+			}
+	}
+	free(deptype->type);
+	free(deptype->services);
+	free(deptype);
+}
+
+#ifdef HAVE_MALLOC_EXTENDED_ATTRIBUTE
+__attribute__ ((malloc (depinfos_free, 1)))
+#endif
+static RC_DEPINFOS *
+make_depinfos(void) {
+	RC_DEPINFOS *depinfos = xmalloc(sizeof(*depinfos));
+	TAILQ_INIT(&depinfos->list);
+	depinfos->index = NULL;
+	depinfos->index_size = 0;
+	depinfos->index_used = 0;
+	return depinfos;
+}
+
+/* Growable buffers used to compile the image */
+struct strtab {
+	char *data;
+	size_t len;
+	size_t size;
+	/* open addressing table of offsets + 1, 0 is empty */
+	uint32_t *slots;
+	size_t nslots;
+	size_t used;
+};
+
+struct u32vec {
+	uint32_t *data;
+	size_t len;
+	size_t size;
+};
+
+static void
+u32vec_push(struct u32vec *vec, uint32_t value)
+{
+	if (vec->len == vec->size) {
+		vec->size = vec->size ? vec->size * 2 : 64;
+		vec->data = xrealloc(vec->data, vec->size * sizeof(*vec->data));
+	}
+	vec->data[vec->len++] = value;
+}
+
+static void
+strtab_grow_slots(struct strtab *tab)
+{
+	size_t nslots = tab->nslots ? tab->nslots * 2 : 256;
+	uint32_t *slots = xmalloc(nslots * sizeof(*slots));
+	size_t i, j;
+
+	memset(slots, 0, nslots * sizeof(*slots));
+	for (i = 0; i < tab->nslots; i++) {
+		if (!tab->slots[i])
+			continue;
+		j = hash_name(tab->data + tab->slots[i] - 1) & (nslots - 1);
+		while (slots[j])
+			j = (j + 1) & (nslots - 1);
+		slots[j] = tab->slots[i];
+	}
+	free(tab->slots);
+	tab->slots = slots;
+	tab->nslots = nslots;
+}
+
+/* Return the offset of str in the string table, adding it if needed */
+static uint32_t
+strtab_intern(struct strtab *tab, const char *str)
+{
+	size_t len = strlen(str);
+	size_t i;
+	uint32_t offset;
+
+	if ((tab->used + 1) * 2 > tab->nslots)
+		strtab_grow_slots(tab);
+
+	i = fnv1a(str, len) & (tab->nslots - 1);
+	while (tab->slots[i]) {
+		if (strcmp(tab->data + tab->slots[i] - 1, str) == 0)
+			return tab->slots[i] - 1;
+		i = (i + 1) & (tab->nslots - 1);
+	}
+
+	while (tab->len + len + 1 > tab->size) {
+		tab->size = tab->size ? tab->size * 2 : 4096;
+		tab->data = xrealloc(tab->data, tab->size);
+	}
+	offset = (uint32_t)tab->len;
+	memcpy(tab->data + tab->len, str, len + 1);
+	tab->len += len + 1;
+	tab->slots[i] = offset + 1;
+	tab->used++;
+	return offset;
+}
+
+static const uint32_t *
+image_section(const void *image, size_t offset)
+{
+	return (const uint32_t *)(const void *)((const char *)image + offset);
+}
+
+/* Check the image and point the deptree at its sections */
+static bool
+deptree_attach(RC_DEPTREE *deptree)
+{
+	const struct deptree_header *hdr = deptree->image;
+	size_t offset, words, limit, nrows;
+	uint32_t i;
+
+	if (deptree->size < sizeof(*hdr) ||
+	    hdr->magic != DEPTREE_MAGIC ||
+	    hdr->version != DEPTREE_VERSION)
+		return false;
+
+	/* Guard the size arithmetic below against overflow */
+	limit = deptree->size / sizeof(uint32_t);
+	if (hdr->ntypes < RC_DEPTYPE_MAX || hdr->ntypes > limit ||
+	    hdr->nservices > limit / hdr->ntypes ||
+	    hdr->nslots > limit || hdr->nedges > limit ||
+	    hdr->strtab_size > deptree->size)
+		return false;
+
+	/* The index must be a power of two with room to spare */
+	if (hdr->nslots == 0 || (hdr->nslots & (hdr->nslots - 1)) ||
+	    hdr->nslots <= hdr->nservices)
+		return false;
+
+	nrows = (size_t)hdr->nservices * hdr->ntypes;
+	words = (size_t)hdr->ntypes + hdr->nservices + hdr->nslots +
+		nrows + 1 + hdr->nedges;
+	if (words > limit || hdr->strtab_size == 0 ||
+	    sizeof(*hdr) + words * sizeof(uint32_t) + hdr->strtab_size != deptree->size)
+		return false;
+
+	if (fnv1a((const char *)deptree->image + sizeof(*hdr),
+		  deptree->size - sizeof(*hdr)) != hdr->checksum)
+		return false;
+
+	offset = sizeof(*hdr);
+	deptree->ntypes = hdr->ntypes;
+	deptree->nservices = hdr->nservices;
+	deptree->nslots = hdr->nslots;
+	deptree->types = image_section(deptree->image, offset);
+	offset += hdr->ntypes * sizeof(uint32_t);
+	deptree->services = image_section(deptree->image, offset);
+	offset += hdr->nservices * sizeof(uint32_t);
+	deptree->index = image_section(deptree->image, offset);
+	offset += hdr->nslots * sizeof(uint32_t);
+	deptree->rows = image_section(deptree->image, offset);
+	offset += (nrows + 1) * sizeof(uint32_t);
+	deptree->edges = image_section(deptree->image, offset);
+	offset += hdr->nedges * sizeof(uint32_t);
+	deptree->strtab = (const char *)deptree->image + offset;
+
+	if (deptree->strtab[hdr->strtab_size - 1] != '\0')
+		return false;
+	for (i = 0; i < hdr->ntypes; i++)
+		if (deptree->types[i] >= hdr->strtab_size)
+			return false;
+	for (i = 0; i < RC_DEPTYPE_MAX; i++)
+		if (strcmp(deptree->strtab + deptree->types[i], deptype_names[i]) != 0)
+			return false;
+	for (i = 0; i < hdr->nservices; i++)
+		if (deptree->services[i] >= hdr->strtab_size)
+			return false;
+	for (i = 0; i < hdr->nslots; i++)
+		if (deptree->index[i] > hdr->nservices)
+			return false;
+	for (i = 0; i < hdr->nedges; i++)
+		if (deptree->edges[i] >= hdr->strtab_size)
+			return false;
+	for (i = 0; i < nrows; i++)
+		if (deptree->rows[i] > deptree->rows[i + 1])
+			return false;
+	if (deptree->rows[nrows] != hdr->nedges)
+		return false;
+
+	return true;
+}
+
+/* Compile the depinfo list into a deptree image */
+static void *
+deptree_compile(const RC_DEPINFOS *depinfos, uint32_t generation, size_t *size)
+{
+	struct strtab tab = { 0 };
+	struct u32vec types = { 0 }, services = { 0 }, rows = { 0 }, edges = { 0 };
+	struct deptree_header hdr;
+	RC_DEPINFO *depinfo;
+	RC_DEPTYPE *deptype;
+	RC_STRING *s;
+	uint32_t *index;
+	uint32_t nslots;
+	char *image, *p;
+	size_t i, j;
+
+	for (i = 0; i < RC_DEPTYPE_MAX; i++)
+		u32vec_push(&types, strtab_intern(&tab, deptype_names[i]));
+	TAILQ_FOREACH(depinfo, &depinfos->list, entries) {
+		TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+			uint32_t type;
+			if (deptype->id != RC_DEPTYPE_MAX)
+				continue;
+			type = strtab_intern(&tab, deptype->type);
+			for (i = RC_DEPTYPE_MAX; i < types.len; i++)
+				if (types.data[i] == type)
+					break;
+			if (i == types.len)
+				u32vec_push(&types, type);
+		}
+	}
+
+	TAILQ_FOREACH(depinfo, &depinfos->list, entries) {
+		u32vec_push(&services, strtab_intern(&tab, depinfo->service));
+		for (i = 0; i < types.len; i++) {
+			u32vec_push(&rows, (uint32_t)edges.len);
+			TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
+				if (i < RC_DEPTYPE_MAX ? deptype->id != i :
+				    strcmp(deptype->type, tab.data + types.data[i]) != 0)
+					continue;
+				TAILQ_FOREACH(s, deptype->services, entries)
+					u32vec_push(&edges, strtab_intern(&tab, s->value));
+			}
+		}
+	}
+	u32vec_push(&rows, (uint32_t)edges.len);
+
+	for (nslots = 16; nslots < services.len * 2; nslots *= 2)
+		;
+	index = xmalloc(nslots * sizeof(*index));
+	memset(index, 0, nslots * sizeof(*index));
+	for (i = 0; i < services.len; i++) {
+		const char *name = tab.data + services.data[i];
+		j = hash_name(name) & (nslots - 1);
+		while (index[j]) {
+			/* The first service of a name wins */
+			if (strcmp(tab.data + services.data[index[j] - 1], name) == 0)
+				break;
+			j = (j + 1) & (nslots - 1);
+		}
+		if (!index[j])
+			index[j] = (uint32_t)i + 1;
+	}
+
+	hdr.magic = DEPTREE_MAGIC;
+	hdr.version = DEPTREE_VERSION;
+	hdr.generation = generation;
+	hdr.ntypes = (uint32_t)types.len;
+	hdr.nservices = (uint32_t)services.len;
+	hdr.nslots = nslots;
+	hdr.nedges = (uint32_t)edges.len;
+	hdr.strtab_size = (uint32_t)tab.len;
+
+	*size = sizeof(hdr) + (types.len + services.len + nslots + rows.len +
+		edges.len) * sizeof(uint32_t) + tab.len;
+	image = xmalloc(*size);
+	p = image + sizeof(hdr);
+#define COPY(data, len) \
+	if (len) \
+		memcpy(p, data, (len) * sizeof(uint32_t)); \
+	p += (len) * sizeof(uint32_t); \
+	free(data);
+	COPY(types.data, types.len)
+	COPY(services.data, services.len)
+	COPY(index, nslots)
+	COPY(rows.data, rows.len)
+	COPY(edges.data, edges.len)
+#undef COPY
+	memcpy(p, tab.data, tab.len);
+	free(tab.data);
+	free(tab.slots);
+
+	hdr.checksum = fnv1a(image + sizeof(hdr), *size - sizeof(hdr));
+	memcpy(image, &hdr, sizeof(hdr));
+	return image;
+}
+
 #ifdef HAVE_MALLOC_EXTENDED_ATTRIBUTE
 __attribute__ ((malloc (rc_deptree_free, 1)))
 #endif
 static RC_DEPTREE *
-make_deptree(void) {
+make_deptree(void *image, size_t size, bool mapped)
+{
 	RC_DEPTREE *deptree = xmalloc(sizeof(*deptree));
-	TAILQ_INIT(deptree);
+	deptree->image = image;
+	deptree->size = size;
+	deptree->mapped = mapped;
 	return deptree;
 }
 
 static RC_DEPTREE *
-deptree_load_file(int dirfd, const char *pathname)
+deptree_from_depinfos(const RC_DEPINFOS *depinfos)
 {
 	RC_DEPTREE *deptree;
+	void *image;
+	size_t size;
+
+	image = deptree_compile(depinfos, 0, &size);
+	deptree = make_deptree(image, size, false);
+	if (!deptree_attach(deptree)) {
+		rc_deptree_free(deptree);
+		errno = EINVAL;
+		return NULL;
+	}
+	return deptree;
+}
+
+static RC_DEPINFOS *
+depinfos_load_file(int dirfd, const char *pathname)
+{
+	RC_DEPINFOS *depinfos;
 	RC_DEPINFO *depinfo = NULL;
 	RC_DEPTYPE *deptype = NULL;
 	char *line = NULL;
@@ -162,7 +667,7 @@ deptree_load_file(int dirfd, const char *pathname)
 	if (!(fp = do_fopenat(dirfd, pathname, O_RDONLY)))
 		return NULL;
 
-	deptree = make_deptree();
+	depinfos = make_depinfos();
 	while (xgetline(&line, &size, fp) != -1) {
 		p = line;
 		e = strsep(&p, "_");
@@ -178,7 +683,7 @@ deptree_load_file(int dirfd, const char *pathname)
 			e = get_shell_value(p);
 			if (!e || *e == '\0')
 				continue;
-			depinfo = make_depinfo(deptree, e);
+			depinfo = make_depinfo(depinfos, e);
 			deptype = NULL;
 			continue;
 		}
@@ -198,13 +703,114 @@ deptree_load_file(int dirfd, const char *pathname)
 	free(line);
 	fclose(fp);
 
+	return depinfos;
+}
+
+static RC_DEPTREE *
+deptree_load_file(int dirfd, const char *pathname)
+{
+	RC_DEPINFOS *depinfos;
+	RC_DEPTREE *deptree;
+
+	if (!(depinfos = depinfos_load_file(dirfd, pathname)))
+		return NULL;
+	deptree = deptree_from_depinfos(depinfos);
+	depinfos_free(depinfos);
 	return deptree;
 }
 
+/* Map the compiled deptree, unless it is missing, damaged or older
+ * than the shell parseable deptree. */
+static RC_DEPTREE *
+deptree_map(int dirfd)
+{
+	RC_DEPTREE *deptree;
+	struct stat st, text;
+	void *image;
+	int fd;
+
+	if ((fd = openat(dirfd, DEPTREE_IMAGE, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0 ||
+	    (fstatat(dirfd, "deptree", &text, 0) == 0 && text.st_mtime > st.st_mtime))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return NULL;
+
+	deptree = make_deptree(image, (size_t)st.st_size, true);
+	if (!deptree_attach(deptree)) {
+		rc_deptree_free(deptree);
+		return NULL;
+	}
+	return deptree;
+}
+
+/* Write the compiled deptree under a temporary name and rename it over
+ * the previous generation. */
+static bool
+deptree_save(int dirfd, const RC_DEPINFOS *depinfos)
+{
+	struct deptree_header old;
+	uint32_t generation = 0;
+	void *image;
+	size_t size;
+	ssize_t len;
+	char *p;
+	int serrno;
+	int fd;
+
+	if ((fd = openat(dirfd, DEPTREE_IMAGE, O_RDONLY | O_CLOEXEC)) != -1) {
+		if (read(fd, &old, sizeof(old)) == sizeof(old) &&
+		    old.magic == DEPTREE_MAGIC && old.version == DEPTREE_VERSION)
+			generation = old.generation + 1;
+		close(fd);
+	}
+
+	image = deptree_compile(depinfos, generation, &size);
+	fd = openat(dirfd, DEPTREE_IMAGE_TMP,
+		    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		free(image);
+		return false;
+	}
+
+	for (p = image; size > 0; p += len, size -= (size_t)len) {
+		if ((len = write(fd, p, size)) == -1) {
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	free(image);
+
+	if (close(fd) != 0 || size > 0 ||
+	    renameat(dirfd, DEPTREE_IMAGE_TMP, dirfd, DEPTREE_IMAGE) != 0)
+	{
+		serrno = errno;
+		unlinkat(dirfd, DEPTREE_IMAGE_TMP, 0);
+		errno = serrno;
+		return false;
+	}
+	return true;
+}
+
 RC_DEPTREE *
 rc_deptree_load(void)
 {
-	return deptree_load_file(rc_dirfd(RC_DIR_SVCDIR), "deptree");
+	int dirfd = rc_dirfd(RC_DIR_SVCDIR);
+	RC_DEPTREE *deptree;
+
+	if ((deptree = deptree_map(dirfd)))
+		return deptree;
+	return deptree_load_file(dirfd, "deptree");
 }
 
 RC_DEPTREE *
@@ -213,16 +819,80 @@ rc_deptree_load_file(const char *deptree_file)
 	return deptree_load_file(AT_FDCWD, deptree_file);
 }
 
+static const char *
+deptree_string(const RC_DEPTREE *deptree, uint32_t offset)
+{
+	return deptree->strtab + offset;
+}
+
+static const char *
+service_name(const RC_DEPTREE *deptree, uint32_t service)
+{
+	return deptree_string(deptree, deptree->services[service]);
+}
+
+static uint32_t
+find_service(const RC_DEPTREE *deptree, const char *service)
+{
+	uint32_t mask, i;
+
+	if (!deptree)
+		return NO_SERVICE;
+
+	mask = deptree->nslots - 1;
+	for (i = hash_name(service) & mask; deptree->index[i]; i = (i + 1) & mask)
+		if (strcmp(service_name(deptree, deptree->index[i] - 1), service) == 0)
+			return deptree->index[i] - 1;
+	return NO_SERVICE;
+}
+
+static uint32_t
+find_deptype(const RC_DEPTREE *deptree, const char *type)
+{
+	uint32_t i = deptype_id(type);
+
+	if (i != RC_DEPTYPE_MAX)
+		return i;
+	for (; i < deptree->ntypes; i++)
+		if (strcmp(deptree_string(deptree, deptree->types[i]), type) == 0)
+			return i;
+	return NO_DEPTYPE;
+}
+
+/* Fill in a view of the services of the given type.
+ * Returns false if the service has no dependencies of that type. */
+static bool
+get_depview(const RC_DEPTREE *deptree, uint32_t service, uint32_t type,
+	    RC_DEPVIEW *view)
+{
+	const uint32_t *row;
+
+	if (service == NO_SERVICE || type == NO_DEPTYPE)
+		return false;
+
+	row = deptree->rows + (size_t)service * deptree->ntypes + type;
+	view->deptree = deptree;
+	view->edges = deptree->edges + row[0];
+	view->count = row[1] - row[0];
+	return view->count != 0;
+}
+
+static const char *
+depview_get(const RC_DEPVIEW *view, size_t i)
+{
+	return deptree_string(view->deptree, view->edges[i]);
+}
+
 static bool
-valid_service(const char *runlevel, const char *service, const char *type)
+valid_service(const char *runlevel, const char *service, uint32_t type)
 {
 	RC_SERVICE state;
 
 	if (!runlevel ||
-	    strcmp(type, "ineed") == 0 ||
-	    strcmp(type, "needsme") == 0  ||
-	    strcmp(type, "iwant") == 0 ||
-	    strcmp(type, "wantsme") == 0)
+	    type == RC_DEPTYPE_INEED ||
+	    type == RC_DEPTYPE_NEEDSME ||
+	    type == RC_DEPTYPE_IWANT ||
+	    type == RC_DEPTYPE_WANTSME)
 		return true;
 
 	if (rc_service_in_runlevel(service, runlevel))
@@ -230,7 +900,7 @@ valid_service(const char *runlevel, const char *service, const char *type)
 	if (strcmp(runlevel, RC_LEVEL_SYSINIT) == 0)
 		    return false;
 	if (strcmp(runlevel, RC_LEVEL_SHUTDOWN) == 0 &&
-	    strcmp(type, "iafter") == 0)
+	    type == RC_DEPTYPE_IAFTER)
 		    return false;
 	if (strcmp(runlevel, bootlevel) != 0) {
 		if (rc_service_in_runlevel(service, bootlevel))
@@ -247,18 +917,18 @@ valid_service(const char *runlevel, const char *service, const char *type)
 
 static bool
 get_provided1(const char *runlevel, RC_STRINGLIST *providers,
-	      RC_DEPTYPE *deptype, const char *level,
+	      const RC_DEPVIEW *deptype, const char *level,
 	      bool hotplugged, RC_SERVICE state)
 {
-	RC_STRING *service;
 	RC_SERVICE st;
 	bool retval = false;
 	bool ok;
 	const char *svc;
+	size_t i;
 
-	TAILQ_FOREACH(service, deptype->services, entries) {
+	for (i = 0; i < deptype->count; i++) {
 		ok = true;
-		svc = service->value;
+		svc = depview_get(deptype, i);
 		st = rc_service_state(svc);
 
 		if (level)
@@ -302,34 +972,38 @@ get_provided1(const char *runlevel, RC_STRINGLIST *providers,
    provided dependency can change depending on runlevel state.
    */
 static RC_STRINGLIST *
-get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
+get_provided(const RC_DEPTREE *deptree, uint32_t depinfo,
+	     const char *runlevel, int options)
 {
-	RC_DEPTYPE *dt;
+	RC_DEPVIEW view;
+	const RC_DEPVIEW *dt = &view;
 	RC_STRINGLIST *providers = rc_stringlist_new();
-	RC_STRING *service;
+	const char *service;
+	size_t i;
 
-	dt = get_deptype(depinfo, "providedby");
-	if (!dt)
+	if (!get_depview(deptree, depinfo, RC_DEPTYPE_PROVIDEDBY, &view))
 		return providers;
 
 	/* If we are stopping then all depends are true, regardless of state.
 	   This is especially true for net services as they could force a restart
 	   of the local dns resolver which may depend on net. */
 	if (options & RC_DEP_STOP) {
-		TAILQ_FOREACH(service, dt->services, entries)
-			rc_stringlist_add(providers, service->value);
+		for (i = 0; i < dt->count; i++)
+			rc_stringlist_add(providers, depview_get(dt, i));
 		return providers;
 	}
 
 	/* If we're strict or starting, then only use what we have in our
 	 * runlevel and bootlevel. If we starting then check hotplugged too. */
 	if (options & RC_DEP_STRICT || options & RC_DEP_START) {
-		TAILQ_FOREACH(service, dt->services, entries)
-			if (rc_service_in_runlevel(service->value, runlevel) ||
-			    rc_service_in_runlevel(service->value, bootlevel) ||
+		for (i = 0; i < dt->count; i++) {
+			service = depview_get(dt, i);
+			if (rc_service_in_runlevel(service, runlevel) ||
+			    rc_service_in_runlevel(service, bootlevel) ||
 			    (options & RC_DEP_START &&
-			     rc_service_state(service->value) & RC_SERVICE_HOTPLUGGED))
-				rc_stringlist_add(providers, service->value);
+			     rc_service_state(service) & RC_SERVICE_HOTPLUGGED))
+				rc_stringlist_add(providers, service);
+		}
 		if (TAILQ_FIRST(providers))
 			return providers;
 	}
@@ -385,64 +1059,72 @@ get_provided(const RC_DEPINFO *depinfo, const char *runlevel, int options)
 		return providers;
 
 	/* Still nothing? OK, list our first provided service. */
-	service = TAILQ_FIRST(dt->services);
-	if (service != NULL)
-		rc_stringlist_add(providers, service->value);
+	rc_stringlist_add(providers, depview_get(dt, 0));
 
 	return providers;
 }
 
+/* State shared by one rc_deptree_depends walk */
+struct visit {
+	const RC_DEPTREE *deptree;
+	/* type numbers to follow, NO_DEPTYPE if not in the deptree */
+	uint32_t *types;
+	size_t ntypes;
+	RC_STRINGLIST *sorted;
+	/* one flag per service */
+	unsigned char *visited;
+	const char *runlevel;
+};
+
 static void
-visit_service(const RC_DEPTREE *deptree,
-	      const RC_STRINGLIST *types,
-	      RC_STRINGLIST *sorted,
-	      RC_STRINGLIST *visited,
-	      const RC_DEPINFO *depinfo,
-	      const char *runlevel, int options)
-{
-	RC_STRING *type;
-	RC_STRING *service;
-	RC_DEPTYPE *dt;
-	RC_DEPINFO *di;
+visit_service(struct visit *v, uint32_t depinfo, int options)
+{
+	const RC_DEPTREE *deptree = v->deptree;
+	RC_DEPVIEW dt;
+	uint32_t di;
+	uint32_t type;
 	RC_STRINGLIST *provided;
 	RC_STRING *p;
+	const char *service;
 	const char *svcname;
+	const char *name = service_name(deptree, depinfo);
+	size_t i, t;
 
 	/* Check if we have already visited this service or not */
-	TAILQ_FOREACH(type, visited, entries)
-		if (strcmp(type->value, depinfo->service) == 0)
-			return;
+	if (v->visited[depinfo])
+		return;
 	/* Add ourselves as a visited service */
-	rc_stringlist_add(visited, depinfo->service);
+	v->visited[depinfo] = 1;
 
-	TAILQ_FOREACH(type, types, entries)
+	for (t = 0; t < v->ntypes; t++)
 	{
-		if (!(dt = get_deptype(depinfo, type->value)))
+		type = v->types[t];
+		if (!get_depview(deptree, depinfo, type, &dt))
 			continue;
 
-		TAILQ_FOREACH(service, dt->services, entries) {
+		for (i = 0; i < dt.count; i++) {
+			service = depview_get(&dt, i);
 			if (!(options & RC_DEP_TRACE) ||
-			    strcmp(type->value, "iprovide") == 0)
+			    type == RC_DEPTYPE_IPROVIDE)
 			{
-				rc_stringlist_add(sorted, service->value);
+				rc_stringlist_add(v->sorted, service);
 				continue;
 			}
 
-			if (!(di = get_depinfo(deptree, service->value)))
+			if ((di = find_service(deptree, service)) == NO_SERVICE)
 				continue;
-			provided = get_provided(di, runlevel, options);
+			provided = get_provided(deptree, di, v->runlevel, options);
 
 			if (TAILQ_FIRST(provided)) {
 				TAILQ_FOREACH(p, provided, entries) {
-					di = get_depinfo(deptree, p->value);
-					if (di && valid_service(runlevel, di->service, type->value))
-						visit_service(deptree, types, sorted, visited, di,
-							      runlevel, options | RC_DEP_TRACE);
+					di = find_service(deptree, p->value);
+					if (di != NO_SERVICE &&
+					    valid_service(v->runlevel, p->value, type))
+						visit_service(v, di, options | RC_DEP_TRACE);
 				}
 			}
-			else if (di && valid_service(runlevel, service->value, type->value))
-				visit_service(deptree, types, sorted, visited, di,
-					      runlevel, options | RC_DEP_TRACE);
+			else if (valid_service(v->runlevel, service, type))
+				visit_service(v, di, options | RC_DEP_TRACE);
 
 			rc_stringlist_free(provided);
 		}
@@ -450,16 +1132,15 @@ visit_service(const RC_DEPTREE *deptree,
 
 	/* Now visit the stuff we provide for */
 	if (options & RC_DEP_TRACE &&
-	    (dt = get_deptype(depinfo, "iprovide")))
+	    get_depview(deptree, depinfo, RC_DEPTYPE_IPROVIDE, &dt))
 	{
-		TAILQ_FOREACH(service, dt->services, entries) {
-			if (!(di = get_depinfo(deptree, service->value)))
+		for (i = 0; i < dt.count; i++) {
+			if ((di = find_service(deptree, depview_get(&dt, i))) == NO_SERVICE)
 				continue;
-			provided = get_provided(di, runlevel, options);
+			provided = get_provided(deptree, di, v->runlevel, options);
 			TAILQ_FOREACH(p, provided, entries)
-				if (strcmp(p->value, depinfo->service) == 0) {
-					visit_service(deptree, types, sorted, visited, di,
-						       runlevel, options | RC_DEP_TRACE);
+				if (strcmp(p->value, name) == 0) {
+					visit_service(v, di, options | RC_DEP_TRACE);
 					break;
 				}
 			rc_stringlist_free(provided);
@@ -469,9 +1150,9 @@ visit_service(const RC_DEPTREE *deptree,
 	/* We've visited everything we need, so add ourselves unless we
 	   are also the service calling us or we are provided by something */
 	svcname = getenv("RC_SVCNAME");
-	if (!svcname || strcmp(svcname, depinfo->service) != 0) {
-		if (!get_deptype(depinfo, "providedby"))
-			rc_stringlist_add(sorted, depinfo->service);
+	if (!svcname || strcmp(svcname, name) != 0) {
+		if (!get_depview(deptree, depinfo, RC_DEPTYPE_PROVIDEDBY, &dt))
+			rc_stringlist_add(v->sorted, name);
 	}
 }
 
@@ -479,22 +1160,22 @@ RC_STRINGLIST *
 rc_deptree_depend(const RC_DEPTREE *deptree,
 		  const char *service, const char *type)
 {
-	RC_DEPINFO *di;
-	RC_DEPTYPE *dt;
+	RC_DEPVIEW dt;
 	RC_STRINGLIST *svcs;
-	RC_STRING *svc;
+	size_t i;
 
 	svcs = rc_stringlist_new();
-	if (!(di = get_depinfo(deptree, service)) ||
-	    !(dt = get_deptype(di, type)))
+	if (!deptree ||
+	    !get_depview(deptree, find_service(deptree, service),
+			 find_deptype(deptree, type), &dt))
 	{
 		errno = ENOENT;
 		return svcs;
 	}
 
 	/* For consistency, we copy the array */
-	TAILQ_FOREACH(svc, dt->services, entries)
-		rc_stringlist_add(svcs, svc->value);
+	for (i = 0; i < dt.count; i++)
+		rc_stringlist_add(svcs, depview_get(&dt, i));
 	return svcs;
 }
 
@@ -504,25 +1185,40 @@ rc_deptree_depends(const RC_DEPTREE *deptree,
 		   const RC_STRINGLIST *services,
 		   const char *runlevel, int options)
 {
-	RC_STRINGLIST *sorted = rc_stringlist_new();
-	RC_STRINGLIST *visited = rc_stringlist_new();
-	RC_DEPINFO *di;
+	struct visit v = {
+		.deptree = deptree,
+		.sorted = rc_stringlist_new(),
+		.runlevel = runlevel,
+	};
+	uint32_t di;
 	const RC_STRING *service;
 
 	bootlevel = getenv("RC_BOOTLEVEL");
 	if (!bootlevel)
 		bootlevel = RC_LEVEL_BOOT;
+
+	if (deptree && types) {
+		TAILQ_FOREACH(service, types, entries)
+			v.ntypes++;
+		v.types = xmalloc((v.ntypes ? v.ntypes : 1) * sizeof(*v.types));
+		v.ntypes = 0;
+		TAILQ_FOREACH(service, types, entries)
+			v.types[v.ntypes++] = find_deptype(deptree, service->value);
+		v.visited = xmalloc(deptree->nservices ? deptree->nservices : 1);
+		memset(v.visited, 0, deptree->nservices);
+	}
+
 	TAILQ_FOREACH(service, services, entries) {
-		if (!(di = get_depinfo(deptree, service->value))) {
+		if ((di = find_service(deptree, service->value)) == NO_SERVICE) {
 			errno = ENOENT;
 			continue;
 		}
 		if (types)
-			visit_service(deptree, types, sorted, visited,
-				      di, runlevel, options);
+			visit_service(&v, di, options);
 	}
-	rc_stringlist_free(visited);
-	return sorted;
+	free(v.types);
+	free(v.visited);
+	return v.sorted;
 }
 
 RC_STRINGLIST *
@@ -669,18 +1365,17 @@ rc_older_than(const char *source, const char *target, time_t *oldest, char *file
 
 typedef struct deppair
 {
-	const char *depend;
-	const char *addto;
+	enum rc_deptype_id depend;
+	enum rc_deptype_id addto;
 } DEPPAIR;
 
 static const DEPPAIR deppairs[] = {
-	{ "ineed",	"needsme" },
-	{ "iuse",	"usesme" },
-	{ "iwant",	"wantsme" },
-	{ "iafter",	"ibefore" },
-	{ "ibefore",	"iafter" },
-	{ "iprovide",	"providedby" },
-	{ NULL, NULL }
+	{ RC_DEPTYPE_INEED,	RC_DEPTYPE_NEEDSME },
+	{ RC_DEPTYPE_IUSE,	RC_DEPTYPE_USESME },
+	{ RC_DEPTYPE_IWANT,	RC_DEPTYPE_WANTSME },
+	{ RC_DEPTYPE_IAFTER,	RC_DEPTYPE_IBEFORE },
+	{ RC_DEPTYPE_IBEFORE,	RC_DEPTYPE_IAFTER },
+	{ RC_DEPTYPE_IPROVIDE,	RC_DEPTYPE_PROVIDEDBY },
 };
 
 bool
@@ -765,6 +1460,507 @@ setup_environment(void)
 		setenv("RC_UNAME", uts.sysname, 1);
 }
 
+/* How many shells to source init scripts with, rc_depend_jobs if set or
+ * one per online cpu otherwise */
+static unsigned int
+gendepends_jobs(void)
+{
+	const char *value = rc_conf_value("rc_depend_jobs");
+	char *end;
+	long jobs;
+
+	if (value && *value) {
+		errno = 0;
+		jobs = strtol(value, &end, 10);
+		if (errno != 0 || *end || jobs < 1)
+			jobs = 1;
+	} else
+		jobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (jobs < 1)
+		return 1;
+	return jobs > GENDEP_JOBS_MAX ? GENDEP_JOBS_MAX : (unsigned int)jobs;
+}
+
+struct gendep_job {
+	pid_t pid;
+	int fd;
+	char *out;
+	size_t len;
+	size_t size;
+	size_t pos;
+};
+
+static bool
+gendepends_spawn(struct gendep_job *job, unsigned int index, unsigned int jobs)
+{
+	char buf[16];
+	int fds[2];
+
+	if (pipe2(fds, O_CLOEXEC) == -1)
+		return false;
+
+	if ((job->pid = fork()) == -1) {
+		close(fds[0]);
+		close(fds[1]);
+		return false;
+	}
+
+	if (job->pid == 0) {
+		if (dup2(fds[1], STDOUT_FILENO) == -1)
+			_exit(EXIT_FAILURE);
+		snprintf(buf, sizeof(buf), "%u", index);
+		setenv("RC_DEPEND_JOB", buf, 1);
+		snprintf(buf, sizeof(buf), "%u", jobs);
+		setenv("RC_DEPEND_JOBS", buf, 1);
+		execl("/bin/sh", "sh", "-c", GENDEP, (char *) NULL);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(fds[1]);
+	job->fd = fds[0];
+	return true;
+}
+
+/* Drain every worker until they have all closed their output */
+static void
+gendepends_read(struct gendep_job *job, unsigned int jobs)
+{
+	struct pollfd pfd[GENDEP_JOBS_MAX];
+	unsigned int i, open = jobs;
+	ssize_t r;
+
+	while (open) {
+		for (i = 0; i < jobs; i++) {
+			pfd[i].fd = job[i].fd;
+			pfd[i].events = POLLIN;
+			pfd[i].revents = 0;
+		}
+		if (poll(pfd, jobs, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		for (i = 0; i < jobs; i++) {
+			if (!pfd[i].revents)
+				continue;
+			if (job[i].size - job[i].len < BUFSIZ) {
+				job[i].size = job[i].size * 2 + BUFSIZ;
+				job[i].out = xrealloc(job[i].out, job[i].size);
+			}
+			r = read(job[i].fd, job[i].out + job[i].len,
+			    job[i].size - job[i].len);
+			if (r > 0)
+				job[i].len += r;
+			else if (r == 0 || errno != EINTR) {
+				close(job[i].fd);
+				job[i].fd = -1;
+				open--;
+			}
+		}
+	}
+
+	for (i = 0; i < jobs; i++)
+		if (job[i].fd != -1)
+			close(job[i].fd);
+}
+
+/* Worker i sourced scripts i, i + jobs, i + 2 * jobs and so on, starting
+ * the output of each with an empty line. Taking one such block from each
+ * worker in turn gives back what a single shell would have printed. */
+static void
+gendepends_merge(FILE *out, struct gendep_job *job, unsigned int jobs)
+{
+	unsigned int i, left = jobs;
+	char *p, *end, *nl;
+
+	while (left) {
+		left = 0;
+		for (i = 0; i < jobs; i++) {
+			p = job[i].out + job[i].pos;
+			end = job[i].out + job[i].len;
+			if (p == end)
+				continue;
+			left++;
+
+			do {
+				nl = memchr(p, '\n', end - p);
+				nl = nl ? nl + 1 : end;
+				fwrite(p, 1, nl - p, out);
+				if (nl[-1] != '\n')
+					fputc('\n', out);
+				p = nl;
+			} while (p < end && *p != '\n');
+			job[i].pos = p - job[i].out;
+		}
+	}
+}
+
+/* Run gendepends in a pool of shells and return a stream reading back their
+ * merged output, which is also returned in buffer to be freed after the
+ * stream is closed. Returns NULL if the pool could not be started. */
+static FILE *
+gendepends_parallel(unsigned int jobs, char **buffer)
+{
+	struct gendep_job job[GENDEP_JOBS_MAX] = { 0 };
+	unsigned int i, started;
+	size_t size;
+	FILE *mem, *fp;
+
+	for (started = 0; started < jobs; started++)
+		if (!gendepends_spawn(&job[started], started, jobs))
+			break;
+
+	if (started == jobs)
+		gendepends_read(job, jobs);
+	else
+		for (i = 0; i < started; i++) {
+			close(job[i].fd);
+			kill(job[i].pid, SIGTERM);
+		}
+
+	for (i = 0; i < started; i++)
+		while (waitpid(job[i].pid, NULL, 0) == -1 && errno == EINTR);
+
+	if (started != jobs)
+		return NULL;
+
+	mem = xopen_memstream(buffer, &size);
+	gendepends_merge(mem, job, jobs);
+	/* fmemopen may refuse an empty buffer, and empty lines are skipped */
+	fputc('\n', mem);
+	xclose_memstream(mem);
+
+	for (i = 0; i < jobs; i++)
+		free(job[i].out);
+
+	if (!(fp = fmemopen(*buffer, size, "r"))) {
+		free(*buffer);
+		*buffer = NULL;
+	}
+	return fp;
+}
+
+/*
+ * The depcache remembers what gendepends printed for each init script
+ * along with the identity of the files that output was sourced from,
+ * so an update only has to source the scripts which changed since.
+ * It is a text file of tagged lines:
+ *   G <identity> <path>   a file every script sources, such as rc.conf
+ *   S <path>              an init script, followed by
+ *   F <identity> <path>   the files its output depends on
+ *   L <line>              and the lines gendepends printed for it
+ * An identity is the device, inode, mode, size and mtime of a file, or
+ * "-" if it does not exist. Any change to the G files drops the cache.
+ */
+#define DEPCACHE		"depcache"
+#define DEPCACHE_TMP		"depcache.tmp"
+#define DEPCACHE_FRESH		"depcache.fresh"
+
+struct depcache_entry {
+	TAILQ_ENTRY(depcache_entry) entries;
+	char *script;
+	RC_STRINGLIST *files;
+	RC_STRINGLIST *lines;
+};
+TAILQ_HEAD(depcache, depcache_entry);
+
+static void
+file_identity(const char *path, char *buf, size_t len)
+{
+	struct stat st;
+
+	if (stat(path, &st) != 0)
+		snprintf(buf, len, "- %s", path);
+	else
+		snprintf(buf, len, "%ju.%ju.%o.%jd.%jd.%ld %s",
+		    (uintmax_t)st.st_dev, (uintmax_t)st.st_ino,
+		    (unsigned int)st.st_mode, (intmax_t)st.st_size,
+		    (intmax_t)st.st_mtim.tv_sec, st.st_mtim.tv_nsec, path);
+}
+
+static void
+add_identity(RC_STRINGLIST *list, const char *path)
+{
+	char buf[PATH_MAX + 128];
+
+	file_identity(path, buf, sizeof(buf));
+	rc_stringlist_add(list, buf);
+}
+
+static RC_STRINGLIST *
+depcache_globals(void)
+{
+	const char *scriptdirs = getenv("RC_SCRIPTDIRS");
+	RC_STRINGLIST *globals = rc_stringlist_new();
+	RC_STRINGLIST *conf_d = rc_stringlist_new();
+	RC_STRING *s;
+	struct dirent *d;
+	char *path;
+	DIR *dp;
+
+	rc_stringlist_add(globals, scriptdirs ? scriptdirs : "");
+	add_identity(globals, GENDEP);
+	add_identity(globals, RC_LIBEXECDIR "/sh/functions.sh");
+	add_identity(globals, RC_LIBEXECDIR "/sh/rc-functions.sh");
+	add_identity(globals, RC_CONF);
+	add_identity(globals, RC_CONF_D);
+
+	if ((dp = opendir(RC_CONF_D))) {
+		while ((d = readdir(dp)))
+			if (d->d_name[0] != '.')
+				rc_stringlist_add(conf_d, d->d_name);
+		closedir(dp);
+	}
+	rc_stringlist_sort(&conf_d);
+	TAILQ_FOREACH(s, conf_d, entries) {
+		xasprintf(&path, "%s/%s", RC_CONF_D, s->value);
+		add_identity(globals, path);
+		free(path);
+	}
+	rc_stringlist_free(conf_d);
+	return globals;
+}
+
+static struct depcache_entry *
+depcache_add(struct depcache *cache, const char *script)
+{
+	struct depcache_entry *entry = xmalloc(sizeof(*entry));
+
+	entry->script = xstrdup(script);
+	entry->files = rc_stringlist_new();
+	entry->lines = rc_stringlist_new();
+	TAILQ_INSERT_TAIL(cache, entry, entries);
+	return entry;
+}
+
+static void
+depcache_remove(struct depcache *cache, struct depcache_entry *entry)
+{
+	TAILQ_REMOVE(cache, entry, entries);
+	rc_stringlist_free(entry->files);
+	rc_stringlist_free(entry->lines);
+	free(entry->script);
+	free(entry);
+}
+
+static void
+depcache_free(struct depcache *cache)
+{
+	while (!TAILQ_EMPTY(cache))
+		depcache_remove(cache, TAILQ_FIRST(cache));
+}
+
+/* Whether none of the files entry was sourced from changed */
+static bool
+depcache_valid(const struct depcache_entry *entry)
+{
+	char buf[PATH_MAX + 128];
+	const char *path;
+	RC_STRING *s;
+
+	TAILQ_FOREACH(s, entry->files, entries) {
+		if (!(path = strchr(s->value, ' ')))
+			return false;
+		file_identity(path + 1, buf, sizeof(buf));
+		if (strcmp(buf, s->value) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Load the entries of the depcache which are still valid */
+static void
+depcache_load(struct depcache *cache, int dirfd, const RC_STRINGLIST *globals)
+{
+	const RC_STRING *global = TAILQ_FIRST(globals);
+	struct depcache_entry *entry = NULL, *np;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	FILE *fp;
+
+	if (!(fp = do_fopenat(dirfd, DEPCACHE, O_RDONLY)))
+		return;
+
+	while ((len = xgetline(&line, &size, fp)) != -1) {
+		if (len < 2 || line[1] != ' ')
+			goto corrupt;
+		switch (line[0]) {
+		case 'G':
+			if (entry || !global || strcmp(global->value, line + 2) != 0)
+				goto corrupt;
+			global = TAILQ_NEXT(global, entries);
+			break;
+		case 'S':
+			if (global)
+				goto corrupt;
+			entry = depcache_add(cache, line + 2);
+			break;
+		case 'F':
+			if (!entry)
+				goto corrupt;
+			rc_stringlist_add(entry->files, line + 2);
+			break;
+		case 'L':
+			if (!entry)
+				goto corrupt;
+			rc_stringlist_add(entry->lines, line + 2);
+			break;
+		default:
+			goto corrupt;
+		}
+	}
+	free(line);
+	fclose(fp);
+
+	if (global)
+		depcache_free(cache);
+	TAILQ_FOREACH_SAFE(entry, cache, entries, np)
+		if (!depcache_valid(entry))
+			depcache_remove(cache, entry);
+	return;
+
+corrupt:
+	free(line);
+	fclose(fp);
+	depcache_free(cache);
+}
+
+/* Write the scripts gendepends need not source again on a single line */
+static bool
+depcache_write_fresh(int dirfd, const struct depcache *cache)
+{
+	const struct depcache_entry *entry;
+	FILE *fp;
+
+	if (!(fp = do_fopenat(dirfd, DEPCACHE_FRESH, O_WRONLY | O_CREAT | O_TRUNC)))
+		return false;
+	TAILQ_FOREACH(entry, cache, entries)
+		fprintf(fp, "%s ", entry->script);
+	fputc('\n', fp);
+	return fclose(fp) == 0;
+}
+
+/* Find script in the loaded cache, looking after the last match first as
+ * gendepends walks the scripts in the same order every time */
+static struct depcache_entry *
+depcache_find(struct depcache *cache, struct depcache_entry **hint,
+		const char *script)
+{
+	struct depcache_entry *entry, *start = *hint;
+
+	for (entry = start; entry; entry = TAILQ_NEXT(entry, entries))
+		if (strcmp(entry->script, script) == 0)
+			return *hint = entry;
+	TAILQ_FOREACH(entry, cache, entries) {
+		if (entry == start)
+			break;
+		if (strcmp(entry->script, script) == 0)
+			return *hint = entry;
+	}
+	return NULL;
+}
+
+/* Record the files the output of a script just sourced came from: the
+ * script, its conf.d files and anything it listed with config. If any of
+ * them changed while we ran, it must be sourced again next time. */
+static bool
+depcache_seal(struct depcache_entry *entry, time_t started)
+{
+	const char *service = strrchr(entry->script, '/') + 1;
+	size_t dirlen = (size_t)(service - entry->script);
+	const char *dot = strchr(service, '.');
+	RC_STRING *s;
+	struct stat st;
+	char *path, *p, *depend, *copy;
+
+	add_identity(entry->files, entry->script);
+	if (dot && dot != service) {
+		xasprintf(&path, "%.*s../conf.d/%.*s", (int)dirlen, entry->script,
+		    (int)(dot - service), service);
+		add_identity(entry->files, path);
+		free(path);
+	}
+	xasprintf(&path, "%.*s../conf.d/%s", (int)dirlen, entry->script, service);
+	add_identity(entry->files, path);
+	free(path);
+
+	TAILQ_FOREACH(s, entry->lines, entries) {
+		p = copy = xstrdup(s->value);
+		strsep(&p, " ");
+		if (p && strcmp(strsep(&p, " "), "config") == 0)
+			while ((depend = strsep(&p, " ")))
+				if (*depend)
+					add_identity(entry->files, depend);
+		free(copy);
+	}
+
+	TAILQ_FOREACH(s, entry->files, entries) {
+		path = strchr(s->value, ' ') + 1;
+		if (stat(path, &st) == 0 && st.st_mtime >= started)
+			return false;
+	}
+	return true;
+}
+
+static bool
+depcache_save(int dirfd, const RC_STRINGLIST *globals,
+		const struct depcache *cache)
+{
+	const struct depcache_entry *entry;
+	const RC_STRING *s;
+	int serrno;
+	FILE *fp;
+
+	if (!(fp = do_fopenat(dirfd, DEPCACHE_TMP, O_WRONLY | O_CREAT | O_TRUNC)))
+		return false;
+
+	TAILQ_FOREACH(s, globals, entries)
+		fprintf(fp, "G %s\n", s->value);
+	TAILQ_FOREACH(entry, cache, entries) {
+		fprintf(fp, "S %s\n", entry->script);
+		TAILQ_FOREACH(s, entry->files, entries)
+			fprintf(fp, "F %s\n", s->value);
+		TAILQ_FOREACH(s, entry->lines, entries)
+			fprintf(fp, "L %s\n", s->value);
+	}
+
+	if (fclose(fp) != 0 ||
+	    renameat(dirfd, DEPCACHE_TMP, dirfd, DEPCACHE) != 0)
+	{
+		serrno = errno;
+		unlinkat(dirfd, DEPCACHE_TMP, 0);
+		errno = serrno;
+		return false;
+	}
+	return true;
+}
+
+/* List the services depinfo directly depends on through types, followed by
+ * depinfo itself, as an untraced rc_deptree_depends would. */
+static RC_STRINGLIST *
+direct_depends(const RC_STRINGLIST *types, const RC_DEPINFO *depinfo)
+{
+	RC_STRINGLIST *sorted = rc_stringlist_new();
+	const char *svcname = getenv("RC_SVCNAME");
+	RC_STRING *type, *s;
+	RC_DEPTYPE *dt;
+
+	TAILQ_FOREACH(type, types, entries) {
+		if (!(dt = get_deptype(depinfo, type->value)))
+			continue;
+		TAILQ_FOREACH(s, dt->services, entries)
+			rc_stringlist_add(sorted, s->value);
+	}
+
+	if ((!svcname || strcmp(svcname, depinfo->service) != 0) &&
+	    !get_deptype(depinfo, "providedby"))
+		rc_stringlist_add(sorted, depinfo->service);
+	return sorted;
+}
+
 /* This is a 7 phase operation
    Phase 1 is a shell script which loads each init script and config in turn
    and echos their dependency info to stdout
@@ -774,17 +1970,27 @@ setup_environment(void)
    Phase 5 removes broken before dependencies
    Phase 6 looks for duplicate services indicating a real and virtual service
    with the same names
-   Phase 7 saves the depinfo object to disk
+   Phase 7 saves the depinfo object to disk, both as a shell parseable
+   file and as the compiled image rc_deptree_load maps
    */
-bool
-rc_deptree_update(void)
+static bool
+deptree_update(void)
 {
 
-	FILE *fp;
-	RC_DEPTREE *deptree, *providers;
+	FILE *fp = NULL;
+	char *gendep = NULL;
+	unsigned int jobs;
+	struct depcache cache = TAILQ_HEAD_INITIALIZER(cache);
+	struct depcache fresh = TAILQ_HEAD_INITIALIZER(fresh);
+	struct depcache_entry *entry = NULL, *hint = NULL;
+	RC_STRINGLIST *globals;
+	RC_STRING *replay = NULL;
+	time_t started = time(NULL);
+	int svcdirfd;
+	RC_DEPINFOS *deptree, *providers;
 	RC_DEPINFO *depinfo = NULL, *depinfo_np, *di;
 	RC_DEPTYPE *deptype = NULL, *dt_np, *dt, *provide;
-	RC_STRINGLIST *config, *dupes, *types, *sorted, *visited;
+	RC_STRINGLIST *config, *dupes, *types, *sorted;
 	RC_STRING *s, *s2, *s2_np, *s3, *s4;
 	char *line = NULL;
 	size_t size;
@@ -796,13 +2002,63 @@ rc_deptree_update(void)
 
 	/* Phase 1 - source all init scripts and print dependencies */
 	setup_environment();
-	if (!(fp = popen(GENDEP, "r")))
+	svcdirfd = rc_dirfd(RC_DIR_SVCDIR);
+	globals = depcache_globals();
+	depcache_load(&cache, svcdirfd, globals);
+	if (!TAILQ_EMPTY(&cache) && depcache_write_fresh(svcdirfd, &cache)) {
+		xasprintf(&line, "%s/%s", rc_svcdir(), DEPCACHE_FRESH);
+		setenv("RC_DEPEND_CACHED", line, 1);
+		free(line);
+		line = NULL;
+	}
+
+	if ((jobs = gendepends_jobs()) > 1)
+		fp = gendepends_parallel(jobs, &gendep);
+	if (!fp)
+		fp = popen(GENDEP, "r");
+	unsetenv("RC_DEPEND_CACHED");
+	if (!fp) {
+		unlinkat(svcdirfd, DEPCACHE_FRESH, 0);
+		depcache_free(&cache);
+		rc_stringlist_free(globals);
 		return false;
+	}
 
 	config = rc_stringlist_new();
 
-	deptree = make_deptree();
-	while (xgetline(&line, &size, fp) != -1) {
+	deptree = make_depinfos();
+	size = 0;
+	for (;;) {
+		if (replay) {
+			l = strlen(replay->value) + 1;
+			if (size < l)
+				line = xrealloc(line, size = l);
+			memcpy(line, replay->value, l);
+			replay = TAILQ_NEXT(replay, entries);
+		} else if (xgetline(&line, &size, fp) == -1)
+			break;
+
+		/* gendepends starts the output of each script with its path,
+		 * followed by cached if we told it we still know the output */
+		if (*line == '/') {
+			depends = line;
+			service = strsep(&depends, " ");
+			if (depends && strcmp(depends, "cached") == 0) {
+				if ((entry = depcache_find(&cache, &hint, service))) {
+					if (hint == entry)
+						hint = TAILQ_NEXT(entry, entries);
+					TAILQ_REMOVE(&cache, entry, entries);
+					TAILQ_INSERT_TAIL(&fresh, entry, entries);
+					replay = TAILQ_FIRST(entry->lines);
+				}
+				entry = NULL;
+			} else
+				entry = depcache_add(&fresh, service);
+			continue;
+		}
+		if (entry)
+			rc_stringlist_add(entry->lines, line);
+
 		depends = line;
 		service = strsep(&depends, " ");
 		if (!service || !*service)
@@ -864,7 +2120,7 @@ rc_deptree_update(void)
 			 * Conversely, we need to allow 'before *; after modules' also */
 			/* If we're before something, remove us from the after list */
 			if (strcmp(type, "ibefore") == 0) {
-				if ((dt = get_deptype(depinfo, "iafter")))
+				if ((dt = depinfo->types[RC_DEPTYPE_IAFTER]))
 					rc_stringlist_delete(dt->services, depend);
 			}
 			/* If we're after something, remove us from the before list */
@@ -872,13 +2128,19 @@ rc_deptree_update(void)
 			    strcmp(type, "ineed") == 0 ||
 			    strcmp(type, "iwant") == 0 ||
 			    strcmp(type, "iuse") == 0) {
-				if ((dt = get_deptype(depinfo, "ibefore")))
+				if ((dt = depinfo->types[RC_DEPTYPE_IBEFORE]))
 					rc_stringlist_delete(dt->services, depend);
 			}
 		}
 	}
 	free(line);
-	pclose(fp);
+	if (gendep) {
+		fclose(fp);
+		free(gendep);
+	} else
+		pclose(fp);
+	unlinkat(svcdirfd, DEPCACHE_FRESH, 0);
+	depcache_free(&cache);
 
 	/* Phase 2 - if we're a special system, remove services that don't
 	 * work for them. This doesn't stop them from being run directly. */
@@ -899,26 +2161,22 @@ rc_deptree_update(void)
 			onosys[i + 2] = (char)tolower((unsigned char)sys[i]);
 		onosys[i + 2] = '\0';
 
-		TAILQ_FOREACH_SAFE(depinfo, deptree, entries, depinfo_np) {
-			if (!(deptype = get_deptype(depinfo, "keyword")))
+		TAILQ_FOREACH_SAFE(depinfo, &deptree->list, entries, depinfo_np) {
+			if (!(deptype = depinfo->types[RC_DEPTYPE_KEYWORD]))
 				continue;
 			TAILQ_FOREACH(s, deptype->services, entries) {
 				if (strcmp(s->value, nosys) != 0 && strcmp(s->value, onosys) != 0)
 					continue;
-				provide = get_deptype(depinfo, "iprovide");
-				TAILQ_REMOVE(deptree, depinfo, entries);
-				TAILQ_FOREACH(di, deptree, entries) {
+				provide = depinfo->types[RC_DEPTYPE_IPROVIDE];
+				remove_depinfo(deptree, depinfo);
+				TAILQ_FOREACH(di, &deptree->list, entries) {
 					TAILQ_FOREACH_SAFE(dt, &di->depends, entries, dt_np) {
 						rc_stringlist_delete(dt->services, depinfo->service);
 						if (provide)
 							TAILQ_FOREACH(s2, provide->services, entries)
 								rc_stringlist_delete(dt->services, s2->value);
-						if (!TAILQ_FIRST(dt->services)) {
-							TAILQ_REMOVE(&di->depends, dt, entries);
-							free(dt->type);
-							free(dt->services);
-							free(dt);
-						}
+						if (!TAILQ_FIRST(dt->services))
+							free_deptype(di, dt);
 					}
 				}
 			}
@@ -928,10 +2186,9 @@ rc_deptree_update(void)
 	}
 
 	/* Phase 3 - add our providers to the tree */
-	providers = xmalloc(sizeof(*providers));
-	TAILQ_INIT(providers);
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		if (!(deptype = get_deptype(depinfo, "iprovide")))
+	providers = make_depinfos();
+	TAILQ_FOREACH(depinfo, &deptree->list, entries) {
+		if (!(deptype = depinfo->types[RC_DEPTYPE_IPROVIDE]))
 			continue;
 		TAILQ_FOREACH(s, deptype->services, entries) {
 			di = get_depinfo(providers, s->value);
@@ -939,32 +2196,36 @@ rc_deptree_update(void)
 				di = make_depinfo(providers, s->value);
 		}
 	}
-	TAILQ_CONCAT(deptree, providers, entries);
-	free(providers);
+	while ((di = TAILQ_FIRST(&providers->list))) {
+		TAILQ_REMOVE(&providers->list, di, entries);
+		TAILQ_INSERT_TAIL(&deptree->list, di, entries);
+		depinfos_index(deptree, di);
+	}
+	depinfos_free(providers);
 
 	/* Phase 4 - backreference our depends */
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		for (i = 0; deppairs[i].depend; i++) {
-			deptype = get_deptype(depinfo, deppairs[i].depend);
+	TAILQ_FOREACH(depinfo, &deptree->list, entries) {
+		for (i = 0; i < ARRAY_SIZE(deppairs); i++) {
+			deptype = depinfo->types[deppairs[i].depend];
 			if (!deptype)
 				continue;
 			TAILQ_FOREACH(s, deptype->services, entries) {
 				di = get_depinfo(deptree, s->value);
 				if (!di) {
-					if (strcmp(deptype->type, "ineed") == 0) {
+					if (deptype->id == RC_DEPTYPE_INEED) {
 						fprintf(stderr, "Service '%s' needs non existent service '%s'\n",
 							 depinfo->service, s->value);
-						dt = get_deptype(depinfo, "broken");
+						dt = depinfo->types[RC_DEPTYPE_BROKEN];
 						if (!dt)
-							dt = make_deptype(depinfo, "broken");
+							dt = make_deptype(depinfo, deptype_names[RC_DEPTYPE_BROKEN]);
 						rc_stringlist_addu(dt->services, s->value);
 					}
 					continue;
 				}
 
-				dt = get_deptype(di, deppairs[i].addto);
+				dt = di->types[deppairs[i].addto];
 				if (!dt)
-					dt = make_deptype(di, deppairs[i].addto);
+					dt = make_deptype(di, deptype_names[deppairs[i].addto]);
 				rc_stringlist_addu(dt->services, depinfo->service);
 			}
 		}
@@ -976,27 +2237,23 @@ rc_deptree_update(void)
 	rc_stringlist_add(types, "iwant");
 	rc_stringlist_add(types, "iuse");
 	rc_stringlist_add(types, "iafter");
-	TAILQ_FOREACH(depinfo, deptree, entries) {
-		deptype = get_deptype(depinfo, "ibefore");
+	TAILQ_FOREACH(depinfo, &deptree->list, entries) {
+		deptype = depinfo->types[RC_DEPTYPE_IBEFORE];
 		if (!deptype)
 			continue;
-		sorted = rc_stringlist_new();
-		visited = rc_stringlist_new();
-		visit_service(deptree, types, sorted, visited, depinfo,
-			      NULL, 0);
-		rc_stringlist_free(visited);
+		sorted = direct_depends(types, depinfo);
 		TAILQ_FOREACH_SAFE(s2, deptype->services, entries, s2_np) {
 			TAILQ_FOREACH(s3, sorted, entries) {
 				di = get_depinfo(deptree, s3->value);
 				if (!di)
 					continue;
 				if (strcmp(s2->value, s3->value) == 0) {
-					dt = get_deptype(di, "iafter");
+					dt = di->types[RC_DEPTYPE_IAFTER];
 					if (dt)
 						rc_stringlist_delete(dt->services, depinfo->service);
 					break;
 				}
-				dt = get_deptype(di, "iprovide");
+				dt = di->types[RC_DEPTYPE_IPROVIDE];
 				if (!dt)
 					continue;
 				TAILQ_FOREACH(s4, dt->services, entries) {
@@ -1006,7 +2263,7 @@ rc_deptree_update(void)
 				if (s4) {
 					di = get_depinfo(deptree, s4->value);
 					if (di) {
-						dt = get_deptype(di, "iafter");
+						dt = di->types[RC_DEPTYPE_IAFTER];
 						if (dt)
 							rc_stringlist_delete(dt->services, depinfo->service);
 					}
@@ -1022,7 +2279,7 @@ rc_deptree_update(void)
 
 	/* Phase 6 - Print errors for duplicate services */
 	dupes = rc_stringlist_new();
-	TAILQ_FOREACH(depinfo, deptree, entries) {
+	TAILQ_FOREACH(depinfo, &deptree->list, entries) {
 		serrno = errno;
 		errno = 0;
 		rc_stringlist_addu(dupes,depinfo->service);
@@ -1043,7 +2300,7 @@ rc_deptree_update(void)
 	   */
 	if ((fp = do_fopenat(rc_dirfd(RC_DIR_SVCDIR), "deptree", O_WRONLY | O_CREAT | O_TRUNC))) {
 		i = 0;
-		TAILQ_FOREACH(depinfo, deptree, entries) {
+		TAILQ_FOREACH(depinfo, &deptree->list, entries) {
 			fprintf(fp, "depinfo_%zu_service='%s'\n", i, depinfo->service);
 			TAILQ_FOREACH(deptype, &depinfo->depends, entries) {
 				size_t k = 0;
@@ -1074,7 +2331,33 @@ rc_deptree_update(void)
 		unlinkat(rc_dirfd(RC_DIR_SVCDIR), "depconfig", 0);
 	}
 
+	if (!deptree_save(rc_dirfd(RC_DIR_SVCDIR), deptree)) {
+		fprintf(stderr, "save '%s/%s': %s\n", rc_svcdir(), DEPTREE_IMAGE, strerror(errno));
+		retval = false;
+	}
+
+	/* Only remember scripts sourced this time whose files did not
+	 * change under us, cached entries were validated on load */
+	TAILQ_FOREACH_SAFE(entry, &fresh, entries, hint)
+		if (TAILQ_EMPTY(entry->files) && !depcache_seal(entry, started))
+			depcache_remove(&fresh, entry);
+	if (!depcache_save(svcdirfd, globals, &fresh))
+		unlinkat(svcdirfd, DEPCACHE, 0);
+	depcache_free(&fresh);
+	rc_stringlist_free(globals);
+
 	rc_stringlist_free(config);
-	rc_deptree_free(deptree);
+	depinfos_free(deptree);
+	return retval;
+}
+
+bool
+rc_deptree_update(void)
+{
+	bool retval;
+
+	rc_trace(RC_TRACE_DEPTREE_BEGIN, NULL, NULL, 0);
+	retval = deptree_update();
+	rc_trace(RC_TRACE_DEPTREE_END, NULL, NULL, retval);
 	return retval;
 }
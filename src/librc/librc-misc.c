@@ -19,13 +19,16 @@
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "queue.h"
 #include "librc.h"
@@ -382,6 +385,258 @@ rc_config_value(RC_STRINGLIST *list, const char *entry)
 	return NULL;
 }
 
+/*
+ * openrc compiles the merged rc.conf into an image in the service
+ * directory, so that every other process can map it and look settings up
+ * by hash instead of parsing each configuration file again.
+ *
+ *   struct conf_header hdr
+ *   struct conf_source sources[nsources]    identity of each file read
+ *   uint32_t index[nslots]                  entry + 1 keyed on the name
+ *   uint32_t entries[nentries]              "name=value" strtab offsets
+ *   char strtab[strtab_size]
+ *
+ * The image is only used while every source file, including those which
+ * did not exist, is as it was when compiled. Overrides from the kernel
+ * command line are compiled in, as the service directory does not outlive
+ * a boot.
+ */
+#define CONF_IMAGE		"rc.conf.bin"
+#define CONF_IMAGE_TMP		"rc.conf.bin.tmp"
+#define CONF_MAGIC		0x52434346 /* RCCF */
+#define CONF_VERSION		1
+#define CONF_NODIR		UINT32_MAX
+
+struct conf_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nsources;
+	uint32_t nslots;
+	uint32_t nentries;
+	uint32_t strtab_size;
+};
+
+struct conf_source {
+	uint32_t dir;		/* enum rc_dir, or CONF_NODIR if absolute */
+	uint32_t name;		/* strtab offset */
+	uint32_t exists;
+	uint32_t pad;
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	int64_t mtime;
+	int64_t mtime_nsec;
+};
+
+struct conf_build {
+	struct conf_source *sources;
+	size_t nsources;
+	char *strtab;
+	size_t strtab_size;
+};
+
+/* Global for the mapped image */
+static struct {
+	void *image;
+	size_t size;
+	uint32_t nslots;
+	uint32_t nentries;
+	const uint32_t *index;
+	const uint32_t *entries;
+	char *strtab;
+} conf_image;
+
+static uint32_t
+conf_strtab_add(struct conf_build *build, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint32_t offset = build->strtab_size;
+
+	build->strtab = xrealloc(build->strtab, build->strtab_size + len);
+	memcpy(build->strtab + offset, str, len);
+	build->strtab_size += len;
+	return offset;
+}
+
+static void
+conf_stat(struct conf_source *source, uint32_t dir, const char *name)
+{
+	struct stat st;
+	int fd = dir == CONF_NODIR ? AT_FDCWD : rc_dirfd(dir);
+
+	memset(source, 0, sizeof(*source));
+	source->dir = dir;
+	if (fd == -1 || fstatat(fd, name, &st, 0) != 0)
+		return;
+	source->exists = 1;
+	source->dev = st.st_dev;
+	source->ino = st.st_ino;
+	source->size = st.st_size;
+	source->mtime = st.st_mtim.tv_sec;
+	source->mtime_nsec = st.st_mtim.tv_nsec;
+}
+
+static void
+conf_source_add(struct conf_build *build, uint32_t dir, const char *name)
+{
+	struct conf_source *source;
+
+	build->sources = xrealloc(build->sources,
+	    sizeof(*build->sources) * (build->nsources + 1));
+	source = &build->sources[build->nsources++];
+	conf_stat(source, dir, name);
+	source->name = conf_strtab_add(build, name);
+}
+
+/* The rc.conf.d directory itself notes fragments coming and going */
+static void
+conf_sources_directory(struct conf_build *build, enum rc_dir dir)
+{
+	struct dirent *d;
+	char *name;
+	DIR *dp;
+
+	conf_source_add(build, dir, "rc.conf.d");
+	if (!(dp = do_opendirat(rc_dirfd(dir), "rc.conf.d")))
+		return;
+	while ((d = readdir(dp)) != NULL) {
+		if (fnmatch("*.conf", d->d_name, FNM_PATHNAME) != 0)
+			continue;
+		xasprintf(&name, "rc.conf.d/%s", d->d_name);
+		conf_source_add(build, dir, name);
+		free(name);
+	}
+	closedir(dp);
+}
+
+/* Every file rc_conf_load reads */
+static void
+conf_sources(struct conf_build *build)
+{
+	if (rc_is_user()) {
+		conf_source_add(build, RC_DIR_USRCONF, "rc.conf");
+		conf_sources_directory(build, RC_DIR_USRCONF);
+	}
+	conf_source_add(build, RC_DIR_SYSCONF, "rc.conf");
+	conf_source_add(build, CONF_NODIR, RC_CONF_OLD);
+	conf_sources_directory(build, RC_DIR_SYSCONF);
+}
+
+static bool
+conf_image_current(const struct conf_source *sources, uint32_t nsources,
+    const char *strtab)
+{
+	struct conf_source source, now;
+	uint32_t i;
+
+	for (i = 0; i < nsources; i++) {
+		memcpy(&source, &sources[i], sizeof(source));
+		conf_stat(&now, source.dir, strtab + source.name);
+		now.name = source.name;
+		if (memcmp(&source, &now, sizeof(source)) != 0)
+			return false;
+	}
+	return true;
+}
+
+/* Check the mapped image and point at its sections */
+static bool
+conf_image_attach(void *image, size_t size)
+{
+	struct conf_header hdr;
+	const struct conf_source *sources;
+	char *p = image;
+	size_t words, i;
+
+	if (size < sizeof(hdr))
+		return false;
+	memcpy(&hdr, image, sizeof(hdr));
+	if (hdr.magic != CONF_MAGIC || hdr.version != CONF_VERSION ||
+	    hdr.nsources > size / sizeof(*sources) ||
+	    hdr.nslots > size / sizeof(uint32_t) ||
+	    hdr.nentries > size / sizeof(uint32_t) ||
+	    hdr.nslots == 0 || (hdr.nslots & (hdr.nslots - 1)) ||
+	    hdr.nslots <= hdr.nentries || hdr.strtab_size == 0)
+		return false;
+
+	words = (size_t)hdr.nslots + hdr.nentries;
+	if (sizeof(hdr) + hdr.nsources * sizeof(*sources) +
+	    words * sizeof(uint32_t) + hdr.strtab_size != size)
+		return false;
+
+	sources = (const void *)(p + sizeof(hdr));
+	conf_image.index = (const void *)(sources + hdr.nsources);
+	conf_image.entries = conf_image.index + hdr.nslots;
+	conf_image.strtab = p + size - hdr.strtab_size;
+	if (conf_image.strtab[hdr.strtab_size - 1] != '\0')
+		return false;
+	for (i = 0; i < hdr.nsources; i++)
+		if (sources[i].name >= hdr.strtab_size)
+			return false;
+	for (i = 0; i < hdr.nslots; i++)
+		if (conf_image.index[i] > hdr.nentries)
+			return false;
+	for (i = 0; i < hdr.nentries; i++)
+		if (conf_image.entries[i] >= hdr.strtab_size)
+			return false;
+
+	if (!conf_image_current(sources, hdr.nsources, conf_image.strtab))
+		return false;
+	conf_image.nslots = hdr.nslots;
+	conf_image.nentries = hdr.nentries;
+	return true;
+}
+
+static bool
+conf_image_map(void)
+{
+	struct stat st;
+	void *image;
+	char *path;
+	int fd;
+
+	xasprintf(&path, "%s/%s", rc_svcdir(), CONF_IMAGE);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	free(path);
+	if (fd == -1)
+		return false;
+	if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+		close(fd);
+		return false;
+	}
+	/* Writable, as callers have always been free to edit the values
+	 * rc_conf_value hands out; the changes stay private to us. */
+	image = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+		return false;
+
+	if (!conf_image_attach(image, (size_t)st.st_size)) {
+		munmap(image, (size_t)st.st_size);
+		return false;
+	}
+	conf_image.image = image;
+	conf_image.size = (size_t)st.st_size;
+	return true;
+}
+
+static char *
+conf_image_value(const char *setting)
+{
+	size_t len = strlen(setting);
+	uint32_t mask = conf_image.nslots - 1;
+	uint32_t i = string_hash(setting) & mask;
+	char *entry;
+
+	for (; conf_image.index[i]; i = (i + 1) & mask) {
+		entry = conf_image.strtab + conf_image.entries[conf_image.index[i] - 1];
+		if (strncmp(setting, entry, len) == 0 && entry[len] == '=')
+			return entry + len + 1;
+	}
+	return NULL;
+}
+
 /* Global for caching the strings loaded from rc.conf to avoid reparsing for
  * each rc_conf_value call */
 static RC_STRINGLIST *rc_conf = NULL;
@@ -390,49 +645,46 @@ static void
 _free_rc_conf(void)
 {
 	rc_stringlist_free(rc_conf);
+	if (conf_image.image)
+		munmap(conf_image.image, conf_image.size);
 }
 
 static void
-rc_conf_append(enum rc_dir dir)
+rc_conf_append(RC_STRINGLIST *config, enum rc_dir dir)
 {
 	RC_STRINGLIST *conf = config_load(rc_dirfd(dir), "rc.conf");
-	TAILQ_CONCAT(rc_conf, conf, entries);
+	TAILQ_CONCAT(config, conf, entries);
 	rc_stringlist_free(conf);
 }
 
-char *
-rc_conf_value(const char *setting)
+static RC_STRINGLIST *
+rc_conf_load(void)
 {
+	RC_STRINGLIST *config = rc_stringlist_new();
 	RC_STRING *s;
 
-	if (rc_conf)
-		return rc_config_value(rc_conf, setting);
-
-	rc_conf = rc_stringlist_new();
-	atexit(_free_rc_conf);
-
 	/* Load user configurations first, as they should override
 	 * system wide configs. */
 	if (rc_is_user()) {
-		rc_conf_append(RC_DIR_USRCONF);
-		rc_config_directory(rc_conf, rc_dirfd(RC_DIR_USRCONF), "rc.conf.d");
+		rc_conf_append(config, RC_DIR_USRCONF);
+		rc_config_directory(config, rc_dirfd(RC_DIR_USRCONF), "rc.conf.d");
 	}
 
-	rc_conf_append(RC_DIR_SYSCONF);
+	rc_conf_append(config, RC_DIR_SYSCONF);
 
 	/* Support old configs. */
 	if (access(RC_CONF_OLD, F_OK) == 0) {
 		RC_STRINGLIST *old_conf = config_load(AT_FDCWD, RC_CONF_OLD);
-		TAILQ_CONCAT(rc_conf, old_conf, entries);
+		TAILQ_CONCAT(config, old_conf, entries);
 		rc_stringlist_free(old_conf);
 	}
 
-	rc_config_directory(rc_conf, rc_dirfd(RC_DIR_SYSCONF), "rc.conf.d");
+	rc_config_directory(config, rc_dirfd(RC_DIR_SYSCONF), "rc.conf.d");
 
-	rc_conf = rc_config_kcl(rc_conf);
+	config = rc_config_kcl(config);
 
 	/* Convert old uppercase to lowercase */
-	TAILQ_FOREACH(s, rc_conf, entries) {
+	TAILQ_FOREACH(s, config, entries) {
 		char *p = s->value;
 		while (p && *p && *p != '=') {
 			if (isupper((unsigned char)*p))
@@ -441,5 +693,132 @@ rc_conf_value(const char *setting)
 		}
 	}
 
+	return config;
+}
+
+char *
+rc_conf_value(const char *setting)
+{
+	if (rc_conf)
+		return rc_config_value(rc_conf, setting);
+	if (conf_image.image)
+		return conf_image_value(setting);
+
+	atexit(_free_rc_conf);
+	if (conf_image_map())
+		return conf_image_value(setting);
+
+	rc_conf = rc_conf_load();
 	return rc_config_value(rc_conf, setting);
 }
+
+bool
+rc_conf_cache_update(void)
+{
+	struct conf_build build = { NULL, 0, NULL, 0 };
+	struct conf_header hdr;
+	RC_STRINGLIST *config;
+	RC_STRING *s;
+	uint32_t *index, *entries;
+	uint32_t nslots = 16, nentries = 0, i;
+	int dirfd = rc_dirfd(RC_DIR_SVCDIR);
+	char *name, *p;
+	size_t size;
+	ssize_t len;
+	char *image;
+	int serrno;
+	int fd;
+
+	if (dirfd == -1)
+		return false;
+	if (conf_image.image || conf_image_map())
+		return true;
+
+	/* Note what we read before reading it, so that a file changing
+	 * under us leaves the image out of date rather than wrong */
+	conf_sources(&build);
+	config = rc_conf_load();
+
+	TAILQ_FOREACH(s, config, entries)
+		nentries++;
+	while (nslots < nentries * 2)
+		nslots *= 2;
+	index = xmalloc(sizeof(*index) * nslots);
+	memset(index, 0, sizeof(*index) * nslots);
+	entries = xmalloc(sizeof(*entries) * (nentries + 1));
+
+	/* The first setting of a name wins, as with rc_config_value */
+	nentries = 0;
+	TAILQ_FOREACH(s, config, entries) {
+		if (!(p = strchr(s->value, '=')))
+			continue;
+		len = p - s->value;
+		*p = '\0';
+		i = string_hash(s->value) & (nslots - 1);
+		*p = '=';
+		for (; index[i]; i = (i + 1) & (nslots - 1)) {
+			name = build.strtab + entries[index[i] - 1];
+			if (strncmp(s->value, name, (size_t)len + 1) == 0)
+				break;
+		}
+		if (!index[i]) {
+			entries[nentries] = conf_strtab_add(&build, s->value);
+			index[i] = ++nentries;
+		}
+	}
+	rc_stringlist_free(config);
+	if (!build.strtab_size)
+		conf_strtab_add(&build, "");
+
+	hdr.magic = CONF_MAGIC;
+	hdr.version = CONF_VERSION;
+	hdr.nsources = (uint32_t)build.nsources;
+	hdr.nslots = nslots;
+	hdr.nentries = nentries;
+	hdr.strtab_size = (uint32_t)build.strtab_size;
+
+	size = sizeof(hdr) + build.nsources * sizeof(*build.sources) +
+	    (nslots + nentries) * sizeof(uint32_t) + build.strtab_size;
+	image = xmalloc(size);
+	p = image;
+	memcpy(p, &hdr, sizeof(hdr));
+	p += sizeof(hdr);
+	memcpy(p, build.sources, build.nsources * sizeof(*build.sources));
+	p += build.nsources * sizeof(*build.sources);
+	memcpy(p, index, nslots * sizeof(uint32_t));
+	p += nslots * sizeof(uint32_t);
+	memcpy(p, entries, nentries * sizeof(uint32_t));
+	p += nentries * sizeof(uint32_t);
+	memcpy(p, build.strtab, build.strtab_size);
+	free(index);
+	free(entries);
+	free(build.sources);
+	free(build.strtab);
+
+	fd = openat(dirfd, CONF_IMAGE_TMP,
+	    O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		free(image);
+		return false;
+	}
+	for (p = image; size > 0; p += len, size -= (size_t)len) {
+		if ((len = write(fd, p, size)) == -1) {
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	free(image);
+
+	if (close(fd) != 0 || size > 0 ||
+	    renameat(dirfd, CONF_IMAGE_TMP, dirfd, CONF_IMAGE) != 0)
+	{
+		serrno = errno;
+		unlinkat(dirfd, CONF_IMAGE_TMP, 0);
+		errno = serrno;
+		return false;
+	}
+	return true;
+}
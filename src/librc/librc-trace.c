@@ -0,0 +1,198 @@
+/*
+ * librc-trace
+ * Records what services do, for working out what a boot waits on
+ */
+
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <sys/file.h>
+#include <sys/mman.h>
+
+#include "librc.h"
+#include "helpers.h"
+
+/*
+ * The trace is a ring of fixed size slots shared by every process which
+ * writes to it. A writer claims the next slot by bumping the head of the
+ * ring, fills it in and then stores its sequence number, so a reader can
+ * tell a complete record from one which is being written or overwritten.
+ */
+#define TRACE_FILE	"trace"
+#define TRACE_MAGIC	"RCTR"
+#define TRACE_VERSION	1
+#define TRACE_SLOTS	8192
+
+struct trace_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t slot_size;
+	uint64_t head;		/* slots ever claimed */
+	char pad[40];
+};
+
+struct trace_slot {
+	uint64_t seq;		/* one more than the slot claimed, once written */
+	RC_TRACE_RECORD rec;
+};
+
+static struct {
+	bool checked;
+	struct trace_header *hdr;
+	struct trace_slot *slots;
+} trace;
+
+static size_t
+trace_size(void)
+{
+	return sizeof(struct trace_header) + TRACE_SLOTS * sizeof(struct trace_slot);
+}
+
+static bool
+trace_valid(const struct trace_header *hdr)
+{
+	return memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) == 0 &&
+	    hdr->version == TRACE_VERSION && hdr->capacity == TRACE_SLOTS &&
+	    hdr->slot_size == sizeof(struct trace_slot);
+}
+
+/* Map the trace, creating it if we may write to it. */
+static struct trace_header *
+trace_map(bool create)
+{
+	struct trace_header hdr, *map;
+	struct stat st;
+	int fd;
+
+	fd = openat(rc_dirfd(RC_DIR_SVCDIR), TRACE_FILE,
+	    (create ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return NULL;
+
+	/* Whoever gets here first lays out an empty ring */
+	if (create && flock(fd, LOCK_EX) == 0) {
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size != trace_size()) {
+			memset(&hdr, 0, sizeof(hdr));
+			memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+			hdr.version = TRACE_VERSION;
+			hdr.capacity = TRACE_SLOTS;
+			hdr.slot_size = sizeof(struct trace_slot);
+			if (ftruncate(fd, 0) == -1 ||
+			    ftruncate(fd, trace_size()) == -1 ||
+			    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+				close(fd);
+				return NULL;
+			}
+		}
+		flock(fd, LOCK_UN);
+	}
+
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != trace_size()) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	map = mmap(NULL, trace_size(), create ? PROT_READ | PROT_WRITE : PROT_READ,
+	    MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	if (!trace_valid(map)) {
+		munmap(map, trace_size());
+		errno = EINVAL;
+		return NULL;
+	}
+	return map;
+}
+
+static void
+trace_copy(char *dst, const char *src)
+{
+	size_t len = src ? strlen(src) : 0;
+
+	if (len >= RC_TRACE_NAMELEN)
+		len = RC_TRACE_NAMELEN - 1;
+	memcpy(dst, src ? src : "", len);
+	memset(dst + len, 0, RC_TRACE_NAMELEN - len);
+}
+
+void
+rc_trace(RC_TRACE_EVENT event, const char *service, const char *detail, int arg)
+{
+	struct trace_slot *slot;
+	struct timespec ts;
+	uint64_t seq;
+	int serrno = errno;
+
+	if (!trace.checked) {
+		trace.checked = true;
+		/* openrc exports RC_TRACE so the services it runs join in */
+		if ((rc_yesno(getenv("RC_TRACE")) ||
+		    rc_yesno(rc_conf_value("rc_trace"))) &&
+		    (trace.hdr = trace_map(true)))
+			trace.slots = (struct trace_slot *)(trace.hdr + 1);
+	}
+	if (!trace.hdr) {
+		errno = serrno;
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	seq = __atomic_fetch_add(&trace.hdr->head, 1, __ATOMIC_RELAXED);
+	slot = &trace.slots[seq % TRACE_SLOTS];
+	__atomic_store_n(&slot->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->rec.time = (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	slot->rec.pid = getpid();
+	slot->rec.arg = arg;
+	slot->rec.event = event;
+	trace_copy(slot->rec.service, service);
+	trace_copy(slot->rec.detail, detail);
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+	errno = serrno;
+}
+
+RC_TRACE_RECORD *
+rc_trace_read(size_t *count)
+{
+	struct trace_header *hdr = trace_map(false);
+	struct trace_slot *slots;
+	RC_TRACE_RECORD *recs;
+	uint64_t head, seq;
+	size_t n = 0;
+
+	*count = 0;
+	if (!hdr)
+		return NULL;
+	slots = (struct trace_slot *)(hdr + 1);
+	head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	seq = head > TRACE_SLOTS ? head - TRACE_SLOTS : 0;
+	recs = xmalloc(sizeof(*recs) * (head - seq + 1));
+	for (; seq < head; seq++) {
+		struct trace_slot *slot = &slots[seq % TRACE_SLOTS];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq + 1)
+			continue;
+		recs[n] = slot->rec;
+		/* Skip it if it was overwritten while we copied it */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq + 1)
+			continue;
+		recs[n].service[RC_TRACE_NAMELEN - 1] = '\0';
+		recs[n].detail[RC_TRACE_NAMELEN - 1] = '\0';
+		n++;
+	}
+	munmap(hdr, trace_size());
+	*count = n;
+	return recs;
+}
@@ -25,6 +25,7 @@
 #include <limits.h>
 #include <regex.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -228,11 +229,15 @@ found:
 static const char *
 get_systype(void)
 {
-	char *systype = rc_conf_value("rc_sys");
-	if (systype) {
-		char *s = systype;
+	static char *systype;
+	const char *value = rc_conf_value("rc_sys");
+
+	free(systype);
+	systype = NULL;
+	if (value) {
+		char *s = systype = xstrdup(value);
 		/* Convert to uppercase */
-		while (s && *s) {
+		while (*s) {
 			if (islower((unsigned char) *s))
 				*s = toupper((unsigned char) *s);
 			s++;
@@ -1026,6 +1031,7 @@ rc_service_mark(const char *service, const RC_SERVICE state)
 			return false;
 		}
 	}
+	rc_trace(RC_TRACE_MARK, base, NULL, state);
 
 	if (state == RC_SERVICE_HOTPLUGGED || state == RC_SERVICE_FAILED) {
 		free(init);
@@ -1140,6 +1146,180 @@ rc_service_state(const char *service)
 	return state;
 }
 
+/*
+ * A state snapshot reads each state directory once and keeps which of them
+ * every service was found in, indexed by an open addressing hash of the
+ * service name, so the state of any number of services can be answered
+ * without touching the filesystem again. Entries are kept in the order
+ * they were found in.
+ */
+struct snapshot_entry {
+	char *service;
+	int dirs;	/* the RC_SERVICE states whose directory lists us */
+	int crashed;	/* -1 until checked */
+};
+
+struct rc_state_snapshot {
+	struct snapshot_entry *entries;
+	size_t count;
+	size_t alloc;
+	uint32_t *index;	/* entry + 1, 0 is an empty slot */
+	size_t index_size;
+	RC_PROCTABLE *procs;	/* shared by the crash checks */
+};
+
+uint32_t
+string_hash(const char *name)
+{
+	uint32_t hash = 2166136261u;
+
+	for (; *name; name++) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t *
+snapshot_slot(const RC_STATE_SNAPSHOT *snapshot, const char *service)
+{
+	size_t mask = snapshot->index_size - 1;
+	size_t i = string_hash(service) & mask;
+	uint32_t *slot;
+
+	for (;; i = (i + 1) & mask) {
+		slot = &snapshot->index[i];
+		if (*slot == 0 ||
+		    strcmp(snapshot->entries[*slot - 1].service, service) == 0)
+			return slot;
+	}
+}
+
+static struct snapshot_entry *
+snapshot_add(RC_STATE_SNAPSHOT *snapshot, const char *service)
+{
+	struct snapshot_entry *entry;
+	uint32_t *slot;
+	size_t i;
+
+	if ((snapshot->count + 1) * 2 > snapshot->index_size) {
+		free(snapshot->index);
+		snapshot->index_size = snapshot->index_size ? snapshot->index_size * 2 : 64;
+		snapshot->index = xmalloc(snapshot->index_size * sizeof(*snapshot->index));
+		memset(snapshot->index, 0, snapshot->index_size * sizeof(*snapshot->index));
+		for (i = 0; i < snapshot->count; i++)
+			*snapshot_slot(snapshot, snapshot->entries[i].service) = i + 1;
+	}
+
+	slot = snapshot_slot(snapshot, service);
+	if (*slot)
+		return &snapshot->entries[*slot - 1];
+
+	if (snapshot->count == snapshot->alloc) {
+		snapshot->alloc = snapshot->alloc ? snapshot->alloc * 2 : 64;
+		snapshot->entries = xrealloc(snapshot->entries,
+		    snapshot->alloc * sizeof(*snapshot->entries));
+	}
+	entry = &snapshot->entries[snapshot->count++];
+	entry->service = xstrdup(service);
+	entry->dirs = 0;
+	entry->crashed = -1;
+	*slot = snapshot->count;
+	return entry;
+}
+
+RC_STATE_SNAPSHOT *
+rc_services_state_snapshot(void)
+{
+	RC_STATE_SNAPSHOT *snapshot = xmalloc(sizeof(*snapshot));
+	struct dirent *d;
+	struct stat buf;
+	DIR *dp;
+	int i;
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (rc_service_state_names[i].dir == RC_DIR_INVALID)
+			continue;
+		if (!(dp = do_dopendir(rc_dirfd(rc_service_state_names[i].dir))))
+			continue;
+		while ((d = readdir(dp))) {
+			/* rc_service_state only counts entries which resolve */
+			if (d->d_name[0] == '.' ||
+			    fstatat(dirfd(dp), d->d_name, &buf, 0) != 0)
+				continue;
+			snapshot_add(snapshot, d->d_name)->dirs |=
+			    rc_service_state_names[i].state;
+		}
+		closedir(dp);
+	}
+	return snapshot;
+}
+
+RC_SERVICE
+rc_state_snapshot_service(RC_STATE_SNAPSHOT *snapshot, const char *service)
+{
+	struct snapshot_entry *entry;
+	int state = RC_SERVICE_STOPPED;
+	uint32_t slot;
+	int i;
+
+	if (!snapshot->index_size ||
+	    !(slot = *snapshot_slot(snapshot, basename_c(service))))
+		return state;
+	entry = &snapshot->entries[slot - 1];
+
+	for (i = 0; rc_service_state_names[i].name; i++) {
+		if (!(entry->dirs & rc_service_state_names[i].state))
+			continue;
+		if (rc_service_state_names[i].state <= 0x10)
+			state = rc_service_state_names[i].state;
+		else
+			state |= rc_service_state_names[i].state;
+	}
+
+	if (state & RC_SERVICE_STARTED) {
+		if (entry->crashed == -1)
+			entry->crashed = rc_service_daemons_crashed_in(service,
+			    &snapshot->procs) && errno != EACCES;
+		if (entry->crashed)
+			state |= RC_SERVICE_CRASHED;
+	}
+
+	return state;
+}
+
+RC_STRINGLIST *
+rc_state_snapshot_services(const RC_STATE_SNAPSHOT *snapshot, RC_SERVICE state)
+{
+	RC_STRINGLIST *list;
+	size_t i;
+
+	if (state == RC_SERVICE_SCHEDULED)
+		return rc_services_in_state(state);
+
+	list = rc_stringlist_new();
+	for (i = 0; i < snapshot->count; i++)
+		if (snapshot->entries[i].dirs & state)
+			rc_stringlist_add(list, snapshot->entries[i].service);
+	return list;
+}
+
+void
+rc_state_snapshot_free(RC_STATE_SNAPSHOT *snapshot)
+{
+	size_t i;
+
+	if (!snapshot)
+		return;
+	for (i = 0; i < snapshot->count; i++)
+		free(snapshot->entries[i].service);
+	free(snapshot->entries);
+	free(snapshot->index);
+	rc_proctable_free(snapshot->procs);
+	free(snapshot);
+}
+
 char *
 rc_service_value_get(const char *service, const char *option)
 {
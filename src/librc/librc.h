@@ -36,6 +36,7 @@
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -77,5 +78,7 @@ static const char *const dirnames[RC_DIR_SYS_MAX] =
 
 RC_STRINGLIST *config_list(int dirfd, const char *pathname);
 void clear_dirfds(void);
+uint32_t string_hash(const char *);
+bool rc_service_daemons_crashed_in(const char *, RC_PROCTABLE **);
 
 #endif
@@ -37,6 +37,9 @@
 
 #include <errno.h>
 #include <getopt.h>
+#ifdef __linux__
+#  include <poll.h>
+#endif
 #include <regex.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -46,6 +49,7 @@
 #include <unistd.h>
 
 #include "einfo.h"
+#include "fstab_cache.h"
 #include "queue.h"
 #include "rc.h"
 #include "rc_exec.h"
@@ -56,7 +60,9 @@
 const char *applet = NULL;
 const char *procmounts = "/proc/mounts";
 const char *extraopts = "[mount1] [mount2] ...";
-const char getoptstring[] = "f:F:n:N:o:O:p:P:iste:E:" getoptstring_COMMON;
+const char getoptstring[] = "f:F:n:N:o:O:p:P:isteEb" getoptstring_COMMON;
+/* what a query read by --batch may hold */
+static const char batch_getoptstring[] = "f:F:n:N:o:O:p:P:isteEq";
 const struct option longopts[] = {
 	{ "fstype-regex",        1, NULL, 'f'},
 	{ "skip-fstype-regex",   1, NULL, 'F'},
@@ -71,6 +77,7 @@ const struct option longopts[] = {
 	{ "node",                0, NULL, 't'},
 	{ "netdev",              0, NULL, 'e'},
 	{ "nonetdev",            0, NULL, 'E'},
+	{ "batch",               0, NULL, 'b'},
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
@@ -87,17 +94,50 @@ const char * const longopts_help[] = {
 	"print node",
 	"is it a network device",
 	"is it not a network device",
+	"answer queries read from stdin, one per line",
 	longopts_help_COMMON
 };
 const char *usagestring = NULL;
 
 #define UMOUNT_ARGS_MAX 16
-#define RUN_MAX 32
+#define RUN_MAX 128
 #define TRY_MAX 3
 #define TRY_DELAY_MS 1000
+/* how stale the mount table may get while we are starting unmounts */
+#define REREAD_DELAY_MS 100
+
+/* The paths to unmount, linked to their parent directories so that a path
+ * is only unmounted once nothing beneath it is left to unmount. */
+struct mount_node {
+	char *path;
+	size_t len;
+	struct mount_node *parent;
+	struct mount_node *hash_next;
+	size_t queued;		/* times the path is still to be unmounted */
+	size_t below;		/* unmounts queued or running beneath the path */
+	size_t mounted;		/* times the path is mounted, as last read */
+	bool running;
+};
+
+struct mount_tree {
+	struct mount_node **slots;
+	size_t nslots;
+	struct mount_node **nodes;
+	size_t count;
+	/* paths with nothing left beneath them, deepest first */
+	struct mount_node **ready;
+	size_t nready;
+	size_t queued;
+	bool stale;
+	int64_t read_time;
+#ifdef __linux__
+	FILE *mountinfo;
+#endif
+};
 
 struct run_queue {
 	const char *mntpath;
+	struct mount_node *node;
 	int64_t last_exec_time;
 	int64_t fuser_exec_time;
 	pid_t pid;
@@ -119,6 +159,20 @@ typedef enum {
 	net_no
 } net_opts;
 
+/* The mount table, read once by --batch to answer each query from. */
+struct mount_entry {
+	char *from;
+	char *to;
+	char *fstype;
+	char *options;
+	int netdev;
+};
+
+struct mount_table {
+	struct mount_entry *entries;
+	size_t count;
+};
+
 struct args;
 typedef int process_func_t(RC_STRINGLIST *, struct args *,
     char *, char *, char *, char *, int);
@@ -131,10 +185,13 @@ struct args {
 	regex_t *skip_fstype_regex;
 	regex_t *options_regex;
 	regex_t *skip_options_regex;
+	regex_t *point_regex;
+	regex_t *skip_point_regex;
 	RC_STRINGLIST *mounts;
 	mount_type mount_type;
 	net_opts netdev;
-	const char *check_mntpath;
+	struct mount_tree *tree;
+	struct mount_table *table;
 };
 
 static int
@@ -316,22 +373,6 @@ find_mounts(struct args *args, size_t *num_mounts)
 
 #elif defined(__linux__) || (defined(__FreeBSD_kernel__) && \
 	defined(__GLIBC__)) || defined(__GNU__)
-static struct mntent *
-getmntfile(const char *file)
-{
-	struct mntent *ent = NULL;
-	FILE *fp;
-
-	if (!(fp = setmntent("/etc/fstab", "r")))
-		return NULL;
-	while ((ent = getmntent(fp)))
-		if (strcmp(file, ent->mnt_dir) == 0)
-			break;
-	endmntent(fp);
-
-	return ent;
-}
-
 static RC_STRINGLIST *
 find_mounts(struct args *args, size_t *num_mounts)
 {
@@ -343,7 +384,8 @@ find_mounts(struct args *args, size_t *num_mounts)
 	char *to;
 	char *fst;
 	char *opts;
-	struct mntent *ent;
+	struct fstab_cache *fstab;
+	const struct fstab_entry *ent;
 	int netdev;
 	RC_STRINGLIST *list;
 
@@ -351,6 +393,7 @@ find_mounts(struct args *args, size_t *num_mounts)
 		eerrorx("getmntinfo: %s", strerror(errno));
 
 	list = rc_stringlist_new();
+	fstab = fstab_cache_load();
 
 	buffer = NULL;
 	while (xgetline(&buffer, &size, fp) != -1) {
@@ -361,8 +404,8 @@ find_mounts(struct args *args, size_t *num_mounts)
 		fst = strsep(&p, " ");
 		opts = strsep(&p, " ");
 
-		if ((ent = getmntfile(to))) {
-			if (strstr(ent->mnt_opts, "_netdev"))
+		if ((ent = fstab_cache_find(fstab, to))) {
+			if (strstr(ent->mntopts, "_netdev"))
 				netdev = 0;
 			else
 				netdev = 1;
@@ -376,6 +419,7 @@ find_mounts(struct args *args, size_t *num_mounts)
 	}
 	free(buffer);
 	fclose(fp);
+	fstab_cache_free(fstab);
 
 	return list;
 }
@@ -384,14 +428,6 @@ find_mounts(struct args *args, size_t *num_mounts)
 #  error "Operating system not supported!"
 #endif
 
-static int is_prefix(const char *needle, const char *hay)
-{
-	size_t nlen = strlen(needle);
-	if (strncmp(needle, hay, nlen) == 0 && hay[nlen] == '/')
-		return true;
-	return false;
-}
-
 static char *unescape_octal(char *beg)
 {
 	int n, i;
@@ -419,20 +455,221 @@ static char *unescape_octal(char *beg)
 	return beg;
 }
 
-static int check_is_mounted(RC_STRINGLIST *list RC_UNUSED, struct args *args,
+static uint32_t
+path_hash(const char *path, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	while (len--) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static struct mount_node *
+mount_node_find(const struct mount_tree *tree, const char *path, size_t len)
+{
+	struct mount_node *node;
+
+	node = tree->slots[path_hash(path, len) & (tree->nslots - 1)];
+	for (; node; node = node->hash_next)
+		if (node->len == len && memcmp(node->path, path, len) == 0)
+			return node;
+	return NULL;
+}
+
+/* Find the node for path, adding it and any parents we lack. */
+static struct mount_node *
+mount_node_get(struct mount_tree *tree, const char *path, size_t len)
+{
+	struct mount_node *node;
+	size_t slot, plen;
+
+	if ((node = mount_node_find(tree, path, len)))
+		return node;
+
+	node = xmalloc(sizeof(*node));
+	memset(node, 0, sizeof(*node));
+	node->path = xmalloc(len + 1);
+	memcpy(node->path, path, len);
+	node->path[len] = '\0';
+	node->len = len;
+	slot = path_hash(path, len) & (tree->nslots - 1);
+	node->hash_next = tree->slots[slot];
+	tree->slots[slot] = node;
+	if ((tree->count & (tree->count - 1)) == 0)
+		tree->nodes = xrealloc(tree->nodes,
+		    (tree->count ? tree->count * 2 : 1) * sizeof(*tree->nodes));
+	tree->nodes[tree->count++] = node;
+
+	/* the parent is everything before the last slash */
+	if (len > 1 && path[0] == '/') {
+		for (plen = len - 1; plen > 0 && path[plen] != '/'; plen--)
+			;
+		node->parent = mount_node_get(tree, path, plen ? plen : 1);
+	}
+	return node;
+}
+
+static void
+mount_tree_init(struct mount_tree *tree, const char **mounts, size_t num_mounts)
+{
+	struct mount_node *node, *p;
+	size_t i;
+
+	memset(tree, 0, sizeof(*tree));
+	for (tree->nslots = 64; tree->nslots < num_mounts * 4; tree->nslots <<= 1)
+		;
+	tree->slots = xmalloc(tree->nslots * sizeof(*tree->slots));
+	memset(tree->slots, 0, tree->nslots * sizeof(*tree->slots));
+
+	for (i = 0; i < num_mounts; i++) {
+		node = mount_node_get(tree, mounts[i], strlen(mounts[i]));
+		node->queued++;
+		for (p = node->parent; p; p = p->parent)
+			p->below++;
+	}
+	tree->queued = num_mounts;
+
+	tree->ready = xmalloc((tree->count ? tree->count : 1) * sizeof(*tree->ready));
+	for (i = 0; i < tree->count; i++)
+		if (tree->nodes[i]->queued && tree->nodes[i]->below == 0)
+			tree->ready[tree->nready++] = tree->nodes[i];
+	tree->stale = true;
+}
+
+static void
+mount_tree_free(struct mount_tree *tree)
+{
+	for (size_t i = 0; i < tree->count; i++) {
+		free(tree->nodes[i]->path);
+		free(tree->nodes[i]);
+	}
+	free(tree->nodes);
+	free(tree->slots);
+	free(tree->ready);
+#ifdef __linux__
+	if (tree->mountinfo)
+		fclose(tree->mountinfo);
+#endif
+}
+
+/* n unmounts of node are over, so its parents may be ready now. */
+static void
+mount_node_done(struct mount_tree *tree, struct mount_node *node, size_t n)
+{
+	struct mount_node *p;
+
+	for (p = node->parent; p; p = p->parent) {
+		p->below -= n;
+		if (p->below == 0 && p->queued && !p->running)
+			tree->ready[tree->nready++] = p;
+	}
+}
+
+/* The unmount of a running node is over, one way or another. */
+static void
+mount_node_finish(struct mount_tree *tree, struct mount_node *node)
+{
+	node->running = false;
+	if (node->queued)
+		tree->ready[tree->nready++] = node;
+	mount_node_done(tree, node, 1);
+}
+
+static int mark_mounted(RC_STRINGLIST *list RC_UNUSED, struct args *args,
     char *from RC_UNUSED, char *to, char *fstype RC_UNUSED,
     char *options RC_UNUSED, int netdev RC_UNUSED)
 {
-	return strcmp(args->check_mntpath, unescape_octal(to)) == 0 ? 0 : -1;
+	struct mount_node *node;
+
+	unescape_octal(to);
+	if ((node = mount_node_find(args->tree, to, strlen(to))))
+		node->mounted++;
+	return -1;
 }
 
-static int is_mounted(const char *mntpath)
+#ifdef __linux__
+/* The kernel flags mountinfo with POLLPRI whenever the table changes,
+ * so we only read it again when it has. */
+static bool
+mount_table_changed(struct mount_tree *tree)
+{
+	struct pollfd pfd;
+
+	if (!tree->mountinfo)
+		return true;
+	pfd.fd = fileno(tree->mountinfo);
+	pfd.events = POLLPRI;
+	return poll(&pfd, 1, 0) > 0 && pfd.revents & (POLLPRI | POLLERR);
+}
+
+static void
+mount_table_read(struct mount_tree *tree)
+{
+	struct args args = { .tree = tree };
+	char *buffer = NULL, *p, *to;
+	size_t size = 0;
+	int i;
+
+	if (!tree->mountinfo) {
+		if (!(tree->mountinfo = fopen("/proc/self/mountinfo", "re")))
+			eerrorx("%s: /proc/self/mountinfo: %s", applet, strerror(errno));
+	} else
+		rewind(tree->mountinfo);
+
+	for (size_t n = 0; n < tree->count; n++)
+		tree->nodes[n]->mounted = 0;
+	while (xgetline(&buffer, &size, tree->mountinfo) != -1) {
+		/* id parent major:minor root mountpoint ... */
+		p = buffer;
+		for (i = 0, to = NULL; i < 5 && p; i++)
+			to = strsep(&p, " ");
+		if (to)
+			mark_mounted(NULL, &args, NULL, to, NULL, NULL, 0);
+	}
+	free(buffer);
+}
+#else
+static bool
+mount_table_changed(struct mount_tree *tree RC_UNUSED)
+{
+	return true;
+}
+
+static void
+mount_table_read(struct mount_tree *tree)
 {
 	size_t num_mounts = 0;
-	struct args args = { .process = check_is_mounted, .check_mntpath = mntpath };
-	RC_STRINGLIST *l = find_mounts(&args, &num_mounts);
-	rc_stringlist_free(l);
-	return num_mounts > 0;
+	struct args args = { .process = mark_mounted, .tree = tree };
+
+	for (size_t n = 0; n < tree->count; n++)
+		tree->nodes[n]->mounted = 0;
+	rc_stringlist_free(find_mounts(&args, &num_mounts));
+}
+#endif
+
+/* Whether node is still mounted. Unless we must know for sure, the table
+ * is read again at most every REREAD_DELAY_MS, as while we unmount a lot
+ * it changes all the time. Being out of date only costs us a umount which
+ * fails, after which we look again. */
+static bool
+is_mounted(struct mount_tree *tree, struct mount_node *node, bool sure)
+{
+	int64_t now;
+
+	if (!tree->stale)
+		tree->stale = mount_table_changed(tree);
+	if (tree->stale) {
+		now = tm_now();
+		if (sure || now - tree->read_time >= REREAD_DELAY_MS) {
+			mount_table_read(tree);
+			tree->stale = false;
+			tree->read_time = now;
+		}
+	}
+	return node->mounted > 0;
 }
 
 static pid_t run_umount(const char *mntpath,
@@ -552,28 +789,262 @@ get_regex(const char *string)
 	if ((result = regcomp(reg, string, REG_EXTENDED | REG_NOSUB)) != 0)
 	{
 		regerror(result, reg, buffer, sizeof(buffer));
-		eerrorx("%s: invalid regex `%s'", applet, buffer);
+		eerror("%s: invalid regex `%s'", applet, buffer);
+		free(reg);
+		return NULL;
 	}
 
 	return reg;
 }
 
+static void
+free_regex(regex_t **reg)
+{
+	if (*reg) {
+		regfree(*reg);
+		free(*reg);
+		*reg = NULL;
+	}
+}
+
+static int
+set_regex(regex_t **reg, const char *string)
+{
+	free_regex(reg);
+	return (*reg = get_regex(string)) ? 1 : -1;
+}
+
+/* Apply an option which picks or prints mounts.
+ * Returns 0 if opt is not one of them and -1 if its argument is bad. */
+static int
+parse_filter(struct args *args, int opt, const char *arg)
+{
+	switch (opt) {
+	case 'e':
+		args->netdev = net_yes;
+		break;
+	case 'E':
+		args->netdev = net_no;
+		break;
+	case 'f':
+		return set_regex(&args->fstype_regex, arg);
+	case 'F':
+		return set_regex(&args->skip_fstype_regex, arg);
+	case 'n':
+		return set_regex(&args->node_regex, arg);
+	case 'N':
+		return set_regex(&args->skip_node_regex, arg);
+	case 'o':
+		return set_regex(&args->options_regex, arg);
+	case 'O':
+		return set_regex(&args->skip_options_regex, arg);
+	case 'p':
+		return set_regex(&args->point_regex, arg);
+	case 'P':
+		return set_regex(&args->skip_point_regex, arg);
+	case 'i':
+		args->mount_type = mount_options;
+		break;
+	case 's':
+		args->mount_type = mount_fstype;
+		break;
+	case 't':
+		args->mount_type = mount_from;
+		break;
+	default:
+		return 0;
+	}
+	return 1;
+}
+
+static bool
+add_mount_point(struct args *args, const char *path)
+{
+	char *real_path;
+
+	if (path[0] != '/') {
+		eerror("%s: `%s' is not a mount point", applet, path);
+		return false;
+	}
+	real_path = realpath(path, NULL);
+	rc_stringlist_add(args->mounts, real_path ? real_path : path);
+	free(real_path);
+	return true;
+}
+
+static void
+free_filters(struct args *args)
+{
+	free_regex(&args->fstype_regex);
+	free_regex(&args->skip_fstype_regex);
+	free_regex(&args->node_regex);
+	free_regex(&args->skip_node_regex);
+	free_regex(&args->options_regex);
+	free_regex(&args->skip_options_regex);
+	free_regex(&args->point_regex);
+	free_regex(&args->skip_point_regex);
+}
+
+static bool
+point_matches(const struct args *args, const char *value)
+{
+	if (args->point_regex &&
+	    regexec(args->point_regex, value, 0, NULL, 0) != 0)
+		return false;
+	if (args->skip_point_regex &&
+	    regexec(args->skip_point_regex, value, 0, NULL, 0) == 0)
+		return false;
+	return true;
+}
+
+static int collect_mount(RC_STRINGLIST *list RC_UNUSED, struct args *args,
+    char *from, char *to, char *fstype, char *options, int netdev)
+{
+	struct mount_table *table = args->table;
+	struct mount_entry *ent;
+
+	if ((table->count & (table->count - 1)) == 0)
+		table->entries = xrealloc(table->entries,
+		    (table->count ? table->count * 2 : 1) * sizeof(*table->entries));
+	ent = &table->entries[table->count++];
+	ent->from = xstrdup(from);
+	ent->to = xstrdup(to);
+	ent->fstype = xstrdup(fstype);
+	ent->options = xstrdup(options);
+	ent->netdev = netdev;
+	return -1;
+}
+
+/*
+ * Undo the \ooo octal escapes fstab uses, in place, so a word may hold
+ * white space or a backslash as \040, \011, \012 or \134. Unlike
+ * unescape_octal, any other backslash is kept, as regexes need them.
+ */
+static void
+unescape_word(char *word)
+{
+	char *in, *out;
+
+	for (in = out = word; *in; out++) {
+		if (in[0] == '\\' &&
+		    in[1] >= '0' && in[1] <= '3' &&
+		    in[2] >= '0' && in[2] <= '7' &&
+		    in[3] >= '0' && in[3] <= '7') {
+			*out = (char) ((in[1] - '0') << 6 | (in[2] - '0') << 3 |
+			    (in[3] - '0'));
+			in += 4;
+		} else
+			*out = *in++;
+	}
+	*out = '\0';
+}
+
+/*
+ * Read the mount table and fstab once, then answer each line of stdin as
+ * if it were the arguments of a separate mountinfo. Words are split on
+ * white space, and may hold it escaped as fstab does. Each answer is a
+ * line with the exit status followed by what would have been printed,
+ * space separated.
+ */
+static int
+run_batch(void)
+{
+	struct mount_table table = { NULL, 0 };
+	struct args args;
+	RC_STRINGLIST *nodes;
+	RC_STRING *s;
+	char *line = NULL, *p, *word;
+	char **qargv = NULL;
+	size_t size = 0, num_mounts = 0;
+	int qargc, opt, result;
+	bool quiet, failed;
+
+	memset(&args, 0, sizeof(args));
+	args.process = collect_mount;
+	args.table = &table;
+	args.mounts = rc_stringlist_new();
+	rc_stringlist_free(find_mounts(&args, &num_mounts));
+	rc_stringlist_free(args.mounts);
+
+	while (xgetline(&line, &size, stdin) != -1) {
+		qargv = xrealloc(qargv, (strlen(line) / 2 + 3) * sizeof(*qargv));
+		qargc = 0;
+		qargv[qargc++] = UNCONST(applet);
+		for (p = line; (word = strsep(&p, " \t\n"));)
+			if (*word) {
+				unescape_word(word);
+				qargv[qargc++] = word;
+			}
+		qargv[qargc] = NULL;
+
+		memset(&args, 0, sizeof(args));
+		args.mount_type = mount_to;
+		args.netdev = net_ignore;
+		args.mounts = rc_stringlist_new();
+		quiet = failed = false;
+		/* optind of 0 starts getopt afresh on glibc, musl and the BSDs */
+		optind = 0;
+		while ((opt = getopt_long(qargc, qargv, batch_getoptstring,
+			    longopts, (int *) 0)) != -1)
+		{
+			if (opt == 'q')
+				quiet = true;
+			else if (parse_filter(&args, opt, optarg) <= 0)
+				failed = true;
+		}
+		for (; optind < qargc; optind++)
+			if (!add_mount_point(&args, qargv[optind]))
+				failed = true;
+
+		result = EXIT_FAILURE;
+		nodes = rc_stringlist_new();
+		if (!failed) {
+			for (size_t i = 0; i < table.count; i++)
+				process_mount(nodes, &args, table.entries[i].from,
+				    table.entries[i].to, table.entries[i].fstype,
+				    table.entries[i].options, table.entries[i].netdev);
+			TAILQ_FOREACH(s, nodes, entries)
+				if (point_matches(&args, s->value))
+					result = EXIT_SUCCESS;
+		}
+		printf("%d", result);
+		if (result == EXIT_SUCCESS && !quiet)
+			TAILQ_FOREACH_REVERSE(s, nodes, rc_stringlist, entries)
+				if (point_matches(&args, s->value))
+					printf(" %s", s->value);
+		printf("\n");
+		fflush(stdout);
+
+		rc_stringlist_free(nodes);
+		rc_stringlist_free(args.mounts);
+		free_filters(&args);
+	}
+
+	for (size_t i = 0; i < table.count; i++) {
+		free(table.entries[i].from);
+		free(table.entries[i].to);
+		free(table.entries[i].fstype);
+		free(table.entries[i].options);
+	}
+	free(table.entries);
+	free(qargv);
+	free(line);
+	return EXIT_SUCCESS;
+}
+
 int main(int argc, char **argv)
 {
 	struct args args;
-	regex_t *point_regex = NULL;
-	regex_t *skip_point_regex = NULL;
 	RC_STRINGLIST *nodes;
 	RC_STRING *s;
-	char *real_path = NULL;
 	int opt;
 	int result;
-	char *this_path, *argv0;
+	char *argv0;
 	const char *tmps;
 	const char *fuser_opt, *fuser_kill_prefix;
 	size_t num_mounts = 0;
-	size_t unmount_index;
 	int doing_unmount = 0;
+	bool batch = false;
 	pid_t pid;
 	int status, flags;
 	int64_t tmp, next_retry, now;
@@ -583,15 +1054,11 @@ int main(int argc, char **argv)
 	const char **mounts = NULL;
 	struct run_queue running[RUN_MAX] = {0};
 	struct run_queue *rp;
+	struct mount_tree tree;
+	struct mount_node *node;
 	size_t num_running = 0, num_waiting = 0;
 	enum { STATE_RUN, STATE_REAP, STATE_RETRY, STATE_END } state;
 
-#define DO_REG(_var)							      \
-	if (_var) free(_var);						      \
-	_var = get_regex(optarg);
-#define REG_FREE(_var)							      \
-	if (_var) { regfree(_var); free(_var); }
-
 	argv0 = argv[0];
 	applet = basename_c(argv[0]);
 	memset (&args, 0, sizeof(args));
@@ -636,63 +1103,30 @@ int main(int argc, char **argv)
 	while ((opt = getopt_long(argc, argv, getoptstring,
 		    longopts, (int *) 0)) != -1)
 	{
+		switch (parse_filter(&args, opt, optarg)) {
+		case 1:
+			continue;
+		case -1:
+			exit(EXIT_FAILURE);
+		}
 		switch (opt) {
-		case 'e':
-			args.netdev = net_yes;
-			break;
-		case 'E':
-			args.netdev = net_no;
-			break;
-		case 'f':
-			DO_REG(args.fstype_regex);
-			break;
-		case 'F':
-			DO_REG(args.skip_fstype_regex);
-			break;
-		case 'n':
-			DO_REG(args.node_regex);
-			break;
-		case 'N':
-			DO_REG(args.skip_node_regex);
-			break;
-		case 'o':
-			DO_REG(args.options_regex);
-			break;
-		case 'O':
-			DO_REG(args.skip_options_regex);
-			break;
-		case 'p':
-			DO_REG(point_regex);
-			break;
-		case 'P':
-			DO_REG(skip_point_regex);
-			break;
-		case 'i':
-			args.mount_type = mount_options;
-			break;
-		case 's':
-			args.mount_type = mount_fstype;
-			break;
-		case 't':
-			args.mount_type = mount_from;
+		case 'b':
+			batch = true;
 			break;
 
 		case_RC_COMMON_GETOPT
 		}
 	}
 
-	while (optind < argc) {
-		if (argv[optind][0] != '/')
-			eerrorx("%s: `%s' is not a mount point",
-			    argv[0], argv[optind]);
-		this_path = argv[optind++];
-		real_path = realpath(this_path, NULL);
-		if (real_path)
-			this_path = real_path;
-		rc_stringlist_add(args.mounts, this_path);
-		free(real_path);
-		real_path = NULL;
+	if (batch) {
+		rc_stringlist_free(args.mounts);
+		free_filters(&args);
+		return run_batch();
 	}
+
+	while (optind < argc)
+		if (!add_mount_point(&args, argv[optind++]))
+			exit(EXIT_FAILURE);
 	nodes = find_mounts(&args, &num_mounts);
 	rc_stringlist_free(args.mounts);
 
@@ -702,11 +1136,7 @@ int main(int argc, char **argv)
 	result = EXIT_FAILURE;
 	/* We should report the mounts in reverse order to ease unmounting */
 	TAILQ_FOREACH_REVERSE(s, nodes, rc_stringlist, entries) {
-		if (point_regex &&
-		    regexec(point_regex, s->value, 0, NULL, 0) != 0)
-			continue;
-		if (skip_point_regex &&
-		    regexec(skip_point_regex, s->value, 0, NULL, 0) == 0)
+		if (!point_matches(&args, s->value))
 			continue;
 		if (doing_unmount)
 			mounts[num_mounts++] = unescape_octal(s->value);
@@ -716,13 +1146,14 @@ int main(int argc, char **argv)
 	}
 	if (!doing_unmount)
 		goto exit;
+	mount_tree_init(&tree, mounts, num_mounts);
 
 	/* STATE_RUN:
 	 * can unmount => stays in STATE_RUN
 	 * cannot unmount (for any of the reasons below) => STATE_REAP
 	 *   (a) nothing left to unmount
 	 *   (b) running queue is full
-	 *   (c) conflicts with running queue
+	 *   (c) everything left has mounts beneath it still to go
 	 *
 	 * STATE_REAP:
 	 * successful reap => STATE_RUN
@@ -742,35 +1173,31 @@ int main(int argc, char **argv)
 	state = STATE_RUN;
 	while (state != STATE_END) switch (state) {
 	case STATE_RUN:
-		for (unmount_index = 0; unmount_index < num_mounts; ++unmount_index) {
-			const char *candidate = mounts[unmount_index];
-			int safe_to_unmount = 1;
-			for (size_t k = 0; safe_to_unmount && k < num_running; ++k)
-				safe_to_unmount = !is_prefix(candidate, running[k].mntpath);
-			for (size_t k = 0; safe_to_unmount && k < num_mounts; ++k)
-				safe_to_unmount = !is_prefix(candidate, mounts[k]);
-			if (!safe_to_unmount)
-				continue;
-			if (!is_mounted(candidate)) {
-				/* probably a shared mount and got unmounted, remove */
-				mounts[unmount_index--] = mounts[--num_mounts];
-			} else {
+		for (node = NULL; num_running < RUN_MAX && tree.nready > 0; node = NULL) {
+			node = tree.ready[--tree.nready];
+			if (is_mounted(&tree, node, false))
 				break;
-			}
+			/* probably a shared mount and got unmounted, remove */
+			tree.queued -= node->queued;
+			mount_node_done(&tree, node, node->queued);
+			node->queued = 0;
 		}
-		if (num_running == RUN_MAX || unmount_index >= num_mounts) {
+		if (!node) {
 			state = STATE_REAP;
 			break;
 		}
+		node->queued--;
+		node->running = true;
+		tree.queued--;
 		rp = running + num_running++;
-		rp->mntpath = mounts[unmount_index];
+		rp->node = node;
+		rp->mntpath = node->path;
 		rp->last_exec_time = tm_now();
 		rp->try_count = 0;
 		rp->pid = run_umount(rp->mntpath, umount_args, umount_args_num);
 		rp->fuser_pid = -1;
 		rp->fuser_stdoutfd = -1;
 		rp->fuser_exec_time = -1;
-		mounts[unmount_index] = mounts[--num_mounts];
 		break;
 	case STATE_REAP:
 		flags = (num_waiting > 0) ? WNOHANG : 0;
@@ -786,12 +1213,16 @@ int main(int argc, char **argv)
 		}
 		if (rp) {
 			if ((WIFEXITED(status) && WEXITSTATUS(status) == 0) ||
-			    !is_mounted(rp->mntpath)) {
+			    !is_mounted(&tree, rp->node, true)) {
 				einfo("Unmounted %s", rp->mntpath);
+				if (rp->node->mounted)
+					rp->node->mounted--;
+				mount_node_finish(&tree, rp->node);
 				*rp = running[--num_running];
 				state = STATE_RUN;
 			} else if (rp->try_count >= TRY_MAX) {
 				eerror("Failed to unmount %s", rp->mntpath);
+				mount_node_finish(&tree, rp->node);
 				*rp = running[--num_running];
 				result = EXIT_FAILURE;
 			} else { /* put into waiting queue */
@@ -820,7 +1251,7 @@ int main(int argc, char **argv)
 			}
 		}
 		if (!rp) {
-			state = (num_mounts > 0) ? STATE_RUN : STATE_END;
+			state = (tree.queued > 0) ? STATE_RUN : STATE_END;
 			break;
 		}
 		now = tm_now();
@@ -841,6 +1272,7 @@ int main(int argc, char **argv)
 				rp->fuser_pid = -1;
 			}
 			if (fuser_decide(rp, fuser_opt, fuser_kill_prefix) < 0) { /* abort */
+				mount_node_finish(&tree, rp->node);
 				*rp = running[--num_running];
 				result = EXIT_FAILURE;
 			} else { /* retry */
@@ -854,18 +1286,12 @@ int main(int argc, char **argv)
 		break;
 	default: break;
 	}
+	mount_tree_free(&tree);
 
 exit:
 	free(mounts);
 	rc_stringlist_free(nodes);
-	REG_FREE(args.fstype_regex);
-	REG_FREE(args.skip_fstype_regex);
-	REG_FREE(args.node_regex);
-	REG_FREE(args.skip_node_regex);
-	REG_FREE(args.options_regex);
-	REG_FREE(args.skip_options_regex);
-	REG_FREE(point_regex);
-	REG_FREE(skip_point_regex);
+	free_filters(&args);
 
 	return result;
 }
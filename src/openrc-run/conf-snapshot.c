@@ -0,0 +1,398 @@
+/*
+ * conf-snapshot.c
+ * Copies the configuration of a service into one file for the shell.
+ */
+
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rc.h"
+#include "helpers.h"
+#include "conf-snapshot.h"
+
+/*
+ * A snapshot is a header of shell comments, one line for the identity of
+ * each file copied and an empty one to end it, followed by a copy of each file in the order the shell
+ * would source them. After each copy comes the check sourcex would make on
+ * loading it, so a snapshot fails just as the files themselves would.
+ */
+#define SNAPSHOT_DIR	"confcache"
+#define SNAPSHOT_MAGIC	"# openrc conf snapshot 1\n"
+
+struct conf_files {
+	char **paths;
+	struct stat *st;
+	size_t count;
+	bool usable;	/* false if only the shell can get this right */
+};
+
+/* Add path if it exists, as sourcex -e would. */
+static bool
+conf_add(struct conf_files *files, const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == -1)
+		return false;
+	/* sourcing it would fail, so leave the error to the shell */
+	if (!S_ISREG(st.st_mode))
+		files->usable = false;
+	files->paths = xrealloc(files->paths,
+	    (files->count + 1) * sizeof(*files->paths));
+	files->st = xrealloc(files->st, (files->count + 1) * sizeof(*files->st));
+	files->paths[files->count] = xstrdup(path);
+	files->st[files->count] = st;
+	files->count++;
+	return true;
+}
+
+static int
+name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* The *.conf files in rc.conf.d, in the order the shell globs them */
+static void
+conf_add_dir(struct conf_files *files, const char *dir)
+{
+	char *path, **names = NULL;
+	size_t count = 0;
+	struct dirent *d;
+	DIR *dp;
+
+	xasprintf(&path, "%s/rc.conf.d", dir);
+	dp = opendir(path);
+	free(path);
+	if (!dp)
+		return;
+	while ((d = readdir(dp))) {
+		if (fnmatch("*.conf", d->d_name, FNM_PERIOD) != 0)
+			continue;
+		names = xrealloc(names, (count + 1) * sizeof(*names));
+		names[count++] = xstrdup(d->d_name);
+	}
+	closedir(dp);
+
+	qsort(names, count, sizeof(*names), name_cmp);
+	for (size_t i = 0; i < count; i++) {
+		xasprintf(&path, "%s/rc.conf.d/%s", dir, names[i]);
+		conf_add(files, path);
+		free(path);
+		free(names[i]);
+	}
+	free(names);
+}
+
+/*
+ * Find the files openrc-run.sh would source, in the same order: rc.conf
+ * and rc.conf.d from each directory in RC_PATH, then the conf.d files of
+ * the service, with those of a base service such as net first.
+ */
+static void
+conf_find(struct conf_files *files, const char *service)
+{
+	const char *rc_path = getenv("RC_PATH");
+	const char *runlevel = getenv("RC_RUNLEVEL");
+	char *buf, *entry, *p, *path, *base;
+	char **dirs = NULL;
+	const char *names[2];
+	size_t ndirs = 0, nnames = 0;
+
+	if (!rc_path)
+		return;
+	buf = xstrdup(rc_path);
+	for (p = buf; (entry = strsep(&p, ":"));) {
+		if (!*entry)
+			continue;
+		/* the shell would split or expand these */
+		if (strpbrk(entry, " \t\n*?["))
+			files->usable = false;
+		dirs = xrealloc(dirs, (ndirs + 1) * sizeof(*dirs));
+		dirs[ndirs++] = entry;
+	}
+
+	/* later directories are overridden by earlier ones */
+	for (size_t i = ndirs; i-- > 0;) {
+		xasprintf(&path, "%s/rc.conf", dirs[i]);
+		conf_add(files, path);
+		free(path);
+		conf_add_dir(files, dirs[i]);
+	}
+
+	base = xstrdup(service);
+	base[strcspn(base, ".")] = '\0';
+	names[nnames++] = base;
+	if (strcmp(base, service) != 0)
+		names[nnames++] = service;
+	for (size_t n = 0; n < nnames; n++) {
+		for (size_t i = ndirs; i-- > 0;) {
+			xasprintf(&path, "%s/conf.d/%s.%s", dirs[i], names[n],
+			    runlevel ? runlevel : "");
+			if (!conf_add(files, path)) {
+				free(path);
+				xasprintf(&path, "%s/conf.d/%s", dirs[i], names[n]);
+				conf_add(files, path);
+			}
+			free(path);
+		}
+	}
+
+	free(base);
+	free(dirs);
+	free(buf);
+}
+
+static void
+conf_files_free(struct conf_files *files)
+{
+	for (size_t i = 0; i < files->count; i++)
+		free(files->paths[i]);
+	free(files->paths);
+	free(files->st);
+}
+
+/* The path as a single quoted shell word */
+static void
+put_quoted(FILE *fp, const char *str)
+{
+	fputc('\'', fp);
+	for (; *str; str++) {
+		if (*str == '\'')
+			fputs("'\\''", fp);
+		else
+			fputc(*str, fp);
+	}
+	fputc('\'', fp);
+}
+
+/*
+ * A return at the top level of a sourced file ends only that file, but
+ * in a snapshot it would end all of them. Rather than parse the shell,
+ * leave any file with the word in it to the shell.
+ */
+static bool
+has_return(const char *buf)
+{
+	const char *p;
+
+	for (p = buf; (p = strstr(p, "return")); p += 6) {
+		if ((p == buf || !(isalnum((unsigned char)p[-1]) || p[-1] == '_')) &&
+		    !(isalnum((unsigned char)p[6]) || p[6] == '_'))
+			return true;
+	}
+	return false;
+}
+
+static bool
+put_file(FILE *fp, const char *path)
+{
+	char *buf = NULL;
+	size_t len;
+
+	if (!rc_getfile(path, &buf, &len))
+		return false;
+	/* shells differ on NUL bytes, so leave those to the shell too */
+	if (strlen(buf) != --len || has_return(buf)) {
+		free(buf);
+		return false;
+	}
+	/* an empty file sources fine, so start from a true status */
+	fputs(":\n", fp);
+	fwrite(buf, 1, len, fp);
+	if (len && buf[len - 1] != '\n')
+		fputc('\n', fp);
+	free(buf);
+	fputs("[ $? -eq 0 ] || { eerror \"$RC_SVCNAME: error loading \"", fp);
+	put_quoted(fp, path);
+	fputs("; exit 1; }\n", fp);
+	return true;
+}
+
+/* Check the snapshot was made from the files as they are now. */
+static bool
+snapshot_current(int dirfd, const char *name, const char *key, size_t keylen)
+{
+	char *buf;
+	ssize_t len;
+	bool current;
+	int fd;
+
+	if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	buf = xmalloc(keylen);
+	len = read(fd, buf, keylen);
+	close(fd);
+	current = len == (ssize_t)keylen && memcmp(buf, key, keylen) == 0;
+	free(buf);
+	return current;
+}
+
+static bool
+snapshot_write(int dirfd, const char *name, const struct conf_files *files,
+		const char *key, size_t keylen)
+{
+	char *data = NULL, *tmp;
+	size_t size = 0;
+	mode_t mode = 0644;
+	ssize_t len;
+	const char *p;
+	bool ok = true;
+	FILE *fp;
+	int fd;
+
+	fp = xopen_memstream(&data, &size);
+	fwrite(key, 1, keylen, fp);
+	for (size_t i = 0; i < files->count && ok; i++) {
+		ok = put_file(fp, files->paths[i]);
+		/* secrets in a conf.d file are only for those who could read it */
+		if (!(files->st[i].st_mode & S_IROTH))
+			mode = 0600;
+	}
+	xclose_memstream(fp);
+	if (!ok) {
+		free(data);
+		return false;
+	}
+
+	xasprintf(&tmp, "%s.%d", name, (int)getpid());
+	fd = openat(dirfd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+	if (fd == -1) {
+		free(tmp);
+		free(data);
+		return false;
+	}
+	for (p = data; size > 0; p += len, size -= (size_t)len) {
+		if ((len = write(fd, p, size)) == -1) {
+			if (errno == EINTR) {
+				len = 0;
+				continue;
+			}
+			break;
+		}
+	}
+	free(data);
+
+	if (close(fd) != 0 || size > 0 ||
+	    renameat(dirfd, tmp, dirfd, name) != 0) {
+		unlinkat(dirfd, tmp, 0);
+		ok = false;
+	}
+	free(tmp);
+	return ok;
+}
+
+char *
+conf_snapshot(const char *service)
+{
+	struct conf_files files = { NULL, NULL, 0, true };
+	char *key = NULL, *path = NULL;
+	size_t keylen = 0;
+	int svcfd, dirfd;
+	FILE *fp;
+
+	conf_find(&files, service);
+	if (!files.usable || files.count == 0)
+		goto out;
+
+	fp = xopen_memstream(&key, &keylen);
+	fputs(SNAPSHOT_MAGIC, fp);
+	for (size_t i = 0; i < files.count; i++)
+		fprintf(fp, "# %ju %ju %jd %jd.%09ld %s\n",
+		    (uintmax_t)files.st[i].st_dev,
+		    (uintmax_t)files.st[i].st_ino,
+		    (intmax_t)files.st[i].st_size,
+		    (intmax_t)files.st[i].st_mtim.tv_sec,
+		    (long)files.st[i].st_mtim.tv_nsec,
+		    files.paths[i]);
+	fputs("#\n", fp);
+	xclose_memstream(fp);
+
+	if ((svcfd = rc_dirfd(RC_DIR_SVCDIR)) == -1)
+		goto out;
+	if (mkdirat(svcfd, SNAPSHOT_DIR, 0755) == -1 && errno != EEXIST)
+		goto out;
+	if ((dirfd = openat(svcfd, SNAPSHOT_DIR,
+	    O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+		goto out;
+	if (snapshot_current(dirfd, service, key, keylen) ||
+	    snapshot_write(dirfd, service, &files, key, keylen))
+		xasprintf(&path, "%s/%s/%s", rc_svcdir(), SNAPSHOT_DIR, service);
+	close(dirfd);
+
+out:
+	free(key);
+	conf_files_free(&files);
+	return path;
+}
+
+/*
+ * gendepends sources rc.conf and rc.conf.d from RC_SYSCONFDIR only, and
+ * the plain conf.d files next to each init script, but knows nothing of
+ * runlevels or of the other directories in RC_PATH.
+ */
+static bool
+conf_seen_by_depend(const char *path, const char *service)
+{
+	const char *names[] = { service, NULL };
+	char *base, *suffix, *script;
+	size_t len = strlen(path), slen;
+	bool seen = false, conf_d = false;
+
+	base = xstrdup(service);
+	base[strcspn(base, ".")] = '\0';
+	names[1] = base;
+	for (size_t n = 0; n < 2 && !conf_d; n++) {
+		xasprintf(&suffix, "/conf.d/%s", names[n]);
+		slen = strlen(suffix);
+		if (len > slen && strcmp(path + len - slen, suffix) == 0) {
+			conf_d = true;
+			xasprintf(&script, "%.*s/init.d/%s", (int)(len - slen),
+			    path, service);
+			seen = access(script, F_OK) == 0;
+			free(script);
+		}
+		free(suffix);
+	}
+	free(base);
+	if (conf_d)
+		return seen;
+	return strcmp(path, RC_CONF) == 0 ||
+	    strncmp(path, RC_CONF_D "/", strlen(RC_CONF_D "/")) == 0;
+}
+
+bool
+conf_in_deptree(const char *service)
+{
+	struct conf_files files = { NULL, NULL, 0, true };
+	bool seen;
+
+	conf_find(&files, service);
+	seen = files.usable;
+	for (size_t i = 0; i < files.count && seen; i++)
+		seen = conf_seen_by_depend(files.paths[i], service);
+	conf_files_free(&files);
+	return seen;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef __RC_CONF_SNAPSHOT_H
+#define __RC_CONF_SNAPSHOT_H
+
+#include <stdbool.h>
+
+/*
+ * The rc.conf, rc.conf.d and conf.d files openrc-run.sh would source for
+ * a service, copied into one file in the service directory so the shell
+ * only has to source that. The copy records the identity of each file it
+ * was made from and is made again when any of them change.
+ * Returns the file to source, or NULL if the shell should find the files
+ * itself.
+ */
+char *conf_snapshot(const char *service);
+
+/*
+ * Check that all the configuration the shell would load for a service was
+ * also loaded by gendepends, so what the deptree says about the service
+ * still holds.
+ */
+bool conf_in_deptree(const char *service);
+
+#endif
@@ -47,12 +47,18 @@
 #  include <libutil.h>
 #endif
 
+#ifdef __linux__
+#  include <sys/inotify.h>
+#endif
+
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
 #include "rc_exec.h"
 #include "misc.h"
+#include "conf-snapshot.h"
 #include "timeutils.h"
+#include "timings.h"
 #include "plugin.h"
 #include "selinux.h"
 #include "_usage.h"
@@ -98,6 +104,9 @@ static bool in_background, deps, dry_run;
 static volatile bool sighup, skip_mark, timedout;
 static pid_t service_pid;
 static int signal_pipe[2] = { -1, -1 };
+static char *prefix_buf;			/* prefixed output not written yet */
+static size_t prefix_len, prefix_size;
+static int prefix_lock = -2;			/* -2 until opened */
 
 static RC_STRINGLIST *deptypes_b;	/* broken deps */
 static RC_STRINGLIST *deptypes_n;	/* needed deps */
@@ -255,6 +264,9 @@ cleanup(void)
 	rc_stringlist_free(tmplist);
 	free(ibsave);
 	free(prefix);
+	free(prefix_buf);
+	if (prefix_lock >= 0)
+		close(prefix_lock);
 	free(runlevel);
 	free(service);
 }
@@ -276,67 +288,131 @@ svc_getenv(const char *svc)
 	rc_stringlist_free(reexports);
 }
 
-/* Buffer and lock all output messages so that we get readable content */
-/* FIXME: Use a dynamic lock file that contains the tty/pts as well.
- * For example openrc-pts8.lock or openrc-tty1.lock.
- * Using a static lock file makes no sense, esp. in multi-user environments.
- * Why don't we use (f)printf, as it is thread-safe through POSIX already?
- * Bug: 360013
- */
+/* Prefixed output is assembled into whole lines, which are written with a
+ * single write under a lock on the terminal we write to, so services
+ * started in parallel don't interleave within a line.
+ * A partial line is held back until its newline arrives or the service
+ * has been quiet for PREFIX_FLUSH_MS, unless it has grown past BUFSIZ or
+ * holds the carriage return a progress meter redraws its line with. */
+#define PREFIX_FLUSH_MS	100
+
 static int
-write_prefix(const char *buffer, size_t bytes, bool *prefixed)
+open_prefix_lock(void)
 {
-	size_t i, j;
-	const char *ec = ecolor(ECOLOR_HILITE);
-	const char *ec_normal = ecolor(ECOLOR_NORMAL);
-	ssize_t ret = 0;
-	int fd = fileno(stdout), lock_fd = -1;
+	const char *tty = ttyname(fileno(stdout));
+	char *name, *p;
+	int fd;
 
-	/*
-	 * Lock the prefix.
-	 * open() may fail here when running as user, as RC_SVCDIR may not be writable.
-	 */
-	lock_fd = openat(rc_dirfd(RC_DIR_SVCDIR), "prefix.lock", O_WRONLY | O_CREAT, 0664);
+	/* One lock per terminal, ie prefix-pts-8.lock or prefix-tty1.lock */
+	if (tty && strncmp(tty, "/dev/", 5) == 0) {
+		xasprintf(&name, "prefix-%s.lock", tty + 5);
+		for (p = name; *p; p++)
+			if (*p == '/')
+				*p = '-';
+	} else
+		name = xstrdup("prefix.lock");
+
+	/* open() may fail here when running as user, as RC_SVCDIR may not be writable. */
+	fd = openat(rc_dirfd(RC_DIR_SVCDIR), name, O_WRONLY | O_CREAT | O_CLOEXEC, 0664);
+	if (fd == -1)
+		ewarnv("Couldn't open the prefix lock, please make sure you have enough permissions");
+	free(name);
+	return fd;
+}
+
+static void
+append_prefix(const char *buffer, size_t bytes)
+{
+	if (prefix_len + bytes > prefix_size) {
+		prefix_size = (prefix_len + bytes) * 2;
+		prefix_buf = xrealloc(prefix_buf, prefix_size);
+	}
+	memcpy(prefix_buf + prefix_len, buffer, bytes);
+	prefix_len += bytes;
+}
+
+/* Write out the first bytes of the assembled output */
+static void
+flush_prefix(size_t bytes)
+{
+	int fd = fileno(stdout);
+	const char *p = prefix_buf;
+	size_t left = bytes;
+	ssize_t ret;
 
-	if (lock_fd != -1) {
-		while (flock(lock_fd, LOCK_EX) != 0) {
+	if (bytes == 0)
+		return;
+
+	if (prefix_lock == -2)
+		prefix_lock = open_prefix_lock();
+	if (prefix_lock != -1) {
+		while (flock(prefix_lock, LOCK_EX) != 0) {
 			if (errno != EINTR) {
 				ewarnv("flock() failed: %s", strerror(errno));
 				break;
 			}
 		}
 	}
-	else
-		ewarnv("Couldn't open the prefix lock, please make sure you have enough permissions");
 
-	for (i = 0; i < bytes; i++) {
-		/* We don't prefix eend calls (cursor up) */
-		if (buffer[i] == '\033' && !*prefixed) {
-			for (j = i + 1; j < bytes; j++) {
-				if (buffer[j] == 'A')
-					*prefixed = true;
-				if (isalpha((unsigned int)buffer[j]))
-					break;
-			}
+	while (left > 0) {
+		if ((ret = write(fd, p, left)) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
 		}
+		p += ret;
+		left -= (size_t)ret;
+	}
+
+	if (prefix_lock != -1)
+		flock(prefix_lock, LOCK_UN);
 
+	memmove(prefix_buf, prefix_buf + bytes, prefix_len - bytes);
+	prefix_len -= bytes;
+}
+
+static void
+write_prefix(const char *buffer, size_t bytes, bool *prefixed)
+{
+	const char *ec = ecolor(ECOLOR_HILITE);
+	const char *ec_normal = ecolor(ECOLOR_NORMAL);
+	size_t i, j, end, lines = 0;
+	const char *nl;
+
+	for (i = 0; i < bytes; i = end) {
 		if (!*prefixed) {
-			ret += write(fd, ec, strlen(ec));
-			ret += write(fd, prefix, strlen(prefix));
-			ret += write(fd, ec_normal, strlen(ec_normal));
-			ret += write(fd, "|", 1);
-			*prefixed = true;
+			/* We don't prefix eend calls (cursor up) */
+			if (buffer[i] == '\033') {
+				for (j = i + 1; j < bytes; j++) {
+					if (buffer[j] == 'A')
+						*prefixed = true;
+					if (isalpha((unsigned int)buffer[j]))
+						break;
+				}
+			}
+
+			if (!*prefixed) {
+				append_prefix(ec, strlen(ec));
+				append_prefix(prefix, strlen(prefix));
+				append_prefix(ec_normal, strlen(ec_normal));
+				append_prefix("|", 1);
+				*prefixed = true;
+			}
 		}
 
-		if (buffer[i] == '\n')
+		nl = memchr(buffer + i, '\n', bytes - i);
+		end = nl ? (size_t)(nl - buffer) + 1 : bytes;
+		append_prefix(buffer + i, end - i);
+		if (nl) {
 			*prefixed = false;
-		ret += write(fd, buffer + i, 1);
+			lines = prefix_len;
+		}
 	}
 
-	/* Release the lock */
-	close(lock_fd);
-
-	return ret;
+	if (lines < prefix_len && (prefix_len - lines >= BUFSIZ ||
+	    memchr(prefix_buf + lines, '\r', prefix_len - lines)))
+		lines = prefix_len;
+	flush_prefix(lines);
 }
 
 static int
@@ -349,10 +425,13 @@ svc_exec(const char *command)
 	int flags = 0;
 	struct pollfd fd[2];
 	bool prefixed = false;
+	ssize_t n;
 	int slave_tty;
 	sigset_t sigchldmask;
 	sigset_t oldmask;
 	char *openrc_sh = NULL;
+	char *snapshot;
+	int err;
 	const char *argv[] = {
 		RC_LIBEXECDIR "/sh/openrc-run.sh",
 		service,
@@ -410,11 +489,21 @@ svc_exec(const char *command)
 		argv[0] = openrc_sh;
 	}
 
+	/* Hand the shell our configuration as one file to source */
+	if ((snapshot = conf_snapshot(applet)))
+		setenv("RC_CONF_SNAPSHOT", snapshot, 1);
+	else
+		unsetenv("RC_CONF_SNAPSHOT");
+	free(snapshot);
+
 	einfov("Executing: %s %s %s", argv[0], service, command);
-	if ((errno = posix_spawn(&service_pid, argv[0], &tty, NULL, UNCONST(argv), environ))) {
-		eerror("%s: exec '%s': %s", service, argv[0], strerror(errno));
+	err = posix_spawn(&service_pid, argv[0], &tty, NULL, UNCONST(argv), environ);
+	unsetenv("RC_CONF_SNAPSHOT");
+	if (err) {
+		eerror("%s: exec '%s': %s", service, argv[0], strerror(err));
 		return 1;
 	}
+	rc_trace(RC_TRACE_EXEC_BEGIN, applet, command, 0);
 
 	posix_spawn_file_actions_destroy(&tty);
 	free(openrc_sh);
@@ -425,16 +514,23 @@ svc_exec(const char *command)
 	fd[0].revents = fd[1].revents = 0;
 
 	for (;;) {
-		if (poll(fd, master_tty >= 0 ? 2 : 1, -1) == -1) {
+		if ((n = poll(fd, master_tty >= 0 ? 2 : 1,
+		    prefix_len ? PREFIX_FLUSH_MS : -1)) == -1)
+		{
 			if (errno == EINTR)
 				continue;
 			eerror("%s: poll: %s", applet, strerror(errno));
 			break;
 		}
 
+		/* Nothing more for a while, show what we have of the line */
+		if (n == 0)
+			flush_prefix(prefix_len);
+
 		if (fd[1].revents & (POLLIN | POLLHUP)) {
 			char buffer[BUFSIZ];
-			write_prefix(buffer, read(master_tty, buffer, BUFSIZ), &prefixed);
+			if ((n = read(master_tty, buffer, BUFSIZ)) > 0)
+				write_prefix(buffer, (size_t)n, &prefixed);
 		}
 
 		/* signal_pipe receives service_pid's exit status */
@@ -460,6 +556,8 @@ svc_exec(const char *command)
 
 	sigprocmask (SIG_SETMASK, &oldmask, NULL);
 
+	flush_prefix(prefix_len);
+
 	if (master_tty >= 0) {
 		/* Why did we do this? */
 		/* signal (SIGWINCH, SIG_IGN); */
@@ -469,6 +567,7 @@ svc_exec(const char *command)
 
 	service_pid = 0;
 
+	rc_trace(RC_TRACE_EXEC_END, applet, command, ret);
 	return ret;
 }
 
@@ -491,6 +590,7 @@ svc_wait(const char *svc)
 	if ((fd = openat(rc_dirfd(RC_DIR_EXCLUSIVE), base, O_RDONLY | O_NONBLOCK)) == -1)
 		return errno == ENOENT;
 
+	rc_trace(RC_TRACE_WAIT_BEGIN, applet, base, 0);
 	timedout = false;
 	for (;;) {
 		if (!forever)
@@ -515,9 +615,188 @@ svc_wait(const char *svc)
 
 	alarm(0);
 	close(fd);
+	rc_trace(RC_TRACE_WAIT_END, applet, base, !retval);
 	return retval;
 }
 
+struct svc_waiter {
+	const char *svc;
+	const char *base;
+	bool forever;
+	bool done;
+};
+
+/* Check without blocking if svc has let go of its exclusive lock.
+ * Returns false while it is still held. */
+static bool
+svc_released(struct svc_waiter *w, RC_STRINGLIST *failed)
+{
+	int fd = openat(rc_dirfd(RC_DIR_EXCLUSIVE), w->base, O_RDONLY | O_NONBLOCK);
+
+	if (fd == -1) {
+		if (errno != ENOENT)
+			rc_stringlist_add(failed, w->svc);
+	} else if (flock(fd, LOCK_SH | LOCK_NB) == -1) {
+		if (errno == EWOULDBLOCK) {
+			close(fd);
+			return false;
+		}
+		rc_stringlist_add(failed, w->svc);
+	}
+	if (fd != -1)
+		close(fd);
+	w->done = true;
+	return true;
+}
+
+#ifdef __linux__
+/* Wait for all of the services at once. A service lets go of its
+ * exclusive lock by unlinking it after marking its new state, so
+ * watching the exclusive and state directories tells us when to look
+ * again. Returns false if inotify cannot be used. */
+static bool
+svc_wait_inotify(struct svc_waiter *waiters, size_t count, RC_STRINGLIST *failed)
+{
+	static const char *const dirs[] = {
+		"exclusive", "started", "inactive", "failed",
+	};
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	int64_t now, deadline, warn;
+	size_t i, pending = 0, timed = 0;
+	ssize_t len;
+	char *path;
+	int fd, ret;
+
+	if ((fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) == -1)
+		return false;
+	for (i = 0; i < ARRAY_SIZE(dirs); i++) {
+		xasprintf(&path, "%s/%s", rc_svcdir(), dirs[i]);
+		ret = inotify_add_watch(fd, path, IN_CREATE | IN_DELETE |
+		    IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ONLYDIR);
+		free(path);
+		if (ret == -1 && i == 0) {
+			close(fd);
+			return false;
+		}
+	}
+
+	/* The watches are in place, so anything released after this
+	 * check will show up as an event. */
+	for (i = 0; i < count; i++) {
+		if (svc_released(&waiters[i], failed))
+			continue;
+		rc_trace(RC_TRACE_WAIT_BEGIN, applet, waiters[i].base, 0);
+		pending++;
+		if (!waiters[i].forever)
+			timed++;
+	}
+
+	now = tm_now();
+	deadline = now + TM_SEC(WAIT_TIMEOUT);
+	warn = now + TM_SEC(WARN_TIMEOUT);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (pending > 0) {
+		now = tm_now();
+		if (timed > 0 && now >= deadline) {
+			for (i = 0; i < count; i++) {
+				if (waiters[i].done || waiters[i].forever)
+					continue;
+				waiters[i].done = true;
+				rc_stringlist_add(failed, waiters[i].svc);
+				rc_trace(RC_TRACE_WAIT_END, applet, waiters[i].base, 1);
+				pending--;
+			}
+			timed = 0;
+			continue;
+		}
+		if (timed > 0 && now >= warn) {
+			for (i = 0; i < count; i++)
+				if (!waiters[i].done && !waiters[i].forever)
+					ewarn("%s: waiting for %s (%d seconds)", applet,
+					    waiters[i].base, (int)((deadline - now + 999) / 1000));
+			warn += TM_SEC(WARN_TIMEOUT);
+		}
+
+		ret = poll(&pfd, 1, timed > 0 ? (int)((warn < deadline ? warn : deadline) - now) : -1);
+		if (ret == -1 && errno != EINTR)
+			break;
+		if (ret <= 0)
+			continue;
+
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
+			for (i = 0; i < (size_t)len; i += sizeof(*ev) + ev->len) {
+				ev = (const struct inotify_event *)(buf + i);
+				for (size_t j = 0; ev->len && j < count; j++) {
+					if (waiters[j].done || strcmp(ev->name, waiters[j].base) != 0)
+						continue;
+					if (!svc_released(&waiters[j], failed))
+						continue;
+					rc_trace(RC_TRACE_WAIT_END, applet, waiters[j].base, 0);
+					pending--;
+					if (!waiters[j].forever)
+						timed--;
+				}
+			}
+		}
+		if (len == -1 && errno != EAGAIN && errno != EINTR)
+			break;
+	}
+
+	close(fd);
+	/* Anything left over goes back to blocking on the lock */
+	for (i = 0; i < count; i++)
+		if (!waiters[i].done && !svc_wait(waiters[i].svc))
+			rc_stringlist_add(failed, waiters[i].svc);
+	return true;
+}
+#endif
+
+/* Wait for a list of services to finish starting or stopping.
+ * Returns the services we gave up on. */
+static RC_STRINGLIST *
+svc_wait_list(RC_STRINGLIST *list)
+{
+	RC_STRINGLIST *failed = rc_stringlist_new();
+	RC_STRINGLIST *keywords;
+	struct svc_waiter *waiters;
+	RC_STRING *svc;
+	size_t count = 0;
+
+	TAILQ_FOREACH(svc, list, entries)
+		count++;
+	if (count == 0)
+		return failed;
+
+	waiters = xmalloc(sizeof(*waiters) * count);
+	count = 0;
+	TAILQ_FOREACH(svc, list, entries) {
+		waiters[count].svc = svc->value;
+		waiters[count].base = basename_c(svc->value);
+		waiters[count].done = false;
+		/* Some services don't have a timeout, like fsck */
+		keywords = rc_deptree_depend(deptree, svc->value, "keyword");
+		waiters[count].forever = rc_stringlist_find(keywords, "-timeout") ||
+		    rc_stringlist_find(keywords, "notimeout");
+		rc_stringlist_free(keywords);
+		count++;
+	}
+
+#ifdef __linux__
+	if (svc_wait_inotify(waiters, count, failed)) {
+		free(waiters);
+		return failed;
+	}
+#endif
+	for (size_t i = 0; i < count; i++)
+		if (!svc_wait(waiters[i].svc))
+			rc_stringlist_add(failed, waiters[i].svc);
+	free(waiters);
+	return failed;
+}
+
 static void
 get_started_services(void)
 {
@@ -620,6 +899,8 @@ svc_start_deps(void)
 	bool first;
 	RC_STRING *svc, *svc2;
 	RC_SERVICE state;
+	RC_STATE_SNAPSHOT *snapshot;
+	RC_STRINGLIST *waitlist, *failed;
 	int depoptions = RC_DEP_TRACE;
 	size_t len, svc_count;
 	char *tmp;
@@ -661,8 +942,9 @@ svc_start_deps(void)
 	use_services = rc_deptree_depends(deptree, deptypes_nwu, applet_list, runlevel, depoptions);
 
 	if (!rc_runlevel_starting()) {
+		snapshot = rc_services_state_snapshot();
 		TAILQ_FOREACH(svc, use_services, entries) {
-			state = rc_service_state(svc->value);
+			state = rc_state_snapshot_service(snapshot, svc->value);
 			/* Don't stop failed services again.
 			 * If you remove this check, ensure that the exclusive file isn't created. */
 			if (state & RC_SERVICE_FAILED && rc_runlevel_starting())
@@ -681,6 +963,7 @@ svc_start_deps(void)
 					rc_waitpid(pid);
 			}
 		}
+		rc_state_snapshot_free(snapshot);
 	}
 
 	if (dry_run)
@@ -690,8 +973,12 @@ svc_start_deps(void)
 	services = rc_deptree_depends(deptree, deptypes_nwua, applet_list, runlevel, depoptions);
 	/* We use tmplist to hold our scheduled by list */
 	tmplist = rc_stringlist_new();
+	/* Services already up are answered from one snapshot; the rest
+	 * are waited for together and then checked again live. */
+	waitlist = rc_stringlist_new();
+	snapshot = rc_services_state_snapshot();
 	TAILQ_FOREACH(svc, services, entries) {
-		state = rc_service_state(svc->value);
+		state = rc_state_snapshot_service(snapshot, svc->value);
 		if (state & RC_SERVICE_STARTED) {
 			svc_getenv(svc->value);
 			continue;
@@ -707,7 +994,13 @@ svc_start_deps(void)
 				continue;
 		}
 
-		if (!svc_wait(svc->value))
+		rc_stringlist_add(waitlist, svc->value);
+	}
+	rc_state_snapshot_free(snapshot);
+
+	failed = svc_wait_list(waitlist);
+	TAILQ_FOREACH(svc, waitlist, entries) {
+		if (rc_stringlist_find(failed, svc->value))
 			eerror("%s: timed out waiting for %s", applet, svc->value);
 		state = rc_service_state(svc->value);
 		if (state & RC_SERVICE_STARTED) {
@@ -723,6 +1016,8 @@ svc_start_deps(void)
 			}
 		}
 	}
+	rc_stringlist_free(failed);
+	rc_stringlist_free(waitlist);
 
 	if (TAILQ_FIRST(tmplist)) {
 		/* Set the state now, then unlink our exclusive so that
@@ -788,6 +1083,7 @@ static void svc_start_real(void)
 {
 	bool started;
 	RC_STRING *svc, *svc2;
+	int64_t begin;
 
 	set_reexports();
 
@@ -795,7 +1091,10 @@ static void svc_start_real(void)
 		setenv("IN_BACKGROUND", ibsave, 1);
 	rc_plugin_run(RC_HOOK_SERVICE_START_NOW, applet);
 	skip_mark = false;
+	begin = tm_now();
 	started = (svc_exec("start") == 0);
+	if (started)
+		timing_record(applet, TIMING_START, tm_now() - begin);
 	if (ibsave)
 		unsetenv("IN_BACKGROUND");
 
@@ -909,6 +1208,7 @@ static void
 svc_stop_deps(RC_SERVICE state)
 {
 	int depoptions = RC_DEP_TRACE;
+	RC_STRINGLIST *waitlist;
 	RC_STRING *svc;
 	pid_t pid;
 
@@ -954,11 +1254,12 @@ svc_stop_deps(RC_SERVICE state)
 	if (dry_run)
 		return;
 
-	TAILQ_FOREACH(svc, tmplist, entries) {
-		if (rc_service_state(svc->value) & RC_SERVICE_STOPPED) {
-			continue;
-		}
-		svc_wait(svc->value);
+	waitlist = rc_stringlist_new();
+	TAILQ_FOREACH(svc, tmplist, entries)
+		if (!(rc_service_state(svc->value) & RC_SERVICE_STOPPED))
+			rc_stringlist_add(waitlist, svc->value);
+	rc_stringlist_free(svc_wait_list(waitlist));
+	TAILQ_FOREACH(svc, waitlist, entries) {
 		if (rc_service_state(svc->value) & RC_SERVICE_STOPPED)
 			continue;
 		if (rc_runlevel_stopping()) {
@@ -971,17 +1272,19 @@ svc_stop_deps(RC_SERVICE state)
 		rc_plugin_run(RC_HOOK_SERVICE_STOP_OUT, applet);
 		eerrorx("ERROR: cannot stop %s as %s is still up", applet, svc->value);
 	}
+	rc_stringlist_free(waitlist);
 	rc_stringlist_free(tmplist);
 	tmplist = NULL;
 
 	/* We now wait for other services that may use us and are
 	 * stopping. This is important when a runlevel stops */
 	services = rc_deptree_depends(deptree, deptypes_mwua, applet_list, runlevel, depoptions);
-	TAILQ_FOREACH(svc, services, entries) {
-		if (rc_service_state(svc->value) & RC_SERVICE_STOPPED)
-			continue;
-		svc_wait(svc->value);
-	}
+	waitlist = rc_stringlist_new();
+	TAILQ_FOREACH(svc, services, entries)
+		if (!(rc_service_state(svc->value) & RC_SERVICE_STOPPED))
+			rc_stringlist_add(waitlist, svc->value);
+	rc_stringlist_free(svc_wait_list(waitlist));
+	rc_stringlist_free(waitlist);
 	rc_stringlist_free(services);
 	services = NULL;
 }
@@ -1004,6 +1307,7 @@ static void
 svc_stop_real(void)
 {
 	bool stopped;
+	int64_t begin;
 
 	load_dep_env();
 
@@ -1016,7 +1320,10 @@ svc_stop_real(void)
 		setenv("IN_BACKGROUND", ibsave, 1);
 	rc_plugin_run(RC_HOOK_SERVICE_STOP_NOW, applet);
 	skip_mark = false;
+	begin = tm_now();
 	stopped = (svc_exec("stop") == 0);
+	if (stopped)
+		timing_record(applet, TIMING_STOP, tm_now() - begin);
 	if (ibsave)
 		unsetenv("IN_BACKGROUND");
 
@@ -1118,6 +1425,108 @@ simple_command(void)
 	return retval;
 }
 
+/* As service_get_value, an empty value is no value. */
+static bool
+has_value(const char *option)
+{
+	char *value = rc_service_value_get(applet, option);
+	bool set = value && *value;
+
+	free(value);
+	return set;
+}
+
+/*
+ * Report the status of a service without the shell, when gendepends found
+ * the script keeps the default status of start-stop-daemon or
+ * supervise-daemon and nothing else the shell does first can matter.
+ * Output and exit code are those of _status and supervise_status.
+ * Returns false if the shell has to do it.
+ */
+static bool
+svc_status(int *retval)
+{
+	RC_STRINGLIST *list;
+	RC_STRING *s;
+	RC_SERVICE state;
+	bool supervise;
+
+	if (in_background || rc_yesno(getenv("RC_DEBUG")))
+		return false;
+	/* verify_boot and livecd support in the shell */
+	if (!rc_yesno(getenv("RC_USER_SERVICES")) &&
+	    faccessat(rc_dirfd(RC_DIR_SVCDIR), "softlevel", F_OK, 0) != 0)
+		return false;
+	if (access("/sbin/livecd-functions.sh", F_OK) == 0)
+		return false;
+
+	/* Only trust a deptree made from the configuration we have now */
+	if (!deptree) {
+		if (rc_deptree_update_needed(NULL, NULL))
+			return false;
+		if (!(deptree = rc_deptree_load()))
+			return false;
+	}
+	list = rc_deptree_depend(deptree, applet, "status");
+	s = TAILQ_FIRST(list);
+	if (!s || !conf_in_deptree(applet)) {
+		rc_stringlist_free(list);
+		return false;
+	}
+	supervise = strcmp(s->value, "supervise-daemon") == 0;
+	rc_stringlist_free(list);
+
+	state = rc_service_state(applet);
+	if (state & RC_SERVICE_STOPPING) {
+		ewarn("status: stopping");
+		*retval = 4;
+	} else if (state & RC_SERVICE_STARTING) {
+		ewarn("status: starting");
+		*retval = 8;
+	} else if (state & RC_SERVICE_INACTIVE) {
+		ewarn("status: inactive");
+		*retval = 16;
+	} else if (state & RC_SERVICE_CRASHED) {
+		/* The shell's service_crashed is this same flag, which librc
+		 * only sets for a started service, so _status asking it before
+		 * service_started comes to the same as supervise_status asking
+		 * after. supervise_status asks _check_supervised first. */
+		if (supervise && has_value("child_pid") &&
+		    has_value("start_time")) {
+			eerror("status: unsupervised");
+			*retval = 64;
+		} else {
+			eerror("status: crashed");
+			*retval = 32;
+		}
+	} else if (state & RC_SERVICE_STARTED) {
+		einfo("status: started");
+		*retval = 0;
+	} else {
+		einfo("status: stopped");
+		*retval = 3;
+	}
+	return true;
+}
+
+static int
+cmd_status(void)
+{
+	char *save = prefix;
+	int retval;
+
+	eprefix(NULL);
+	prefix = NULL;
+
+	if (!svc_status(&retval))
+		retval = svc_exec(optarg);
+
+	eprefix(save);
+	prefix = save;
+
+	return retval;
+}
+
 static int
 resolve_deptype(void)
 {
@@ -1204,7 +1613,7 @@ struct {
 	{ "describe",           simple_command,  false },
 	{ "help",               simple_command,  false },
 	{ "depend",             simple_command,  false },
-	{ "status",             simple_command,  false },
+	{ "status",             cmd_status,      false },
 	{ "ineed",              resolve_deptype, false },
 	{ "iuse",               resolve_deptype, false },
 	{ "iwant",              resolve_deptype, false },
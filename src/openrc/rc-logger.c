@@ -19,6 +19,7 @@
 #include <errno.h>
 #include <ctype.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
 #include <signal.h>
 #include <stdio.h>
@@ -63,41 +64,89 @@ pid_t rc_logger_pid = -1;
 int rc_logger_tty = -1;
 bool rc_in_logger = false;
 
+static void
+flush_log(int logfd, const char *buffer, size_t bytes)
+{
+	ssize_t ret;
+
+	while (bytes > 0) {
+		if ((ret = write(logfd, buffer, bytes)) == -1) {
+			if (errno == EINTR)
+				continue;
+			eerror("write: %s", strerror(errno));
+			return;
+		}
+		buffer += ret;
+		bytes -= (size_t)ret;
+	}
+}
+
+/* Log buffer with colours, cursor movement and other escape sequences
+ * stripped. Runs of printable characters are copied a block at a time;
+ * only escape sequences go through the state machine byte by byte. */
 static void
 write_log(int logfd, const char *buffer, size_t bytes)
 {
-	const char *p = buffer;
+	static bool plain[UCHAR_MAX + 1];
+	static bool plain_init;
+	const char *p = buffer, *end = buffer + bytes, *run;
+	char out[BUFSIZ];
+	size_t len = 0, n;
+	int c;
+
+	if (!plain_init) {
+		for (c = 0; c <= UCHAR_MAX; c++)
+			plain[c] = isprint((int)(char)c) || c == '\n';
+		plain_init = true;
+	}
+
+	while (p < end) {
+		if (!in_escape) {
+			for (run = p; p < end && plain[(unsigned char)*p]; p++)
+				;
+			while (run < p) {
+				if (len == sizeof(out)) {
+					flush_log(logfd, out, len);
+					len = 0;
+				}
+				n = (size_t)(p - run);
+				if (n > sizeof(out) - len)
+					n = sizeof(out) - len;
+				memcpy(out + len, run, n);
+				len += n;
+				run += n;
+			}
+			if (p == end)
+				break;
+			/* Anything else that is not printable is dropped */
+			if (*p == '\033') {
+				in_escape = true;
+				in_term = false;
+			}
+			p++;
+			continue;
+		}
 
-	while ((size_t)(p - buffer) < bytes) {
 		switch (*p) {
 		case '\r':
-			goto cont;
+			break;
 		case '\033':
-			in_escape = true;
 			in_term = false;
-			goto cont;
+			break;
 		case '\n':
 			in_escape = in_term = false;
-			break;
-		case '[':
-			if (in_escape)
-				in_term = true;
-			break;
-		}
-
-		if (!in_escape) {
-			if (!isprint((int) *p) && *p != '\n')
-				goto cont;
-			if (write(logfd, p++, 1) == -1)
-				eerror("write: %s", strerror(errno));
 			continue;
+		case '[':
+			in_term = true;
+			/* FALLTHROUGH */
+		default:
+			if (!in_term || isalpha((unsigned char)*p))
+				in_escape = in_term = false;
 		}
-
-		if (!in_term || isalpha((unsigned char)*p))
-			in_escape = in_term = false;
-cont:
 		p++;
 	}
+
+	flush_log(logfd, out, len);
 }
 
 static void
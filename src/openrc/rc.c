@@ -45,6 +45,7 @@
 #include "rc-logger.h"
 #include "misc.h"
 #include "plugin.h"
+#include "timings.h"
 #include "version.h"
 #include "_usage.h"
 #include "helpers.h"
@@ -414,18 +415,17 @@ handle_signal(int sig)
 
 	switch (sig) {
 	case SIGCHLD:
-		do {
-			pid = waitpid(-1, &status, WNOHANG);
+		/* Several children may have exited for one signal, so reap
+		 * them all and remove them from our list */
+		while ((pid = waitpid(-1, &status, WNOHANG)) != 0) {
 			if (pid < 0) {
 				if (errno != ECHILD)
 					eerror("waitpid: %s", strerror(errno));
-				return;
+				break;
 			}
-		} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-		/* Remove that pid from our list */
-		if (pid > 0)
-			remove_pid(pid, true);
+			if (WIFEXITED(status) || WIFSIGNALED(status))
+				remove_pid(pid, true);
+		}
 		break;
 
 	case SIGWINCH:
@@ -548,7 +548,8 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 	RC_STRINGLIST *types_nw_save = NULL;
 	RC_SERVICE state;
 	RC_STRINGLIST *nostop;
-	bool crashed, nstop;
+	RC_STRINGLIST *crashed = NULL;
+	bool nstop;
 
 	if (!types_nw) {
 		types_nw = types_nw_save = rc_stringlist_new();
@@ -556,7 +557,8 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 		rc_stringlist_add(types_nw, "wantsme");
 	}
 
-	crashed = rc_conf_yesno("rc_crashed_stop");
+	if (rc_conf_yesno("rc_crashed_stop"))
+		crashed = rc_services_daemons_crashed(stop_services);
 
 	nostop = rc_stringlist_split(rc_conf_value("rc_nostop"), " ");
 	TAILQ_FOREACH_REVERSE(service, stop_services, rc_stringlist, entries)
@@ -587,8 +589,7 @@ do_stop_services(RC_STRINGLIST *types_nw, RC_STRINGLIST *start_services,
 
 		/* If the service has crashed, skip further checks and just stop
 		   it */
-		if (crashed &&
-		    rc_service_daemons_crashed(service->value))
+		if (crashed && rc_stringlist_find(crashed, service->value))
 			goto stop;
 
 		/* If we're in the start list then don't bother stopping us */
@@ -645,65 +646,303 @@ stop:
 		rc_stringlist_free(types_nw_save);
 
 	rc_stringlist_free(nostop);
+	rc_stringlist_free(crashed);
 }
 
-static void
-do_start_services(const RC_STRINGLIST *start_services, bool parallel)
+/* Whether service should be skipped rather than started, asking the
+ * user first if we are interactive */
+static bool
+skip_service(const char *service, RC_STRINGLIST *crashed,
+		bool *interactive)
 {
-	RC_STRING *service;
+	RC_SERVICE state = rc_service_state(service);
+
+	if (state & RC_SERVICE_FAILED)
+		return true;
+	if (!(state & RC_SERVICE_STOPPED)) {
+		if (crashed && rc_stringlist_find(crashed, service))
+			rc_service_mark(service, RC_SERVICE_STOPPED);
+		else
+			return true;
+	}
+	if (!*interactive)
+		*interactive = want_interactive();
+
+	if (*interactive) {
+interactive_retry:
+		printf("\n");
+		einfo("About to start the service %s", service);
+		eindent();
+		einfo("1) Start the service\t\t2) Skip the service");
+		einfo("3) Continue boot process\t\t4) Exit to shell");
+		eoutdent();
+interactive_option:
+		switch (read_key(true)) {
+		case '1': break;
+		case '2': return true;
+		case '3': *interactive = false; break;
+		case '4': open_shell(); goto interactive_retry;
+		default: goto interactive_option;
+		}
+	}
+	return false;
+}
+
+static bool
+pid_running(pid_t pid)
+{
+	RC_PID *p;
+
+	LIST_FOREACH(p, &service_pids, entries)
+		if (p->pid == pid)
+			return true;
+	return false;
+}
+
+struct start_job {
+	const char *service;
 	pid_t pid;
-	bool interactive = false;
-	RC_SERVICE state;
-	bool crashed = false;
+	enum { JOB_WAITING, JOB_RUNNING, JOB_DONE } state;
+	/* how many services before us in the list we still wait for */
+	size_t waiting;
+	size_t *dependents;
+	size_t ndependents;
+	/* how long we and the longest chain of services waiting on us
+	 * took to start last time, in milliseconds */
+	uint64_t weight;
+};
 
-	if (!rc_yesno(getenv("EINFO_QUIET")))
-		interactive = faccessat(rc_dirfd(RC_DIR_SVCDIR), "interactive", F_OK, 0) == 0;
+struct start_name {
+	const char *service;
+	size_t job;
+};
+
+static int
+start_name_cmp(const void *a, const void *b)
+{
+	return strcmp(((const struct start_name *)a)->service,
+	    ((const struct start_name *)b)->service);
+}
+
+static size_t
+parallel_jobs(void)
+{
+	const char *value = rc_conf_value("rc_parallel_jobs");
+	char *end;
+	long jobs;
+
+	if (!value || !*value)
+		return 0;
 	errno = 0;
-	crashed = rc_conf_yesno("rc_crashed_start");
-	if (errno == ENOENT)
-		crashed = true;
+	jobs = strtol(value, &end, 10);
+	if (errno != 0 || *end || jobs < 0) {
+		ewarn("%s: invalid rc_parallel_jobs '%s'", applet, value);
+		return 0;
+	}
+	return (size_t)jobs;
+}
 
+/* Build the graph of which services in the list have to finish before
+ * another one is started. The list is in dependency order, so only
+ * services before a job in the list count, which also breaks loops. */
+static struct start_job *
+start_jobs_new(const RC_STRINGLIST *start_services, const char *level,
+		size_t *count)
+{
+	RC_STRINGLIST *single = rc_stringlist_new();
+	RC_STRINGLIST *deps;
+	struct start_job *jobs;
+	struct start_name *names, key, *found;
+	const RC_STRING *service, *dep;
+	size_t n = 0, i, j, *seen;
+
+	TAILQ_FOREACH(service, start_services, entries)
+		n++;
+	jobs = xmalloc((n ? n : 1) * sizeof(*jobs));
+	names = xmalloc((n ? n : 1) * sizeof(*names));
+	seen = xmalloc((n ? n : 1) * sizeof(*seen));
+
+	i = 0;
 	TAILQ_FOREACH(service, start_services, entries) {
-		state = rc_service_state(service->value);
-		if (state & RC_SERVICE_FAILED)
-			continue;
-		if (!(state & RC_SERVICE_STOPPED)) {
-			if (crashed &&
-			    rc_service_daemons_crashed(service->value))
-				rc_service_mark(service->value,
-				    RC_SERVICE_STOPPED);
-			else
-			    continue;
+		jobs[i] = (struct start_job) { .service = service->value };
+		names[i] = (struct start_name) { service->value, i };
+		seen[i] = n;
+		i++;
+	}
+	qsort(names, n, sizeof(*names), start_name_cmp);
+
+	for (i = 0; i < n; i++) {
+		rc_stringlist_add(single, jobs[i].service);
+		deps = rc_deptree_depends(main_deptree, main_types_nwua, single,
+		    level, RC_DEP_STRICT | RC_DEP_TRACE | RC_DEP_START);
+		rc_stringlist_delete(single, jobs[i].service);
+
+		TAILQ_FOREACH(dep, deps, entries) {
+			key.service = dep->value;
+			found = bsearch(&key, names, n, sizeof(*names), start_name_cmp);
+			if (!found || (j = found->job) >= i || seen[j] == i)
+				continue;
+			seen[j] = i;
+			jobs[j].dependents = xrealloc(jobs[j].dependents,
+			    (jobs[j].ndependents + 1) * sizeof(size_t));
+			jobs[j].dependents[jobs[j].ndependents++] = i;
+			jobs[i].waiting++;
 		}
-		if (!interactive)
-			interactive = want_interactive();
-
-		if (interactive) {
-	interactive_retry:
-			printf("\n");
-			einfo("About to start the service %s",
-			    service->value);
-			eindent();
-			einfo("1) Start the service\t\t2) Skip the service");
-			einfo("3) Continue boot process\t\t4) Exit to shell");
-			eoutdent();
-	interactive_option:
-			switch (read_key(true)) {
-			case '1': break;
-			case '2': continue;
-			case '3': interactive = false; break;
-			case '4': open_shell(); goto interactive_retry;
-			default: goto interactive_option;
+		rc_stringlist_free(deps);
+	}
+
+	rc_stringlist_free(single);
+	free(names);
+	free(seen);
+	*count = n;
+	return jobs;
+}
+
+/* Order the jobs so that when several could be started, those at the head
+ * of the longest chains go first. Without any timings this is the
+ * dependency order, as ties keep their place in the list. */
+static size_t *
+start_jobs_order(struct start_job *jobs, size_t count)
+{
+	struct timings *timings = timings_load();
+	struct timing timing;
+	size_t *order = xmalloc((count ? count : 1) * sizeof(*order));
+	size_t i, j, k;
+	uint64_t longest;
+
+	/* dependents always come later in the list */
+	for (i = count; i > 0; i--) {
+		longest = 0;
+		for (j = 0; j < jobs[i - 1].ndependents; j++)
+			if (jobs[jobs[i - 1].dependents[j]].weight > longest)
+				longest = jobs[jobs[i - 1].dependents[j]].weight;
+		if (timings_get(timings, jobs[i - 1].service, TIMING_START, &timing))
+			longest += timing.mean;
+		jobs[i - 1].weight = longest;
+	}
+	timings_free(timings);
+
+	/* a stable insertion sort, the list is rarely long */
+	for (i = 0; i < count; i++) {
+		for (k = i; k > 0 && jobs[order[k - 1]].weight < jobs[i].weight; k--)
+			;
+		for (j = i; j > k; j--)
+			order[j] = order[j - 1];
+		order[k] = i;
+	}
+	return order;
+}
+
+static void
+start_job_done(struct start_job *jobs, size_t job)
+{
+	jobs[job].state = JOB_DONE;
+	for (size_t i = 0; i < jobs[job].ndependents; i++)
+		jobs[jobs[job].dependents[i]].waiting--;
+}
+
+/* Start each service once everything it needs, wants, uses or comes after
+ * in the list has finished, keeping at most rc_parallel_jobs running and
+ * preferring the longest chains. Finished services are noticed as the
+ * SIGCHLD handler takes their pid off service_pids. */
+static void
+start_services_parallel(const RC_STRINGLIST *start_services, const char *level,
+		RC_STRINGLIST *crashed, bool *interactive)
+{
+	size_t count, i, k, running = 0, limit = parallel_jobs();
+	struct start_job *jobs = start_jobs_new(start_services, level, &count);
+	size_t *order = start_jobs_order(jobs, count);
+	bool launch = true, progress;
+	sigset_t sset, old;
+	pid_t pid;
+
+	sigemptyset(&sset);
+	sigaddset(&sset, SIGCHLD);
+
+	for (;;) {
+		for (k = 0; launch && k < count; k++) {
+			i = order[k];
+			if (limit && running >= limit)
+				break;
+			if (jobs[i].state != JOB_WAITING || jobs[i].waiting)
+				continue;
+
+			if (skip_service(jobs[i].service, crashed, interactive)) {
+				start_job_done(jobs, i);
+				continue;
+			}
+
+			pid = service_start(jobs[i].service);
+			if (pid == -1) {
+				launch = false;
+				break;
+			}
+			if (pid == 0) {
+				start_job_done(jobs, i);
+				continue;
 			}
+			add_pid(pid);
+			jobs[i].pid = pid;
+			jobs[i].state = JOB_RUNNING;
+			running++;
 		}
 
-		pid = service_start(service->value);
-		if (pid == -1)
+		if (!running)
 			break;
-		/* Remember the pid if we're running in parallel */
-		if (pid > 0) {
-			add_pid(pid);
-			if (!parallel) {
+
+		/* Wait for the SIGCHLD handler to reap at least one of ours */
+		sigprocmask(SIG_BLOCK, &sset, &old);
+		for (progress = false; !progress; ) {
+			for (i = 0; i < count; i++) {
+				if (jobs[i].state != JOB_RUNNING ||
+				    pid_running(jobs[i].pid))
+					continue;
+				/* frees what the handler took off the list */
+				remove_pid(jobs[i].pid, false);
+				start_job_done(jobs, i);
+				running--;
+				progress = true;
+			}
+			if (!progress)
+				sigsuspend(&old);
+		}
+		sigprocmask(SIG_SETMASK, &old, NULL);
+	}
+
+	for (i = 0; i < count; i++)
+		free(jobs[i].dependents);
+	free(jobs);
+	free(order);
+}
+
+static void
+do_start_services(const RC_STRINGLIST *start_services, const char *level,
+		bool parallel)
+{
+	RC_STRING *service;
+	pid_t pid;
+	bool interactive = false;
+	RC_STRINGLIST *crashed = NULL;
+
+	if (!rc_yesno(getenv("EINFO_QUIET")))
+		interactive = faccessat(rc_dirfd(RC_DIR_SVCDIR), "interactive", F_OK, 0) == 0;
+	/* Find every crashed service up front, reading the process list once */
+	errno = 0;
+	if (rc_conf_yesno("rc_crashed_start") || errno == ENOENT)
+		crashed = rc_services_daemons_crashed(start_services);
+
+	if (parallel) {
+		start_services_parallel(start_services, level, crashed, &interactive);
+	} else {
+		TAILQ_FOREACH(service, start_services, entries) {
+			if (skip_service(service->value, crashed, &interactive))
+				continue;
+
+			pid = service_start(service->value);
+			if (pid == -1)
+				break;
+			if (pid > 0) {
+				add_pid(pid);
 				rc_waitpid(pid);
 				remove_pid(pid, false);
 			}
@@ -717,6 +956,8 @@ do_start_services(const RC_STRINGLIST *start_services, bool parallel)
 		mark_interactive();
 	else
 		unlinkat(rc_dirfd(RC_DIR_SVCDIR), "interactive", 0);
+
+	rc_stringlist_free(crashed);
 }
 
 #ifdef RC_DEBUG
@@ -752,6 +993,7 @@ int main(int argc, char **argv)
 	const char *systype = NULL;
 	RC_STRINGLIST *deporder = NULL;
 	RC_STRINGLIST *tmplist;
+	RC_STATE_SNAPSHOT *snapshot;
 	RC_STRING *service;
 	bool going_down = false;
 	int depoptions = RC_DEP_STRICT | RC_DEP_TRACE;
@@ -869,6 +1111,10 @@ int main(int argc, char **argv)
 	setenv("RC_PID", pidstr, 1);
 	free(pidstr);
 
+	/* Services may not see the same rc.conf we do, so pass tracing on */
+	if (rc_conf_yesno("rc_trace"))
+		setenv("RC_TRACE", "YES", 1);
+
 	/* Create a list of all services which should be started for the new or
 	* current runlevel including those in boot, sysinit and hotplugged
 	* runlevels.  Clearly, some of these will already be started so we
@@ -950,8 +1196,10 @@ int main(int argc, char **argv)
 		rc_logger_close();
 #endif
 
+		rc_trace(RC_TRACE_RUNLEVEL, NULL, newlevel, 0);
 		rc_plugin_run(RC_HOOK_RUNLEVEL_STOP_IN, newlevel);
 	} else {
+		rc_trace(RC_TRACE_RUNLEVEL, NULL, newlevel ? newlevel : runlevel, 0);
 		rc_plugin_run(RC_HOOK_RUNLEVEL_STOP_IN, runlevel);
 	}
 
@@ -969,6 +1217,9 @@ int main(int argc, char **argv)
 		eerrorx("failed to load deptree");
 	}
 
+	/* Let the services we run map rc.conf rather than parse it */
+	rc_conf_cache_update();
+
 	if (faccessat(rc_dirfd(RC_DIR_SVCDIR), "clock-skewed", F_OK, 0) == 0)
 		ewarn("WARNING: clock skew detected!");
 
@@ -987,13 +1238,9 @@ int main(int argc, char **argv)
 	* in the new or current runlevel so we won't actually be stopping
 	* them all.
 	*/
-	main_stop_services = rc_services_in_state(RC_SERVICE_STARTED);
-	tmplist = rc_services_in_state(RC_SERVICE_INACTIVE);
-	TAILQ_CONCAT(main_stop_services, tmplist, entries);
-	free(tmplist);
-	tmplist = rc_services_in_state(RC_SERVICE_STARTING);
-	TAILQ_CONCAT(main_stop_services, tmplist, entries);
-	free(tmplist);
+	snapshot = rc_services_state_snapshot();
+	main_stop_services = rc_state_snapshot_services(snapshot,
+	    RC_SERVICE_STARTED | RC_SERVICE_INACTIVE | RC_SERVICE_STARTING);
 	if (main_stop_services)
 		rc_stringlist_sort(&main_stop_services);
 
@@ -1015,7 +1262,9 @@ int main(int argc, char **argv)
 	 * runlevels.  Clearly, some of these will already be started so we
 	 * won't actually be starting them all.
 	 */
-	main_hotplugged_services = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
+	main_hotplugged_services = rc_state_snapshot_services(snapshot,
+	    RC_SERVICE_HOTPLUGGED);
+	rc_state_snapshot_free(snapshot);
 	main_start_services = rc_services_in_runlevel_stacked(newlevel ?
 	    newlevel : runlevel);
 	if (strcmp(newlevel ? newlevel : runlevel, RC_LEVEL_SHUTDOWN) != 0 &&
@@ -1113,7 +1362,7 @@ int main(int argc, char **argv)
 			deporder = rc_deptree_depends(main_deptree, main_types_nwua, run_services, rlevel->value, depoptions | RC_DEP_START);
 			rc_stringlist_free(run_services);
 			run_services = deporder;
-			do_start_services(run_services, parallel);
+			do_start_services(run_services, rlevel->value, parallel);
 
 			/* Wait for our services to finish */
 			wait_for_services();
@@ -31,6 +31,7 @@
 #include "misc.h"
 #include "_usage.h"
 #include "helpers.h"
+#include "timings.h"
 
 enum format_t {
 	FORMAT_DEFAULT,
@@ -39,7 +40,7 @@ enum format_t {
 
 const char *applet = NULL;
 const char *extraopts = NULL;
-const char getoptstring[] = "acf:i:lmrsSu" getoptstring_COMMON;
+const char getoptstring[] = "acf:i:lmrsStu" getoptstring_COMMON;
 const struct option longopts[] = {
 	{"all",         0, NULL, 'a'},
 	{"crashed",     0, NULL, 'c'},
@@ -50,6 +51,7 @@ const struct option longopts[] = {
 	{"runlevel",    0, NULL, 'r'},
 	{"servicelist", 0, NULL, 's'},
 	{"supervised", 0, NULL, 'S'},
+	{"timings",     0, NULL, 't'},
 	{"unused",      0, NULL, 'u'},
 	longopts_COMMON
 };
@@ -63,20 +65,39 @@ const char * const longopts_help[] = {
 	"Show the name of the current runlevel",
 	"Show service list",
 	"show supervised services",
+	"Show how long services took to start and stop",
 	"Show services not assigned to any runlevel",
 	longopts_help_COMMON
 };
 const char *usagestring = ""
-	"Usage: rc-status [-C] [-f ini] [-i state] [runlevel]\n"
-	"   or: rc-status [-C] [-f ini] [-a | -m | -S | -s | -u]\n"
+	"Usage: rc-status [-C] [-f ini] [-t] [-i state] [runlevel]\n"
+	"   or: rc-status [-C] [-f ini] [-t] [-a | -m | -S | -s | -u]\n"
 	"   or: rc-status [-C] [-c | -l | -r]";
 
 static RC_DEPTREE *deptree;
+static RC_STATE_SNAPSHOT *snapshot;
 static RC_STRINGLIST *types;
+static struct timings *timings;
+static bool show_timings;
 
 static RC_STRINGLIST *levels, *services, *tmp, *alist;
 static RC_STRINGLIST *sservices, *nservices, *needsme;
 
+/* All the states are read once, on first use */
+static RC_SERVICE service_state(const char *service)
+{
+	if (!snapshot)
+		snapshot = rc_services_state_snapshot();
+	return rc_state_snapshot_service(snapshot, service);
+}
+
+static RC_STRINGLIST *services_in_state(RC_SERVICE state)
+{
+	if (!snapshot)
+		snapshot = rc_services_state_snapshot();
+	return rc_state_snapshot_services(snapshot, state);
+}
+
 static void print_level(const char *prefix, const char *level,
 		enum format_t format)
 {
@@ -102,7 +123,7 @@ static void print_level(const char *prefix, const char *level,
 
 static char *get_uptime(const char *service)
 {
-	RC_SERVICE state = rc_service_state(service);
+	RC_SERVICE state = service_state(service);
 	char *start_count;
 	char *start_time_string;
 	time_t start_time;
@@ -140,6 +161,30 @@ static char *get_uptime(const char *service)
 	return uptime;
 }
 
+static void append_timing(char **str, const char *service,
+		enum timing_kind kind, const char *what)
+{
+	struct timing t;
+	char *old = *str;
+
+	if (!timings_get(timings, service, kind, &t))
+		return;
+	xasprintf(str, "%s%s%s %u.%03us (mean %u.%03us, p95 %u.%03us)",
+			old ? old : "", old ? ", " : "", what,
+			t.last / 1000, t.last % 1000, t.mean / 1000, t.mean % 1000,
+			t.p95 / 1000, t.p95 % 1000);
+	free(old);
+}
+
+static char *get_timings(const char *service)
+{
+	char *str = NULL;
+
+	append_timing(&str, service, TIMING_START, "start");
+	append_timing(&str, service, TIMING_STOP, "stop");
+	return str;
+}
+
 static void print_service(const char *service, enum format_t format,
 	RC_SERVICE accept, RC_SERVICE reject)
 {
@@ -147,9 +192,10 @@ static void print_service(const char *service, enum format_t format,
 	char *uptime = NULL;
 	char *child_pid = NULL;
 	char *start_time = NULL;
+	char *timing, *tmp_status;
 	int cols;
 	const char *c = ecolor(ECOLOR_GOOD);
-	RC_SERVICE state = rc_service_state(service);
+	RC_SERVICE state = service_state(service);
 	ECOLOR color = ECOLOR_BAD;
 
 	if (!(state & accept) || (state & reject))
@@ -164,9 +210,7 @@ static void print_service(const char *service, enum format_t format,
 		xasprintf(&status, "inactive ");
 		color = ECOLOR_WARN;
 	} else if (state & RC_SERVICE_STARTED) {
-		errno = 0;
-		if (rc_service_daemons_crashed(service) && errno != EACCES)
-		{
+		if (state & RC_SERVICE_CRASHED) {
 			child_pid = rc_service_value_get(service, "child_pid");
 			start_time = rc_service_value_get(service, "start_time");
 			if (start_time && child_pid)
@@ -193,6 +237,13 @@ static void print_service(const char *service, enum format_t format,
 	} else
 		xasprintf(&status, " stopped ");
 
+	if (show_timings && (timing = get_timings(service))) {
+		tmp_status = status;
+		xasprintf(&status, "%s %s", tmp_status, timing);
+		free(tmp_status);
+		free(timing);
+	}
+
 	errno = 0;
 	switch (format) {
 	case FORMAT_DEFAULT:
@@ -280,6 +331,7 @@ int main(int argc, char **argv)
 	RC_SERVICE accept = -1;
 	RC_SERVICE reject = 0;
 	RC_STRING *s, *l, *t, *level;
+	RC_STRINGLIST *started;
 	const rc_service_state_name_t *it;
 	enum format_t format = FORMAT_DEFAULT;
 	bool levels_given = false;
@@ -296,13 +348,14 @@ int main(int argc, char **argv)
 			levels = rc_runlevel_list();
 			break;
 		case 'c':
-			services = rc_services_in_state(RC_SERVICE_STARTED);
+			started = services_in_state(RC_SERVICE_STARTED);
+			services = rc_services_daemons_crashed(started);
+			rc_stringlist_free(started);
 			retval = 1;
-			TAILQ_FOREACH(s, services, entries)
-				if (rc_service_daemons_crashed(s->value)) {
-					printf("%s\n", s->value);
-					retval = 0;
-				}
+			TAILQ_FOREACH(s, services, entries) {
+				printf("%s\n", s->value);
+				retval = 0;
+			}
 			goto exit;
 			/* NOTREACHED */
 		case 'f':
@@ -366,7 +419,7 @@ int main(int argc, char **argv)
 					}
 			}
 			TAILQ_FOREACH_SAFE(s, services, entries, t)
-				if (rc_service_state(s->value) &
+				if (service_state(s->value) &
 					(RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)) {
 					TAILQ_REMOVE(services, s, entries);
 					free(s->value);
@@ -380,8 +433,13 @@ int main(int argc, char **argv)
 			printf("%s\n", runlevel);
 			goto exit;
 			/* NOTREACHED */
+		case 't':
+			show_timings = true;
+			if (!timings)
+				timings = timings_load();
+			break;
 		case 'S':
-			services = rc_services_in_state(RC_SERVICE_STARTED);
+			services = services_in_state(RC_SERVICE_STARTED);
 			TAILQ_FOREACH_SAFE(s, services, entries, t) {
 				char *ret = rc_service_value_get(s->value, "child_pid");
 				if (!ret) {
@@ -453,7 +511,7 @@ int main(int argc, char **argv)
 	if (show_all || !levels_given) {
 		/* Show hotplugged services */
 		print_level("Dynamic", "hotplugged", format);
-		services = rc_services_in_state(RC_SERVICE_HOTPLUGGED);
+		services = services_in_state(RC_SERVICE_HOTPLUGGED);
 		print_services_in_state(NULL, services, format, accept, reject);
 		rc_stringlist_free(services);
 		services = NULL;
@@ -476,7 +534,7 @@ int main(int argc, char **argv)
 			rc_stringlist_free(nservices);
 		}
 		TAILQ_FOREACH_SAFE(s, services, entries, t) {
-			state = rc_service_state(s->value);
+			state = service_state(s->value);
 			if ((rc_stringlist_find(sservices, s->value) ||
 			    (state & ( RC_SERVICE_STOPPED | RC_SERVICE_HOTPLUGGED)))) {
 				if (!(state & RC_SERVICE_FAILED)) {
@@ -528,6 +586,8 @@ exit:
 	rc_stringlist_free(types);
 	rc_stringlist_free(levels);
 	rc_deptree_free(deptree);
+	rc_state_snapshot_free(snapshot);
+	timings_free(timings);
 
 	return retval;
 }
@@ -0,0 +1,391 @@
+/*
+ * rc-trace
+ * Show what a runlevel change spent its time on
+ */
+
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "einfo.h"
+#include "queue.h"
+#include "rc.h"
+#include "misc.h"
+#include "_usage.h"
+#include "helpers.h"
+
+const char *applet = NULL;
+const char *extraopts = NULL;
+const char getoptstring[] = "ajl" getoptstring_COMMON;
+const struct option longopts[] = {
+	{ "all",  0, NULL, 'a'},
+	{ "json", 0, NULL, 'j'},
+	{ "list", 0, NULL, 'l'},
+	longopts_COMMON
+};
+const char * const longopts_help[] = {
+	"Use the whole trace, not just the last runlevel change",
+	"Print the trace as Chrome trace event JSON",
+	"List the recorded events",
+	longopts_help_COMMON
+};
+const char *usagestring = NULL;
+
+static const char *const event_names[] = {
+	[RC_TRACE_RUNLEVEL] = "runlevel",
+	[RC_TRACE_MARK] = "mark",
+	[RC_TRACE_WAIT_BEGIN] = "wait",
+	[RC_TRACE_WAIT_END] = "waited",
+	[RC_TRACE_EXEC_BEGIN] = "exec",
+	[RC_TRACE_EXEC_END] = "exited",
+	[RC_TRACE_HOOK_BEGIN] = "hook",
+	[RC_TRACE_HOOK_END] = "hooked",
+	[RC_TRACE_DEPTREE_BEGIN] = "deptree",
+	[RC_TRACE_DEPTREE_END] = "deptreed",
+};
+
+/* A service going from starting or stopping to where it ended up */
+struct span {
+	const char *service;
+	int64_t begin;
+	int64_t end;		/* 0 while it has not got there */
+	bool stopping;
+};
+
+/* An event which has begun but not ended yet */
+struct pending {
+	const RC_TRACE_RECORD *rec;
+	bool done;
+};
+
+static const char *
+event_name(uint16_t event)
+{
+	if (event < ARRAY_SIZE(event_names) && event_names[event])
+		return event_names[event];
+	return "unknown";
+}
+
+static double
+seconds(int64_t ns)
+{
+	return (double)ns / 1e9;
+}
+
+/* Pair up the marks of each service into spans. */
+static struct span *
+find_spans(const RC_TRACE_RECORD *recs, size_t count, size_t *nspans)
+{
+	struct span *spans = NULL, *s;
+	size_t n = 0, i, j;
+
+	for (i = 0; i < count; i++) {
+		if (recs[i].event != RC_TRACE_MARK)
+			continue;
+		/* the latest span of this service */
+		for (s = NULL, j = n; j > 0; j--) {
+			if (strcmp(spans[j - 1].service, recs[i].service) == 0) {
+				s = &spans[j - 1];
+				break;
+			}
+		}
+		switch (recs[i].arg) {
+		case RC_SERVICE_STARTING:
+		case RC_SERVICE_STOPPING:
+			if (s && s->end == 0 &&
+			    s->stopping == (recs[i].arg == RC_SERVICE_STOPPING))
+				continue;
+			spans = xrealloc(spans, sizeof(*spans) * (n + 1));
+			s = &spans[n++];
+			s->service = recs[i].service;
+			s->begin = recs[i].time;
+			s->end = 0;
+			s->stopping = recs[i].arg == RC_SERVICE_STOPPING;
+			break;
+		case RC_SERVICE_STARTED:
+		case RC_SERVICE_INACTIVE:
+		case RC_SERVICE_STOPPED:
+		case RC_SERVICE_FAILED:
+			if (s && s->end == 0)
+				s->end = recs[i].time;
+			break;
+		default:
+			break;
+		}
+	}
+	*nspans = n;
+	return spans;
+}
+
+static const struct span *
+started_span(const struct span *spans, size_t nspans, const char *service)
+{
+	size_t i;
+
+	for (i = nspans; i > 0; i--)
+		if (!spans[i - 1].stopping && spans[i - 1].end &&
+		    strcmp(spans[i - 1].service, service) == 0)
+			return &spans[i - 1];
+	return NULL;
+}
+
+/*
+ * Start from the service which finished starting last and work back
+ * through its dependencies, each time taking the one which finished last
+ * before it did, as that is what it was left waiting for.
+ */
+static void
+critical_path(const struct span *spans, size_t nspans, int64_t t0)
+{
+	static const char *const types[] = { "ineed", "iuse", "iwant", "iafter" };
+	RC_DEPTREE *deptree = rc_deptree_load();
+	RC_STRINGLIST *deps;
+	RC_STRING *d;
+	const struct span **path = NULL;
+	const struct span *cur = NULL, *pred, *s;
+	size_t npath = 0, i, t;
+	int64_t from;
+
+	for (i = 0; i < nspans; i++)
+		if (!spans[i].stopping && spans[i].end &&
+		    (!cur || spans[i].end > cur->end))
+			cur = &spans[i];
+	if (!cur) {
+		printf("no services were started\n");
+		rc_deptree_free(deptree);
+		return;
+	}
+
+	while (cur && npath < nspans) {
+		path = xrealloc(path, sizeof(*path) * (npath + 1));
+		path[npath++] = cur;
+		pred = NULL;
+		for (t = 0; deptree && t < ARRAY_SIZE(types); t++) {
+			deps = rc_deptree_depend(deptree, cur->service, types[t]);
+			TAILQ_FOREACH(d, deps, entries) {
+				s = started_span(spans, nspans, d->value);
+				if (s && s != cur && s->end <= cur->end &&
+				    (!pred || s->end > pred->end))
+					pred = s;
+			}
+			rc_stringlist_free(deps);
+		}
+		cur = pred;
+	}
+
+	printf("critical path %.3fs\n", seconds(path[0]->end - t0));
+	for (i = npath; i > 0; i--) {
+		cur = path[i - 1];
+		from = cur->begin;
+		if (i < npath && path[i]->end > from)
+			from = path[i]->end;
+		printf("  %-24s @%.3fs +%.3fs\n", cur->service,
+		    seconds(cur->end - t0), seconds(cur->end - from));
+	}
+	free(path);
+	rc_deptree_free(deptree);
+}
+
+static void
+list_events(const RC_TRACE_RECORD *recs, size_t count, int64_t t0)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		printf("%12.6f %7d %-9s %-24s %-24s %d\n",
+		    seconds(recs[i].time - t0), (int)recs[i].pid,
+		    event_name(recs[i].event), recs[i].service,
+		    recs[i].detail, (int)recs[i].arg);
+}
+
+static void
+json_string(const char *str)
+{
+	const unsigned char *p;
+
+	putchar('"');
+	for (p = (const unsigned char *)str; *p; p++) {
+		if (*p == '"' || *p == '\\')
+			printf("\\%c", *p);
+		else if (*p < 0x20)
+			printf("\\u%04x", *p);
+		else
+			putchar(*p);
+	}
+	putchar('"');
+}
+
+static void
+json_event(bool *first, const char *name, const char *cat, const char *ph,
+    int64_t ts, int64_t dur, long pid, long tid)
+{
+	printf("%s\n{\"name\":", *first ? "" : ",");
+	*first = false;
+	json_string(name);
+	printf(",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f", cat, ph,
+	    (double)ts / 1e3);
+	if (*ph == 'X')
+		printf(",\"dur\":%.3f", (double)dur / 1e3);
+	else if (*ph == 'i')
+		printf(",\"s\":\"t\"");
+	printf(",\"pid\":%ld,\"tid\":%ld}", pid, tid);
+}
+
+/* Chrome trace events: a row for each service on how long it took to
+ * start or stop, and a row for each process on what it did meanwhile. */
+static void
+export_json(const RC_TRACE_RECORD *recs, size_t count,
+    const struct span *spans, size_t nspans, int64_t t0)
+{
+	struct pending *begun = xmalloc(sizeof(*begun) * (count + 1));
+	const RC_TRACE_RECORD *b = NULL;
+	size_t nbegun = 0, i, j;
+	bool first = true;
+	char *name;
+	int64_t end = count ? recs[count - 1].time : t0;
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	printf("\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,"
+	    "\"args\":{\"name\":\"services\"}}");
+	first = false;
+
+	for (i = 0; i < nspans; i++) {
+		xasprintf(&name, "%s %s", spans[i].service,
+		    spans[i].stopping ? "stopping" : "starting");
+		json_event(&first, name, "service", "X", spans[i].begin - t0,
+		    (spans[i].end ? spans[i].end : end) - spans[i].begin,
+		    0, (long)i + 1);
+		free(name);
+	}
+
+	for (i = 0; i < count; i++) {
+		switch (recs[i].event) {
+		case RC_TRACE_WAIT_BEGIN:
+		case RC_TRACE_EXEC_BEGIN:
+		case RC_TRACE_HOOK_BEGIN:
+		case RC_TRACE_DEPTREE_BEGIN:
+			/* waits may be begun again, keep the first */
+			for (j = 0; j < nbegun; j++)
+				if (!begun[j].done && begun[j].rec->pid == recs[i].pid &&
+				    begun[j].rec->event == recs[i].event &&
+				    strcmp(begun[j].rec->detail, recs[i].detail) == 0)
+					break;
+			if (j == nbegun) {
+				begun[nbegun].rec = &recs[i];
+				begun[nbegun++].done = false;
+			}
+			break;
+		case RC_TRACE_WAIT_END:
+		case RC_TRACE_EXEC_END:
+		case RC_TRACE_HOOK_END:
+		case RC_TRACE_DEPTREE_END:
+			for (j = nbegun; j > 0; j--) {
+				b = begun[j - 1].rec;
+				if (!begun[j - 1].done && b->pid == recs[i].pid &&
+				    b->event == recs[i].event - 1 &&
+				    strcmp(b->detail, recs[i].detail) == 0)
+					break;
+			}
+			if (j == 0)
+				break;
+			begun[j - 1].done = true;
+			if (b->event == RC_TRACE_WAIT_BEGIN)
+				xasprintf(&name, "wait %s", b->detail);
+			else if (b->event == RC_TRACE_HOOK_BEGIN)
+				xasprintf(&name, "%s hook %d", b->detail, (int)b->arg);
+			else if (b->event == RC_TRACE_DEPTREE_BEGIN)
+				name = xstrdup("deptree");
+			else
+				xasprintf(&name, "%s %s", b->service, b->detail);
+			json_event(&first, name, event_name(b->event), "X",
+			    b->time - t0, recs[i].time - b->time,
+			    (long)b->pid, (long)b->pid);
+			free(name);
+			break;
+		case RC_TRACE_RUNLEVEL:
+			json_event(&first, recs[i].detail, "runlevel", "i",
+			    recs[i].time - t0, 0, (long)recs[i].pid,
+			    (long)recs[i].pid);
+			break;
+		default:
+			break;
+		}
+	}
+	printf("\n]}\n");
+	free(begun);
+}
+
+int main(int argc, char **argv)
+{
+	RC_TRACE_RECORD *recs;
+	struct span *spans;
+	size_t count, nspans, from = 0, i;
+	bool all = false, json = false, list = false;
+	int opt;
+
+	applet = basename_c(argv[0]);
+	while ((opt = getopt_long(argc, argv, getoptstring,
+		    longopts, (int *) 0)) != -1)
+	{
+		switch (opt) {
+		case 'a':
+			all = true;
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'l':
+			list = true;
+			break;
+
+		case_RC_COMMON_GETOPT
+		}
+	}
+
+	if (!(recs = rc_trace_read(&count))) {
+		if (errno == ENOENT)
+			eerrorx("%s: nothing has been traced, set rc_trace=YES in rc.conf",
+			    applet);
+		eerrorx("%s: unable to read the trace: %s", applet, strerror(errno));
+	}
+	if (count == 0) {
+		free(recs);
+		eerrorx("%s: the trace is empty", applet);
+	}
+
+	if (!all)
+		for (i = count; i > 0; i--)
+			if (recs[i - 1].event == RC_TRACE_RUNLEVEL) {
+				from = i - 1;
+				break;
+			}
+
+	spans = find_spans(recs + from, count - from, &nspans);
+	if (list)
+		list_events(recs + from, count - from, recs[from].time);
+	else if (json)
+		export_json(recs + from, count - from, spans, nspans,
+		    recs[from].time);
+	else
+		critical_path(spans, nspans, recs[from].time);
+
+	free(spans);
+	free(recs);
+	return EXIT_SUCCESS;
+}
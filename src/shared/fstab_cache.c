@@ -0,0 +1,145 @@
+/*
+ * fstab_cache.c
+ * Reads /etc/fstab once for the applets which look things up in it.
+ */
+
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* getmntent on linux, as getfsent is missing from some of its libcs */
+#ifdef __linux__
+#  include <mntent.h>
+#else
+#  include <fstab.h>
+#endif
+
+#include "helpers.h"
+#include "fstab_cache.h"
+
+static uint32_t
+file_hash(const char *file)
+{
+	uint32_t hash = 2166136261u;
+
+	while (*file) {
+		hash ^= (unsigned char)*file++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void
+fstab_cache_add(struct fstab_cache *fstab, const char *spec, const char *file,
+		const char *vfstype, const char *mntopts, int passno)
+{
+	struct fstab_entry *ent = xmalloc(sizeof(*ent));
+
+	ent->spec = xstrdup(spec);
+	ent->file = xstrdup(file);
+	ent->vfstype = xstrdup(vfstype);
+	ent->mntopts = xstrdup(mntopts);
+	ent->passno = passno;
+	ent->hash_next = NULL;
+	TAILQ_INSERT_TAIL(&fstab->entries, ent, entries);
+}
+
+struct fstab_cache *
+fstab_cache_load(void)
+{
+	struct fstab_cache *fstab;
+	struct fstab_entry *ent, **slot;
+	size_t count = 0;
+#ifdef __linux__
+	struct mntent *mnt;
+	FILE *fp;
+
+	if (!(fp = setmntent("/etc/fstab", "r")))
+		return NULL;
+#else
+	struct fstab *fs;
+
+	if (!setfsent())
+		return NULL;
+#endif
+
+	fstab = xmalloc(sizeof(*fstab));
+	TAILQ_INIT(&fstab->entries);
+#ifdef __linux__
+	while ((mnt = getmntent(fp))) {
+		fstab_cache_add(fstab, mnt->mnt_fsname, mnt->mnt_dir,
+		    mnt->mnt_type, mnt->mnt_opts, mnt->mnt_passno);
+		count++;
+	}
+	endmntent(fp);
+#else
+	while ((fs = getfsent())) {
+		fstab_cache_add(fstab, fs->fs_spec, fs->fs_file,
+		    fs->fs_vfstype, fs->fs_mntops, fs->fs_passno);
+		count++;
+	}
+	endfsent();
+#endif
+
+	for (fstab->nslots = 16; fstab->nslots < count * 2; fstab->nslots <<= 1)
+		;
+	fstab->slots = xmalloc(fstab->nslots * sizeof(*fstab->slots));
+	memset(fstab->slots, 0, fstab->nslots * sizeof(*fstab->slots));
+
+	/* Lookups find the first entry for a mount point, as a scan would */
+	TAILQ_FOREACH(ent, &fstab->entries, entries) {
+		slot = &fstab->slots[file_hash(ent->file) & (fstab->nslots - 1)];
+		for (; *slot; slot = &(*slot)->hash_next)
+			if (strcmp((*slot)->file, ent->file) == 0)
+				break;
+		if (!*slot)
+			*slot = ent;
+	}
+	return fstab;
+}
+
+const struct fstab_entry *
+fstab_cache_find(const struct fstab_cache *fstab, const char *file)
+{
+	const struct fstab_entry *ent;
+
+	if (!fstab)
+		return NULL;
+	ent = fstab->slots[file_hash(file) & (fstab->nslots - 1)];
+	for (; ent; ent = ent->hash_next)
+		if (strcmp(ent->file, file) == 0)
+			return ent;
+	return NULL;
+}
+
+void
+fstab_cache_free(struct fstab_cache *fstab)
+{
+	struct fstab_entry *ent;
+
+	if (!fstab)
+		return;
+	while ((ent = TAILQ_FIRST(&fstab->entries))) {
+		TAILQ_REMOVE(&fstab->entries, ent, entries);
+		free(ent->spec);
+		free(ent->file);
+		free(ent->vfstype);
+		free(ent->mntopts);
+		free(ent);
+	}
+	free(fstab->slots);
+	free(fstab);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef __RC_FSTAB_CACHE_H
+#define __RC_FSTAB_CACHE_H
+
+#include <stddef.h>
+
+#include "queue.h"
+
+/*
+ * /etc/fstab read once into memory, in file order and hashed by mount
+ * point, so that looking up many mount points does not rescan the file.
+ */
+
+struct fstab_entry {
+	char *spec;
+	char *file;
+	char *vfstype;
+	char *mntopts;
+	int passno;
+	struct fstab_entry *hash_next;
+	TAILQ_ENTRY(fstab_entry) entries;
+};
+TAILQ_HEAD(fstab_entries, fstab_entry);
+
+struct fstab_cache {
+	struct fstab_entries entries;
+	struct fstab_entry **slots;
+	size_t nslots;
+};
+
+struct fstab_cache *fstab_cache_load(void);
+const struct fstab_entry *fstab_cache_find(const struct fstab_cache *fstab,
+		const char *file);
+void fstab_cache_free(struct fstab_cache *fstab);
+
+#endif
@@ -57,6 +57,23 @@ rc_conf_yesno(const char *setting)
 	return rc_yesno(rc_conf_value (setting));
 }
 
+/* Where state which outlives a boot is kept, NULL if we cannot tell. */
+char *
+rc_cachedir(void)
+{
+	const char *cache_home;
+	char *cachedir = NULL;
+
+	if (!rc_is_user())
+		return xstrdup("/var/cache/rc");
+
+	if ((cache_home = getenv("XDG_CACHE_HOME")))
+		xasprintf(&cachedir, "%s/rc", cache_home);
+	else if ((cache_home = getenv("HOME")))
+		xasprintf(&cachedir, "%s/.cache/rc", cache_home);
+	return cachedir;
+}
+
 static const char *const env_allowlist[] = {
 	"EERROR_QUIET", "EINFO_QUIET",
 	"IN_BACKGROUND", "IN_DRYRUN", "IN_HOTPLUG",
@@ -180,6 +197,7 @@ env_config(void)
 	const char *const *init_path = rc_scriptdirs();
 	char *buffer = NULL;
 	char *tmpdir;
+	char *cachedir;
 	size_t size = 0;
 
 	/* Ensure our PATH is prefixed with the system locations first
@@ -209,22 +227,9 @@ env_config(void)
 		free(e);
 	}
 
-	if (!rc_is_user()) {
-		setenv("RC_CACHEDIR", "/var/cache/rc", 1);
-	} else {
-		const char *cache_home = getenv("XDG_CACHE_HOME");
-		char *cachedir = NULL;
-
-		if (cache_home)
-			xasprintf(&cachedir, "%s/rc", cache_home);
-		else if ((cache_home = getenv("HOME")))
-			xasprintf(&cachedir, "%s/.cache/rc", cache_home);
-
-		if (cachedir)
-			setenv("RC_CACHEDIR", cachedir, 1);
-
-		free(cachedir);
-	}
+	if ((cachedir = rc_cachedir()))
+		setenv("RC_CACHEDIR", cachedir, 1);
+	free(cachedir);
 
 	xasprintf(&tmpdir, "%s/tmp", svcdir);
 	e = rc_runlevel_get();
@@ -429,7 +434,9 @@ RC_DEPTREE * _rc_deptree_load(int force, int *regen)
 
 			eerror("Clock skew detected with '%s'", file);
 			eerrorn("Adjusting mtime of '%s/deptree' to %s", rc_svcdir(), ctime(&t));
-			utimensat(rc_dirfd(RC_DIR_SVCDIR), "deptree", (struct timespec[]) {{ .tv_sec = t }, { .tv_sec = t }}, 0);
+			utimensat(svcdirfd, "deptree", (struct timespec[]) {{ .tv_sec = t }, { .tv_sec = t }}, 0);
+			/* Keep the compiled deptree from looking stale */
+			utimensat(svcdirfd, "deptree.bin", (struct timespec[]) {{ .tv_sec = t }, { .tv_sec = t }}, 0);
 
 			if ((fp = do_fopenat(svcdirfd, "clock-skewed", O_WRONLY | O_CREAT | O_TRUNC))) {
 				fprintf(fp, "%s\n", file);
@@ -16,15 +16,19 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <dirent.h>
 #include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #include "einfo.h"
@@ -35,18 +39,42 @@
 #include "helpers.h"
 
 #define RC_PLUGIN_HOOK "rc_plugin_hook"
+#define RC_PLUGIN_NOWAIT "rc_plugin_nowait"
+
+extern char **environ;
 
 bool rc_in_plugin = false;
 
+/*
+ * Each plugin runs in a host process of its own, so we never crash or are
+ * otherwise affected by it. The host is forked when the plugin is first
+ * needed and is sent each hook along with our environment over a socket.
+ * It replies with the environment variables the plugin set, unless the
+ * plugin said it never sets any from that hook, in which case we don't
+ * wait for it. If the host dies, another is started for the next hook.
+ */
 typedef struct plugin
 {
 	char *name;
 	void *handle;
 	int (*hook)(RC_HOOK, const char *);
+	const RC_HOOK *nowait;
+	pid_t host;
+	int fd;
 	TAILQ_ENTRY(plugin) entries;
 } PLUGIN;
 TAILQ_HEAD(, plugin) plugins;
 
+struct plugin_request {
+	int32_t hook;
+	uint32_t flags;
+	uint32_t value_len;
+	uint32_t env_len;
+};
+
+#define PLUGIN_VALUE	0x01	/* value is not NULL */
+#define PLUGIN_NOWAIT	0x02	/* no reply is wanted */
+
 void
 rc_plugin_load(void)
 {
@@ -91,106 +119,356 @@ rc_plugin_load(void)
 			plugin->name = xstrdup(d->d_name);
 			plugin->handle = h;
 			plugin->hook = fptr.func;
+			plugin->nowait = dlsym(h, RC_PLUGIN_NOWAIT);
+			plugin->host = 0;
+			plugin->fd = -1;
 			TAILQ_INSERT_TAIL(&plugins, plugin, entries);
 		}
 	}
 	closedir(dp);
 }
 
-void
-rc_plugin_run(RC_HOOK hook, const char *value)
+static bool
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t nw;
+
+	while (len > 0) {
+		if ((nw = send(fd, p, len, MSG_NOSIGNAL)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += nw;
+		len -= nw;
+	}
+	return true;
+}
+
+static bool
+read_all(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t nr;
+
+	while (len > 0) {
+		if ((nr = read(fd, p, len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		if (nr == 0)
+			return false;
+		p += nr;
+		len -= nr;
+	}
+	return true;
+}
+
+/* Our environment as NUL separated FOO=BAR strings. */
+static char *
+environ_block(size_t *len)
+{
+	char **e;
+	char *block, *p;
+	size_t size = 0;
+
+	for (e = environ; e && *e; e++)
+		size += strlen(*e) + 1;
+	p = block = xmalloc(size ? size : 1);
+	for (e = environ; e && *e; e++)
+		p = stpcpy(p, *e) + 1;
+	*len = size;
+	return block;
+}
+
+/* Set the variables in a block of NUL separated FOO=BAR strings,
+ * unsetting those which have no value. */
+static void
+environ_apply(char *block, size_t len)
+{
+	char *p = block, *token;
+
+	while (p < block + len && *p) {
+		token = strsep(&p, "=");
+		if (!token)
+			break;
+		unsetenv(token);
+		if (!p)
+			break;
+		if (*p) {
+			setenv(token, p, 1);
+			p += strlen(p) + 1;
+		} else
+			p++;
+	}
+}
+
+/* Make our environment the one the caller had when it ran the hook. */
+static void
+environ_replace(char *block, size_t len)
+{
+	RC_STRINGLIST *names = rc_stringlist_new();
+	RC_STRING *name;
+	char **e, *eq, *var;
+
+	for (e = environ; e && *e; e++) {
+		if (!(eq = strchr(*e, '=')))
+			continue;
+		xasprintf(&var, "%.*s", (int)(eq - *e), *e);
+		rc_stringlist_add(names, var);
+		free(var);
+	}
+	TAILQ_FOREACH(name, names, entries)
+		unsetenv(name->value);
+	rc_stringlist_free(names);
+	environ_apply(block, len);
+}
+
+RC_NORETURN static void
+plugin_host(PLUGIN *plugin, int fd)
+{
+	struct plugin_request req;
+	char *value = NULL, *env = NULL, *last = NULL, *buffer;
+	size_t last_len = 0, size;
+	uint32_t len;
+
+	while (read_all(fd, &req, sizeof(req))) {
+		value = xrealloc(value, req.value_len + 1);
+		env = xrealloc(env, req.env_len + 1);
+		if (!read_all(fd, value, req.value_len) ||
+		    !read_all(fd, env, req.env_len))
+			break;
+		value[req.value_len] = '\0';
+
+		/* the environment rarely changes between hooks */
+		if (!last || last_len != req.env_len ||
+		    memcmp(last, env, req.env_len) != 0) {
+			last = xrealloc(last, req.env_len + 1);
+			memcpy(last, env, req.env_len);
+			last_len = req.env_len;
+			environ_replace(env, req.env_len);
+		}
+
+		buffer = NULL;
+		size = 0;
+		rc_environ_fd = open_memstream(&buffer, &size);
+		plugin->hook(req.hook, req.flags & PLUGIN_VALUE ? value : NULL);
+		if (rc_environ_fd)
+			fclose(rc_environ_fd);
+		rc_environ_fd = NULL;
+
+		/* Just in case the plugin sets this to false */
+		rc_in_plugin = true;
+
+		if (!(req.flags & PLUGIN_NOWAIT)) {
+			len = buffer ? size : 0;
+			if (!write_all(fd, &len, sizeof(len)) ||
+			    !write_all(fd, buffer, len))
+				break;
+		}
+		free(buffer);
+	}
+	exit(EXIT_SUCCESS);
+}
+
+/*
+ * The host is never exec'ed, so it would keep every file we had open,
+ * along with any lock on it such as the exclusive lock of openrc-run,
+ * for as long as it runs. Close all of them but stdio, our socket and the
+ * directories librc keeps open for itself.
+ */
+static void
+plugin_host_close_fds(int keep)
+{
+	struct dirent *d;
+	struct stat st;
+	int *fds = NULL;
+	size_t count = 0;
+	int fd, max;
+	DIR *dp;
+
+	closelog();
+	if ((dp = opendir("/proc/self/fd"))) {
+		while ((d = readdir(dp))) {
+			if (d->d_name[0] == '.' || (fd = atoi(d->d_name)) == dirfd(dp))
+				continue;
+			fds = xrealloc(fds, (count + 1) * sizeof(*fds));
+			fds[count++] = fd;
+		}
+		closedir(dp);
+	} else {
+		for (fd = 0, max = getdtablesize(); fd < max; fd++) {
+			if (fcntl(fd, F_GETFD) == -1)
+				continue;
+			fds = xrealloc(fds, (count + 1) * sizeof(*fds));
+			fds[count++] = fd;
+		}
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		fd = fds[i];
+		if (fd <= STDERR_FILENO || fd == keep)
+			continue;
+		if (fstat(fd, &st) == 0 && S_ISDIR(st.st_mode))
+			continue;
+		close(fd);
+	}
+	free(fds);
+}
+
+static bool
+plugin_host_start(PLUGIN *plugin)
 {
-	PLUGIN *plugin;
 	struct sigaction sa;
-	sigset_t empty;
 	sigset_t full;
 	sigset_t old;
-	int pfd[2];
+	int sv[2];
 	pid_t pid;
-	char *buffer;
-	char *token;
-	char *p;
-	ssize_t nr;
-	int retval;
 
-	/* Don't run plugins if we're in one */
-	if (rc_in_plugin)
-		return;
+	/* O_CLOEXEC to stop any scripts from inheriting us.
+	 * This is actually quite important as without this, the splash
+	 * plugin will probably hang when running in silent mode. */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+		eerror("socketpair: %s", strerror(errno));
+		return false;
+	}
 
 	/* We need to block signals until we have forked */
 	memset(&sa, 0, sizeof(sa));
 	sa.sa_handler = SIG_DFL;
 	sigemptyset(&sa.sa_mask);
-	sigemptyset(&empty);
 	sigfillset(&full);
+	sigprocmask(SIG_SETMASK, &full, &old);
 
-	TAILQ_FOREACH(plugin, &plugins, entries) {
-		/* We create a pipe so that plugins can affect our environment
-		 * vars, which in turn influence our scripts.
-		 * O_CLOEXEC to stop any scripts from inheriting us.
-		 * This is actually quite important as without this, the splash
-		 * plugin will probably hang when running in silent mode. */
-		if (pipe2(pfd, O_CLOEXEC) == -1) {
-			eerror("pipe2: %s", strerror(errno));
-			return;
-		}
+	if ((pid = fork()) == -1) {
+		eerror("fork: %s", strerror(errno));
+		sigprocmask(SIG_SETMASK, &old, NULL);
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
 
-		sigprocmask(SIG_SETMASK, &full, &old);
+	if (pid == 0) {
+		/* Restore default handlers */
+		sigaction(SIGCHLD, &sa, NULL);
+		sigaction(SIGHUP,  &sa, NULL);
+		sigaction(SIGINT,  &sa, NULL);
+		sigaction(SIGQUIT, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		sigaction(SIGUSR1, &sa, NULL);
+		sigaction(SIGWINCH, &sa, NULL);
+		sigprocmask(SIG_SETMASK, &old, NULL);
 
-		/* We run the plugin in a new process so we never crash
-		 * or otherwise affected by it */
-		if ((pid = fork()) == -1) {
-			eerror("fork: %s", strerror(errno));
-			break;
-		}
+		/* In a group of our own, like the logger, so openrc does not
+		 * wait for us along with its services */
+		setpgid(0, 0);
+		rc_in_plugin = true;
+		/* This includes the sockets of other hosts, which must see
+		 * us go when the caller does */
+		plugin_host_close_fds(sv[1]);
+		plugin_host(plugin, sv[1]);
+	}
 
-		if (pid == 0) {
-			/* Restore default handlers */
-			sigaction(SIGCHLD, &sa, NULL);
-			sigaction(SIGHUP,  &sa, NULL);
-			sigaction(SIGINT,  &sa, NULL);
-			sigaction(SIGQUIT, &sa, NULL);
-			sigaction(SIGTERM, &sa, NULL);
-			sigaction(SIGUSR1, &sa, NULL);
-			sigaction(SIGWINCH, &sa, NULL);
-			sigprocmask(SIG_SETMASK, &old, NULL);
-
-			rc_in_plugin = true;
-			close(pfd[0]);
-			rc_environ_fd = fdopen(pfd[1], "w");
-			retval = plugin->hook(hook, value);
-			fclose(rc_environ_fd);
-			rc_environ_fd = NULL;
+	setpgid(pid, 0);
+	sigprocmask(SIG_SETMASK, &old, NULL);
+	close(sv[1]);
+	plugin->host = pid;
+	plugin->fd = sv[0];
+	return true;
+}
 
-			/* Just in case the plugin sets this to false */
-			rc_in_plugin = true;
-			exit(retval);
-		}
+static void
+plugin_host_stop(PLUGIN *plugin)
+{
+	if (plugin->fd == -1)
+		return;
+	close(plugin->fd);
+	plugin->fd = -1;
+	/* It exits once it has run what we already sent */
+	waitpid(plugin->host, NULL, WNOHANG);
+	plugin->host = 0;
+}
 
-		sigprocmask(SIG_SETMASK, &old, NULL);
-		close(pfd[1]);
-		buffer = xmalloc(sizeof(char) * BUFSIZ);
-		memset(buffer, 0, BUFSIZ);
-
-		while ((nr = read(pfd[0], buffer, BUFSIZ)) > 0) {
-			p = buffer;
-			while (*p && p - buffer < nr) {
-				token = strsep(&p, "=");
-				if (token) {
-					unsetenv(token);
-					if (*p) {
-						setenv(token, p, 1);
-						p += strlen(p) + 1;
-					} else
-						p++;
-				}
-			}
-		}
+static bool
+plugin_waits(const PLUGIN *plugin, RC_HOOK hook)
+{
+	const RC_HOOK *h;
+
+	for (h = plugin->nowait; h && *h; h++)
+		if (*h == hook)
+			return false;
+	return true;
+}
+
+static bool
+plugin_send(PLUGIN *plugin, RC_HOOK hook, const char *value, bool wait)
+{
+	struct plugin_request req;
+	char *env;
+	size_t env_len;
+	bool ok;
+
+	env = environ_block(&env_len);
+	req.hook = hook;
+	req.flags = (value ? PLUGIN_VALUE : 0) | (wait ? 0 : PLUGIN_NOWAIT);
+	req.value_len = value ? strlen(value) : 0;
+	req.env_len = env_len;
+	ok = write_all(plugin->fd, &req, sizeof(req)) &&
+	    write_all(plugin->fd, value, req.value_len) &&
+	    write_all(plugin->fd, env, env_len);
+	free(env);
+	return ok;
+}
 
+/* Plugins can affect our environment vars, which in turn influence
+ * our scripts. */
+static bool
+plugin_reply(PLUGIN *plugin)
+{
+	char *buffer;
+	uint32_t len;
+
+	if (!read_all(plugin->fd, &len, sizeof(len)))
+		return false;
+	buffer = xmalloc(len + 1);
+	if (!read_all(plugin->fd, buffer, len)) {
 		free(buffer);
-		close(pfd[0]);
+		return false;
+	}
+	buffer[len] = '\0';
+	environ_apply(buffer, len);
+	free(buffer);
+	return true;
+}
+
+void
+rc_plugin_run(RC_HOOK hook, const char *value)
+{
+	PLUGIN *plugin;
+	bool wait, sent;
+	int tries;
+
+	/* Don't run plugins if we're in one */
+	if (rc_in_plugin)
+		return;
+
+	TAILQ_FOREACH(plugin, &plugins, entries) {
+		wait = plugin_waits(plugin, hook);
+		rc_trace(RC_TRACE_HOOK_BEGIN, value, plugin->name, hook);
+
+		/* The host may have died since the last hook */
+		for (sent = false, tries = 0; !sent && tries < 2; tries++) {
+			if (plugin->fd == -1 && !plugin_host_start(plugin))
+				break;
+			if (!(sent = plugin_send(plugin, hook, value, wait)))
+				plugin_host_stop(plugin);
+		}
+		if (sent && wait && !plugin_reply(plugin))
+			plugin_host_stop(plugin);
 
-		rc_waitpid(pid);
+		rc_trace(RC_TRACE_HOOK_END, value, plugin->name, hook);
 	}
 }
 
@@ -202,6 +480,7 @@ rc_plugin_unload(void)
 
 	while (plugin) {
 		next = TAILQ_NEXT(plugin, entries);
+		plugin_host_stop(plugin);
 		dlclose(plugin->handle);
 		free(plugin->name);
 		free(plugin);
@@ -31,12 +31,18 @@
 #include <syslog.h>
 #include <time.h>
 #include <sys/types.h>
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#endif
 
 #include "einfo.h"
 #include "queue.h"
 #include "rc.h"
 #include "schedules.h"
 #include "helpers.h"
+#include "timeutils.h"
 
 typedef struct scheduleitem {
 	enum {
@@ -303,6 +309,132 @@ int do_stop(const char *applet, const char *exec, const char *const *argv,
 	return nkilled;
 }
 
+#if defined(__linux__) && defined(SYS_pidfd_open)
+struct pidfds {
+	struct pollfd *fds;
+	pid_t *pids;
+	size_t count;
+	pid_t *gone;		/* exited, though maybe not reaped yet */
+	size_t ngone;
+};
+
+static bool pidfds_gone(struct pidfds *pf, pid_t pid)
+{
+	size_t i;
+
+	for (i = 0; i < pf->ngone; i++)
+		if (pf->gone[i] == pid)
+			return true;
+	for (i = 0; i < pf->count; i++)
+		if (pf->pids[i] == pid)
+			return true;
+	return false;
+}
+
+/* Look for processes to wait on which we are not waiting on yet.
+ * Returns false if pidfds cannot be used. */
+static bool pidfds_add(struct pidfds *pf, const char *exec,
+		const char *const *argv, pid_t pid, uid_t uid)
+{
+	RC_PIDLIST *pids;
+	RC_PID *pi, *np;
+	bool ok = true;
+	int fd;
+
+	if (pid > 0)
+		pids = rc_find_pids(NULL, NULL, 0, pid);
+	else
+		pids = rc_find_pids(exec, argv, uid, 0);
+	if (!pids)
+		return true;
+
+	LIST_FOREACH_SAFE(pi, pids, entries, np) {
+		if (ok && !pidfds_gone(pf, pi->pid)) {
+			fd = syscall(SYS_pidfd_open, pi->pid, 0);
+			if (fd != -1) {
+				pf->fds = xrealloc(pf->fds, sizeof(*pf->fds) * (pf->count + 1));
+				pf->pids = xrealloc(pf->pids, sizeof(*pf->pids) * (pf->count + 1));
+				pf->fds[pf->count].fd = fd;
+				pf->fds[pf->count].events = POLLIN;
+				pf->pids[pf->count++] = pi->pid;
+			} else if (errno != ESRCH)
+				ok = false;
+		}
+		free(pi);
+	}
+	free(pids);
+	return ok;
+}
+
+/* Wait up to seconds (forever if negative) for the processes we are
+ * stopping to exit. Instead of looking through every process every
+ * POLL_INTERVAL, we find them once and wait on pidfds, only looking
+ * again for ones which appeared meanwhile once they have all gone.
+ * Returns how many are still running, or -1 if pidfds cannot be used. */
+static int wait_pidfds(const char *exec, const char *const *argv,
+		pid_t pid, uid_t uid, int seconds, bool progress, bool *progressed)
+{
+	struct pidfds pf = { 0 };
+	int64_t now = tm_now();
+	int64_t deadline = now + TM_SEC(seconds);
+	int64_t tick = now + TM_SEC(1);
+	int64_t wake;
+	int nrunning = -1;
+	size_t i;
+
+	if (!pidfds_add(&pf, exec, argv, pid, uid))
+		goto out;
+
+	for (;;) {
+		if (pf.count == 0) {
+			if (!pidfds_add(&pf, exec, argv, pid, uid))
+				goto out;
+			if (pf.count == 0) {
+				nrunning = 0;
+				goto out;
+			}
+		}
+
+		now = tm_now();
+		if (now >= tick) {
+			if (progress) {
+				printf(".");
+				fflush(stdout);
+				*progressed = true;
+			}
+			tick += TM_SEC(1);
+		}
+		if (seconds >= 0 && now >= deadline) {
+			nrunning = pf.count;
+			goto out;
+		}
+		wake = seconds >= 0 && deadline < tick ? deadline : tick;
+		if (poll(pf.fds, pf.count, wake > now ? (int)(wake - now) : 0) <= 0)
+			continue;
+
+		for (i = 0; i < pf.count;) {
+			if (!pf.fds[i].revents) {
+				i++;
+				continue;
+			}
+			close(pf.fds[i].fd);
+			pf.gone = xrealloc(pf.gone, sizeof(*pf.gone) * (pf.ngone + 1));
+			pf.gone[pf.ngone++] = pf.pids[i];
+			pf.fds[i] = pf.fds[--pf.count];
+			pf.pids[i] = pf.pids[pf.count];
+		}
+	}
+
+out:
+	for (i = 0; i < pf.count; i++)
+		close(pf.fds[i].fd);
+	free(pf.fds);
+	free(pf.pids);
+	free(pf.gone);
+	return nrunning;
+}
+#endif
+
 int run_stop_schedule(const char *applet,
 		const char *exec, const char *const *argv,
 		pid_t pid, uid_t uid, bool group,
@@ -379,6 +511,18 @@ int run_stop_schedule(const char *applet,
 				break;
 			}
 
+#if defined(__linux__) && defined(SYS_pidfd_open)
+			/* A process group cannot be waited on as a whole */
+			if (!test && !group) {
+				nrunning = wait_pidfds(exec, argv, pid, uid,
+						item->type == SC_FOREVER ? -1 : item->value,
+						progress, &progressed);
+				if (nrunning == 0)
+					return 0;
+				if (nrunning > 0)
+					break;
+			}
+#endif
 			ts.tv_sec = 0;
 			ts.tv_nsec = POLL_INTERVAL;
 
@@ -0,0 +1,263 @@
+/*
+ * timings.c
+ * Remember how long services take to start and stop.
+ */
+
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rc.h"
+#include "misc.h"
+#include "helpers.h"
+#include "timings.h"
+
+/*
+ * The file is a header followed by one fixed size record per service.
+ * Each record keeps the last few samples of each kind in a small ring,
+ * along with the mtime of the init script they were taken with.
+ */
+#define TIMINGS_FILE	"timings"
+#define TIMINGS_MAGIC	"RCTM"
+#define TIMINGS_VERSION	1
+#define TIMING_SAMPLES	20
+#define TIMING_NAMELEN	64
+
+struct timings_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t pad;
+};
+
+struct timing_samples {
+	uint32_t ms[TIMING_SAMPLES];
+	uint32_t count;		/* samples ever taken */
+};
+
+struct timing_record {
+	char service[TIMING_NAMELEN];
+	int64_t mtime;
+	struct timing_samples kind[TIMING_KINDS];
+};
+
+struct timings {
+	struct timing_record *records;
+	size_t count;
+};
+
+static void
+timings_header_init(struct timings_header *hdr)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, TIMINGS_MAGIC, sizeof(hdr->magic));
+	hdr->version = TIMINGS_VERSION;
+	hdr->record_size = sizeof(struct timing_record);
+}
+
+static bool
+timings_header_valid(const struct timings_header *hdr)
+{
+	struct timings_header want;
+
+	timings_header_init(&want);
+	return memcmp(hdr, &want, sizeof(want)) == 0;
+}
+
+static int
+timings_open(int flags)
+{
+	char *dir = rc_cachedir();
+	char *path;
+	int fd;
+
+	if (!dir)
+		return -1;
+	if (flags & O_CREAT)
+		mkdir(dir, 0755);
+	xasprintf(&path, "%s/%s", dir, TIMINGS_FILE);
+	fd = open(path, flags | O_CLOEXEC, 0644);
+	free(path);
+	free(dir);
+	return fd;
+}
+
+/* The mtime of the init script, so we know when samples go stale. */
+static int64_t
+script_mtime(const char *service)
+{
+	char *path = rc_service_resolve(service);
+	struct stat st;
+	int64_t mtime = 0;
+
+	if (path && stat(path, &st) == 0)
+		mtime = (int64_t)st.st_mtime;
+	free(path);
+	return mtime;
+}
+
+void
+timing_record(const char *service, enum timing_kind kind, int64_t ms)
+{
+	struct timings_header hdr;
+	struct timing_record rec;
+	struct timing_samples *s;
+	struct stat st;
+	off_t off;
+	int64_t mtime;
+	int fd;
+
+	if (strlen(service) >= TIMING_NAMELEN || ms < 0)
+		return;
+	if ((fd = timings_open(O_RDWR | O_CREAT)) == -1)
+		return;
+	if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
+		goto out;
+
+	/* Start again if the file is not one of ours */
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    !timings_header_valid(&hdr) ||
+	    (st.st_size - sizeof(hdr)) % sizeof(rec) != 0) {
+		timings_header_init(&hdr);
+		if (ftruncate(fd, 0) == -1 ||
+		    pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+			goto out;
+		st.st_size = sizeof(hdr);
+	}
+
+	for (off = sizeof(hdr); off < st.st_size; off += sizeof(rec)) {
+		if (pread(fd, &rec, sizeof(rec), off) != sizeof(rec))
+			goto out;
+		if (strncmp(rec.service, service, sizeof(rec.service)) == 0)
+			break;
+	}
+
+	mtime = script_mtime(service);
+	if (off >= st.st_size) {
+		memset(&rec, 0, sizeof(rec));
+		strcpy(rec.service, service);
+		rec.mtime = mtime;
+	} else if (rec.mtime != mtime) {
+		memset(rec.kind, 0, sizeof(rec.kind));
+		rec.mtime = mtime;
+	}
+
+	s = &rec.kind[kind];
+	s->ms[s->count % TIMING_SAMPLES] = ms > UINT32_MAX ? UINT32_MAX : (uint32_t)ms;
+	s->count++;
+	/* a short write leaves the file misaligned, which is reset next time */
+	pwrite(fd, &rec, sizeof(rec), off);
+
+out:
+	close(fd);
+}
+
+static int
+timing_record_cmp(const void *a, const void *b)
+{
+	return strncmp(((const struct timing_record *)a)->service,
+	    ((const struct timing_record *)b)->service, TIMING_NAMELEN);
+}
+
+struct timings *
+timings_load(void)
+{
+	struct timings *timings;
+	struct timings_header hdr;
+	struct stat st;
+	size_t size;
+	int fd;
+
+	if ((fd = timings_open(O_RDONLY)) == -1)
+		return NULL;
+	timings = xmalloc(sizeof(*timings));
+	timings->records = NULL;
+	timings->count = 0;
+
+	if (flock(fd, LOCK_SH) == -1 || fstat(fd, &st) == -1 ||
+	    read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+	    !timings_header_valid(&hdr))
+		goto out;
+
+	size = st.st_size - sizeof(hdr);
+	timings->count = size / sizeof(struct timing_record);
+	timings->records = xmalloc(size ? size : 1);
+	if (read(fd, timings->records, size) != (ssize_t)size) {
+		timings->count = 0;
+		goto out;
+	}
+	for (size_t i = 0; i < timings->count; i++)
+		timings->records[i].service[TIMING_NAMELEN - 1] = '\0';
+	qsort(timings->records, timings->count, sizeof(struct timing_record),
+	    timing_record_cmp);
+
+out:
+	close(fd);
+	return timings;
+}
+
+static int
+uint32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+bool
+timings_get(const struct timings *timings, const char *service,
+		enum timing_kind kind, struct timing *timing)
+{
+	struct timing_record key, *rec;
+	const struct timing_samples *s;
+	uint32_t sorted[TIMING_SAMPLES];
+	uint64_t sum = 0;
+	size_t n;
+
+	if (!timings || strlen(service) >= TIMING_NAMELEN)
+		return false;
+	strcpy(key.service, service);
+	rec = bsearch(&key, timings->records, timings->count,
+	    sizeof(struct timing_record), timing_record_cmp);
+	if (!rec || rec->kind[kind].count == 0 ||
+	    rec->mtime != script_mtime(service))
+		return false;
+
+	s = &rec->kind[kind];
+	n = s->count < TIMING_SAMPLES ? s->count : TIMING_SAMPLES;
+	memcpy(sorted, s->ms, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), uint32_cmp);
+	for (size_t i = 0; i < n; i++)
+		sum += sorted[i];
+
+	timing->last = s->ms[(s->count - 1) % TIMING_SAMPLES];
+	timing->mean = (uint32_t)(sum / n);
+	timing->p95 = sorted[(n * 95 + 99) / 100 - 1];
+	timing->count = s->count;
+	return true;
+}
+
+void
+timings_free(struct timings *timings)
+{
+	if (!timings)
+		return;
+	free(timings->records);
+	free(timings);
+}
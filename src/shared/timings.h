@@ -0,0 +1,46 @@
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef __RC_TIMINGS_H
+#define __RC_TIMINGS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * How long services take to start and stop, kept across boots in
+ * RC_CACHEDIR. Samples are forgotten when the init script changes.
+ */
+
+enum timing_kind {
+	TIMING_START,
+	TIMING_STOP,
+	TIMING_KINDS,
+};
+
+/* all in milliseconds, over the last few runs */
+struct timing {
+	uint32_t last;
+	uint32_t mean;
+	uint32_t p95;
+	uint32_t count;
+};
+
+struct timings;
+
+void timing_record(const char *service, enum timing_kind kind, int64_t ms);
+struct timings *timings_load(void);
+bool timings_get(const struct timings *timings, const char *service,
+		enum timing_kind kind, struct timing *timing);
+void timings_free(struct timings *timings);
+
+#endif
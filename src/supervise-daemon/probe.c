@@ -0,0 +1,343 @@
+/*
+ * probe.c
+ * Health checks run by supervise-daemon itself.
+ */
+
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "helpers.h"
+#include "probe.h"
+#include "timeutils.h"
+
+enum probe_type {
+	PROBE_PID,
+	PROBE_TCP,
+	PROBE_UNIX,
+	PROBE_HTTP,
+	PROBE_FILE,
+};
+
+struct probe {
+	enum probe_type type;
+	const char *host;
+	const char *port;
+	const char *path;
+	long age;
+};
+
+/* Split host:port, where host may be an IPv6 address in brackets. */
+static bool probe_hostport(char *str, struct probe *p, const char *port)
+{
+	char *sep;
+
+	if (*str == '[') {
+		if (!(sep = strchr(str, ']')))
+			return false;
+		*sep++ = '\0';
+		p->host = str + 1;
+		if (*sep != '\0' && *sep != ':')
+			return false;
+	} else {
+		p->host = str;
+		sep = strrchr(str, ':');
+	}
+	if (sep && *sep == ':') {
+		*sep++ = '\0';
+		p->port = sep;
+	} else
+		p->port = port;
+	return *p->host && p->port && *p->port;
+}
+
+/* Parse one probe, which is modified in place. */
+static bool probe_parse(char *spec, struct probe *p)
+{
+	char *sep, *end;
+
+	memset(p, 0, sizeof(*p));
+	if (strcmp(spec, "pid") == 0) {
+		p->type = PROBE_PID;
+		return true;
+	}
+	if (strncmp(spec, "tcp:", 4) == 0) {
+		p->type = PROBE_TCP;
+		return probe_hostport(spec + 4, p, NULL);
+	}
+	if (strncmp(spec, "unix:", 5) == 0) {
+		p->type = PROBE_UNIX;
+		p->path = spec + 5;
+		return *p->path && strlen(p->path) < sizeof(((struct sockaddr_un *)0)->sun_path);
+	}
+	if (strncmp(spec, "http://", 7) == 0) {
+		p->type = PROBE_HTTP;
+		spec += 7;
+		/* the path is kept without its leading slash */
+		if ((sep = strchr(spec, '/'))) {
+			*sep++ = '\0';
+			p->path = sep;
+		} else
+			p->path = "";
+		return probe_hostport(spec, p, "80");
+	}
+	if (strncmp(spec, "file:", 5) == 0) {
+		p->type = PROBE_FILE;
+		p->path = spec + 5;
+		if (!(sep = strrchr(p->path, ':')) || sep == p->path)
+			return false;
+		*sep++ = '\0';
+		errno = 0;
+		p->age = strtol(sep, &end, 10);
+		return errno == 0 && *sep && *end == '\0' && p->age > 0;
+	}
+	return false;
+}
+
+/* Wait for events on fd until the deadline. */
+static bool probe_wait(int fd, short events, int64_t deadline)
+{
+	struct pollfd pfd;
+	int64_t left;
+	int r;
+
+	pfd.fd = fd;
+	pfd.events = events;
+	do {
+		if ((left = deadline - tm_now()) <= 0) {
+			errno = ETIMEDOUT;
+			return false;
+		}
+		r = poll(&pfd, 1, left > INT_MAX ? INT_MAX : (int)left);
+	} while (r == -1 && errno == EINTR);
+	if (r == 0)
+		errno = ETIMEDOUT;
+	return r > 0;
+}
+
+static int probe_connect(const struct sockaddr *addr, socklen_t len,
+		int64_t deadline)
+{
+	int fd, err;
+	socklen_t errlen = sizeof(err);
+
+	if ((fd = socket(addr->sa_family, SOCK_STREAM, 0)) == -1)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	if (connect(fd, addr, len) == 0)
+		return fd;
+	if (errno == EINPROGRESS && probe_wait(fd, POLLOUT, deadline) &&
+	    getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) == 0) {
+		if (err == 0)
+			return fd;
+		errno = err;
+	}
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+static int probe_connect_inet(const struct probe *p, int64_t deadline)
+{
+	struct addrinfo hints, *res, *ai;
+	int fd = -1;
+	int r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((r = getaddrinfo(p->host, p->port, &hints, &res)) != 0) {
+		errno = r == EAI_SYSTEM ? errno : EADDRNOTAVAIL;
+		return -1;
+	}
+	for (ai = res; ai && fd == -1; ai = ai->ai_next)
+		fd = probe_connect(ai->ai_addr, ai->ai_addrlen, deadline);
+	freeaddrinfo(res);
+	return fd;
+}
+
+static int probe_connect_unix(const struct probe *p, int64_t deadline)
+{
+	struct sockaddr_un sun;
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, p->path);
+	return probe_connect((struct sockaddr *) &sun, sizeof(sun), deadline);
+}
+
+/* Send a GET request and look at the status of the response. */
+static bool probe_http(const struct probe *p, int fd, int64_t deadline)
+{
+	char buf[256];
+	char *req;
+	size_t len, done = 0;
+	ssize_t r;
+	int status;
+
+	len = xasprintf(&req, "GET /%s HTTP/1.0\r\nHost: %s\r\n"
+			"User-Agent: supervise-daemon\r\nConnection: close\r\n\r\n",
+			p->path, p->host);
+	while (done < len) {
+		if (!probe_wait(fd, POLLOUT, deadline))
+			break;
+		if ((r = send(fd, req + done, len - done, MSG_NOSIGNAL)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			break;
+		}
+		done += r;
+	}
+	free(req);
+	if (done < len)
+		return false;
+
+	/* we only need the status line */
+	len = 0;
+	while (len < sizeof(buf) - 1) {
+		if (!probe_wait(fd, POLLIN, deadline))
+			return false;
+		if ((r = recv(fd, buf + len, sizeof(buf) - 1 - len, 0)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			return false;
+		}
+		if (r == 0)
+			break;
+		len += r;
+		buf[len] = '\0';
+		if (strchr(buf, '\n'))
+			break;
+	}
+	buf[len] = '\0';
+	if (strncmp(buf, "HTTP/", 5) != 0 ||
+	    sscanf(buf, "HTTP/%*s %d", &status) != 1) {
+		errno = EPROTO;
+		return false;
+	}
+	if (status < 200 || status > 399) {
+		syslog(LOG_INFO, "http://%s/%s returned status %d",
+				p->host, p->path, status);
+		errno = 0;
+		return false;
+	}
+	return true;
+}
+
+static bool probe_file(const struct probe *p)
+{
+	struct stat st;
+
+	if (stat(p->path, &st) == -1)
+		return false;
+	if (time(NULL) - st.st_mtime > p->age) {
+		errno = ESTALE;
+		return false;
+	}
+	return true;
+}
+
+static bool probe_one(const struct probe *p, pid_t pid, int64_t deadline)
+{
+	bool ok;
+	int fd;
+
+	switch (p->type) {
+	case PROBE_PID:
+		if (pid <= 0) {
+			errno = ESRCH;
+			return false;
+		}
+		return kill(pid, 0) == 0;
+	case PROBE_FILE:
+		return probe_file(p);
+	case PROBE_UNIX:
+		fd = probe_connect_unix(p, deadline);
+		break;
+	default:
+		fd = probe_connect_inet(p, deadline);
+		break;
+	}
+	if (fd == -1)
+		return false;
+	ok = p->type != PROBE_HTTP || probe_http(p, fd, deadline);
+	close(fd);
+	return ok;
+}
+
+/* Call fn on each probe in the list, stopping when it returns false. */
+static bool probe_each(const char *probes,
+		bool (*fn)(const char *, const struct probe *, pid_t, int64_t),
+		pid_t pid, int64_t deadline)
+{
+	char *list = xstrdup(probes);
+	char *token, *spec, *save = NULL;
+	struct probe p;
+	bool ok = true;
+
+	for (token = strtok_r(list, " \t\n", &save); token && ok;
+	     token = strtok_r(NULL, " \t\n", &save)) {
+		spec = xstrdup(token);
+		ok = probe_parse(spec, &p) && fn(token, &p, pid, deadline);
+		free(spec);
+	}
+	free(list);
+	return ok;
+}
+
+static bool probe_parsed(const char *spec RC_UNUSED,
+		const struct probe *p RC_UNUSED, pid_t pid RC_UNUSED,
+		int64_t deadline RC_UNUSED)
+{
+	return true;
+}
+
+static bool probe_passes(const char *spec, const struct probe *p,
+		pid_t pid, int64_t deadline)
+{
+	if (probe_one(p, pid, deadline))
+		return true;
+	if (errno)
+		syslog(LOG_INFO, "health probe %s failed: %s", spec, strerror(errno));
+	else
+		syslog(LOG_INFO, "health probe %s failed", spec);
+	return false;
+}
+
+bool probe_valid(const char *probes)
+{
+	return probe_each(probes, probe_parsed, 0, 0);
+}
+
+bool probe_run(const char *probes, pid_t pid, int64_t timeout)
+{
+	/* one deadline for the whole list, so a list of slow probes cannot
+	 * hold the health check up for longer than a single one */
+	return probe_each(probes, probe_passes, pid, tm_now() + timeout);
+}
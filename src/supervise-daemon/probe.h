@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2026 The OpenRC Authors.
+ * See the Authors file at the top-level directory of this distribution and
+ * https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+ *
+ * This file is part of OpenRC. It is subject to the license terms in
+ * the LICENSE file found in the top-level directory of this
+ * distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+ * This file may not be copied, modified, propagated, or distributed
+ *    except according to the terms contained in the LICENSE file.
+ */
+
+#ifndef __RC_PROBE_H
+#define __RC_PROBE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * Health checks supervise-daemon can run itself instead of running the
+ * healthcheck() function of the service script. A list of probes is
+ * separated by whitespace, and each one is one of
+ *   pid                   the daemon is still running
+ *   tcp:host:port         a TCP connection to host:port can be made
+ *   unix:path             a connection to the UNIX socket can be made
+ *   http://host[:port]/path
+ *                         a GET request gets a 2xx or 3xx response
+ *   file:path:seconds     path was modified in the last seconds
+ */
+
+/* Returns true if every probe in the list can be parsed. */
+bool probe_valid(const char *probes);
+/* Returns true if every probe in the list passes, giving up once the
+ * list as a whole has taken longer than timeout milliseconds. */
+bool probe_run(const char *probes, pid_t pid, int64_t timeout);
+
+#endif
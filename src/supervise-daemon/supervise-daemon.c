@@ -22,8 +22,10 @@
 #include <getopt.h>
 #include <limits.h>
 #include <grp.h>
+#include <poll.h>
 #include <pwd.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,10 +36,19 @@
 # include <sys/syscall.h> /* For io priority */
 # include <sys/prctl.h> /* For prctl */
 #endif
+#if defined(__linux__) && defined(SYS_pidfd_open)
+# define SUPERVISOR_EPOLL
+# include <sys/epoll.h>
+# include <sys/signalfd.h>
+# include <sys/timerfd.h>
+#endif
 #include <syslog.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
@@ -63,6 +74,7 @@ static struct pam_conv conv = { NULL, NULL};
 #include "timeutils.h"
 #include "_usage.h"
 #include "helpers.h"
+#include "probe.h"
 
 /* Use long option value that is out of range for 8 bit getopt values.
  * The exact enum value is internal and can freely change, so we keep the
@@ -81,6 +93,9 @@ enum {
   LONGOPT_NOTIFY,
   LONGOPT_RESPAWN_DELAY_STEP,
   LONGOPT_RESPAWN_DELAY_CAP,
+  LONGOPT_MUX,
+  LONGOPT_MUX_CHILD,
+  LONGOPT_HEALTHCHECK_PROBE,
 };
 
 const char *applet = NULL;
@@ -90,6 +105,7 @@ const char getoptstring[] = "A:a:D:d:e:Gg:I:Kk:m:N:p:R:r:s:Su:0:1:2:3" \
 const struct option longopts[] = {
 	{ "healthcheck-timer",        1, NULL, 'a'},
 	{ "healthcheck-delay",        1, NULL, 'A'},
+	{ "healthcheck-probe",        1, NULL, LONGOPT_HEALTHCHECK_PROBE},
 	{ "capabilities", 1, NULL, LONGOPT_CAPABILITIES},
 	{ "secbits",      1, NULL, LONGOPT_SECBITS},
 	{ "no-new-privs", 0, NULL, LONGOPT_NO_NEW_PRIVS},
@@ -120,11 +136,14 @@ const struct option longopts[] = {
 	{ "stderr-logger",1, NULL, LONGOPT_STDERR_LOGGER},
 	{ "reexec",       0, NULL, '3'},
 	{ "notify",       1, NULL, LONGOPT_NOTIFY},
+	{ "mux",          0, NULL, LONGOPT_MUX},
+	{ "mux-child",    1, NULL, LONGOPT_MUX_CHILD},
 	longopts_COMMON
 };
 const char * const longopts_help[] = {
 	"set an initial health check delay",
 	"set a health check timer",
+	"check health with a built-in probe",
 	"Set the inheritable, ambient and bounding capabilities",
 	"Set the security-bits for the program",
 	"Set the No New Privs flag for the program",
@@ -155,13 +174,19 @@ const char * const longopts_help[] = {
 	"Redirect stderr to process",
 	"reexec (used internally)",
 	"Configures experimental notification behaviour",
+	"Use the supervisor shared by all services",
+	"run the daemon for the shared supervisor (used internally)",
 	longopts_help_COMMON
 };
 const char *usagestring = NULL;
 
 static int healthcheckdelay = 0;
 static int healthchecktimer = 0;
+static char *healthcheckprobe = NULL;
+#define PROBE_TIMEOUT	TM_SEC(5)	/* longest a built-in probe may take */
+#ifndef SUPERVISOR_EPOLL
 static volatile sig_atomic_t do_healthcheck = 0;
+#endif
 static volatile sig_atomic_t exiting = 0;
 static int nicelevel = INT_MIN;
 static int ionicec = -1;
@@ -193,9 +218,14 @@ static int64_t respawn_period; /* default set inside main() */
 static int respawn_max = 10;
 static char *fifopath = NULL;
 static int fifo_fd = 0;
+/* signal mask for the commands we run, if not the one we were called with */
+static const sigset_t *command_signals = NULL;
 static char *pidfile = NULL;
 static char *svcname = NULL;
 static bool verbose = false;
+static bool mux = false;
+static bool mux_child = false;
+static int mux_child_fd = -1;
 #ifdef __linux__
 static cap_iab_t cap_iab = NULL;
 static unsigned secbits = 0;
@@ -226,6 +256,7 @@ static void cleanup(void)
 	free(changeuser);
 }
 
+#ifndef SUPERVISOR_EPOLL
 RC_NORETURN static void re_exec_supervisor(void)
 {
 	syslog(LOG_WARNING, "Re-executing for %s", svcname);
@@ -266,6 +297,7 @@ static void handle_signal(int sig)
 	/* Restore errno */
 	errno = serrno;
 }
+#endif
 
 static char * expand_home(const char *home, const char *path)
 {
@@ -354,7 +386,8 @@ static pid_t exec_command(const char *cmd)
 		sigaction(SIGWINCH, &sa, NULL);
 
 		/* Unmask signals */
-		sigprocmask(SIG_SETMASK, &old, NULL);
+		sigprocmask(SIG_SETMASK, command_signals ? command_signals : &old,
+				NULL);
 
 		/* Safe to run now */
 		execl(file, file, cmd, (char *) NULL);
@@ -639,24 +672,321 @@ RC_NORETURN static void child_process(char *exec, char **argv)
 	eerrorx("%s: failed to exec `%s': %s", applet, exec,strerror(errno));
 }
 
-RC_NORETURN static void supervisor(char *exec, char **argv)
+/*
+ * Count a respawn of the daemon, returning how long to wait before it or
+ * -1 if it has respawned too many times.
+ */
+static int64_t respawn_backoff(const char *exec, int64_t *first_spawn)
+{
+	int64_t now = tm_now();
+	int64_t sleep_for;
+
+	if (*first_spawn == 0)
+		*first_spawn = now;
+	if ((respawn_period > 0) && (now - *first_spawn > respawn_period)) {
+		respawn_count = 0;
+		*first_spawn = 0;
+	} else
+		respawn_count++;
+	if (respawn_max > 0 && respawn_count > respawn_max) {
+		syslog(LOG_WARNING, "respawned \"%s\" too many times, exiting",
+				exec);
+		return -1;
+	}
+	sleep_for = respawn_delay + (respawn_delay_step * respawn_count);
+	if (respawn_delay_step > 0 && sleep_for > respawn_delay_cap)
+		sleep_for = respawn_delay_cap;
+	return sleep_for;
+}
+
+static void spawn_child(char *exec, char **argv, const sigset_t *old_signals)
+{
+	struct sigaction sa;
+
+	child_pid = fork();
+	if (child_pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (child_pid == 0) {
+		sigprocmask(SIG_SETMASK, old_signals, NULL);
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = SIG_DFL;
+		sigaction(SIGALRM, &sa, NULL);
+		sigaction(SIGCHLD, &sa, NULL);
+		sigaction(SIGTERM, &sa, NULL);
+		child_process(exec, argv);
+	}
+}
+
+static int stop_child(const char *exec)
+{
+	int nkilled;
+
+	syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
+	nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
+			stopgroup, false, false, true);
+	if (nkilled < 0)
+		syslog(LOG_INFO, "Unable to kill %d: %s",
+				child_pid, strerror(errno));
+	return nkilled;
+}
+
+/* Act on what was written to the control fifo. Each write is a command,
+ * but more than one may have arrived before we read them. */
+static void fifo_commands(char *buf, bool running)
+{
+	char *p = buf;
+	char *end;
+	long sig_send;
+
+	if (verbose)
+		syslog(LOG_DEBUG, "Received %s from fifo", buf);
+	while ((p = strcasestr(p, "sig"))) {
+		p += 3;
+		sig_send = strtol(p, &end, 10);
+		if (end == p || sig_send < 0 || sig_send >= NSIG)
+			continue;
+		p = end;
+		syslog(LOG_INFO, "Sending signal %ld to %d", sig_send, child_pid);
+		if (!running || kill(child_pid, (int)sig_send) == -1)
+			syslog(LOG_ERR, "Unable to send signal %ld to %d",
+					sig_send, child_pid);
+	}
+}
+
+#ifdef SUPERVISOR_EPOLL
+/*
+ * The supervisor sleeps in epoll_wait until something happens, with no
+ * timers armed unless a health check or respawn is due. Signals arrive on
+ * a signalfd, the daemon exiting on its pidfd and commands on the control
+ * fifo, which we keep open for writing as well so it never reads as
+ * closed between commands.
+ */
+enum supervisor_event {
+	EV_SIGNAL,
+	EV_FIFO,
+	EV_CHILD,
+	EV_HEALTH,
+	EV_RESPAWN,
+};
+
+static void timer_arm(int fd, int64_t ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	/* a zero timer is disarmed, so a due one fires as soon as it can */
+	if (ms == 0)
+		its.it_value.tv_nsec = 1;
+	else if (ms > 0) {
+		its.it_value.tv_sec = ms / 1000;
+		its.it_value.tv_nsec = (ms % 1000) * 1000000;
+	}
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
+static void epoll_watch(int efd, int fd, enum supervisor_event ev)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = ev;
+	if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) == -1)
+		syslog(LOG_ERR, "epoll_ctl: %s", strerror(errno));
+}
+
+static int watch_child(int efd)
+{
+	int fd = (int)syscall(SYS_pidfd_open, child_pid, 0);
+
+	if (fd == -1)
+		syslog(LOG_ERR, "pidfd_open %d: %s", child_pid, strerror(errno));
+	else
+		epoll_watch(efd, fd, EV_CHILD);
+	return fd;
+}
+
+/*
+ * Run the probes in a helper so a slow one cannot stall the loop; its
+ * exit status is handled as though healthcheck() had returned it.
+ * Signals stay blocked in the helper, which never runs longer than
+ * PROBE_TIMEOUT.
+ */
+static pid_t probe_fork(void)
+{
+	pid_t pid = fork();
+
+	if (pid == 0)
+		_exit(probe_run(healthcheckprobe, child_pid, PROBE_TIMEOUT) ?
+				EXIT_SUCCESS : EXIT_FAILURE);
+	if (pid == -1)
+		syslog(LOG_ERR, "fork: %s", strerror(errno));
+	return pid;
+}
+
+static void supervisor_loop(char *exec, char **argv,
+		const sigset_t *old_signals, int *failing)
+{
+	struct epoll_event events[8];
+	struct signalfd_siginfo si;
+	sigset_t signals;
+	enum { HEALTH_IDLE, HEALTH_CHECK, HEALTH_UNHEALTHY } health = HEALTH_IDLE;
+	pid_t health_pid = 0;
+	int64_t first_spawn = 0;
+	int64_t sleep_for;
+	char buf[2048];
+	ssize_t count;
+	bool running = true;
+	int efd, sfd, fifo_wfd, health_tfd, respawn_tfd, child_fd;
+	int status, n, i;
+
+	/* block all signals, those we handle are read from a signalfd */
+	sigfillset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigaddset(&signals, SIGTERM);
+
+	efd = epoll_create1(EPOLL_CLOEXEC);
+	sfd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	fifo_fd = open(fifopath, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	fifo_wfd = open(fifopath, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+	health_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	respawn_tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (efd == -1 || sfd == -1 || fifo_fd == -1 || fifo_wfd == -1 ||
+	    health_tfd == -1 || respawn_tfd == -1) {
+		syslog(LOG_ERR, "%s: unable to set up the event loop: %s",
+				applet, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	epoll_watch(efd, sfd, EV_SIGNAL);
+	epoll_watch(efd, fifo_fd, EV_FIFO);
+	epoll_watch(efd, health_tfd, EV_HEALTH);
+	epoll_watch(efd, respawn_tfd, EV_RESPAWN);
+	child_fd = watch_child(efd);
+
+	if (healthcheckdelay)
+		timer_arm(health_tfd, TM_SEC(healthcheckdelay));
+	else if (healthchecktimer)
+		timer_arm(health_tfd, TM_SEC(healthchecktimer));
+
+	while (!exiting) {
+		n = epoll_wait(efd, events, sizeof(events) / sizeof(events[0]), -1);
+		if (n == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "epoll_wait: %s", strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < n && !exiting; i++) {
+			switch (events[i].data.u32) {
+			case EV_SIGNAL:
+				while (read(sfd, &si, sizeof(si)) == sizeof(si))
+					if (si.ssi_signo == SIGTERM)
+						exiting = 1;
+				/* the daemon is reaped when its pidfd says it has gone */
+				while (health_pid > 0 &&
+				    waitpid(health_pid, &status, WNOHANG) == health_pid) {
+					health_pid = 0;
+					if (health == HEALTH_CHECK &&
+					    WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+						health = HEALTH_IDLE;
+						timer_arm(health_tfd, TM_SEC(healthchecktimer));
+						continue;
+					}
+					if (health == HEALTH_CHECK) {
+						syslog(LOG_WARNING, "health check for %s failed",
+								svcname);
+						health = HEALTH_UNHEALTHY;
+						if ((health_pid = exec_command("unhealthy")) > 0)
+							continue;
+					}
+					/* the daemon exiting respawns it */
+					health = HEALTH_IDLE;
+					if (running && stop_child(exec) < 0)
+						timer_arm(health_tfd, TM_SEC(healthchecktimer));
+				}
+				break;
+			case EV_FIFO:
+				while ((count = read(fifo_fd, buf, sizeof(buf) - 1)) > 0) {
+					buf[count] = '\0';
+					fifo_commands(buf, running);
+				}
+				break;
+			case EV_HEALTH:
+				timer_arm(health_tfd, -1);
+				if (!running || health != HEALTH_IDLE)
+					break;
+				if (verbose)
+					syslog(LOG_DEBUG, "running health check for %s", svcname);
+				if (healthcheckprobe)
+					health_pid = probe_fork();
+				else
+					health_pid = exec_command("healthcheck");
+				if (health_pid > 0)
+					health = HEALTH_CHECK;
+				else
+					timer_arm(health_tfd, TM_SEC(healthchecktimer));
+				break;
+			case EV_CHILD:
+				if (waitpid(child_pid, &status, WNOHANG) != child_pid)
+					break;
+				if (WIFEXITED(status))
+					syslog(LOG_WARNING, "%s, pid %d, exited with return code %d",
+							exec, child_pid, WEXITSTATUS(status));
+				else if (WIFSIGNALED(status))
+					syslog(LOG_WARNING, "%s, pid %d, terminated by signal %d",
+							exec, child_pid, WTERMSIG(status));
+				running = false;
+				close(child_fd);
+				child_fd = -1;
+				timer_arm(health_tfd, -1);
+				if ((sleep_for = respawn_backoff(exec, &first_spawn)) < 0) {
+					exiting = 1;
+					*failing = 1;
+					break;
+				}
+				timer_arm(respawn_tfd, sleep_for);
+				break;
+			case EV_RESPAWN:
+				timer_arm(respawn_tfd, -1);
+				spawn_child(exec, argv, old_signals);
+				running = true;
+				child_fd = watch_child(efd);
+				if (healthcheckdelay)
+					timer_arm(health_tfd, TM_SEC(healthcheckdelay));
+				else if (healthchecktimer)
+					timer_arm(health_tfd, TM_SEC(healthchecktimer));
+				break;
+			}
+		}
+	}
+
+	if (running) {
+		n = stop_child(exec);
+		if (n > 0)
+			syslog(LOG_INFO, "killed %d processes", n);
+	}
+	close(fifo_wfd);
+}
+
+#else
+static void supervisor_loop(char *exec, char **argv,
+		const sigset_t *old_signals, int *failing)
 {
-	FILE *fp;
 	char buf[2048];
-	char cmd[2048];
 	int count;
-	int failing;
 	int health_status;
 	int healthcheck_respawn;
+	bool healthy;
 	int i;
 	int nkilled;
-	int sig_send;
 	pid_t health_pid;
 	pid_t wait_pid;
-	sigset_t old_signals;
 	sigset_t signals;
 	struct sigaction sa;
-	int64_t respawn_now = 0;
 	int64_t first_spawn = 0;
 	int64_t sleep_for;
 
@@ -665,7 +995,7 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 	sigdelset(&signals, SIGALRM);
 	sigdelset(&signals, SIGCHLD);
 	sigdelset(&signals, SIGTERM);
-	sigprocmask(SIG_SETMASK, &signals, &old_signals);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
 
 	/* install signal  handler */
 	memset(&sa, 0, sizeof(sa));
@@ -674,30 +1004,10 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 	sigaction(SIGCHLD, &sa, NULL);
 	sigaction(SIGTERM, &sa, NULL);
 
-	fp = fopen(pidfile, "w");
-	if (!fp)
-		eerrorx("%s: fopen `%s': %s", applet, pidfile, strerror(errno));
-	fprintf(fp, "%d\n", getpid());
-	fclose(fp);
-
-	if (svcname)
-		rc_service_daemon_set(svcname, exec, (const char * const *) argv,
-				pidfile, true);
-
-	/* remove the controlling tty */
-#ifdef TIOCNOTTY
-	ioctl(tty_fd, TIOCNOTTY, 0);
-	close(tty_fd);
-#endif
-
-	/*
-	 * Supervisor main loop
-	 */
 	if (healthcheckdelay)
 		alarm(healthcheckdelay);
 	else if (healthchecktimer)
 		alarm(healthchecktimer);
-	failing = 0;
 	while (!exiting) {
 		healthcheck_respawn = 0;
 		fifo_fd = open(fifopath, O_RDONLY);
@@ -709,18 +1019,7 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 				buf[count] = 0;
 			if (count == 0)
 				continue;
-			if (verbose)
-				syslog(LOG_DEBUG, "Received %s from fifo", buf);
-			if (strncasecmp(buf, "sig", 3) == 0) {
-				if ((sscanf(buf, "%s %d", cmd, &sig_send) == 2)
-						&& (sig_send >= 0 && sig_send < NSIG)) {
-					syslog(LOG_INFO, "Sending signal %d to %d", sig_send,
-							child_pid);
-					if (kill(child_pid, sig_send) == -1)
-						syslog(LOG_ERR, "Unable to send signal %d to %d",
-								sig_send, child_pid);
-				}
-			}
+			fifo_commands(buf, true);
 			continue;
 		}
 		if (do_healthcheck) {
@@ -728,29 +1027,28 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 			alarm(0);
 			if (verbose)
 				syslog(LOG_DEBUG, "running health check for %s", svcname);
-			health_pid = exec_command("healthcheck");
-			health_status = rc_waitpid(health_pid);
-			if (WIFEXITED(health_status) && WEXITSTATUS(health_status) == 0)
+			if (healthcheckprobe)
+				healthy = probe_run(healthcheckprobe, child_pid,
+						PROBE_TIMEOUT);
+			else {
+				health_pid = exec_command("healthcheck");
+				health_status = rc_waitpid(health_pid);
+				healthy = WIFEXITED(health_status) &&
+					WEXITSTATUS(health_status) == 0;
+			}
+			if (healthy)
 				alarm(healthchecktimer);
 			else {
 				syslog(LOG_WARNING, "health check for %s failed", svcname);
 				health_pid = exec_command("unhealthy");
 				rc_waitpid(health_pid);
-				syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
-				nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
-						stopgroup, false, false, true);
-				if (nkilled < 0)
-					syslog(LOG_INFO, "Unable to kill %d: %s",
-							child_pid, strerror(errno));
-				else
+				if (stop_child(exec) >= 0)
 					healthcheck_respawn = 1;
 			}
 		}
 		if (exiting) {
 			alarm(0);
-			syslog(LOG_INFO, "stopping %s, pid %d", exec, child_pid);
-			nkilled = run_stop_schedule(applet, NULL, NULL, child_pid, 0,
-					stopgroup, false, false, true);
+			nkilled = stop_child(exec);
 			if (nkilled > 0)
 				syslog(LOG_INFO, "killed %d processes", nkilled);
 			continue;
@@ -768,48 +1066,53 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 			do_healthcheck = 0;
 			healthcheck_respawn = 0;
 			alarm(0);
-			respawn_now = tm_now();
-			if (first_spawn == 0)
-				first_spawn = respawn_now;
-			if ((respawn_period > 0)
-					&& (respawn_now - first_spawn > respawn_period)) {
-				respawn_count = 0;
-				first_spawn = 0;
-			} else
-				respawn_count++;
-			if (respawn_max > 0 && respawn_count > respawn_max) {
-				syslog(LOG_WARNING, "respawned \"%s\" too many times, exiting",
-						exec);
+			if ((sleep_for = respawn_backoff(exec, &first_spawn)) < 0) {
 				exiting = 1;
-				failing = 1;
+				*failing = 1;
 				continue;
 			}
-			sleep_for = respawn_delay + (respawn_delay_step * respawn_count);
-			if (respawn_delay_step > 0 && sleep_for > respawn_delay_cap)
-				sleep_for = respawn_delay_cap;
 			tm_sleep(sleep_for, TM_NO_EINTR);
 			if (exiting)
 				continue;
-			child_pid = fork();
-			if (child_pid == -1) {
-				syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-			if (child_pid == 0) {
-				sigprocmask(SIG_SETMASK, &old_signals, NULL);
-				memset(&sa, 0, sizeof(sa));
-				sa.sa_handler = SIG_DFL;
-				sigaction(SIGALRM, &sa, NULL);
-				sigaction(SIGCHLD, &sa, NULL);
-				sigaction(SIGTERM, &sa, NULL);
-				child_process(exec, argv);
-			}
+			spawn_child(exec, argv, old_signals);
 			if (healthcheckdelay)
 				alarm(healthcheckdelay);
 			else if (healthchecktimer)
 				alarm(healthchecktimer);
 		}
 	}
+}
+#endif
+
+RC_NORETURN static void supervisor(char *exec, char **argv)
+{
+	FILE *fp;
+	int failing = 0;
+	sigset_t old_signals;
+
+	sigprocmask(SIG_SETMASK, NULL, &old_signals);
+	command_signals = &old_signals;
+
+	fp = fopen(pidfile, "w");
+	if (!fp)
+		eerrorx("%s: fopen `%s': %s", applet, pidfile, strerror(errno));
+	fprintf(fp, "%d\n", getpid());
+	fclose(fp);
+
+	if (svcname)
+		rc_service_daemon_set(svcname, exec, (const char * const *) argv,
+				pidfile, true);
+
+	/* remove the controlling tty */
+#ifdef TIOCNOTTY
+	ioctl(tty_fd, TIOCNOTTY, 0);
+	close(tty_fd);
+#endif
+
+	/*
+	 * Supervisor main loop
+	 */
+	supervisor_loop(exec, argv, &old_signals, &failing);
 
 	if (svcname) {
 		rc_service_daemon_set(svcname, exec, (const char *const *)argv,
@@ -826,6 +1129,1211 @@ RC_NORETURN static void supervisor(char *exec, char **argv)
 	exit(EXIT_SUCCESS);
 }
 
+/*
+ * Multiplexed supervisor.
+ * With --mux, the supervisor for a service is not a process of its own.
+ * One hub per $RC_SVCDIR supervises all such services. It is started on
+ * demand and takes commands over a socket, one per connection. A request
+ * is a list of NUL terminated strings, sections of it ending with an
+ * empty string, and the reply is one line of text. Each run of a daemon
+ * is a fresh supervise-daemon with --mux-child, so all the options
+ * affecting the daemon itself are handled exactly as without --mux.
+ * The hub runs it, and the health checks, in the cgroups and with the
+ * resource limits the client had, which is where the service script put
+ * its own supervisor.
+ */
+#define MUX_IDLE	TM_SEC(10)	/* hub exits once idle for this long */
+#define MUX_WAIT	TM_SEC(5)	/* how long to wait for the hub to start,
+				   and for a client to send its request */
+#define MUX_SUPERVISOR	RC_SBINDIR "/supervise-daemon"
+
+struct mux_service {
+	TAILQ_ENTRY(mux_service) entries;
+	char *name;
+	char *exec;
+	char *pidfile;
+	char *retry;
+	char **argv;		/* our own arguments, to start the daemon with */
+	char **cmd;		/* the daemon command line */
+	char **env;
+	char *cgroups;		/* as in the client's /proc/self/cgroup */
+	struct rlimit limits[RLIM_NLIMITS];
+	bool limits_set[RLIM_NLIMITS];
+	int sig;
+	bool stopgroup;
+	int64_t respawn_delay;
+	int64_t respawn_delay_step;
+	int64_t respawn_delay_cap;
+	int64_t respawn_period;
+	int respawn_max;
+	int respawn_count;
+	int healthcheckdelay;
+	int healthchecktimer;
+	char *healthcheckprobe;
+	int notify_fd;
+	pid_t child_pid;
+	pid_t health_pid;
+	pid_t stop_pid;
+	int stop_conn;		/* client waiting for the stop to finish */
+	int64_t first_spawn;
+	int64_t respawn_at;
+	int64_t health_at;
+	bool failing;
+};
+TAILQ_HEAD(mux_servicelist, mux_service);
+
+/* A client whose request has not all arrived yet */
+struct mux_conn {
+	TAILQ_ENTRY(mux_conn) entries;
+	int fd;
+	int passed_fd;		/* sent along with the request, or -1 */
+	char *req;
+	size_t len;
+	int64_t deadline;
+};
+TAILQ_HEAD(mux_connlist, mux_conn);
+
+static struct mux_servicelist mux_services =
+	TAILQ_HEAD_INITIALIZER(mux_services);
+static struct mux_connlist mux_conns =
+	TAILQ_HEAD_INITIALIZER(mux_conns);
+static int mux_signal_pipe[2] = { -1, -1 };
+
+static char *mux_path(const char *suffix)
+{
+	char *path;
+
+	xasprintf(&path, "%s/supervise-daemon.%s", rc_svcdir(), suffix);
+	return path;
+}
+
+static int mux_socket_addr(struct sockaddr_un *addr)
+{
+	char *path = mux_path("sock");
+	int ret = 0;
+
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+		ret = -1;
+	else
+		strcpy(addr->sun_path, path);
+	free(path);
+	return ret;
+}
+
+static void mux_put(FILE *mem, const char *str)
+{
+	fputs(str ? str : "", mem);
+	fputc('\0', mem);
+}
+
+RC_PRINTF(3, 4) static void mux_putf(FILE *mem, const char *key, const char *fmt, ...)
+{
+	va_list ap;
+
+	fprintf(mem, "%s=", key);
+	va_start(ap, fmt);
+	vfprintf(mem, fmt, ap);
+	va_end(ap);
+	fputc('\0', mem);
+}
+
+static void mux_reply(int fd, const char *msg)
+{
+	if (fd < 0)
+		return;
+	if (write(fd, msg, strlen(msg)) == -1)
+		syslog(LOG_WARNING, "unable to reply: %s", strerror(errno));
+	close(fd);
+}
+
+/* The cgroups we are in, listed as /proc/self/cgroup does */
+static char *mux_cgroups(void)
+{
+	char buf[BUFSIZ], *list = NULL;
+	size_t size, n;
+	FILE *fp, *mem;
+
+	if (!(fp = fopen("/proc/self/cgroup", "re")))
+		return NULL;
+	mem = xopen_memstream(&list, &size);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, mem);
+	fclose(fp);
+	xclose_memstream(mem);
+	if (size == 0) {
+		free(list);
+		return NULL;
+	}
+	return list;
+}
+
+/* Does the comma separated list have every item of the other one? */
+static bool mux_has_all(const char *list, const char *items)
+{
+	char *haystack, *needle, *copy = xstrdup(items), *item, *save = NULL;
+	bool found = true;
+
+	xasprintf(&haystack, ",%s,", list);
+	for (item = strtok_r(copy, ",", &save); item && found;
+	     item = strtok_r(NULL, ",", &save)) {
+		xasprintf(&needle, ",%s,", item);
+		found = strstr(haystack, needle) != NULL;
+		free(needle);
+	}
+	free(haystack);
+	free(copy);
+	return found;
+}
+
+/* A cgroup file system in /proc/self/mountinfo */
+struct mux_cgroup_mount {
+	const char *root;
+	const char *dir;
+	const char *type;
+	const char *options;
+};
+
+/* Read the cgroup mounts out of mountinfo, which has the root and mount
+ * point as its 4th and 5th fields, and the type, source and options after
+ * a lone "-". */
+static struct mux_cgroup_mount *mux_cgroup_mounts(char **buffer)
+{
+	struct mux_cgroup_mount *mounts = NULL, m;
+	char buf[BUFSIZ], *line, *lsave = NULL, *tok, *tsave;
+	size_t count = 0, size, n;
+	FILE *fp, *mem;
+	int i;
+
+	*buffer = NULL;
+	if (!(fp = fopen("/proc/self/mountinfo", "re")))
+		return NULL;
+	mem = xopen_memstream(buffer, &size);
+	while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+		fwrite(buf, 1, n, mem);
+	fclose(fp);
+	xclose_memstream(mem);
+
+	for (line = strtok_r(*buffer, "\n", &lsave); line;
+	     line = strtok_r(NULL, "\n", &lsave)) {
+		memset(&m, 0, sizeof(m));
+		tsave = NULL;
+		for (i = 0, tok = strtok_r(line, " ", &tsave); tok;
+		     i++, tok = strtok_r(NULL, " ", &tsave)) {
+			if (i == 3)
+				m.root = tok;
+			else if (i == 4)
+				m.dir = tok;
+			else if (i > 4 && strcmp(tok, "-") == 0) {
+				m.type = strtok_r(NULL, " ", &tsave);
+				strtok_r(NULL, " ", &tsave);
+				m.options = strtok_r(NULL, " ", &tsave);
+				break;
+			}
+		}
+		if (!m.type || !m.options ||
+		    (strcmp(m.type, "cgroup") != 0 && strcmp(m.type, "cgroup2") != 0))
+			continue;
+		mounts = xrealloc(mounts, sizeof(*mounts) * (count + 2));
+		mounts[count++] = m;
+	}
+	if (mounts)
+		mounts[count].dir = NULL;
+	return mounts;
+}
+
+/* Move ourselves into the cgroups listed, each line of which is
+ * id:controllers:path, or with top set, to the top of the same
+ * hierarchies. */
+static void mux_join_cgroups(const char *cgroups, bool top)
+{
+	struct mux_cgroup_mount *mounts, *m;
+	char *list = xstrdup(cgroups), *line, *lsave = NULL;
+	char *buffer, *controllers, *path, *procs;
+	int fd;
+
+	if (!(mounts = mux_cgroup_mounts(&buffer))) {
+		free(buffer);
+		free(list);
+		return;
+	}
+	for (line = strtok_r(list, "\n", &lsave); line;
+	     line = strtok_r(NULL, "\n", &lsave)) {
+		if (!(controllers = strchr(line, ':')) ||
+		    !(path = strchr(++controllers, ':')))
+			continue;
+		*path++ = '\0';
+		for (m = mounts; m->dir; m++)
+			if (*controllers ? strcmp(m->type, "cgroup") == 0 &&
+			    mux_has_all(m->options, controllers) :
+			    strcmp(m->type, "cgroup2") == 0)
+				break;
+		if (!m->dir)
+			continue;
+		/* paths are relative to the root of our cgroup namespace,
+		 * which need not be the root of what is mounted */
+		if (top)
+			*path = '\0';
+		else if (strcmp(m->root, "/") != 0 &&
+		    strncmp(path, m->root, strlen(m->root)) == 0)
+			path += strlen(m->root);
+		xasprintf(&procs, "%s/%s/cgroup.procs", m->dir, path);
+		if ((fd = open(procs, O_WRONLY | O_CLOEXEC)) != -1) {
+			if (write(fd, "0", 1) == -1)
+				syslog(LOG_WARNING, "unable to join %s: %s", procs,
+						strerror(errno));
+			close(fd);
+		}
+		free(procs);
+	}
+	free(mounts);
+	free(buffer);
+	free(list);
+}
+
+/* The hub serves every service, so it keeps none of the environment of
+ * the one which happens to start it beyond what finds $RC_SVCDIR. */
+static const char *const mux_hub_env[] = {
+	"EINFO_VERBOSE", "HOME", "RC_SVCDIR", "RC_USER_SERVICES",
+	"XDG_CONFIG_DIRS", "XDG_CONFIG_HOME", "XDG_RUNTIME_DIR", NULL
+};
+
+static void mux_spawn_hub(void)
+{
+	const char *const *name;
+	const char *value;
+	char **env;
+	size_t n = 0;
+	pid_t pid = fork();
+	int fd;
+
+	if (pid == -1)
+		return;
+	if (pid != 0) {
+		rc_waitpid(pid);
+		return;
+	}
+
+	setsid();
+	if (fork() != 0)
+		_exit(EXIT_SUCCESS);
+	if ((fd = open("/dev/null", O_RDWR)) != -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+	}
+	cloexec_fds_from(3);
+	env = xmalloc(sizeof(*env) * (ARRAY_SIZE(mux_hub_env) + 1));
+	for (name = mux_hub_env; *name; name++)
+		if ((value = getenv(*name)))
+			xasprintf(&env[n++], "%s=%s", *name, value);
+	env[n++] = xstrdup("PATH=" RC_PATH_PREFIX);
+	env[n] = NULL;
+	execle(MUX_SUPERVISOR, "supervise-daemon", "--mux", (char *) NULL, env);
+	_exit(EXIT_FAILURE);
+}
+
+static int mux_connect(bool spawn)
+{
+	struct sockaddr_un addr;
+	int64_t deadline = 0;
+	int fd;
+
+	if (mux_socket_addr(&addr) == -1) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	for (;;) {
+		if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+			return -1;
+		if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+			return fd;
+		close(fd);
+		if (!spawn || (errno != ENOENT && errno != ECONNREFUSED))
+			return -1;
+		if (deadline == 0) {
+			mux_spawn_hub();
+			deadline = tm_now() + MUX_WAIT;
+		} else if (tm_now() >= deadline)
+			return -1;
+		tm_sleep(TM_MS(10), TM_NO_EINTR);
+	}
+}
+
+/* Send one request to the hub, passing fd along if it is not -1,
+ * and return its reply or NULL if it could not be reached. */
+static char *mux_call(char *req, size_t len, int fd, bool spawn)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	struct iovec iov = { .iov_base = req, .iov_len = len };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	char buf[BUFSIZ];
+	char *reply = NULL;
+	size_t replylen = 0;
+	ssize_t n;
+	int attempt, sock;
+
+	/* The hub may just be going away, so try again if the
+	 * connection is dropped without a reply. */
+	for (attempt = 0; attempt < 3 && !reply; attempt++) {
+		if ((sock = mux_connect(spawn)) == -1)
+			return NULL;
+		if (fd != -1) {
+			memset(control, 0, sizeof(control));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+		if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t) len) {
+			close(sock);
+			continue;
+		}
+		shutdown(sock, SHUT_WR);
+		while ((n = read(sock, buf, sizeof(buf))) > 0 ||
+		    (n == -1 && errno == EINTR)) {
+			if (n <= 0)
+				continue;
+			reply = xrealloc(reply, replylen + n + 1);
+			memcpy(reply + replylen, buf, n);
+			replylen += n;
+			reply[replylen] = '\0';
+		}
+		close(sock);
+	}
+	if (reply && replylen > 0 && reply[replylen - 1] == '\n')
+		reply[replylen - 1] = '\0';
+	return reply;
+}
+
+/* Hand the service over to the hub instead of supervising it here. */
+RC_NORETURN static void mux_start(char **args, char *exec, char **argv,
+		const char *retry, int sig)
+{
+	struct rlimit lim;
+	char **c;
+	char *req, *reply, *cgroups;
+	size_t len;
+	int r;
+	FILE *mem = xopen_memstream(&req, &len);
+
+	mux_put(mem, "start");
+	mux_put(mem, svcname);
+	mux_putf(mem, "exec", "%s", exec);
+	mux_putf(mem, "pidfile", "%s", pidfile);
+	if (retry)
+		mux_putf(mem, "retry", "%s", retry);
+	mux_putf(mem, "signal", "%d", sig);
+	mux_putf(mem, "stopgroup", "%d", stopgroup);
+	mux_putf(mem, "respawn_delay", "%"PRId64, respawn_delay);
+	mux_putf(mem, "respawn_delay_step", "%"PRId64, respawn_delay_step);
+	mux_putf(mem, "respawn_delay_cap", "%"PRId64, respawn_delay_cap);
+	mux_putf(mem, "respawn_period", "%"PRId64, respawn_period);
+	mux_putf(mem, "respawn_max", "%d", respawn_max);
+	mux_putf(mem, "healthcheck_delay", "%d", healthcheckdelay);
+	mux_putf(mem, "healthcheck_timer", "%d", healthchecktimer);
+	if (healthcheckprobe)
+		mux_putf(mem, "healthcheck_probe", "%s", healthcheckprobe);
+	/* what the service script set up for its supervisor */
+	for (r = 0; r < RLIM_NLIMITS; r++)
+		if (getrlimit(r, &lim) == 0)
+			mux_putf(mem, "rlimit", "%d:%llu:%llu", r,
+					(unsigned long long) lim.rlim_cur,
+					(unsigned long long) lim.rlim_max);
+	if ((cgroups = mux_cgroups())) {
+		mux_putf(mem, "cgroups", "%s", cgroups);
+		free(cgroups);
+	}
+	mux_put(mem, NULL);
+	for (c = args; *c; c++)
+		mux_put(mem, *c);
+	mux_put(mem, NULL);
+	for (c = argv; *c; c++)
+		mux_put(mem, *c);
+	mux_put(mem, NULL);
+	for (c = environ; *c; c++)
+		mux_put(mem, *c);
+	xclose_memstream(mem);
+
+	reply = mux_call(req, len, notify.type == NOTIFY_FD ? notify.pipe[1] : -1, true);
+	free(req);
+	if (!reply)
+		eerrorx("%s: unable to reach the supervisor: %s", applet, strerror(errno));
+	if (strcmp(reply, "ok") != 0)
+		eerrorx("%s: %s", applet, reply);
+	free(reply);
+	exit(notify_wait(applet, notify) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+static bool mux_managed(void)
+{
+	char *value = rc_service_value_get(svcname, "supervisor");
+	bool managed = value && strcmp(value, "supervise-daemon-mux") == 0;
+
+	free(value);
+	return managed;
+}
+
+static bool mux_command(const char *cmd, const char *arg)
+{
+	char *req, *reply;
+	size_t len;
+	bool ok;
+	FILE *mem = xopen_memstream(&req, &len);
+
+	mux_put(mem, cmd);
+	mux_put(mem, svcname);
+	if (arg)
+		mux_put(mem, arg);
+	xclose_memstream(mem);
+
+	reply = mux_call(req, len, -1, false);
+	free(req);
+	if (!reply)
+		return false;
+	if (!(ok = strcmp(reply, "ok") == 0))
+		ewarn("%s: %s", applet, reply);
+	free(reply);
+	return ok;
+}
+
+static void mux_signal_handler(int sig)
+{
+	int serrno = errno;
+	char c = (char) sig;
+
+	if (sig == SIGTERM)
+		exiting = 1;
+	if (write(mux_signal_pipe[1], &c, 1) == -1) {}
+	errno = serrno;
+}
+
+/* Undo the hub's signal setup in a process it forks. */
+static void mux_child_signals(void)
+{
+	struct sigaction sa;
+	sigset_t signals;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_DFL;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGPIPE, &sa, NULL);
+	sigemptyset(&signals);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
+}
+
+/* Put a process the hub forks for a service where its own supervisor
+ * would have been. */
+static void mux_enter(struct mux_service *s)
+{
+	int r;
+
+	if (s->cgroups)
+		mux_join_cgroups(s->cgroups, false);
+	for (r = 0; r < RLIM_NLIMITS; r++)
+		if (s->limits_set[r] && setrlimit(r, &s->limits[r]) == -1)
+			syslog(LOG_WARNING, "%s: unable to set resource limit %d: %s",
+					s->name, r, strerror(errno));
+	environ = s->env;
+}
+
+static struct mux_service *mux_find(const char *name)
+{
+	struct mux_service *s;
+
+	TAILQ_FOREACH(s, &mux_services, entries)
+		if (strcmp(s->name, name) == 0)
+			return s;
+	return NULL;
+}
+
+static void mux_free_list(char **list)
+{
+	char **c;
+
+	for (c = list; c && *c; c++)
+		free(*c);
+	free(list);
+}
+
+static void mux_free(struct mux_service *s)
+{
+	mux_free_list(s->env);
+	mux_free_list(s->argv);
+	mux_free_list(s->cmd);
+	free(s->name);
+	free(s->exec);
+	free(s->pidfile);
+	free(s->retry);
+	free(s->healthcheckprobe);
+	free(s->cgroups);
+	if (s->notify_fd != -1)
+		close(s->notify_fd);
+	free(s);
+}
+
+/* The supervisor for this service is done, as if its own process
+ * had exited. */
+static void mux_finish(struct mux_service *s)
+{
+	char *path;
+
+	rc_service_daemon_set(s->name, s->exec, (const char *const *) s->cmd,
+			s->pidfile, false);
+	rc_service_value_set(s->name, "child_pid", NULL);
+	rc_service_value_set(s->name, "supervisor", NULL);
+	rc_service_mark(s->name, RC_SERVICE_STOPPED);
+	if (s->failing)
+		rc_service_mark(s->name, RC_SERVICE_FAILED);
+	if (s->pidfile)
+		unlink(s->pidfile);
+	xasprintf(&path, "%s/supervise-%s.ctl", rc_svcdir(), s->name);
+	unlink(path);
+	free(path);
+	mux_reply(s->stop_conn, "ok\n");
+	TAILQ_REMOVE(&mux_services, s, entries);
+	mux_free(s);
+}
+
+static void mux_spawn(struct mux_service *s)
+{
+	char **argv, *childarg;
+	size_t argc = 0, i;
+	int64_t now = tm_now();
+
+	while (s->argv[argc])
+		argc++;
+	/* supervise-daemon service --mux-child count:fd options... */
+	argv = xmalloc(sizeof(*argv) * (argc + 3));
+	argv[0] = s->argv[0];
+	argv[1] = s->argv[1];
+	xasprintf(&childarg, "--mux-child=%d:%d", s->respawn_count, s->notify_fd);
+	argv[2] = childarg;
+	for (i = 2; i <= argc; i++)
+		argv[i + 1] = s->argv[i];
+
+	s->child_pid = fork();
+	if (s->child_pid == 0) {
+		mux_child_signals();
+		if (s->notify_fd != -1)
+			fcntl(s->notify_fd, F_SETFD, 0);
+		mux_enter(s);
+		execv(MUX_SUPERVISOR, argv);
+		syslog(LOG_ERR, "Unable to execute supervise-daemon: %s",
+				strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	free(childarg);
+	free(argv);
+	if (s->child_pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		s->child_pid = 0;
+	}
+
+	/* Only the first run of the daemon can tell us it is ready */
+	if (s->notify_fd != -1) {
+		close(s->notify_fd);
+		s->notify_fd = -1;
+	}
+
+	if (s->healthcheckdelay)
+		s->health_at = now + TM_SEC(s->healthcheckdelay);
+	else if (s->healthchecktimer)
+		s->health_at = now + TM_SEC(s->healthchecktimer);
+	else
+		s->health_at = 0;
+}
+
+/* Stop the daemon from a helper process so that the hub keeps
+ * reaping and serving the other services meanwhile. */
+static void mux_stop(struct mux_service *s)
+{
+	int nkilled;
+
+	s->respawn_at = 0;
+	s->health_at = 0;
+	if (s->child_pid <= 0) {
+		mux_finish(s);
+		return;
+	}
+
+	s->stop_pid = fork();
+	if (s->stop_pid == 0) {
+		mux_child_signals();
+		syslog(LOG_INFO, "stopping %s, pid %d", s->exec, s->child_pid);
+		parse_schedule(applet, s->retry, s->sig);
+		nkilled = run_stop_schedule(applet, NULL, NULL, s->child_pid, 0,
+				s->stopgroup, false, false, true);
+		if (nkilled > 0)
+			syslog(LOG_INFO, "killed %d processes", nkilled);
+		_exit(nkilled < 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	if (s->stop_pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		s->stop_pid = 0;
+		mux_finish(s);
+	}
+}
+
+static void mux_healthcheck(struct mux_service *s)
+{
+	int status, nkilled;
+	pid_t pid;
+
+	s->health_pid = fork();
+	if (s->health_pid == 0) {
+		mux_child_signals();
+		mux_enter(s);
+		svcname = s->name;
+		if (verbose)
+			syslog(LOG_DEBUG, "running health check for %s", svcname);
+		if (s->healthcheckprobe) {
+			if (probe_run(s->healthcheckprobe, s->child_pid, PROBE_TIMEOUT))
+				_exit(EXIT_SUCCESS);
+		} else {
+			pid = exec_command("healthcheck");
+			status = rc_waitpid(pid);
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				_exit(EXIT_SUCCESS);
+		}
+		syslog(LOG_WARNING, "health check for %s failed", svcname);
+		pid = exec_command("unhealthy");
+		rc_waitpid(pid);
+		syslog(LOG_INFO, "stopping %s, pid %d", s->exec, s->child_pid);
+		parse_schedule(applet, s->retry, s->sig);
+		nkilled = run_stop_schedule(applet, NULL, NULL, s->child_pid, 0,
+				s->stopgroup, false, false, true);
+		if (nkilled < 0)
+			syslog(LOG_INFO, "Unable to kill %d: %s",
+					s->child_pid, strerror(errno));
+		_exit(EXIT_FAILURE);
+	}
+	if (s->health_pid == -1) {
+		syslog(LOG_ERR, "%s: fork: %s", applet, strerror(errno));
+		s->health_pid = 0;
+	}
+}
+
+/* The daemon went away without being asked to. */
+static void mux_respawn(struct mux_service *s)
+{
+	int64_t now = tm_now();
+	int64_t sleep_for;
+
+	s->health_at = 0;
+	if (s->first_spawn == 0)
+		s->first_spawn = now;
+	if (s->respawn_period > 0 && now - s->first_spawn > s->respawn_period) {
+		s->respawn_count = 0;
+		s->first_spawn = 0;
+	} else
+		s->respawn_count++;
+	if (s->respawn_max > 0 && s->respawn_count > s->respawn_max) {
+		syslog(LOG_WARNING, "respawned \"%s\" too many times, exiting",
+				s->exec);
+		s->failing = true;
+		mux_finish(s);
+		return;
+	}
+	sleep_for = s->respawn_delay + (s->respawn_delay_step * s->respawn_count);
+	if (s->respawn_delay_step > 0 && sleep_for > s->respawn_delay_cap)
+		sleep_for = s->respawn_delay_cap;
+	s->respawn_at = now + sleep_for;
+	/* zero means no timer, and the daemon is already gone */
+	if (s->respawn_at == 0)
+		s->respawn_at = 1;
+}
+
+static void mux_reap(void)
+{
+	struct mux_service *s, *next;
+	pid_t pid;
+	int status;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		TAILQ_FOREACH_SAFE(s, &mux_services, entries, next) {
+			if (pid == s->child_pid) {
+				if (WIFEXITED(status))
+					syslog(LOG_WARNING, "%s, pid %d, exited with return code %d",
+							s->exec, pid, WEXITSTATUS(status));
+				else if (WIFSIGNALED(status))
+					syslog(LOG_WARNING, "%s, pid %d, terminated by signal %d",
+							s->exec, pid, WTERMSIG(status));
+				s->child_pid = 0;
+				if (s->stop_pid == 0)
+					mux_respawn(s);
+				break;
+			}
+			if (pid == s->health_pid) {
+				s->health_pid = 0;
+				if (WIFEXITED(status) && WEXITSTATUS(status) == 0 &&
+				    s->healthchecktimer && s->child_pid > 0)
+					s->health_at = tm_now() + TM_SEC(s->healthchecktimer);
+				break;
+			}
+			if (pid == s->stop_pid) {
+				s->stop_pid = 0;
+				mux_finish(s);
+				break;
+			}
+		}
+	}
+}
+
+/* Split the next section of a request into a NULL terminated array
+ * pointing into the request itself. */
+static char **mux_section(char **p, const char *end)
+{
+	char **list = NULL;
+	size_t count = 0;
+
+	while (*p < end && **p) {
+		list = xrealloc(list, sizeof(*list) * (count + 2));
+		list[count++] = *p;
+		*p += strlen(*p) + 1;
+	}
+	if (*p < end)
+		(*p)++;
+	if (!list)
+		list = xmalloc(sizeof(*list));
+	list[count] = NULL;
+	return list;
+}
+
+static void mux_add(int conn, char *name, char *p, const char *end, int fd)
+{
+	struct mux_service *s;
+	char **fields, **env, **c, *value;
+	unsigned long long cur, max;
+	FILE *fp;
+	size_t i;
+	int r;
+
+	if (exiting) {
+		mux_reply(conn, "the supervisor is shutting down\n");
+		return;
+	}
+	if (mux_find(name)) {
+		mux_reply(conn, "already supervised\n");
+		return;
+	}
+
+	s = xmalloc(sizeof(*s));
+	memset(s, 0, sizeof(*s));
+	s->notify_fd = fd;
+	s->stop_conn = -1;
+	s->name = xstrdup(name);
+	fields = mux_section(&p, end);
+	for (c = fields; *c; c++) {
+		if (!(value = strchr(*c, '=')))
+			continue;
+		*value++ = '\0';
+		if (strcmp(*c, "exec") == 0)
+			s->exec = xstrdup(value);
+		else if (strcmp(*c, "pidfile") == 0)
+			s->pidfile = xstrdup(value);
+		else if (strcmp(*c, "retry") == 0)
+			s->retry = xstrdup(value);
+		else if (strcmp(*c, "signal") == 0)
+			s->sig = atoi(value);
+		else if (strcmp(*c, "stopgroup") == 0)
+			s->stopgroup = atoi(value);
+		else if (strcmp(*c, "respawn_delay") == 0)
+			sscanf(value, "%"SCNd64, &s->respawn_delay);
+		else if (strcmp(*c, "respawn_delay_step") == 0)
+			sscanf(value, "%"SCNd64, &s->respawn_delay_step);
+		else if (strcmp(*c, "respawn_delay_cap") == 0)
+			sscanf(value, "%"SCNd64, &s->respawn_delay_cap);
+		else if (strcmp(*c, "respawn_period") == 0)
+			sscanf(value, "%"SCNd64, &s->respawn_period);
+		else if (strcmp(*c, "respawn_max") == 0)
+			s->respawn_max = atoi(value);
+		else if (strcmp(*c, "healthcheck_delay") == 0)
+			s->healthcheckdelay = atoi(value);
+		else if (strcmp(*c, "healthcheck_timer") == 0)
+			s->healthchecktimer = atoi(value);
+		else if (strcmp(*c, "healthcheck_probe") == 0)
+			s->healthcheckprobe = xstrdup(value);
+		else if (strcmp(*c, "cgroups") == 0)
+			s->cgroups = xstrdup(value);
+		else if (strcmp(*c, "rlimit") == 0 &&
+		    sscanf(value, "%d:%llu:%llu", &r, &cur, &max) == 3 &&
+		    r >= 0 && r < RLIM_NLIMITS) {
+			s->limits[r].rlim_cur = (rlim_t) cur;
+			s->limits[r].rlim_max = (rlim_t) max;
+			s->limits_set[r] = true;
+		}
+	}
+	free(fields);
+	s->argv = mux_section(&p, end);
+	s->cmd = mux_section(&p, end);
+	env = mux_section(&p, end);
+
+	/* argv and cmd point into the request, so take one copy of all
+	 * of it and move them over. */
+	i = 0;
+	for (c = env; *c; c++)
+		i++;
+	s->env = xmalloc(sizeof(*s->env) * (i + 1));
+	for (i = 0; env[i]; i++)
+		s->env[i] = xstrdup(env[i]);
+	s->env[i] = NULL;
+	free(env);
+	for (c = s->argv; *c; c++)
+		*c = xstrdup(*c);
+	for (c = s->cmd; *c; c++)
+		*c = xstrdup(*c);
+
+	if (!s->exec || !s->pidfile || !s->argv[0] || !s->argv[1]) {
+		mux_reply(conn, "invalid request\n");
+		mux_free(s);
+		return;
+	}
+
+	if (!(fp = fopen(s->pidfile, "w"))) {
+		mux_reply(conn, "unable to write the pidfile\n");
+		mux_free(s);
+		return;
+	}
+	fprintf(fp, "%d\n", getpid());
+	fclose(fp);
+
+	TAILQ_INSERT_TAIL(&mux_services, s, entries);
+	rc_service_daemon_set(s->name, s->exec, (const char *const *) s->cmd,
+			s->pidfile, true);
+	rc_service_value_set(s->name, "supervisor", "supervise-daemon-mux");
+	mux_spawn(s);
+	mux_reply(conn, "ok\n");
+}
+
+/* Only the user the hub runs as may tell it what to run */
+static bool mux_peer_allowed(int conn)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	return cred.uid == getuid();
+#else
+	uid_t uid;
+	gid_t gid;
+
+	if (getpeereid(conn, &uid, &gid) == -1)
+		return false;
+	return uid == getuid();
+#endif
+}
+
+static void mux_accept(int lfd)
+{
+	struct mux_conn *c;
+	int conn;
+
+	if ((conn = accept(lfd, NULL, NULL)) == -1)
+		return;
+	fcntl(conn, F_SETFD, FD_CLOEXEC);
+	if (!mux_peer_allowed(conn)) {
+		syslog(LOG_WARNING, "Refusing a request from another user");
+		close(conn);
+		return;
+	}
+	/* The request is read as it arrives, so a client which is slow
+	 * to send it holds up nobody else */
+	fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+	c = xmalloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+	c->fd = conn;
+	c->passed_fd = -1;
+	c->deadline = tm_now() + MUX_WAIT;
+	TAILQ_INSERT_TAIL(&mux_conns, c, entries);
+}
+
+static void mux_drop(struct mux_conn *c)
+{
+	TAILQ_REMOVE(&mux_conns, c, entries);
+	if (c->passed_fd != -1)
+		close(c->passed_fd);
+	free(c->req);
+	free(c);
+}
+
+/* Act on a whole request, ending in the client closing its side */
+static void mux_request(int conn, char *req, size_t len, int fd)
+{
+	struct mux_service *s;
+	char *p, *end, *name;
+	int sig;
+
+	p = req;
+	end = req + len;
+	name = p + strlen(p) + 1;
+	if (name >= end) {
+		mux_reply(conn, "invalid request\n");
+		goto out;
+	}
+	p = name + strlen(name) + 1;
+
+	if (verbose)
+		syslog(LOG_DEBUG, "Received %s for %s", req, name);
+	if (strcmp(req, "start") == 0) {
+		mux_add(conn, name, p, end, fd);
+		fd = -1;
+	} else if (!(s = mux_find(name))) {
+		mux_reply(conn, "not supervised\n");
+	} else if (strcmp(req, "stop") == 0) {
+		if (s->stop_conn != -1 || s->stop_pid) {
+			mux_reply(conn, "already stopping\n");
+		} else {
+			s->stop_conn = conn;
+			mux_stop(s);
+		}
+	} else if (strcmp(req, "signal") == 0 && p < end &&
+	    sscanf(p, "%d", &sig) == 1 && sig >= 0 && sig < NSIG) {
+		syslog(LOG_INFO, "Sending signal %d to %d", sig, s->child_pid);
+		if (s->child_pid > 0 && kill(s->child_pid, sig) == 0)
+			mux_reply(conn, "ok\n");
+		else {
+			syslog(LOG_ERR, "Unable to send signal %d to %d",
+					sig, s->child_pid);
+			mux_reply(conn, "unable to send the signal\n");
+		}
+	} else
+		mux_reply(conn, "invalid request\n");
+
+out:
+	if (fd != -1)
+		close(fd);
+}
+
+/* Read what the client has sent so far */
+static void mux_read(struct mux_conn *c)
+{
+	char control[CMSG_SPACE(sizeof(int))];
+	char buf[BUFSIZ];
+	struct iovec iov = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+	ssize_t n;
+	int fd;
+
+	for (;;) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		n = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0)
+			break;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+				if (c->passed_fd != -1)
+					close(c->passed_fd);
+				memcpy(&c->passed_fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		c->req = xrealloc(c->req, c->len + n + 1);
+		memcpy(c->req + c->len, buf, n);
+		c->len += n;
+	}
+
+	if (n == -1 || c->len == 0)
+		close(c->fd);
+	else {
+		/* make sure the last string is terminated */
+		c->req[c->len] = '\0';
+		fd = c->passed_fd;
+		c->passed_fd = -1;
+		mux_request(c->fd, c->req, c->len, fd);
+	}
+	mux_drop(c);
+}
+
+/* The hub outlives the client which started it, so it leaves that
+ * client's cgroups and limits behind; each daemon gets its own back in
+ * mux_enter. */
+static void mux_hub_context(void)
+{
+	char *cgroups;
+#ifdef __linux__
+	struct rlimit lim;
+	int r;
+
+	/* Take the limits init runs with; a user hub may be unable to
+	 * raise them, and keeps its own */
+	for (r = 0; r < RLIM_NLIMITS; r++)
+		if (prlimit(1, r, NULL, &lim) == 0)
+			setrlimit(r, &lim);
+#endif
+
+	if ((cgroups = mux_cgroups())) {
+		mux_join_cgroups(cgroups, true);
+		free(cgroups);
+	}
+}
+
+/* Become the hub. There is only ever one for each $RC_SVCDIR; if
+ * another one is already serving, we just go away. */
+RC_NORETURN static void mux_hub(void)
+{
+	struct sockaddr_un addr;
+	struct pollfd *pfd = NULL;
+	struct mux_service *s, *next;
+	struct mux_conn *c, *cnext;
+	struct sigaction sa;
+	sigset_t signals;
+	int64_t now, idle_since, wake;
+	char *lockpath, *sockpath, buf[64];
+	int lfd, lockfd, timeout;
+	size_t npfd, i;
+
+	/* We were started by a client which already set the umask of its
+	 * daemon, but the hub serves them all */
+	umask(022);
+	openlog(applet, LOG_PID, LOG_DAEMON);
+	verbose = rc_yesno(getenv("EINFO_VERBOSE"));
+	if (chdir("/") == -1) {}
+	mux_hub_context();
+
+	if (mux_socket_addr(&addr) == -1)
+		exit(EXIT_FAILURE);
+	lockpath = mux_path("lock");
+	lockfd = open(lockpath, O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+	free(lockpath);
+	if (lockfd == -1)
+		exit(EXIT_FAILURE);
+	/* An old hub may still be on its way out */
+	now = tm_now();
+	while (flock(lockfd, LOCK_EX | LOCK_NB) == -1) {
+		if ((lfd = mux_connect(false)) != -1 || tm_now() - now > MUX_WAIT)
+			exit(EXIT_SUCCESS);
+		tm_sleep(TM_MS(10), TM_NO_EINTR);
+	}
+
+	sockpath = addr.sun_path;
+	unlink(sockpath);
+	/* Nobody else may connect, not even before the socket is ready */
+	umask(077);
+	if ((lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+	    bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    listen(lfd, SOMAXCONN) == -1) {
+		syslog(LOG_ERR, "unable to listen on %s: %s", sockpath, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	umask(022);
+	chmod(sockpath, 0600);
+
+	if (pipe2(mux_signal_pipe, O_CLOEXEC | O_NONBLOCK) == -1) {
+		syslog(LOG_ERR, "pipe: %s", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	sigfillset(&signals);
+	sigdelset(&signals, SIGCHLD);
+	sigdelset(&signals, SIGTERM);
+	sigprocmask(SIG_SETMASK, &signals, NULL);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = mux_signal_handler;
+	sigaction(SIGCHLD, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, NULL);
+
+	idle_since = tm_now();
+	for (;;) {
+		now = tm_now();
+		if (exiting) {
+			TAILQ_FOREACH_SAFE(s, &mux_services, entries, next)
+				if (!s->stop_pid)
+					mux_stop(s);
+		}
+		if (TAILQ_EMPTY(&mux_services) && TAILQ_EMPTY(&mux_conns)) {
+			if (exiting || now - idle_since >= MUX_IDLE)
+				break;
+		} else
+			idle_since = now;
+
+		/* Run whatever timers are due and find the next one */
+		wake = exiting || TAILQ_EMPTY(&mux_services) ? idle_since + MUX_IDLE : INT64_MAX;
+		TAILQ_FOREACH_SAFE(s, &mux_services, entries, next) {
+			if (s->respawn_at && s->respawn_at <= now) {
+				s->respawn_at = 0;
+				mux_spawn(s);
+			}
+			if (s->health_at && s->health_at <= now) {
+				s->health_at = 0;
+				if (s->child_pid > 0 && !s->health_pid)
+					mux_healthcheck(s);
+			}
+			if (s->respawn_at && s->respawn_at < wake)
+				wake = s->respawn_at;
+			if (s->health_at && s->health_at < wake)
+				wake = s->health_at;
+		}
+		/* Give up on clients which never finish their request */
+		npfd = 2;
+		TAILQ_FOREACH_SAFE(c, &mux_conns, entries, cnext) {
+			if (c->deadline <= now) {
+				syslog(LOG_WARNING, "Timed out reading a request");
+				close(c->fd);
+				mux_drop(c);
+				continue;
+			}
+			if (c->deadline < wake)
+				wake = c->deadline;
+			npfd++;
+		}
+		if (wake == INT64_MAX)
+			timeout = -1;
+		else if (wake - now > INT_MAX)
+			timeout = INT_MAX;
+		else
+			timeout = wake > now ? (int) (wake - now) : 0;
+
+		pfd = xrealloc(pfd, npfd * sizeof(*pfd));
+		pfd[0].fd = lfd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = mux_signal_pipe[0];
+		pfd[1].events = POLLIN;
+		i = 2;
+		TAILQ_FOREACH(c, &mux_conns, entries) {
+			pfd[i].fd = c->fd;
+			pfd[i++].events = POLLIN;
+		}
+
+		if (poll(pfd, npfd, timeout) == -1) {
+			if (errno == EINTR)
+				continue;
+			syslog(LOG_ERR, "poll: %s", strerror(errno));
+			break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			while (read(mux_signal_pipe[0], buf, sizeof(buf)) > 0) {}
+			mux_reap();
+		}
+		/* The list is in the order it was polled in; reading may
+		 * only drop the connection being read */
+		i = 2;
+		TAILQ_FOREACH_SAFE(c, &mux_conns, entries, cnext)
+			if (pfd[i++].revents)
+				mux_read(c);
+		if (pfd[0].revents & POLLIN)
+			mux_accept(lfd);
+	}
+
+	unlink(sockpath);
+	close(lfd);
+	exit(EXIT_SUCCESS);
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
@@ -860,9 +2368,12 @@ int main(int argc, char **argv)
 	char *cmdline = NULL;
 	const char *respawn_delay_str  = "0";
 	const char *respawn_period_str = "12sec";
+	char **mux_args = argv;
 
 	applet = basename_c(argv[0]);
 	atexit(cleanup);
+	if (argc == 2 && strcmp(argv[1], "--mux") == 0)
+		mux_hub();
 	svcname = getenv("RC_SVCNAME");
 	if (!svcname)
 		eerrorx("%s: The RC_SVCNAME environment variable is not set", applet);
@@ -925,6 +2436,17 @@ int main(int argc, char **argv)
 				eerrorx("%s: invalid health check delay %s", applet, optarg);
 			break;
 
+		case LONGOPT_HEALTHCHECK_PROBE:  /* --healthcheck-probe <probes> */
+			if (!probe_valid(optarg))
+				eerrorx("%s: invalid health check probe %s", applet, optarg);
+			if (healthcheckprobe) {
+				xasprintf(&p, "%s %s", healthcheckprobe, optarg);
+				free(healthcheckprobe);
+				healthcheckprobe = p;
+			} else
+				healthcheckprobe = xstrdup(optarg);
+			break;
+
 		case LONGOPT_CAPABILITIES:
 #ifdef __linux__
 			cap_iab = cap_iab_from_text(optarg);
@@ -1111,7 +2633,24 @@ int main(int argc, char **argv)
 			break;
 
 		case LONGOPT_NOTIFY:
-			notify = notify_parse(svcname, optarg);
+			/* The hub has the other end already */
+			if (!mux_child)
+				notify = notify_parse(svcname, optarg);
+			else if (mux_child_fd != -1 &&
+			    sscanf(optarg, "fd:%d", &notify.fd) == 1) {
+				notify.type = NOTIFY_FD;
+				notify.pipe[1] = mux_child_fd;
+			}
+			break;
+
+		case LONGOPT_MUX:
+			mux = true;
+			break;
+
+		case LONGOPT_MUX_CHILD:
+			mux_child = true;
+			if (sscanf(optarg, "%d:%d", &respawn_count, &mux_child_fd) != 2)
+				eerrorx("%s: invalid mux-child value '%s'", applet, optarg);
 			break;
 
 		case LONGOPT_RESPAWN_DELAY_STEP:
@@ -1149,6 +2688,12 @@ int main(int argc, char **argv)
 		ch_root = expand_home(home, ch_root);
 
 	umask(numask);
+	if (mux_child) {
+		if (exec && *exec == '~')
+			exec = expand_home(home, exec);
+		devnull_fd = open("/dev/null", O_RDWR);
+		child_process(exec, argv);
+	}
 	if (!pidfile)
 		xasprintf(&pidfile, "%s/supervise-%s.pid", rc_is_user() ? getenv("XDG_RUNTIME_DIR") : "/var/run", svcname);
 	xasprintf(&fifopath, "%s/supervise-%s.ctl", rc_svcdir(), svcname);
@@ -1272,6 +2817,8 @@ int main(int argc, char **argv)
 		rc_service_value_set(svcname, "respawn_delay_cap", numbuf);
 		snprintf(numbuf, sizeof(numbuf), "%i", respawn_max);
 		rc_service_value_set(svcname, "respawn_max", numbuf);
+		if (mux)
+			mux_start(mux_args, exec, argv, retry, sig);
 		child_pid = fork();
 		if (child_pid == -1)
 			eerrorx("%s: fork: %s", applet, strerror(errno));
@@ -1313,7 +2860,13 @@ int main(int argc, char **argv)
 		} else
 			child_process(exec, argv);
 	} else if (stop) {
-		pid = get_pid(applet, pidfile);
+		pid = -1;
+		if (mux_managed()) {
+			if (!mux_command("stop", NULL))
+				ewarn("Unable to shut down the supervisor");
+			rc_service_value_set(svcname, "supervisor", NULL);
+		} else
+			pid = get_pid(applet, pidfile);
 		if (pid != -1) {
 			i = kill(pid, SIGTERM);
 			if (i != 0)
@@ -1342,6 +2895,11 @@ int main(int argc, char **argv)
 			rc_service_mark(svcname, RC_SERVICE_STOPPED);
 		}
 		exit(EXIT_SUCCESS);
+	} else if (sendsig && mux_managed()) {
+		snprintf(numbuf, sizeof(numbuf), "%d", sig);
+		if (!mux_command("signal", numbuf))
+			eerrorx("%s: unable to signal the daemon", applet);
+		exit(EXIT_SUCCESS);
 	} else if (sendsig) {
 		fifo_fd = open(fifopath, O_WRONLY |O_NONBLOCK);
 		if (fifo_fd < 0)
@@ -0,0 +1,192 @@
+#!/bin/sh
+# Copyright (c) 2026 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+# Run a user service from the build tree, once with the configuration
+# snapshot openrc-run hands the shell and once with openrc-run.sh finding
+# and sourcing each file itself, and check both set the same variables.
+# Also check the supervisor functions openrc-run.sh only loads on demand.
+
+if [ -z "${BUILD_ROOT}" ]; then
+	printf "%s\n" "BUILD_ROOT must be defined" >&2
+	exit 1
+fi
+
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+LIBEXECDIR="${TMPDIR}"/libexec
+SVCDIR="${TMPDIR}"/run/openrc
+CONFDIR="${TMPDIR}"/config/rc
+SYSCONFDIR="${TMPDIR}"/xdg/rc
+SCRIPT="${CONFDIR}"/init.d/foo.bar
+
+# The shell side, pointed at the build tree instead of where it installs
+setup_libexec()
+{
+	local f libexec
+
+	libexec=$(sed -n 's|^sourcex "\(.*\)/sh/functions.sh"$|\1|p' \
+		"${BUILD_ROOT}"/sh/openrc-run.sh)
+	if [ -z "${libexec}" ]; then
+		printf "%s\n" "cannot find LIBEXECDIR in openrc-run.sh" >&2
+		return 1
+	fi
+	mkdir -p "${LIBEXECDIR}"/sh "${LIBEXECDIR}"/bin
+	ln -s bin "${LIBEXECDIR}"/sbin
+	for f in "${BUILD_ROOT}"/src/*/*; do
+		[ -f "${f}" ] && [ -x "${f}" ] && ln -s "${f}" "${LIBEXECDIR}"/bin
+	done
+	for f in "${BUILD_ROOT}"/sh/*.sh "${SOURCE_ROOT}"/sh/*.sh; do
+		sed "s|${libexec}|${LIBEXECDIR}|g" "${f}" \
+			> "${LIBEXECDIR}"/sh/"${f##*/}"
+	done
+
+	# openrc-run prefers an openrc-run.sh in the service directory
+	mkdir -p "${SVCDIR}"
+	cat > "${SVCDIR}"/openrc-run.sh <<-EOF
+	#!/bin/sh
+	if [ -n "\${RC_CONF_SNAPSHOT}" ]; then
+		: > "${TMPDIR}"/snapshot-used
+		[ -e "${TMPDIR}"/no-snapshot ] && unset RC_CONF_SNAPSHOT
+	fi
+	. "${LIBEXECDIR}"/sh/openrc-run.sh
+	EOF
+	chmod +x "${SVCDIR}"/openrc-run.sh
+	echo default > "${SVCDIR}"/softlevel
+}
+
+setup_conf()
+{
+	mkdir -p "${CONFDIR}"/init.d "${CONFDIR}"/conf.d "${CONFDIR}"/rc.conf.d \
+		"${CONFDIR}"/runlevels/default "${SYSCONFDIR}"/conf.d
+
+	printf '#!%s\n' "${BUILD_ROOT}"/src/openrc-run/openrc-run > "${SCRIPT}"
+	cat >> "${SCRIPT}" <<-'EOF'
+	extra_commands="vars stubs"
+	vars()
+	{
+		local v
+		for v in $(set | sed -n 's/^\(conf_[a-z]*\)=.*/\1/p'); do
+			eval "printf '%s=%s\n' $v \"\$$v\""
+		done
+	}
+	ssd_status() { echo "own ssd_status"; }
+	stubs()
+	{
+		ssd_status
+		supervise_status
+		echo "supervise_status $?"
+		command -v supervise_stop >/dev/null && echo "supervise_stop stub"
+		ssd_start 2>&1 | head -n 1
+		ssd_status
+	}
+	EOF
+	chmod +x "${SCRIPT}"
+
+	# the directories in XDG_CONFIG_DIRS come before our own
+	printf '%s\n' 'conf_order=sys' 'conf_sys=yes' > "${SYSCONFDIR}"/rc.conf
+	printf '%s\n' 'conf_base=sys' > "${SYSCONFDIR}"/conf.d/foo
+	printf '%s\n' 'conf_order="${conf_order} user"' > "${CONFDIR}"/rc.conf
+	printf '%s\n' 'conf_order="${conf_order} b"' > "${CONFDIR}"/rc.conf.d/20-b.conf
+	printf '%s\n' 'conf_order="${conf_order} a"' > "${CONFDIR}"/rc.conf.d/10-a.conf
+	printf '%s\n' 'conf_order="${conf_order} ignored"' > "${CONFDIR}"/rc.conf.d/30-c.conf.old
+	# the runlevel's own file replaces the plain one in the same directory
+	printf '%s\n' 'conf_base=plain' > "${CONFDIR}"/conf.d/foo
+	printf '%s\n' 'conf_base="${conf_base} default"' > "${CONFDIR}"/conf.d/foo.default
+	printf '%s\n' 'conf_inst="${conf_base} bar"' > "${CONFDIR}"/conf.d/foo.bar
+}
+
+user_rc()
+{
+	env -i PATH="${LIBEXECDIR}"/bin:/usr/bin:/bin \
+		HOME="${TMPDIR}" XDG_CONFIG_HOME="${TMPDIR}"/config \
+		XDG_CONFIG_DIRS="${TMPDIR}"/xdg XDG_RUNTIME_DIR="${TMPDIR}"/run \
+		"${SCRIPT}" --user "$@"
+}
+
+# Compare the variables with and without the snapshot to what we expect,
+# checking too whether openrc-run thought it could make one
+check_vars()
+{
+	local want="$1" how="$2" made="$3" snapshot= shell=
+
+	rm -f "${TMPDIR}"/snapshot-used "${TMPDIR}"/no-snapshot
+	snapshot=$(user_rc vars)
+	if [ -e "${TMPDIR}"/snapshot-used ]; then
+		if [ "${made}" = no ]; then
+			printf "%s: openrc-run made a snapshot\n" "${how}" >&2
+			return 1
+		fi
+	elif [ "${made}" = yes ]; then
+		printf "%s: openrc-run did not make a snapshot\n" "${how}" >&2
+		return 1
+	fi
+	: > "${TMPDIR}"/no-snapshot
+	shell=$(user_rc vars)
+	[ -n "${VERBOSE}" ] && printf "%s:\n%s\n" "${how}" "${shell}"
+
+	if [ "${shell}" != "${want}" ]; then
+		printf "%s: without the snapshot got\n%s\nwant\n%s\n" \
+			"${how}" "${shell}" "${want}" >&2
+		return 1
+	fi
+	if [ "${snapshot}" != "${shell}" ]; then
+		printf "%s: with the snapshot got\n%s\nwant\n%s\n" \
+			"${how}" "${snapshot}" "${shell}" >&2
+		return 1
+	fi
+	return 0
+}
+
+run_test()
+{
+	local out= want=
+
+	setup_libexec || return 1
+	setup_conf
+
+	want="conf_base=sys default
+conf_inst=sys default bar
+conf_order=sys user a b
+conf_sys=yes"
+	check_vars "${want}" "plain files" yes || return 1
+
+	# a return ends the file it is in, not the ones after it, so
+	# that is left to the shell
+	printf '%s\n' 'conf_ret=yes' 'return 0' 'conf_ret=no' \
+		> "${CONFDIR}"/rc.conf.d/15-ret.conf
+	want="conf_base=sys default
+conf_inst=sys default bar
+conf_order=sys user a b
+conf_ret=yes
+conf_sys=yes"
+	check_vars "${want}" "a file which returns" no || return 1
+
+	out=$(user_rc stubs 2>&1)
+	[ -n "${VERBOSE}" ] && printf "stubs:\n%s\n" "${out}"
+	# our own ssd_status wins even once start-stop-daemon.sh is loaded
+	want="own ssd_status
+ * status: stopped
+supervise_status 3
+supervise_stop stub
+ * The command variable is undefined.
+own ssd_status"
+	if [ "${out}" != "${want}" ]; then
+		printf "supervisor functions: got\n%s\nwant\n%s\n" \
+			"${out}" "${want}" >&2
+		return 1
+	fi
+	return 0
+}
+
+rm -rf "${TMPDIR}"
+run_test
+retval=$?
+rm -rf "${TMPDIR}"
+exit ${retval}
@@ -0,0 +1,121 @@
+#!/bin/sh
+# Copyright (c) 2007-2015 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+# Order a generated tree of services the way rc_deptree_order does and
+# check that every service comes after what it needs. Set BUDGET to a
+# number of milliseconds to also fail when ordering takes longer than
+# that, which catches quadratic lookups on a machine of known speed.
+
+if [ -z "${BUILD_ROOT}" ]; then
+	printf "%s\n" "BUILD_ROOT must be defined" >&2
+	exit 1
+fi
+PATH="${BUILD_ROOT}"/src/rc-depend:${PATH}
+
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+SERVICES=${SERVICES:-2000}
+
+now_ms()
+{
+	local ns
+	ns=$(date +%s%N 2>/dev/null)
+	case "${ns}" in
+		*N|"") echo 0;;
+		*) echo $(( ns / 1000000 ));;
+	esac
+}
+
+make_deptree()
+{
+	awk -v n="${SERVICES}" 'BEGIN {
+		srand(1)
+		for (i = 0; i < n; i++) {
+			printf "depinfo_%d_service=\047svc%d\047\n", i, i
+			for (j = 0; i > 0 && j < 3; j++)
+				printf "depinfo_%d_ineed_%d=\047svc%d\047\n", i, j, int(rand() * i)
+			for (j = 0; j < 3; j++)
+				printf "depinfo_%d_iuse_%d=\047svc%d\047\n", i, j, int(rand() * n)
+			for (j = 0; i > 0 && j < 2; j++)
+				printf "depinfo_%d_iafter_%d=\047svc%d\047\n", i, j, int(rand() * i)
+		}
+	}' > "${TMPDIR}"/deptree
+}
+
+# Every ineed of a service has to be listed before it
+check_order()
+{
+	awk -v n="${SERVICES}" '
+		FNR == NR {
+			if (split($0, kv, "=") != 2 || kv[1] !~ /_ineed_/)
+				next
+			split(kv[1], f, "_")
+			gsub("\047", "", kv[2])
+			needs["svc" f[2]] = needs["svc" f[2]] " " kv[2]
+			next
+		}
+		{
+			for (i = 1; i <= NF; i++) {
+				if ($i in pos) {
+					print "duplicate " $i
+					exit 1
+				}
+				pos[$i] = i
+			}
+		}
+		END {
+			if (length(pos) != n) {
+				print "ordered " length(pos) " of " n " services"
+				exit 1
+			}
+			for (s in needs) {
+				split(needs[s], d, " ")
+				for (i in d)
+					if (pos[d[i]] > pos[s]) {
+						print s " ordered before " d[i]
+						exit 1
+					}
+			}
+		}' "${TMPDIR}"/deptree "${TMPDIR}"/order
+}
+
+run_test()
+{
+	local services= start= elapsed= i=0
+
+	make_deptree || return 1
+	while [ ${i} -lt "${SERVICES}" ]; do
+		services="${services} svc${i}"
+		: $(( i += 1 ))
+	done
+
+	start=$(now_ms)
+	RC_SVCDIR="${TMPDIR}"/svcdir RC_RUNLEVEL=default \
+	    rc-depend -F "${TMPDIR}"/deptree -s -t ineed,iuse,iwant,iafter \
+	    ${services} > "${TMPDIR}"/order || return 1
+	elapsed=$(( $(now_ms) - start ))
+
+	check_order || return 1
+
+	[ -n "${VERBOSE}" ] &&
+		printf "ordered %s services in %s ms\n" "${SERVICES}" "${elapsed}"
+	if [ -n "${BUDGET}" ] && [ "${elapsed}" -gt "${BUDGET}" ]; then
+		printf "ordering %s services took %s ms, over %s ms\n" \
+			"${SERVICES}" "${elapsed}" "${BUDGET}" >&2
+		return 1
+	fi
+}
+
+rm -rf "${TMPDIR}"
+mkdir -p "${TMPDIR}"/svcdir
+run_test
+retval=$?
+rm -rf "${TMPDIR}"
+exit ${retval}
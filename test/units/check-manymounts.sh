@@ -0,0 +1,55 @@
+#!/bin/sh
+# Copyright (c) 2026 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+# Time do_unmount against the mounts tools/manymounts.sh makes.
+# This needs root and tmpfs, so it is skipped otherwise.
+
+if [ -z "${BUILD_ROOT}" ] || [ -z "${SOURCE_ROOT}" ]; then
+	printf "%s\n" "BUILD_ROOT and SOURCE_ROOT must be defined" >&2
+	exit 1
+fi
+
+# seconds do_unmount may take, which is mostly spent in umount(8)
+budget=${MANYMOUNTS_BUDGET:-60}
+mntdir=/tmp/manymounts
+do_unmount="${BUILD_ROOT}"/src/mountinfo/do_unmount
+
+if [ "$(id -u)" -ne 0 ] || [ -e "${mntdir}" ] ||
+	! mkdir "${mntdir}" 2>/dev/null; then
+	echo "skipped: needs root and no ${mntdir}"
+	exit 77
+fi
+if ! mount -t tmpfs -o size=256K tmpfs "${mntdir}" 2>/dev/null; then
+	rmdir "${mntdir}"
+	echo "skipped: cannot mount tmpfs"
+	exit 77
+fi
+umount "${mntdir}"
+
+sh "${SOURCE_ROOT}"/tools/manymounts.sh
+count=$(grep -c " ${mntdir}/" /proc/self/mountinfo)
+
+start=$(date +%s)
+"${do_unmount}" -- -p "^${mntdir}/" >/dev/null
+ret=$?
+end=$(date +%s)
+
+left=$(grep -c " ${mntdir}/" /proc/self/mountinfo)
+echo "unmounted $((count - left)) of ${count} mounts in $((end - start))s"
+if [ "${left}" -ne 0 ]; then
+	echo "${left} mounts were left behind"
+	ret=1
+elif [ $((end - start)) -gt "${budget}" ]; then
+	echo "that took longer than ${budget}s"
+	ret=1
+fi
+[ "${left}" -eq 0 ] && rm -rf "${mntdir}"
+exit ${ret}
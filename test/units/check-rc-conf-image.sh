@@ -0,0 +1,69 @@
+#!/bin/sh
+# Copyright (c) 2026 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+# Let openrc compile a user rc.conf into rc.conf.bin and check that
+# settings read from the image match those parsed from rc.conf, including
+# rc_sys, which librc uppercases after looking it up.
+
+if [ -z "${BUILD_ROOT}" ]; then
+	printf "%s\n" "BUILD_ROOT must be defined" >&2
+	exit 1
+fi
+
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+SVCDIR="${TMPDIR}"/run/openrc
+
+user_rc()
+{
+	env -i PATH="${BUILD_ROOT}"/src/openrc:/usr/bin:/bin \
+		HOME="${TMPDIR}" XDG_CONFIG_HOME="${TMPDIR}"/config \
+		XDG_CONFIG_DIRS="${TMPDIR}"/none XDG_RUNTIME_DIR="${TMPDIR}"/run \
+		openrc --user "$@"
+}
+
+check_sys()
+{
+	local sys= want="$1" how="$2"
+
+	sys=$(user_rc --sys)
+	if [ $? -ne 0 ] || [ "${sys}" != "${want}" ]; then
+		printf "rc_sys from %s: got '%s', want '%s'\n" \
+			"${how}" "${sys}" "${want}" >&2
+		return 1
+	fi
+	[ -n "${VERBOSE}" ] && printf "rc_sys from %s: %s\n" "${how}" "${sys}"
+	return 0
+}
+
+run_test()
+{
+	mkdir -p "${TMPDIR}"/config/rc/runlevels/default "${TMPDIR}"/run
+	printf 'rc_sys="lxc"\n' > "${TMPDIR}"/config/rc/rc.conf
+
+	check_sys LXC rc.conf || return 1
+
+	user_rc default >/dev/null 2>&1
+	if [ ! -f "${SVCDIR}"/rc.conf.bin ]; then
+		printf "%s\n" "openrc did not compile rc.conf.bin" >&2
+		return 1
+	fi
+	check_sys LXC rc.conf.bin || return 1
+
+	# editing rc.conf makes the image stale
+	printf 'rc_sys="vserver"\n' > "${TMPDIR}"/config/rc/rc.conf
+	check_sys VSERVER "a changed rc.conf"
+}
+
+rm -rf "${TMPDIR}"
+run_test
+retval=$?
+rm -rf "${TMPDIR}"
+exit ${retval}
@@ -0,0 +1,98 @@
+#!/bin/sh
+# Copyright (c) 2026 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+# Start a user runlevel with rc_logger on and a service which prints a
+# verbose boot's worth of coloured output, then check that every line
+# reached the log with its escape sequences stripped. Set BUDGET to a
+# number of milliseconds to also fail when it takes longer than that.
+
+if [ -z "${BUILD_ROOT}" ]; then
+	printf "%s\n" "BUILD_ROOT must be defined" >&2
+	exit 1
+fi
+
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+CONFDIR="${TMPDIR}"/config/rc
+SVCDIR="${TMPDIR}"/run/openrc
+LOG_LINES=${LOG_LINES:-100000}
+
+now_ms()
+{
+	local ns
+	ns=$(date +%s%N 2>/dev/null)
+	case "${ns}" in
+		*N|"") echo 0;;
+		*) echo $(( ns / 1000000 ));;
+	esac
+}
+
+setup()
+{
+	mkdir -p "${CONFDIR}"/init.d "${CONFDIR}"/runlevels/default "${SVCDIR}"
+	printf '%s\n' 'rc_logger="YES"' "rc_log_path=\"${TMPDIR}/rc.log\"" \
+		> "${CONFDIR}"/rc.conf
+
+	# openrc only needs something to run, not an openrc-run script
+	cat > "${CONFDIR}"/init.d/chatty <<-EOF
+	#!/bin/sh
+	awk 'BEGIN {
+		for (i = 0; i < ${LOG_LINES}; i++)
+			printf "\033[32;01m*\033[0m line %d of boot output\n", i
+	}'
+	EOF
+	chmod +x "${CONFDIR}"/init.d/chatty
+	ln -s "${CONFDIR}"/init.d/chatty "${CONFDIR}"/runlevels/default
+
+	# written last, so it is current and gendepends is not needed
+	printf '%s\n' "depinfo_0_service='chatty'" > "${SVCDIR}"/deptree
+}
+
+run_test()
+{
+	local start= elapsed= count=
+
+	setup
+	start=$(now_ms)
+	env -i PATH="${BUILD_ROOT}"/src/openrc:/usr/bin:/bin \
+		HOME="${TMPDIR}" XDG_CONFIG_HOME="${TMPDIR}"/config \
+		XDG_CONFIG_DIRS="${TMPDIR}"/none XDG_RUNTIME_DIR="${TMPDIR}"/run \
+		openrc --user default >/dev/null 2>&1
+	elapsed=$(( $(now_ms) - start ))
+
+	if [ ! -f "${TMPDIR}"/rc.log ]; then
+		printf "%s\n" "rc-logger wrote no log" >&2
+		return 1
+	fi
+	count=$(grep -c '^\* line [0-9]* of boot output$' "${TMPDIR}"/rc.log)
+	if [ "${count}" -ne "${LOG_LINES}" ]; then
+		printf "logged %s of %s lines\n" "${count}" "${LOG_LINES}" >&2
+		return 1
+	fi
+	if grep -q "$(printf '\033')" "${TMPDIR}"/rc.log; then
+		printf "%s\n" "escape sequences reached the log" >&2
+		return 1
+	fi
+
+	[ -n "${VERBOSE}" ] &&
+		printf "logged %s lines in %s ms\n" "${LOG_LINES}" "${elapsed}"
+	if [ -n "${BUDGET}" ] && [ "${elapsed}" -gt "${BUDGET}" ]; then
+		printf "logging %s lines took %s ms, over %s ms\n" \
+			"${LOG_LINES}" "${elapsed}" "${BUDGET}" >&2
+		return 1
+	fi
+	return 0
+}
+
+rm -rf "${TMPDIR}"
+run_test
+retval=$?
+rm -rf "${TMPDIR}"
+exit ${retval}
@@ -0,0 +1,172 @@
+#!/bin/sh
+# Copyright (c) 2026 The OpenRC Authors.
+# See the Authors file at the top-level directory of this distribution and
+# https://github.com/OpenRC/openrc/blob/HEAD/AUTHORS
+#
+# This file is part of OpenRC. It is subject to the license terms in
+# the LICENSE file found in the top-level directory of this
+# distribution and at https://github.com/OpenRC/openrc/blob/HEAD/LICENSE
+# This file may not be copied, modified, propagated, or distributed
+#    except according to the terms contained in the LICENSE file.
+
+# openrc-run reports the status of a service itself when gendepends says
+# the script keeps a default status. Run user services from the build tree
+# in each state and check that it answers as the shell does, and only
+# when it should.
+
+if [ -z "${BUILD_ROOT}" ]; then
+	printf "%s\n" "BUILD_ROOT must be defined" >&2
+	exit 1
+fi
+
+TMPDIR="${BUILD_ROOT}"/tmp-"$(basename "$0")"
+LIBEXECDIR="${TMPDIR}"/libexec
+SVCDIR="${TMPDIR}"/run/openrc
+CONFDIR="${TMPDIR}"/config/rc
+
+# The shell side, pointed at the build tree instead of where it installs
+setup_libexec()
+{
+	local f libexec
+
+	libexec=$(sed -n 's|^sourcex "\(.*\)/sh/functions.sh"$|\1|p' \
+		"${BUILD_ROOT}"/sh/openrc-run.sh)
+	if [ -z "${libexec}" ]; then
+		printf "%s\n" "cannot find LIBEXECDIR in openrc-run.sh" >&2
+		return 1
+	fi
+	mkdir -p "${LIBEXECDIR}"/sh "${LIBEXECDIR}"/bin
+	ln -s bin "${LIBEXECDIR}"/sbin
+	for f in "${BUILD_ROOT}"/src/*/*; do
+		[ -f "${f}" ] && [ -x "${f}" ] && ln -s "${f}" "${LIBEXECDIR}"/bin
+	done
+	for f in "${BUILD_ROOT}"/sh/*.sh "${SOURCE_ROOT}"/sh/*.sh; do
+		sed "s|${libexec}|${LIBEXECDIR}|g" "${f}" \
+			> "${LIBEXECDIR}"/sh/"${f##*/}"
+	done
+
+	# openrc-run prefers an openrc-run.sh in the service directory
+	mkdir -p "${SVCDIR}"
+	cat > "${SVCDIR}"/openrc-run.sh <<-EOF
+	#!/bin/sh
+	: > "${TMPDIR}"/shell-ran
+	. "${LIBEXECDIR}"/sh/openrc-run.sh
+	EOF
+	chmod +x "${SVCDIR}"/openrc-run.sh
+}
+
+add_service()
+{
+	local name="$1"
+
+	shift
+	printf '#!%s\n' "${BUILD_ROOT}"/src/openrc-run/openrc-run \
+		> "${CONFDIR}"/init.d/"${name}"
+	printf '%s\n' "$@" >> "${CONFDIR}"/init.d/"${name}"
+	chmod +x "${CONFDIR}"/init.d/"${name}"
+}
+
+# Turn what gendepends says into a deptree openrc-run can load
+make_deptree()
+{
+	env -i PATH="${LIBEXECDIR}"/bin:/usr/bin:/bin RC_SCRIPTDIRS="${CONFDIR}" \
+		RC_USER_SERVICES=yes RC_SVCDIR="${SVCDIR}" \
+		sh "${LIBEXECDIR}"/sh/gendepends.sh > "${TMPDIR}"/depends 2>/dev/null
+	awk '$2 == "status" {
+		printf "depinfo_%d_service=\047%s\047\n", n, $1
+		printf "depinfo_%d_status_0=\047%s\047\n", n++, $3
+	}' "${TMPDIR}"/depends > "${SVCDIR}"/deptree
+	[ -n "${VERBOSE}" ] && cat "${SVCDIR}"/deptree
+}
+
+user_rc()
+{
+	local name="$1"
+
+	shift
+	env -i PATH="${LIBEXECDIR}"/bin:/usr/bin:/bin \
+		HOME="${TMPDIR}" XDG_CONFIG_HOME="${TMPDIR}"/config \
+		XDG_CONFIG_DIRS="${TMPDIR}"/none XDG_RUNTIME_DIR="${TMPDIR}"/run \
+		"${CONFDIR}"/init.d/"${name}" --user "$@"
+}
+
+# Check status gives what we want, both with and without the deptree
+# which lets openrc-run answer it
+check_status()
+{
+	local name="$1" want="$2" fast="$3" out= shell=
+
+	rm -f "${TMPDIR}"/shell-ran
+	out=$(user_rc "${name}" status 2>&1; echo "exit $?")
+	[ -n "${VERBOSE}" ] && printf "%s: %s\n" "${name}" "${out}"
+	if [ "${out}" != "${want}" ]; then
+		printf "%s: got '%s', want '%s'\n" "${name}" "${out}" "${want}" >&2
+		return 1
+	fi
+	if [ -e "${TMPDIR}"/shell-ran ]; then
+		if [ "${fast}" = yes ]; then
+			printf "%s: status ran the shell\n" "${name}" >&2
+			return 1
+		fi
+	elif [ "${fast}" = no ]; then
+		printf "%s: status did not run the shell\n" "${name}" >&2
+		return 1
+	fi
+
+	mv "${SVCDIR}"/deptree "${TMPDIR}"/deptree
+	shell=$(user_rc "${name}" status 2>&1; echo "exit $?")
+	mv "${TMPDIR}"/deptree "${SVCDIR}"/deptree
+	touch "${SVCDIR}"/deptree
+	if [ "${shell}" != "${out}" ]; then
+		printf "%s: the shell said '%s', openrc-run '%s'\n" \
+			"${name}" "${shell}" "${out}" >&2
+		return 1
+	fi
+	return 0
+}
+
+run_test()
+{
+	local pid= i=0
+
+	setup_libexec || return 1
+	mkdir -p "${CONFDIR}"/init.d
+	add_service foo command=/bin/sleep command_args=300 \
+		command_background=yes pidfile="${TMPDIR}"/foo.pid
+	add_service bar supervisor=supervise-daemon command=/bin/sleep
+	add_service own 'status() { einfo "status: own"; }'
+	make_deptree
+
+	check_status foo " * status: stopped
+exit 3" yes || return 1
+	check_status bar " * status: stopped
+exit 3" yes || return 1
+	check_status own " * status: own
+exit 0" no || return 1
+
+	user_rc foo start >/dev/null 2>&1
+	check_status foo " * status: started
+exit 0" yes || return 1
+
+	# a crash is only noticed once the daemon is gone for good
+	read -r pid < "${TMPDIR}"/foo.pid
+	kill "${pid}"
+	while kill -0 "${pid}" 2>/dev/null && [ "${i}" -lt 50 ]; do
+		sleep 0.1
+		i=$((i + 1))
+	done
+	check_status foo " * status: crashed
+exit 32" yes || return 1
+	user_rc foo zap >/dev/null 2>&1
+	return 0
+}
+
+rm -rf "${TMPDIR}"
+run_test
+retval=$?
+if [ -s "${TMPDIR}"/foo.pid ]; then
+	read -r pid < "${TMPDIR}"/foo.pid
+	kill "${pid}" 2>/dev/null
+fi
+rm -rf "${TMPDIR}"
+exit ${retval}